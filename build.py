@@ -14,11 +14,13 @@ available_modules_help_text = f"""Optionally takes zero or more module names to
 {' '*22}The module names can also be given without giving the `setup' command, making it implicitly selected"""
 
 available_arguments = [
+    ("bench", "Build and run all benchmarks, always with an optimized configuration"),
     ("generate", "Only generate the ninja script and compile commands database, do not compile"),
     ("optimized", "Build with optimized configuration instead of debug configuration, suitable for releases"),
     ("pristine", "Clean the build directory before build"),
     ("run", "Run the resulting executable after a successful build"),
     ("setup", f"Operate on the third party libraries instead of the project itself. {available_modules_help_text}"),
+    ("startup", "Build with optimized configuration and benchmark cold and warm startup of the resulting executable"),
     ("test", "Build and run all tests"),
     ("verbose", "Print verbose information to the terminal"),
 ]
@@ -100,16 +102,18 @@ if __name__ == "__main__":
             else:
                 implicit_setup = True
 
+    bench = "bench" in expanded_args
     generate = "generate" in expanded_args
     optimized = "optimized" in expanded_args
     pristine = "pristine" in expanded_args
     run = "run" in expanded_args
     setup = "setup" in expanded_args or implicit_setup
+    startup = "startup" in expanded_args
     test = "test" in expanded_args
     verbose = "verbose" in expanded_args
 
     build = not generate
-    debug = not optimized
+    debug = not optimized and not startup
 
     if verbose:
         print(args)
@@ -143,7 +147,7 @@ if __name__ == "__main__":
         if setup:
             sys.exit(returncode)
 
-    def runner(build_type: Literal["debug", "optimized", "test"]):
+    def runner(build_type: Literal["bench", "debug", "optimized", "test"]):
         # build_type = "debug" if debug else "optimized"
         build_dir = str(Path(f"{root}/output/{build_type}"))
 
@@ -187,7 +191,15 @@ if __name__ == "__main__":
         if build:
             subprocess.run(["ninja"] + ninja_args + [program]).check_returncode()
 
-        if run or build_type == "test":
+        if startup:
+            # Always measure again, the target is otherwise up to date as long as the executable is
+            startup_report = str(Path(f"{build_dir}/startup-bench.json"))
+            if os.path.exists(startup_report):
+                os.remove(startup_report)
+            returncode = subprocess.run(["ninja"] + ninja_args + [startup_report]).returncode
+            sys.exit(returncode)
+
+        if run or build_type in ["bench", "test"]:
             if verbose:
                 print(f"Running project {program}")
             returncode = subprocess.run(program).returncode
@@ -197,5 +209,7 @@ if __name__ == "__main__":
 
     if test:
         runner("test")
+    elif bench:
+        runner("bench")
     else:
         runner("debug" if debug else "optimized")
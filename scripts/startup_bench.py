@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+"""Runs the host a number of times from a cold and from a warm module cache and reports percentiles of every startup
+phase, as written by `--startup-json`. Host options, such as a snapshot to restore, are passed with `--host-arg`, so
+the same guest can be timed to its first script with and without one. Given a baseline from an earlier run it fails
+if any total got slower by more than the allowed ratio, so it can gate changes that regress startup."""
+
+_PERCENTILES = [50, 90, 99, 100]
+
+
+def percentile(sorted_values: list[int], p: int) -> int:
+    index = max(0, (len(sorted_values) * p + 99) // 100 - 1)
+    return sorted_values[min(index, len(sorted_values) - 1)]
+
+
+def run_once(binary: str, cache_dir: str, host_args: list[str], guest_args: list[str]) -> dict:
+    import json
+    import os
+    import subprocess
+    import tempfile
+
+    with tempfile.NamedTemporaryFile(suffix=".json") as timeline_file:
+        env = dict(os.environ, QOST_CACHE_DIR=cache_dir)
+        command = [binary, f"--startup-json={timeline_file.name}"] + host_args + ["--"] + guest_args
+        subprocess.run(
+            command, env=env, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL
+        )
+        with open(timeline_file.name, "r") as timeline:
+            return json.load(timeline)
+
+
+def summarize(runs: list[dict]) -> dict:
+    samples = {}
+    for run in runs:
+        for phase in run["phases"]:
+            samples.setdefault(phase["name"], []).append(phase["ns"])
+    samples["total"] = [run["total_ns"] for run in runs]
+
+    summary = {}
+    for name, values in samples.items():
+        values.sort()
+        summary[name] = {f"p{p}" if p < 100 else "max": percentile(values, p) for p in _PERCENTILES}
+        summary[name]["runs"] = len(values)
+    summary["total"]["peak_rss_bytes"] = max(run["peak_rss_bytes"] for run in runs)
+    return summary
+
+
+def print_summary(title: str, summary: dict):
+    print(f"{title}:")
+    print(f"  {'phase':<16} {'p50 ms':>10} {'p90 ms':>10} {'p99 ms':>10} {'max ms':>10}")
+    for name, stats in summary.items():
+        columns = " ".join(f"{stats[key] / 1e6:>10.3f}" for key in ["p50", "p90", "p99", "max"])
+        print(f"  {name:<16} {columns}")
+    print(f"  peak RSS {summary['total']['peak_rss_bytes'] // 1024} KiB")
+
+
+def main(
+    binary: str,
+    runs: int,
+    out: str,
+    baseline: str | None,
+    max_regression: float,
+    host_args: list[str],
+    guest_args: list[str],
+) -> int:
+    import json
+    import shutil
+    import tempfile
+
+    results = {}
+
+    # Every cold run gets an empty cache of its own, so it compiles the module from scratch
+    cold = []
+    for _ in range(runs):
+        cache_dir = tempfile.mkdtemp(prefix="qost-startup-cold-")
+        try:
+            cold.append(run_once(binary, cache_dir, host_args, guest_args))
+        finally:
+            shutil.rmtree(cache_dir, ignore_errors=True)
+    results["cold"] = summarize(cold)
+
+    # Warm runs share one cache that an untimed run has filled first
+    cache_dir = tempfile.mkdtemp(prefix="qost-startup-warm-")
+    try:
+        run_once(binary, cache_dir, host_args, guest_args)
+        results["warm"] = summarize([run_once(binary, cache_dir, host_args, guest_args) for _ in range(runs)])
+    finally:
+        shutil.rmtree(cache_dir, ignore_errors=True)
+
+    for kind, summary in results.items():
+        print_summary(f"{kind.capitalize()} start, {runs} runs", summary)
+
+    if out:
+        with open(out, "w") as out_file:
+            json.dump(results, out_file, indent=2)
+
+    if not baseline:
+        return 0
+
+    with open(baseline, "r") as baseline_file:
+        previous = json.load(baseline_file)
+    failed = False
+    for kind in results:
+        if kind not in previous:
+            continue
+        before = previous[kind]["total"]["p50"]
+        after = results[kind]["total"]["p50"]
+        if before and after > before * (1 + max_regression):
+            print(f"ERROR: {kind} start p50 went from {before / 1e6:.3f} ms to {after / 1e6:.3f} ms")
+            failed = True
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    import argparse
+    import sys
+
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--binary", required=True, help="The host executable to start")
+    parser.add_argument("--runs", type=int, default=20, help="Number of timed runs for each of cold and warm starts")
+    parser.add_argument("--out", help="Write the percentiles as JSON to this file")
+    parser.add_argument("--baseline", help="Percentiles JSON of an earlier run to compare against")
+    parser.add_argument(
+        "--max-regression", type=float, default=0.1, help="Allowed slowdown of the median total, as a ratio"
+    )
+    parser.add_argument(
+        "--host-arg", action="append", default=[], help="Option given to the host, may be repeated"
+    )
+    parser.add_argument("guest_args", nargs="*", default=["-c", "pass"], help="Arguments given to the guest")
+    args = parser.parse_args()
+
+    sys.exit(
+        main(args.binary, args.runs, args.out, args.baseline, args.max_regression, args.host_arg, args.guest_args)
+    )
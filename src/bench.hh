@@ -0,0 +1,87 @@
+#pragma once
+
+// Tiny benchmark registry in the spirit of doctest: benchmarks are written next to the code they measure inside
+// `#ifdef BENCHMARK` blocks, and the translation unit defining `QOST_BENCH_IMPLEMENT_WITH_MAIN` gets a main() that runs
+// them all, optionally filtered by substrings given on the command line
+
+namespace tss::bench {
+
+struct BenchCase {
+    std::string_view name;
+    void (*func)();
+};
+
+inline auto bench_registry() -> std::vector<BenchCase> & {
+    static std::vector<BenchCase> registry;
+    return registry;
+}
+
+struct BenchRegistrar {
+    BenchRegistrar(std::string_view name, void (*func)()) {
+        bench_registry().push_back({name, func});
+    }
+};
+
+template <typename T>
+inline void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline auto now_ns() -> int64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Runs `func` `iterations` times and returns the mean time per iteration in nanoseconds
+template <typename F>
+inline auto ns_per_op(size_t iterations, F &&func) -> double {
+    auto begin = now_ns();
+    for (size_t index = 0; index < iterations; index++) {
+        func();
+    }
+    return static_cast<double>(now_ns() - begin) / static_cast<double>(iterations);
+}
+
+// Nearest-rank percentile, `p` in [0, 100]
+inline auto percentile(std::vector<double> samples, double p) -> double {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(samples.size() - 1) + 0.5);
+    return samples[std::min(rank, samples.size() - 1)];
+}
+
+inline void report(std::string_view name, double value, std::string_view unit) {
+    fmt::print("  {:<56} {:>14.2f} {}\n", name, value, unit);
+}
+} // namespace tss::bench
+
+#define BENCH_CAT_(a, b) a##b
+#define BENCH_CAT(a, b) BENCH_CAT_(a, b)
+#define BENCHMARK_CASE_IMPL(func, name)                                                                                \
+    static void func();                                                                                                \
+    static tss::bench::BenchRegistrar BENCH_CAT(func, _registrar)(name, func);                                         \
+    static void func()
+#define BENCHMARK_CASE(name) BENCHMARK_CASE_IMPL(BENCH_CAT(qost_bench_, __COUNTER__), name)
+
+#ifdef QOST_BENCH_IMPLEMENT_WITH_MAIN
+int main(int argc, char *argv[]) {
+    std::vector<std::string_view> filters(argv + 1, argv + argc);
+
+    for (auto &bench_case : tss::bench::bench_registry()) {
+        bool selected = filters.empty();
+        for (auto filter : filters) {
+            selected |= bench_case.name.find(filter) != std::string_view::npos;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        fmt::print("[{}]\n", bench_case.name);
+        bench_case.func();
+    }
+
+    return 0;
+}
+#endif
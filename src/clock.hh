@@ -0,0 +1,222 @@
+#pragma once
+
+#include "inc.hh"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+// Clocks seen by the guest. Game scripts read the clock every frame, so reading it must not cost more than a handful of
+// nanoseconds and never allocates. An instance either reads host time, through the vDSO or from a calibrated invariant
+// TSC, or a virtual time that only moves when the host advances it at each simulation tick, which makes replays and
+// lockstep simulations see identical timestamps
+
+namespace tss {
+
+enum class ClockMode {
+    vdso,          // clock_gettime, which the vDSO serves without entering the kernel
+    tsc,           // Monotonic time from the TSC, scaled by a factor measured against CLOCK_MONOTONIC at startup
+    deterministic, // Virtual time driven by `WasiClock::advance`
+};
+
+__extension__ typedef unsigned __int128 tsc_wide_t; // Products of TSC deltas and `mult` need 96 bits
+
+// Maps TSC readings onto CLOCK_MONOTONIC as `base_ns + ((tsc - base_tsc) * mult >> 32)`
+struct TscCalibration {
+    uint64_t base_tsc = 0;
+    uint64_t base_ns  = 0;
+    uint64_t mult     = 0;
+    uint64_t res_ns   = 1; // Rounded up length of one TSC tick
+    bool valid        = false;
+};
+
+inline auto clock_ns(clockid_t id) -> uint64_t {
+    timespec ts;
+    ::clock_gettime(id, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+inline auto tsc_read() -> uint64_t {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Only an invariant TSC ticks at a constant rate in every power state and agrees between cores
+inline auto tsc_invariant() -> bool {
+#if defined(__x86_64__)
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+#else
+    return false;
+#endif
+}
+
+// Reads CLOCK_MONOTONIC between two TSC reads and pairs it with their midpoint, retrying a few times to get a pair
+// that was not split by an interrupt
+inline void tsc_sample(uint64_t *tsc, uint64_t *ns) {
+    uint64_t best = UINT64_MAX;
+    for (int attempt = 0; attempt < 8; attempt++) {
+        const auto before = tsc_read();
+        const auto now    = clock_ns(CLOCK_MONOTONIC);
+        const auto after  = tsc_read();
+        if (after - before < best) {
+            best = after - before;
+            *tsc = before + (after - before) / 2;
+            *ns  = now;
+        }
+    }
+}
+
+// Measured over 20 ms, which puts the rate within a few ppm of the kernel's own
+inline auto tsc_calibrate() -> TscCalibration {
+    TscCalibration calibration{};
+    if (!tsc_invariant()) {
+        return calibration;
+    }
+
+    uint64_t tsc_begin = 0, ns_begin = 0, tsc_end = 0, ns_end = 0;
+    tsc_sample(&tsc_begin, &ns_begin);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    tsc_sample(&tsc_end, &ns_end);
+    if (tsc_end <= tsc_begin || ns_end <= ns_begin) {
+        return calibration;
+    }
+
+    const auto ticks     = tsc_end - tsc_begin;
+    calibration.base_tsc = tsc_end;
+    calibration.base_ns  = ns_end;
+    calibration.mult     = static_cast<uint64_t>((static_cast<tsc_wide_t>(ns_end - ns_begin) << 32) / ticks);
+    calibration.res_ns   = std::max<uint64_t>(1, ((calibration.mult + 0xffffffffULL) >> 32));
+    calibration.valid    = calibration.mult != 0;
+    return calibration;
+}
+
+// Calibrated once per process, the first time an instance asks for it
+inline auto tsc_calibration() -> const TscCalibration & {
+    static const TscCalibration calibration = tsc_calibrate();
+    return calibration;
+}
+
+class WasiClock {
+public:
+    // Falls back to the vDSO and returns false if the TSC is not usable as a clock on this machine
+    auto set_mode(ClockMode mode) -> bool {
+        m_Mode = mode;
+        if (mode == ClockMode::tsc) {
+            m_Tsc = tsc_calibration();
+            if (!m_Tsc.valid) {
+                m_Mode = ClockMode::vdso;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    auto mode() const -> ClockMode {
+        return m_Mode;
+    }
+
+    // Virtual time starts at `epoch_ns` on the realtime clock and at zero on every other one, and moves by `tick_ns`
+    // per `tick()`
+    void set_virtual(uint64_t epoch_ns, uint64_t tick_ns) {
+        m_Epoch = epoch_ns;
+        m_Tick  = std::max<uint64_t>(1, tick_ns);
+    }
+
+    // Moves virtual time forward by one simulation tick
+    void tick() {
+        m_Virtual += m_Tick;
+    }
+
+    void advance(uint64_t ns) {
+        m_Virtual += ns;
+    }
+
+    // How far virtual time has moved since the clock was created
+    auto virtual_ns() const -> uint64_t {
+        return m_Virtual;
+    }
+
+    // Puts virtual time back to where `virtual_ns` was, for instances that are reused
+    void set_virtual_ns(uint64_t ns) {
+        m_Virtual = ns;
+    }
+
+    // `id` must be a valid clock id
+    auto now(ClockID id) const -> uint64_t {
+        if (m_Mode == ClockMode::deterministic) {
+            return id == ClockID::realtime ? m_Epoch + m_Virtual : m_Virtual;
+        }
+        if (m_Mode == ClockMode::tsc && id == ClockID::monotonic) {
+            const auto ticks = tsc_read() - m_Tsc.base_tsc;
+            return m_Tsc.base_ns + static_cast<uint64_t>((static_cast<tsc_wide_t>(ticks) * m_Tsc.mult) >> 32);
+        }
+        return clock_ns(static_cast<clockid_t>(id));
+    }
+
+    // Virtual clocks only ever move in whole ticks, so that is their resolution
+    auto resolution(ClockID id) const -> uint64_t {
+        if (m_Mode == ClockMode::deterministic) {
+            return m_Tick;
+        }
+        if (m_Mode == ClockMode::tsc && id == ClockID::monotonic) {
+            return m_Tsc.res_ns;
+        }
+        timespec ts;
+        if (::clock_getres(static_cast<clockid_t>(id), &ts) < 0) {
+            return 1;
+        }
+        const auto ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+        return std::max<uint64_t>(1, ns);
+    }
+
+private:
+    ClockMode m_Mode = ClockMode::vdso;
+    TscCalibration m_Tsc{};
+    uint64_t m_Virtual = 0;
+    uint64_t m_Epoch   = 0;
+    uint64_t m_Tick    = 1;
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("WasiClock") {
+    tss::WasiClock clock;
+    REQUIRE(clock.mode() == tss::ClockMode::vdso);
+    const auto realtime = clock.now(ClockID::realtime);
+    REQUIRE(realtime > 1600000000ULL * 1000000000ULL);
+    REQUIRE(clock.now(ClockID::monotonic) <= clock.now(ClockID::monotonic));
+    REQUIRE(clock.resolution(ClockID::monotonic) >= 1);
+
+    // Virtual time only moves with the simulation
+    clock.set_mode(tss::ClockMode::deterministic);
+    clock.set_virtual(1000, 16);
+    REQUIRE(clock.now(ClockID::monotonic) == 0);
+    REQUIRE(clock.now(ClockID::realtime) == 1000);
+    clock.tick();
+    clock.advance(4);
+    REQUIRE(clock.now(ClockID::monotonic) == 20);
+    REQUIRE(clock.now(ClockID::realtime) == 1020);
+    REQUIRE(clock.now(ClockID::thread_cputime_id) == 20);
+    REQUIRE(clock.resolution(ClockID::realtime) == 16);
+
+    // The TSC clock tracks CLOCK_MONOTONIC closely where it is available at all
+    if (clock.set_mode(tss::ClockMode::tsc)) {
+        const auto host = tss::clock_ns(CLOCK_MONOTONIC);
+        const auto tsc  = clock.now(ClockID::monotonic);
+        REQUIRE(tsc + 1000000 > host);
+        REQUIRE(tsc < host + 1000000);
+        REQUIRE(clock.now(ClockID::realtime) >= realtime);
+    } else {
+        REQUIRE(clock.mode() == tss::ClockMode::vdso);
+    }
+}
+#endif
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+
+inline auto wasmer_compiler_to_str(wasmer_compiler_t compiler) -> std::string {
+    switch (compiler) {
+    case CRANELIFT: {
+        return "cranelift";
+    }
+    case LLVM: {
+        return "llvm";
+    }
+    case SINGLEPASS: {
+        return "singlepass";
+    }
+    default: {
+        return fmt::format("unknown ({})", std::to_underlying(compiler));
+    }
+    }
+}
+
+struct EngineConfig {
+    wasmer_compiler_t compiler = CRANELIFT;
+    bool metering              = false; // Charge fuel for every operator, see FuelMeter
+
+    // Also used as the module cache tag, so it has to cover every setting that affects code generation
+    auto to_str() const -> std::string {
+        return fmt::format("compiler={}{}", wasmer_compiler_to_str(compiler), metering ? ",metering" : "");
+    }
+};
+
+inline auto wasm_engine_new_from_config(const EngineConfig &config) -> wasm_engine_t * {
+    wasm_config_t *wasm_config = ::wasm_config_new();
+    ::wasm_config_set_compiler(wasm_config, config.compiler);
+    if (config.metering) {
+        // One unit of fuel per operator. Instances start out without a limit, FuelMeter sets one for each call
+        auto metering = ::wasmer_metering_new(UINT64_MAX, [](wasmer_parser_operator_t) -> uint64_t { return 1; });
+        // The config takes ownership of the middleware, which took ownership of the metering
+        ::wasm_config_push_middleware(wasm_config, ::wasmer_metering_as_middleware(metering));
+    }
+    // The engine takes ownership of the config
+    return ::wasm_engine_new_with_config(wasm_config);
+}
+
+enum class CompilerTier : uint8_t {
+    none,      // Nothing compiled yet
+    baseline,  // Quick to compile, slow to run
+    optimized, // Slow to compile, fast to run
+};
+
+inline auto compiler_tier_to_str(CompilerTier tier) -> std::string {
+    switch (tier) {
+    case CompilerTier::none: {
+        return "none";
+    }
+    case CompilerTier::baseline: {
+        return "baseline";
+    }
+    case CompilerTier::optimized: {
+        return "optimized";
+    }
+    default: {
+        return fmt::format("unknown ({})", std::to_underlying(tier));
+    }
+    }
+}
+
+struct TierMetrics {
+    std::atomic<CompilerTier> active{CompilerTier::none};
+    std::atomic<int64_t> baseline_compile_ns{-1}; // -1 while the tier has not been compiled
+    std::atomic<int64_t> optimized_compile_ns{-1};
+    std::atomic<bool> baseline_from_cache{false};
+    std::atomic<bool> optimized_from_cache{false};
+};
+
+inline auto tier_metrics_to_str(const TierMetrics &metrics) -> std::string {
+    auto ns_to_str = [](int64_t ns) -> std::string {
+        return ns < 0 ? "-" : fmt::format("{:.3f} ms", static_cast<double>(ns) / 1e6);
+    };
+
+    return fmt::format("active tier: {}, baseline: {}{}, optimized: {}{}",
+                       compiler_tier_to_str(metrics.active.load()),
+                       ns_to_str(metrics.baseline_compile_ns.load()),
+                       metrics.baseline_from_cache.load() ? " (cached)" : "",
+                       ns_to_str(metrics.optimized_compile_ns.load()),
+                       metrics.optimized_from_cache.load() ? " (cached)" : "");
+}
+
+// One compiled module together with the engine it belongs to, and a store to instantiate it in
+struct CompiledTier {
+    wasm_engine_t *engine = nullptr;
+    wasm_store_t *store   = nullptr;
+    wasm_module_t *module = nullptr;
+
+    explicit operator bool() const {
+        return module != nullptr;
+    }
+
+    void destroy() {
+        if (module)
+            ::wasm_module_delete(module);
+        if (store)
+            ::wasm_store_delete(store);
+        if (engine)
+            ::wasm_engine_delete(engine);
+        *this = {};
+    }
+};
+
+// Marks "engine" and "compile" on `timeline` if given, which must then belong to the calling thread
+inline auto compile_tier(ModuleCache &cache,
+                         const wasm_byte_vec_t *binary,
+                         const EngineConfig &config,
+                         bool *from_cache,
+                         StartupTimeline *timeline = nullptr) -> CompiledTier {
+    CompiledTier tier{};
+    tier.engine = wasm_engine_new_from_config(config);
+    tier.store  = ::wasm_store_new(tier.engine);
+    if (timeline) {
+        timeline->mark("engine");
+    }
+
+    const auto tag     = config.to_str();
+    uint64_t wasm_hash = 0;
+    tier.module        = wasm_module_load_cached(cache, tier.store, binary, tag, &wasm_hash);
+    *from_cache        = tier.module != nullptr;
+    if (!tier.module) {
+        tier.module = ::wasm_module_new(tier.store, binary);
+        if (tier.module) {
+            module_cache_put(cache, tier.module, wasm_hash, tag);
+        }
+    }
+
+    if (!tier.module) {
+        tier.destroy();
+    }
+    if (timeline) {
+        timeline->mark("compile");
+    }
+
+    return tier;
+}
+
+struct TierConfig {
+    bool tiered = false;                           // Compile with `baseline` first, `optimized` in the background
+    EngineConfig baseline{.compiler = SINGLEPASS}; // Used only when tiered
+    EngineConfig optimized{.compiler = CRANELIFT};
+};
+
+// Owns the wasm binary and every tier compiled from it. With tiering enabled, `start` returns as soon as the baseline
+// compiler is done, while the optimizing compiler runs on a background thread. The host calls `poll` at a safe point
+// (between ticks or guest calls) to switch to the optimized module once it is ready; instances created before the
+// switch keep running on the baseline module, which stays alive until this object is destroyed. A background compile
+// that has not finished by then is left to finish on its own, so exiting never waits for a tier nobody will use
+class TieredModule {
+public:
+    TieredModule(MappedFile file, ModuleCache cache, TierConfig config)
+        : m_File{std::make_shared<MappedFile>(std::move(file))}, m_Cache{std::move(cache)}, m_Config{config} {}
+
+    ~TieredModule() {
+        if (m_Thread.joinable()) {
+            auto expected = BackgroundCompile::running;
+            if (m_Background->compare_exchange_strong(expected, BackgroundCompile::abandoned)) {
+                // The thread throws its tier away once done, and only touches what it shares with us until then
+                m_Thread.detach();
+            } else {
+                m_Thread.join();
+            }
+        }
+        m_Pending.destroy();
+        m_Current.destroy();
+        for (auto &tier : m_Retired) {
+            tier.destroy();
+        }
+    }
+
+    TieredModule(const TieredModule &)            = delete;
+    TieredModule &operator=(const TieredModule &) = delete;
+
+    // Produces a usable module synchronously, returns false if compilation failed. `timeline` gets the startup
+    // phases of the synchronous part
+    auto start(StartupTimeline *timeline = nullptr) -> bool {
+        const wasm_byte_vec_t binary = m_File->view();
+        const bool baseline_available = m_Config.tiered &&
+                                        m_Config.baseline.compiler != m_Config.optimized.compiler &&
+                                        ::wasmer_is_compiler_available(m_Config.baseline.compiler);
+
+        // An optimized artifact in the cache beats any baseline compile, so check for that first
+        if (baseline_available) {
+            auto begin       = std::chrono::steady_clock::now();
+            m_Current.engine = wasm_engine_new_from_config(m_Config.optimized);
+            m_Current.store  = ::wasm_store_new(m_Current.engine);
+            m_Current.module = wasm_module_load_cached(m_Cache, m_Current.store, &binary, m_Config.optimized.to_str());
+            if (timeline) {
+                timeline->mark(m_Current ? "compile" : "cache probe");
+            }
+            if (m_Current) {
+                m_Metrics.optimized_compile_ns = elapsed_ns(begin);
+                m_Metrics.optimized_from_cache = true;
+                m_Metrics.active               = CompilerTier::optimized;
+                m_File->release_pages();
+                return true;
+            }
+            m_Current.destroy();
+        }
+
+        const auto tier    = baseline_available ? CompilerTier::baseline : CompilerTier::optimized;
+        const auto &config = baseline_available ? m_Config.baseline : m_Config.optimized;
+        bool from_cache    = false;
+
+        auto begin = std::chrono::steady_clock::now();
+        m_Current  = compile_tier(m_Cache, &binary, config, &from_cache, timeline);
+        if (!m_Current) {
+            return false;
+        }
+
+        if (tier == CompilerTier::baseline) {
+            m_Metrics.baseline_compile_ns = elapsed_ns(begin);
+            m_Metrics.baseline_from_cache = from_cache;
+        } else {
+            m_Metrics.optimized_compile_ns = elapsed_ns(begin);
+            m_Metrics.optimized_from_cache = from_cache;
+        }
+        m_Metrics.active = tier;
+
+        if (tier == CompilerTier::baseline) {
+            // The background compile gets its own copy of the cache, the stats are not shared between threads. It may
+            // outlive this object, so it holds on to the file and the state, and touches nothing else of ours unless
+            // it gets to hand over its tier
+            m_Background->store(BackgroundCompile::running);
+            auto compile = [this,
+                            file       = m_File,
+                            background = m_Background,
+                            cache      = m_Cache,
+                            config     = m_Config.optimized]() mutable {
+                const wasm_byte_vec_t bytes = file->view();
+                bool cached                 = false;
+                auto optimized_begin        = std::chrono::steady_clock::now();
+                auto optimized              = compile_tier(cache, &bytes, config, &cached);
+                auto expected               = BackgroundCompile::running;
+                if (!background->compare_exchange_strong(expected, BackgroundCompile::finishing)) {
+                    optimized.destroy();
+                    return;
+                }
+                m_Pending                      = optimized;
+                m_Metrics.optimized_compile_ns = elapsed_ns(optimized_begin);
+                m_Metrics.optimized_from_cache = cached;
+                background->store(BackgroundCompile::ready, std::memory_order_release);
+            };
+            m_Thread = std::thread(std::move(compile));
+        } else {
+            m_File->release_pages();
+        }
+
+        return true;
+    }
+
+    // Safe point: switches to the optimized tier if it finished compiling. Returns true if the tier changed, in which
+    // case the host should create new instances from `current()`
+    auto poll() -> bool {
+        if (m_Metrics.active.load() != CompilerTier::baseline ||
+            m_Background->load(std::memory_order_acquire) != BackgroundCompile::ready) {
+            return false;
+        }
+
+        m_Thread.join();
+        m_File->release_pages();
+
+        if (!m_Pending) {
+            fmt::print(stderr, "Optimized compile failed, staying on the baseline tier\n");
+            m_Background->store(BackgroundCompile::none);
+            m_Metrics.optimized_compile_ns = -1;
+            return false;
+        }
+
+        m_Retired.push_back(std::exchange(m_Current, m_Pending));
+        m_Pending        = {};
+        m_Metrics.active = CompilerTier::optimized;
+        return true;
+    }
+
+    auto current() const -> const CompiledTier & {
+        return m_Current;
+    }
+
+    auto metrics() const -> const TierMetrics & {
+        return m_Metrics;
+    }
+
+    auto cache() const -> const ModuleCache & {
+        return m_Cache;
+    }
+
+private:
+    enum class BackgroundCompile : uint8_t {
+        none,
+        running,
+        finishing, // Handing over its tier, which the destructor waits for
+        ready,     // For `poll` to switch to
+        abandoned, // By the destructor, the thread cleans up after itself
+    };
+
+    static auto elapsed_ns(std::chrono::steady_clock::time_point begin) -> int64_t {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    std::shared_ptr<MappedFile> m_File; // Shared with the background compile
+    ModuleCache m_Cache;
+    TierConfig m_Config;
+    TierMetrics m_Metrics;
+    CompiledTier m_Current{};
+    CompiledTier m_Pending{}; // Written by the background thread, handed over in `poll`
+    std::vector<CompiledTier> m_Retired;
+    std::shared_ptr<std::atomic<BackgroundCompile>> m_Background =
+        std::make_shared<std::atomic<BackgroundCompile>>(BackgroundCompile::none);
+    std::thread m_Thread;
+};
+} // namespace tss
@@ -0,0 +1,314 @@
+#pragma once
+
+#include "inc.hh"
+
+// Guest file descriptor table. Guest fds index straight into a dense vector of entries, closed slots go on a free-list
+// and are handed out again before the vector grows, so lookups are one bounds check and one load no matter how many
+// handles are open. Every entry carries its rights as plain bitmasks, making the rights check of a call a single AND
+
+namespace tss {
+
+inline constexpr auto wasi_rights(std::initializer_list<Rights> rights) -> __wasi_rights_t {
+    __wasi_rights_t mask = 0;
+    for (auto right : rights) {
+        mask |= std::to_underlying(right);
+    }
+    return mask;
+}
+
+inline constexpr __wasi_rights_t wasi_rights_all = (__wasi_rights_t{std::to_underlying(Rights::sock_accept)} << 1) - 1;
+
+inline constexpr __wasi_rights_t wasi_rights_stdio = wasi_rights({Rights::fd_read,
+                                                                  Rights::fd_write,
+                                                                  Rights::fd_fdstat_set_flags,
+                                                                  Rights::fd_filestat_get,
+                                                                  Rights::poll_fd_readwrite});
+
+// Everything that does not modify the filesystem, for packs
+inline constexpr __wasi_rights_t wasi_rights_read_only = wasi_rights({Rights::fd_read,
+                                                                      Rights::fd_seek,
+                                                                      Rights::fd_tell,
+                                                                      Rights::fd_advise,
+                                                                      Rights::path_open,
+                                                                      Rights::fd_readdir,
+                                                                      Rights::path_filestat_get,
+                                                                      Rights::fd_filestat_get,
+                                                                      Rights::poll_fd_readwrite});
+
+inline auto wasi_filetype_from_mode(mode_t mode) -> Filetype {
+    switch (mode & S_IFMT) {
+    case S_IFBLK: {
+        return Filetype::block_device;
+    }
+    case S_IFCHR: {
+        return Filetype::character_device;
+    }
+    case S_IFDIR: {
+        return Filetype::directory;
+    }
+    case S_IFREG: {
+        return Filetype::regular_file;
+    }
+    case S_IFSOCK: {
+        return Filetype::socket_stream;
+    }
+    case S_IFLNK: {
+        return Filetype::symbolic_link;
+    }
+    default: {
+        return Filetype::unknown;
+    }
+    }
+}
+
+// Either a host fd, or an entry of a pack
+struct FdEntry {
+    int host_fd                       = -1;
+    Filetype filetype                 = Filetype::unknown;
+    __wasi_fdflags_t flags            = 0;
+    __wasi_rights_t rights_base       = 0;
+    __wasi_rights_t rights_inheriting = 0;
+    bool owned                        = false; // The host fd is closed together with the entry
+    std::string preopen;                       // Guest path of a preopened directory, empty for anything else
+    const VfsPack *pack               = nullptr;
+    uint32_t pack_index               = 0;
+    uint64_t position                 = 0;       // File offset of pack entries, the kernel keeps it for host fds
+    StatCache *stat_cache             = nullptr; // Metadata cache of a preopened host directory, owned by the table
+
+    auto in_use() const -> bool {
+        return host_fd >= 0 || pack;
+    }
+};
+
+class FdTable {
+public:
+    FdTable() = default;
+
+    ~FdTable() {
+        for (auto &entry : m_Entries) {
+            if (entry.owned && entry.host_fd >= 0) {
+                ::close(entry.host_fd);
+            }
+        }
+    }
+
+    FdTable(const FdTable &)            = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    FdTable(FdTable &&other) noexcept
+        : m_Entries{std::move(other.m_Entries)}, m_Free{std::move(other.m_Free)},
+          m_Open{std::exchange(other.m_Open, 0)}, m_Packs{std::move(other.m_Packs)},
+          m_StatCaches{std::move(other.m_StatCaches)} {}
+
+    // Reuses the most recently closed slot if there is one
+    auto insert(FdEntry entry) -> __wasi_fd_t {
+        assert(entry.in_use());
+        m_Open++;
+        if (!m_Free.empty()) {
+            const auto fd = m_Free.back();
+            m_Free.pop_back();
+            m_Entries[static_cast<size_t>(fd)] = std::move(entry);
+            return fd;
+        }
+        m_Entries.push_back(std::move(entry));
+        return static_cast<__wasi_fd_t>(m_Entries.size() - 1);
+    }
+
+    // Nullptr if `fd` is not open
+    auto get(__wasi_fd_t fd) -> FdEntry * {
+        if (fd < 0 || static_cast<size_t>(fd) >= m_Entries.size()) {
+            return nullptr;
+        }
+        auto &entry = m_Entries[static_cast<size_t>(fd)];
+        return entry.in_use() ? &entry : nullptr;
+    }
+
+    // The entry for `fd` if it is open and has all of `rights`, e_badf or e_notcapable otherwise
+    auto lookup(__wasi_fd_t fd, __wasi_rights_t rights, FdEntry **out) -> Errno {
+        *out = get(fd);
+        if (!*out) {
+            return Errno::e_badf;
+        }
+        if (((*out)->rights_base & rights) != rights) {
+            return Errno::e_notcapable;
+        }
+        return Errno::e_success;
+    }
+
+    // Frees the slot of `fd` and hands its entry over, closing an owned host fd is then up to the caller
+    auto remove(__wasi_fd_t fd) -> std::optional<FdEntry> {
+        auto entry = get(fd);
+        if (!entry) {
+            return std::nullopt;
+        }
+        m_Free.push_back(fd);
+        m_Open--;
+        return std::exchange(*entry, {});
+    }
+
+    // Number of open fds
+    auto size() const -> size_t {
+        return m_Open;
+    }
+
+    // Guest fds 0 to 2 refer to the host's stdio, which the table does not own
+    void install_stdio() {
+        for (int host_fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) {
+            struct stat st;
+            const auto filetype = ::fstat(host_fd, &st) == 0 ? wasi_filetype_from_mode(st.st_mode) : Filetype::unknown;
+            insert({host_fd, filetype, 0, wasi_rights_stdio, 0, false, {}, nullptr, 0, 0, nullptr});
+        }
+    }
+
+    // Opens `host_path` as a directory the guest sees as `guest_path`. WASI libc discovers preopens by probing fds
+    // upwards from 3 until one fails, so all of them must be installed right after stdio
+    auto preopen(const std::string &guest_path, const std::filesystem::path &host_path, bool stat_cache) -> bool {
+        int host_fd = ::open(host_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (host_fd < 0) {
+            fmt::print(stderr, "Preopen: {}: {}\n", host_path.string(), std::strerror(errno));
+            return false;
+        }
+
+        StatCache *cache = nullptr;
+        if (stat_cache) {
+            if (auto created = StatCache::create(host_fd, host_path)) {
+                cache = m_StatCaches.emplace_back(std::move(created)).get();
+            } else {
+                fmt::print(stderr, "Preopen: no inotify for {}, not caching metadata\n", host_path.string());
+            }
+        }
+        const auto rights = wasi_rights_all;
+        insert({host_fd, Filetype::directory, 0, rights, rights, true, guest_path, nullptr, 0, 0, cache});
+        return true;
+    }
+
+    // Exposes the root of `pack` as `guest_path`. The table keeps the pack alive for as long as it has fds into it
+    void preopen(const std::string &guest_path, std::shared_ptr<const VfsPack> pack) {
+        const auto rights = wasi_rights_read_only;
+        insert({-1, Filetype::directory, 0, rights, rights, false, guest_path, pack.get(), 0, 0, nullptr});
+        m_Packs.push_back(std::move(pack));
+    }
+
+    // Closes whatever the guest opened itself, leaving stdio and the preopens that still directly follow it. A table
+    // reset this way hands out the same fds again as a fresh one
+    void reset_to_preopens() {
+        size_t kept = 0;
+        while (kept < m_Entries.size() && m_Entries[kept].in_use() && (kept < 3 || !m_Entries[kept].preopen.empty())) {
+            kept++;
+        }
+        for (size_t index = kept; index < m_Entries.size(); index++) {
+            auto &entry = m_Entries[index];
+            if (entry.owned && entry.host_fd >= 0) {
+                ::close(entry.host_fd);
+            }
+        }
+        m_Entries.resize(kept);
+        m_Free.clear();
+        m_Open = kept;
+    }
+
+    // Guest paths of the preopened directories, in fd order
+    auto preopens() const -> std::vector<std::string_view> {
+        std::vector<std::string_view> paths;
+        for (const auto &entry : m_Entries) {
+            if (entry.in_use() && !entry.preopen.empty()) {
+                paths.push_back(entry.preopen);
+            }
+        }
+        return paths;
+    }
+
+    // Lets every metadata cache know that the instance has written to a file
+    void note_write() {
+        for (auto &cache : m_StatCaches) {
+            cache->note_write();
+        }
+    }
+
+    // Summed over all preopens
+    auto stat_cache_stats() const -> StatCacheStats {
+        StatCacheStats total{};
+        for (const auto &cache : m_StatCaches) {
+            const auto stats = cache->stats();
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+            total.invalidations += stats.invalidations;
+        }
+        return total;
+    }
+
+private:
+    std::vector<FdEntry> m_Entries;
+    std::vector<__wasi_fd_t> m_Free;
+    size_t m_Open = 0;
+    std::vector<std::shared_ptr<const VfsPack>> m_Packs;
+    std::vector<std::unique_ptr<StatCache>> m_StatCaches; // Destroyed after the destructor closed the host fds
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("FdTable") {
+    tss::FdTable table;
+    table.install_stdio();
+    REQUIRE(table.size() == 3);
+    REQUIRE(table.get(1)->host_fd == STDOUT_FILENO);
+    REQUIRE(!table.get(3));
+    REQUIRE(!table.get(-1));
+
+    tss::FdEntry *entry = nullptr;
+    REQUIRE(table.lookup(1, tss::wasi_rights({Rights::fd_write}), &entry) == Errno::e_success);
+    REQUIRE(entry == table.get(1));
+    REQUIRE(table.lookup(1, tss::wasi_rights({Rights::fd_write, Rights::path_open}), &entry) == Errno::e_notcapable);
+    REQUIRE(table.lookup(3, 0, &entry) == Errno::e_badf);
+
+    // Closed slots are reused before the table grows
+    const auto read_only = tss::wasi_rights({Rights::fd_read});
+    const tss::FdEntry stdin_entry{STDIN_FILENO, Filetype::unknown, 0, read_only, 0, false, {}, nullptr, 0, 0, nullptr};
+    for (int index = 0; index < 50000; index++) {
+        REQUIRE(table.insert(stdin_entry) == 3 + index);
+    }
+    REQUIRE(table.remove(1000));
+    REQUIRE(!table.remove(1000));
+    REQUIRE(table.insert(stdin_entry) == 1000);
+    REQUIRE(table.size() == 50003);
+
+    REQUIRE(table.preopen("/", "/", false));
+    REQUIRE(table.get(50003)->filetype == Filetype::directory);
+    REQUIRE(table.get(50003)->preopen == "/");
+    REQUIRE(!table.preopen("/missing", "/nonexistent/qost", false));
+
+    // Resetting keeps stdio and the preopens right after it, and hands out the same fds again
+    tss::FdTable reused;
+    reused.install_stdio();
+    REQUIRE(reused.preopen("/", "/", false));
+    REQUIRE(reused.insert(stdin_entry) == 4);
+    REQUIRE(reused.insert(stdin_entry) == 5);
+    REQUIRE(reused.remove(4));
+    reused.reset_to_preopens();
+    REQUIRE(reused.size() == 4);
+    REQUIRE(reused.preopens() == std::vector<std::string_view>{"/"});
+    REQUIRE(reused.insert(stdin_entry) == 4);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("fd_table: lookup") {
+    tss::FdTable table;
+    table.install_stdio();
+    const auto rights_all = tss::wasi_rights_all;
+    for (int index = 0; index < 20000; index++) {
+        table.insert({STDIN_FILENO, Filetype::unknown, 0, rights_all, 0, false, {}, nullptr, 0, 0, nullptr});
+    }
+
+    const auto rights   = tss::wasi_rights({Rights::fd_read});
+    __wasi_fd_t fd      = 0;
+    tss::FdEntry *entry = nullptr;
+    tss::bench::report("lookup with rights check, 20k open fds",
+                       tss::bench::ns_per_op(10000000,
+                                             [&]() {
+                                                 fd = (fd * 7919 + 1) % 20003;
+                                                 tss::bench::do_not_optimize(table.lookup(fd, rights, &entry));
+                                             }),
+                       "ns");
+}
+#endif
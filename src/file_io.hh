@@ -0,0 +1,557 @@
+#pragma once
+
+#include "inc.hh"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// Positioned file I/O for the WASI layer, with an optional io_uring backend.
+//
+// Guest fd_pwrite calls to regular files are deferred: the data is copied out of guest memory and queued, and the call
+// returns right away, so a guest writing a save-game in many small pieces costs one io_uring_enter for all of them.
+// Everything queued, by the guest or by the host through `FileIo::enqueue`, is submitted together by `complete`,
+// which the host calls at tick boundaries and before any other WASI call, and the guest through sched_yield. A
+// deferred write that fails is reported by the next read, write or close of its fd, as write-behind caches do.
+// Guest calls that have to return data, such as fd_pread, still wait for their own completion, sharing the
+// io_uring_enter with whatever is queued. Without io_uring (old kernels, seccomp filters, or simply not enabled)
+// nothing is deferred and the same interface runs on preadv/pwritev
+
+namespace tss {
+
+// Raw io_uring, driven through the syscalls directly so there is no liburing dependency. Only used from the thread
+// that owns the instance
+class IoRing {
+public:
+    // Nullptr if the kernel does not let us have a ring
+    static auto create(unsigned entries) -> std::unique_ptr<IoRing> {
+        std::unique_ptr<IoRing> self(new IoRing());
+
+        io_uring_params params{};
+        self->m_Fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (self->m_Fd < 0) {
+            return nullptr;
+        }
+
+        self->m_SqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        self->m_CqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            self->m_SqSize = self->m_CqSize = std::max(self->m_SqSize, self->m_CqSize);
+        }
+
+        self->m_Sq       = self->map(self->m_SqSize, IORING_OFF_SQ_RING);
+        self->m_Cq       = single_mmap ? self->m_Sq : self->map(self->m_CqSize, IORING_OFF_CQ_RING);
+        self->m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        self->m_Sqes     = reinterpret_cast<io_uring_sqe *>(self->map(self->m_SqesSize, IORING_OFF_SQES));
+        if (!self->m_Sq || !self->m_Cq || !self->m_Sqes) {
+            return nullptr;
+        }
+
+        self->m_Entries = params.sq_entries;
+        self->m_SqTail  = reinterpret_cast<unsigned *>(self->m_Sq + params.sq_off.tail);
+        self->m_SqHead  = reinterpret_cast<unsigned *>(self->m_Sq + params.sq_off.head);
+        self->m_SqMask  = *reinterpret_cast<unsigned *>(self->m_Sq + params.sq_off.ring_mask);
+        self->m_SqArray = reinterpret_cast<unsigned *>(self->m_Sq + params.sq_off.array);
+        self->m_CqHead  = reinterpret_cast<unsigned *>(self->m_Cq + params.cq_off.head);
+        self->m_CqTail  = reinterpret_cast<unsigned *>(self->m_Cq + params.cq_off.tail);
+        self->m_CqMask  = *reinterpret_cast<unsigned *>(self->m_Cq + params.cq_off.ring_mask);
+        self->m_Cqes    = reinterpret_cast<io_uring_cqe *>(self->m_Cq + params.cq_off.cqes);
+
+        return self;
+    }
+
+    ~IoRing() {
+        if (m_Sqes) {
+            ::munmap(m_Sqes, m_SqesSize);
+        }
+        if (m_Cq && m_Cq != m_Sq) {
+            ::munmap(m_Cq, m_CqSize);
+        }
+        if (m_Sq) {
+            ::munmap(m_Sq, m_SqSize);
+        }
+        if (m_Fd >= 0) {
+            ::close(m_Fd);
+        }
+    }
+
+    IoRing(const IoRing &)            = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    auto entries() const -> unsigned {
+        return m_Entries;
+    }
+
+    // False if the submission queue is full, `submit` makes room
+    auto queue(uint8_t opcode,
+               int fd,
+               const void *addr,
+               uint32_t len,
+               uint64_t offset,
+               uint64_t user_data,
+               uint8_t flags = 0) -> bool {
+        const unsigned tail = *m_SqTail;
+        const unsigned head = std::atomic_ref<unsigned>(*m_SqHead).load(std::memory_order_acquire);
+        if (tail - head >= m_Entries) {
+            return false;
+        }
+
+        const unsigned index = tail & m_SqMask;
+        io_uring_sqe &sqe    = m_Sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode       = opcode;
+        sqe.flags        = flags;
+        sqe.fd           = fd;
+        sqe.addr         = reinterpret_cast<uint64_t>(addr);
+        sqe.len          = len;
+        sqe.off          = offset;
+        sqe.user_data    = user_data;
+        m_SqArray[index] = index;
+        std::atomic_ref<unsigned>(*m_SqTail).store(tail + 1, std::memory_order_release);
+        m_Unsubmitted++;
+        return true;
+    }
+
+    // Submits everything queued and waits until at least `wait` completions are available. Negative errno on failure,
+    // -EINTR once `*interrupted` is set
+    auto submit(unsigned wait, const std::atomic<bool> *interrupted = nullptr) -> int {
+        int result;
+        do {
+            result = static_cast<int>(::syscall(__NR_io_uring_enter,
+                                                m_Fd,
+                                                m_Unsubmitted,
+                                                wait,
+                                                wait != 0 ? IORING_ENTER_GETEVENTS : 0U,
+                                                nullptr,
+                                                size_t{0}));
+        } while (result < 0 && errno == EINTR && !(interrupted && interrupted->load(std::memory_order_relaxed)));
+
+        if (result < 0) {
+            return -errno;
+        }
+        m_Unsubmitted -= static_cast<unsigned>(result);
+        return result;
+    }
+
+    // Calls `func(user_data, result)` for every available completion
+    template <typename F>
+    void reap(F &&func) {
+        unsigned head       = *m_CqHead;
+        const unsigned tail = std::atomic_ref<unsigned>(*m_CqTail).load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = m_Cqes[head & m_CqMask];
+            func(cqe.user_data, cqe.res);
+        }
+        std::atomic_ref<unsigned>(*m_CqHead).store(head, std::memory_order_release);
+    }
+
+private:
+    IoRing() = default;
+
+    auto map(size_t size, off_t offset) const -> uint8_t * {
+        void *ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, offset);
+        return ptr == MAP_FAILED ? nullptr : static_cast<uint8_t *>(ptr);
+    }
+
+    int m_Fd               = -1;
+    unsigned m_Entries     = 0;
+    unsigned m_Unsubmitted = 0;
+    uint8_t *m_Sq          = nullptr;
+    uint8_t *m_Cq          = nullptr;
+    size_t m_SqSize        = 0;
+    size_t m_CqSize        = 0;
+    size_t m_SqesSize      = 0;
+    unsigned *m_SqHead     = nullptr;
+    unsigned *m_SqTail     = nullptr;
+    unsigned *m_SqArray    = nullptr;
+    unsigned m_SqMask      = 0;
+    io_uring_sqe *m_Sqes   = nullptr;
+    unsigned *m_CqHead     = nullptr;
+    unsigned *m_CqTail     = nullptr;
+    unsigned m_CqMask      = 0;
+    io_uring_cqe *m_Cqes   = nullptr;
+};
+
+// A read or write queued by the host. The caller keeps it and its buffer alive until `FileIo::complete` returns
+struct IoRequest {
+    int fd          = -1;
+    bool write      = false;
+    void *buffer    = nullptr;
+    uint32_t length = 0;
+    uint64_t offset = 0;
+    int64_t result  = 0; // Bytes transferred, or negative errno, once completed
+};
+
+class FileIo {
+public:
+    FileIo() = default;
+
+    // Deferred writes land before the instance goes away
+    ~FileIo() {
+        complete();
+    }
+
+    FileIo(const FileIo &)            = delete;
+    FileIo &operator=(const FileIo &) = delete;
+
+    // Falls back to preadv/pwritev if the ring cannot be created
+    auto enable_io_uring(unsigned entries = 256) -> bool {
+        m_Ring = IoRing::create(entries);
+        return m_Ring != nullptr;
+    }
+
+    auto uses_io_uring() const -> bool {
+        return m_Ring != nullptr;
+    }
+
+    // Positioned scatter/gather transfer that returns once it is done. Bytes transferred, or negative errno. Gives up
+    // with -EINTR once `*interrupted` is set and a signal comes in, see `Watchdog`. The buffers then have to stay alive
+    // until the next `complete`, the kernel may still be working on them
+    auto transfer(bool write,
+                  int fd,
+                  const iovec *iovs,
+                  int count,
+                  uint64_t offset,
+                  const std::atomic<bool> *interrupted = nullptr) -> int64_t {
+        if (!m_Ring) {
+            ssize_t result;
+            do {
+                result = write ? ::pwritev(fd, iovs, count, static_cast<off_t>(offset))
+                               : ::preadv(fd, iovs, count, static_cast<off_t>(offset));
+            } while (result < 0 && errno == EINTR && !(interrupted && interrupted->load(std::memory_order_relaxed)));
+            return result < 0 ? -errno : result;
+        }
+
+        const uint8_t opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        // Deferred writes it may overlap have to land first
+        const uint8_t flags = m_Deferred.empty() ? 0 : IOSQE_IO_DRAIN;
+        // Its own id, so the completion of one given up on is not taken for that of a later one
+        const uint64_t sync_user_data = m_NextSync;
+        m_NextSync += 2;
+        while (!m_Ring->queue(opcode, fd, iovs, static_cast<uint32_t>(count), offset, sync_user_data, flags)) {
+            if (auto error = drain(); error < 0) {
+                return error;
+            }
+        }
+        m_InFlight++;
+
+        // Whatever the host has queued since the last tick goes into the kernel with this same call
+        std::optional<int64_t> own;
+        while (!own) {
+            if (auto error = m_Ring->submit(1, interrupted); error < 0) {
+                return error;
+            }
+            m_Ring->reap([&](uint64_t user_data, int32_t result) {
+                m_InFlight--;
+                if (user_data == sync_user_data) {
+                    own = result;
+                } else if (!is_sync(user_data)) {
+                    reinterpret_cast<IoRequest *>(user_data)->result = result;
+                }
+            });
+        }
+        return *own;
+    }
+
+    // Queues a request without submitting it, the syscall is shared with the next transfer or `complete`
+    void enqueue(IoRequest *request) {
+        if (!m_Ring) {
+            m_Pending.push_back(request);
+            return;
+        }
+        queue_request(request, 0);
+    }
+
+    // Copies the data and queues a positioned write of it, to be submitted with the next transfer or `complete`. The
+    // bytes queued, or nothing if the write has to be made synchronously: without io_uring, or when it is too large
+    // to be worth the copy. Writes overlapping one still queued are ordered after it
+    auto write_deferred(int fd, const iovec *iovs, int count, uint64_t offset) -> std::optional<uint32_t> {
+        if (!m_Ring) {
+            return std::nullopt;
+        }
+        size_t size = 0;
+        for (int index = 0; index < count; index++) {
+            size += iovs[index].iov_len;
+        }
+        if (size > deferred_write_max) {
+            return std::nullopt;
+        }
+        if (m_DeferredBytes + size > deferred_bytes_max) {
+            complete();
+        }
+
+        uint8_t flags = 0;
+        for (const auto &deferred : m_Deferred) {
+            if (deferred.request.fd == fd && deferred.request.offset < offset + size &&
+                offset < deferred.request.offset + deferred.request.length) {
+                flags = IOSQE_IO_DRAIN;
+                break;
+            }
+        }
+
+        // A deque, so the requests the ring points at stay where they are
+        auto &deferred = m_Deferred.emplace_back();
+        deferred.data.resize(size);
+        size_t copied = 0;
+        for (int index = 0; index < count; index++) {
+            std::memcpy(deferred.data.data() + copied, iovs[index].iov_base, iovs[index].iov_len);
+            copied += iovs[index].iov_len;
+        }
+        deferred.request = {fd, true, deferred.data.data(), static_cast<uint32_t>(size), offset, 0};
+        m_DeferredBytes += size;
+        queue_request(&deferred.request, flags);
+        return static_cast<uint32_t>(size);
+    }
+
+    // Whether there are deferred writes `complete` has yet to finish
+    auto has_deferred() const -> bool {
+        return !m_Deferred.empty();
+    }
+
+    // The errno of the first deferred write to `fd` that failed since the last call, or 0
+    auto take_error(int fd) -> int {
+        if (m_Errors.empty()) {
+            return 0;
+        }
+        const auto found = m_Errors.find(fd);
+        if (found == m_Errors.end()) {
+            return 0;
+        }
+        const int error = found->second;
+        m_Errors.erase(found);
+        return error;
+    }
+
+    // For fds closed without asking, whose numbers the host may reuse
+    void clear_errors() {
+        m_Errors.clear();
+    }
+
+    // Completes every enqueued request and deferred write, called at tick boundaries, before any WASI call other than
+    // fd_pwrite, and when the guest yields
+    void complete() {
+        if (!m_Ring) {
+            for (auto request : m_Pending) {
+                iovec iov{request->buffer, request->length};
+                request->result = transfer(request->write, request->fd, &iov, 1, request->offset);
+            }
+            m_Pending.clear();
+            return;
+        }
+
+        while (m_InFlight > 0) {
+            if (drain() < 0) {
+                break;
+            }
+        }
+        for (const auto &deferred : m_Deferred) {
+            const auto &request = deferred.request;
+            if (request.result != static_cast<int64_t>(request.length)) {
+                // A short write with no error of its own means the disk filled up
+                m_Errors.try_emplace(request.fd, request.result < 0 ? static_cast<int>(-request.result) : ENOSPC);
+            }
+        }
+        m_Deferred.clear();
+        m_DeferredBytes = 0;
+    }
+
+private:
+    struct DeferredWrite {
+        IoRequest request;
+        std::vector<uint8_t> data; // Copied from the guest, which may reuse its buffer as soon as the call returns
+    };
+
+    static constexpr size_t deferred_write_max = 64 << 10; // Larger writes cost more to copy than a syscall does
+    static constexpr size_t deferred_bytes_max = 4 << 20;  // Copies held at once, before they are completed early
+
+    void queue_request(IoRequest *request, uint8_t flags) {
+        const uint8_t opcode     = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+        const uint64_t user_data = reinterpret_cast<uint64_t>(request);
+        // Keep the completion queue from overflowing, it is sized for the submission queue
+        while (m_InFlight >= m_Ring->entries() || !m_Ring->queue(opcode,
+                                                                 request->fd,
+                                                                 request->buffer,
+                                                                 request->length,
+                                                                 request->offset,
+                                                                 user_data,
+                                                                 flags)) {
+            if (auto error = drain(); error < 0) {
+                request->result = error;
+                return;
+            }
+        }
+        m_InFlight++;
+    }
+
+    // User data of `transfer`s are odd, that of requests the address of an `IoRequest`
+    static auto is_sync(uint64_t user_data) -> bool {
+        return user_data & 1;
+    }
+
+    // Submits and waits for at least one completion
+    auto drain() -> int {
+        if (auto error = m_Ring->submit(m_InFlight > 0 ? 1 : 0); error < 0) {
+            return error;
+        }
+        m_Ring->reap([&](uint64_t user_data, int32_t result) {
+            m_InFlight--;
+            if (!is_sync(user_data)) {
+                reinterpret_cast<IoRequest *>(user_data)->result = result;
+            }
+        });
+        return 0;
+    }
+
+    std::unique_ptr<IoRing> m_Ring;
+    unsigned m_InFlight = 0;
+    uint64_t m_NextSync = 1;
+    std::vector<IoRequest *> m_Pending; // Fallback only
+    std::deque<DeferredWrite> m_Deferred;
+    size_t m_DeferredBytes = 0;
+    std::unordered_map<int, int> m_Errors; // host fd -> errno of its first failed deferred write
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("FileIo") {
+    char path[] = "/tmp/qost_file_io_XXXXXX";
+    int fd      = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+
+    for (bool io_uring : {false, true}) {
+        tss::FileIo io;
+        if (io_uring && !io.enable_io_uring(4)) {
+            continue; // Not allowed in this environment, the fallback has been tested already
+        }
+        INFO("io_uring: ", io.uses_io_uring());
+
+        char hello[]        = "hello";
+        char world[]        = "world";
+        iovec write_iovs[2] = {{hello, 5}, {world, 5}};
+        REQUIRE(io.transfer(true, fd, write_iovs, 2, 100) == 10);
+
+        // More requests than the ring has entries, completed in one go
+        std::array<char, 2> chunks[8] = {};
+        tss::IoRequest requests[8];
+        for (uint32_t index = 0; index < 8; index++) {
+            requests[index] = {fd, false, chunks[index].data(), 1, 100 + index, 0};
+            io.enqueue(&requests[index]);
+        }
+        io.complete();
+        for (uint32_t index = 0; index < 8; index++) {
+            REQUIRE(requests[index].result == 1);
+            REQUIRE(chunks[index][0] == "hellowor"[index]);
+        }
+
+        char buf[16] = {};
+        iovec read_iov{buf, sizeof(buf)};
+        REQUIRE(io.transfer(false, fd, &read_iov, 1, 105) == 5);
+        REQUIRE(std::string_view(buf, 5) == "world");
+        REQUIRE(io.transfer(false, -1, &read_iov, 1, 0) == -EBADF);
+
+        // Deferred writes land at `complete`, overlapping ones in the order they were made
+        char first[]  = "AAAA";
+        char second[] = "BB";
+        iovec first_iov{first, 4};
+        iovec second_iov{second, 2};
+        const auto queued = io.write_deferred(fd, &first_iov, 1, 200);
+        if (!io.uses_io_uring()) {
+            REQUIRE(!queued);
+            continue;
+        }
+        REQUIRE(queued == 4u);
+        REQUIRE(io.write_deferred(fd, &second_iov, 1, 201) == 2u);
+        REQUIRE(io.has_deferred());
+        io.complete();
+        REQUIRE(!io.has_deferred());
+        REQUIRE(io.transfer(false, fd, &read_iov, 1, 200) == 4);
+        REQUIRE(std::string_view(buf, 4) == "ABBA");
+
+        // A failed one is kept for whoever next uses its fd
+        const int read_only = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        REQUIRE(read_only >= 0);
+        REQUIRE(io.write_deferred(read_only, &first_iov, 1, 0) == 4u);
+        io.complete();
+        REQUIRE(io.take_error(fd) == 0);
+        REQUIRE(io.take_error(read_only) == EBADF);
+        REQUIRE(io.take_error(read_only) == 0);
+        ::close(read_only);
+    }
+
+    close(fd);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("file_io: small random reads") {
+    // Stands in for save-game and asset lookups: many 4 KiB reads at random offsets of a file in the page cache
+    char path[] = "/tmp/qost_bench_file_io_XXXXXX";
+    int fd      = mkstemp(path);
+    if (fd < 0) {
+        return;
+    }
+    unlink(path);
+
+    constexpr size_t file_size  = 64 << 20;
+    constexpr uint32_t io_size  = 4096;
+    constexpr size_t batch      = 64;
+    constexpr size_t iterations = 200000;
+    if (ftruncate(fd, file_size) < 0) {
+        close(fd);
+        return;
+    }
+
+    std::vector<uint64_t> offsets(iterations);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (auto &offset : offsets) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        offset = (state % (file_size / io_size)) * io_size;
+    }
+    std::vector<char> buffers(batch * io_size);
+
+    for (bool io_uring : {false, true}) {
+        tss::FileIo io;
+        if (io_uring && !io.enable_io_uring(batch)) {
+            fmt::print("  io_uring is not available\n");
+            continue;
+        }
+        const auto backend = io_uring ? "io_uring" : "preadv";
+
+        const double sync_ns = tss::bench::ns_per_op(iterations, [&, index = size_t{0}]() mutable {
+            iovec iov{buffers.data(), io_size};
+            tss::bench::do_not_optimize(io.transfer(false, fd, &iov, 1, offsets[index++]));
+        });
+        tss::bench::report(fmt::format("{}: one read per call", backend), sync_ns, "ns/read");
+
+        std::vector<tss::IoRequest> requests(batch);
+        const double batched_ns = tss::bench::ns_per_op(iterations / batch, [&, index = size_t{0}]() mutable {
+            for (size_t slot = 0; slot < batch; slot++) {
+                requests[slot] = {fd, false, &buffers[slot * io_size], io_size, offsets[index++], 0};
+                io.enqueue(&requests[slot]);
+            }
+            io.complete();
+        });
+        tss::bench::report(fmt::format("{}: {} reads per tick", backend, batch), batched_ns / batch, "ns/read");
+
+        // What guest fd_pwrite calls cost, deferred with io_uring and one syscall each without
+        const double write_ns = tss::bench::ns_per_op(iterations / batch, [&, index = size_t{0}]() mutable {
+            for (size_t slot = 0; slot < batch; slot++) {
+                iovec iov{&buffers[slot * io_size], 256};
+                if (!io.write_deferred(fd, &iov, 1, offsets[index])) {
+                    tss::bench::do_not_optimize(io.transfer(true, fd, &iov, 1, offsets[index]));
+                }
+                index++;
+            }
+            io.complete();
+        });
+        tss::bench::report(fmt::format("{}: {} small guest writes per tick", backend, batch),
+                           write_ns / batch,
+                           "ns/write");
+    }
+
+    close(fd);
+}
+#endif
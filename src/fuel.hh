@@ -0,0 +1,232 @@
+#pragma once
+
+#include "inc.hh"
+
+// CPU budgets for guest code, counted in fuel. A module compiled with `EngineConfig::metering` has wasmer's metering
+// middleware charge one unit of fuel for every operator it runs, and a call that runs out is stopped with a trap on
+// the spot, so one runaway guest can not stall everybody else. The meter gives every call the smaller of its per-call
+// budget and what is left of the per-tick one, and afterwards books what the call used to the guest. Between calls the
+// instance has no limit, so plain `wasm_func_call`s, like snapshot init functions, are never cut short. A call stopped
+// for lack of fuel leaves the guest wherever it was, as a trap would
+
+namespace tss {
+
+struct FuelBudget {
+    uint64_t per_call = 0; // Fuel one call may use, 0 for no limit
+    uint64_t per_tick = 0; // Fuel all calls between two `begin_tick`s may use together, 0 for no limit
+};
+
+struct FuelUsage {
+    uint64_t last_call = 0;
+    uint64_t tick      = 0; // Since the last `begin_tick`
+    uint64_t total     = 0;
+    size_t exhausted   = 0; // Calls stopped, or not made, for lack of fuel
+};
+
+enum class FuelCallResult {
+    returned,
+    trapped,   // For some other reason than running out of fuel
+    exhausted,   // Stopped, or not even started, for lack of fuel
+    interrupted, // Ran past its deadline, see `watchdog_call`
+};
+
+// Fuel the next call may use, given what the tick has used so far. 0 once the tick's budget is spent
+inline auto fuel_call_limit(const FuelBudget &budget, uint64_t tick_used) -> uint64_t {
+    uint64_t limit = budget.per_call ? budget.per_call : UINT64_MAX;
+    if (budget.per_tick) {
+        limit = std::min(limit, budget.per_tick > tick_used ? budget.per_tick - tick_used : 0);
+    }
+    return limit;
+}
+
+class FuelMeter {
+public:
+    // Only for an instance of a module compiled with metering, whose functions are then all called through `call`
+    void enable(wasm_instance_t *instance) {
+        m_Instance = instance;
+    }
+
+    auto enabled() const -> bool {
+        return m_Instance != nullptr;
+    }
+
+    // May be called from any thread, also while the guest runs, and applies from its next call on
+    void set_budget(FuelBudget budget) {
+        m_PerCall.store(budget.per_call, std::memory_order_relaxed);
+        m_PerTick.store(budget.per_tick, std::memory_order_relaxed);
+    }
+
+    auto budget() const -> FuelBudget {
+        return {m_PerCall.load(std::memory_order_relaxed), m_PerTick.load(std::memory_order_relaxed)};
+    }
+
+    void begin_tick() {
+        m_Usage.tick = 0;
+    }
+
+    auto usage() const -> const FuelUsage & {
+        return m_Usage;
+    }
+
+    void reset_usage() {
+        m_Usage = {};
+    }
+
+    // Calls `func` within the budget, and within `max_fuel` on top of it. The trap of a `trapped` call is left in
+    // `*trap` for the caller to delete, the one that stopped an `exhausted` call is deleted here. Without metering this
+    // is a plain call. The remaining fuel lives in the store, so it is only ever touched from here, on the thread
+    // making the call
+    auto call(wasm_func_t *func,
+              const wasm_val_vec_t *args,
+              wasm_val_vec_t *results,
+              wasm_trap_t **trap,
+              uint64_t max_fuel = UINT64_MAX) -> FuelCallResult {
+        *trap = nullptr;
+        if (!m_Instance) {
+            *trap = ::wasm_func_call(func, args, results);
+            return *trap ? FuelCallResult::trapped : FuelCallResult::returned;
+        }
+
+        const auto limit = std::min(fuel_call_limit(budget(), m_Usage.tick), max_fuel);
+        if (limit == 0) {
+            m_Usage.last_call = 0;
+            m_Usage.exhausted++;
+            return FuelCallResult::exhausted;
+        }
+
+        ::wasmer_metering_set_remaining_points(m_Instance, limit);
+        *trap                = ::wasm_func_call(func, args, results);
+        const bool exhausted = ::wasmer_metering_points_are_exhausted(m_Instance);
+        const auto used      = exhausted ? limit : limit - ::wasmer_metering_get_remaining_points(m_Instance);
+        ::wasmer_metering_set_remaining_points(m_Instance, UINT64_MAX);
+
+        m_Usage.last_call = used;
+        m_Usage.tick += used;
+        m_Usage.total += used;
+        if (exhausted) {
+            if (*trap) {
+                ::wasm_trap_delete(*trap);
+                *trap = nullptr;
+            }
+            m_Usage.exhausted++;
+            return FuelCallResult::exhausted;
+        }
+        return *trap ? FuelCallResult::trapped : FuelCallResult::returned;
+    }
+
+private:
+    wasm_instance_t *m_Instance = nullptr;
+    std::atomic<uint64_t> m_PerCall{0};
+    std::atomic<uint64_t> m_PerTick{0};
+    FuelUsage m_Usage{}; // Only touched by the thread calling into the instance
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("fuel_call_limit") {
+    REQUIRE(tss::fuel_call_limit({}, 123) == UINT64_MAX);
+    REQUIRE(tss::fuel_call_limit({.per_call = 1000}, 5000) == 1000);
+
+    // The tick's budget caps every call by what is left of it
+    REQUIRE(tss::fuel_call_limit({.per_tick = 5000}, 0) == 5000);
+    REQUIRE(tss::fuel_call_limit({.per_tick = 5000}, 4500) == 500);
+    REQUIRE(tss::fuel_call_limit({.per_call = 1000, .per_tick = 5000}, 1000) == 1000);
+    REQUIRE(tss::fuel_call_limit({.per_call = 1000, .per_tick = 5000}, 4800) == 200);
+    REQUIRE(tss::fuel_call_limit({.per_call = 1000, .per_tick = 5000}, 5000) == 0);
+    REQUIRE(tss::fuel_call_limit({.per_call = 1000, .per_tick = 5000}, 7000) == 0);
+
+    tss::FuelMeter meter;
+    REQUIRE(!meter.enabled());
+    meter.set_budget({.per_call = 10, .per_tick = 20});
+    REQUIRE(meter.budget().per_call == 10);
+    REQUIRE(meter.budget().per_tick == 20);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("fuel: metering overhead") {
+    // The same loop-heavy function compiled with and without metering, and called through the meter with a budget it
+    // stays within, so the difference is what charging every operator costs. Only the C API here, the engine and the
+    // instance are not declared yet
+    constexpr std::string_view wat = R"((module
+        (memory (export "memory") 1)
+        (func $mix (param $value i32) (result i32)
+            (i32.xor (i32.mul (local.get $value) (i32.const 31)) (i32.const 0x5bd1e995)))
+        (func (export "work") (param $iterations i32) (result i32)
+            (local $acc i32)
+            (loop $loop
+                (local.set $acc (call $mix (i32.add (local.get $acc) (local.get $iterations))))
+                (i32.store (i32.and (i32.shl (local.get $iterations) (i32.const 2)) (i32.const 0xfffc))
+                           (local.get $acc))
+                (local.set $iterations (i32.sub (local.get $iterations) (i32.const 1)))
+                (br_if $loop (local.get $iterations)))
+            (local.get $acc))))";
+    wasm_byte_vec_t wat_bytes;
+    wasm_byte_vec_t wasm_bytes;
+    ::wasm_byte_vec_new(&wat_bytes, wat.size(), wat.data());
+    ::wat2wasm(&wat_bytes, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wat_bytes);
+
+    constexpr int32_t iterations = 1 << 16;
+    double plain_ns              = 0.0;
+    for (auto compiler : {SINGLEPASS, CRANELIFT}) {
+        for (bool metering : {false, true}) {
+            // The same middleware `wasm_engine_new_from_config` adds for `EngineConfig::metering`
+            wasm_config_t *config = ::wasm_config_new();
+            ::wasm_config_set_compiler(config, compiler);
+            if (metering) {
+                auto cost = [](wasmer_parser_operator_t) -> uint64_t { return 1; };
+                ::wasm_config_push_middleware(config,
+                                              ::wasmer_metering_as_middleware(::wasmer_metering_new(UINT64_MAX, cost)));
+            }
+            wasm_engine_t *engine = ::wasm_engine_new_with_config(config);
+            wasm_store_t *store   = ::wasm_store_new(engine);
+            wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+
+            wasm_extern_vec_t imports = WASM_EMPTY_VEC;
+            wasm_instance_t *instance = ::wasm_instance_new(store, module, &imports, nullptr);
+            wasm_extern_vec_t exports;
+            ::wasm_instance_exports(instance, &exports);
+            wasm_func_t *work = ::wasm_extern_as_func(exports.data[1]);
+            tss::FuelMeter fuel;
+            if (metering) {
+                fuel.enable(instance);
+            }
+            fuel.set_budget({.per_call = uint64_t{100} * iterations});
+
+            const auto ns = tss::bench::ns_per_op(200, [&]() {
+                wasm_val_t args_val[1]    = {WASM_I32_VAL(iterations)};
+                wasm_val_t results_val[1] = {WASM_INIT_VAL};
+                wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+                wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+                wasm_trap_t *trap         = nullptr;
+                fuel.call(work, &args, &results, &trap);
+                if (trap) {
+                    ::wasm_trap_delete(trap);
+                }
+                tss::bench::do_not_optimize(results_val[0].of.i32);
+            });
+
+            const auto name = fmt::format("{}, {}",
+                                          compiler == SINGLEPASS ? "singlepass" : "cranelift",
+                                          metering ? "metered" : "plain");
+            tss::bench::report(fmt::format("{}, ns per iteration", name), ns / static_cast<double>(iterations), "ns");
+            if (metering) {
+                tss::bench::report(fmt::format("{}, overhead", name), 100.0 * (ns - plain_ns) / plain_ns, "%");
+                tss::bench::report(fmt::format("{}, fuel per call", name),
+                                   static_cast<double>(fuel.usage().last_call),
+                                   "ops");
+            } else {
+                plain_ns = ns;
+            }
+
+            ::wasm_extern_vec_delete(&exports);
+            ::wasm_instance_delete(instance);
+            ::wasm_module_delete(module);
+            ::wasm_store_delete(store);
+            ::wasm_engine_delete(engine);
+        }
+    }
+    ::wasm_byte_vec_delete(&wasm_bytes);
+}
+#endif
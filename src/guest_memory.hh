@@ -0,0 +1,226 @@
+#pragma once
+
+#include "inc.hh"
+
+// Host side view of a guest's linear memory.
+//
+// `GuestMemory` caches the base pointer and size of the memory, and is refreshed once at the start of every host call
+// that takes guest pointers. The guest cannot grow its memory while a host function runs, so the cached values stay
+// valid until the call returns; host code that grows the memory itself must call `refresh` afterwards.
+//
+// `GuestPtr<T>` and `GuestSpan<T>` are offsets into that memory which have been bounds checked once, when they were
+// created. Linear memory never shrinks, so a range that was in bounds stays in bounds, and since accesses go through
+// the `GuestMemory` rather than a copy of the base pointer they follow the memory if it moves on growth. Guest data has
+// no alignment guarantees, so single values are copied in and out with `memcpy`, and only byte ranges are handed out
+// as `std::span`s
+
+namespace tss {
+
+static_assert(std::endian::native == std::endian::little, "guest memory is little endian, and so must the host be");
+
+class GuestMemory {
+public:
+    GuestMemory() = default;
+
+    explicit GuestMemory(wasm_memory_t *memory) {
+        refresh(memory);
+    }
+
+    // Over any host buffer, mostly useful for tests
+    GuestMemory(uint8_t *base, size_t size) : m_Base{base}, m_Size{size} {}
+
+    void refresh(wasm_memory_t *memory) {
+        m_Base = memory ? reinterpret_cast<uint8_t *>(::wasm_memory_data(memory)) : nullptr;
+        m_Size = memory ? ::wasm_memory_data_size(memory) : 0;
+    }
+
+    auto base() const -> uint8_t * {
+        return m_Base;
+    }
+
+    auto size() const -> size_t {
+        return m_Size;
+    }
+
+    // True if [offset, offset + size) lies inside the memory, computed without overflowing
+    auto contains(uint64_t offset, uint64_t size) const -> bool {
+        return size <= m_Size && offset <= m_Size - size;
+    }
+
+    // Empty if the range is out of bounds
+    auto bytes(uint32_t offset, uint64_t size) const -> std::span<uint8_t> {
+        if (!contains(offset, size)) {
+            return {};
+        }
+        return {m_Base + offset, size};
+    }
+
+    template <typename T>
+    auto load(uint32_t offset) const -> T {
+        static_assert(std::is_trivially_copyable_v<T>);
+        assert(contains(offset, sizeof(T)));
+        T value;
+        std::memcpy(&value, m_Base + offset, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void store(uint32_t offset, const T &value) const {
+        static_assert(std::is_trivially_copyable_v<T>);
+        assert(contains(offset, sizeof(T)));
+        std::memcpy(m_Base + offset, &value, sizeof(T));
+    }
+
+private:
+    uint8_t *m_Base = nullptr;
+    size_t m_Size   = 0;
+};
+
+template <typename T>
+class GuestPtr {
+public:
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    GuestPtr() = default;
+
+    GuestPtr(const GuestMemory &memory, uint32_t offset)
+        : m_Memory{&memory}, m_Offset{offset}, m_Valid{memory.contains(offset, sizeof(T))} {}
+
+    // False if the pointee does not fit inside the memory, in which case it must not be accessed
+    explicit operator bool() const {
+        return m_Valid;
+    }
+
+    auto offset() const -> uint32_t {
+        return m_Offset;
+    }
+
+    auto load() const -> T {
+        assert(m_Valid);
+        return m_Memory->load<T>(m_Offset);
+    }
+
+    void store(const T &value) const {
+        assert(m_Valid);
+        m_Memory->store(m_Offset, value);
+    }
+
+private:
+    const GuestMemory *m_Memory = nullptr;
+    uint32_t m_Offset           = 0;
+    bool m_Valid                = false;
+};
+
+// `count` elements of T starting at `offset`, checked as a whole
+template <typename T>
+class GuestSpan {
+public:
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    GuestSpan() = default;
+
+    GuestSpan(const GuestMemory &memory, uint32_t offset, uint32_t count)
+        : m_Memory{&memory}, m_Offset{offset}, m_Count{count},
+          m_Valid{memory.contains(offset, static_cast<uint64_t>(count) * sizeof(T))} {}
+
+    explicit operator bool() const {
+        return m_Valid;
+    }
+
+    auto offset() const -> uint32_t {
+        return m_Offset;
+    }
+
+    auto size() const -> uint32_t {
+        return m_Count;
+    }
+
+    auto empty() const -> bool {
+        return m_Count == 0;
+    }
+
+    auto size_bytes() const -> size_t {
+        return static_cast<size_t>(m_Count) * sizeof(T);
+    }
+
+    auto load(uint32_t index) const -> T {
+        assert(m_Valid && index < m_Count);
+        return m_Memory->load<T>(element_offset(index));
+    }
+
+    void store(uint32_t index, const T &value) const {
+        assert(m_Valid && index < m_Count);
+        m_Memory->store(element_offset(index), value);
+    }
+
+    auto operator[](uint32_t index) const -> GuestPtr<T> {
+        assert(m_Valid && index < m_Count);
+        return GuestPtr<T>(*m_Memory, element_offset(index));
+    }
+
+    // Raw view of the whole range, for bulk copies and zero-copy I/O
+    auto bytes() const -> std::span<uint8_t> {
+        assert(m_Valid);
+        return {m_Memory->base() + m_Offset, size_bytes()};
+    }
+
+    // Byte-sized elements have no alignment requirement, so these can be viewed directly
+    auto span() const -> std::span<T>
+        requires(alignof(T) == 1)
+    {
+        assert(m_Valid);
+        return {reinterpret_cast<T *>(m_Memory->base() + m_Offset), m_Count};
+    }
+
+    auto string_view() const -> std::string_view
+        requires(sizeof(T) == 1)
+    {
+        assert(m_Valid);
+        return {reinterpret_cast<const char *>(m_Memory->base() + m_Offset), m_Count};
+    }
+
+private:
+    auto element_offset(uint32_t index) const -> uint32_t {
+        return m_Offset + static_cast<uint32_t>(index * sizeof(T));
+    }
+
+    const GuestMemory *m_Memory = nullptr;
+    uint32_t m_Offset           = 0;
+    uint32_t m_Count            = 0;
+    bool m_Valid                = false;
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("GuestMemory") {
+    tss::GuestMemory empty;
+    REQUIRE(!tss::GuestPtr<uint8_t>(empty, 0));
+
+    // Stand in for a wasm memory, with a size that is not a multiple of the element sizes to exercise the edges
+    std::vector<uint8_t> storage(100);
+    tss::GuestMemory memory(storage.data(), storage.size());
+
+    REQUIRE(memory.contains(0, 100));
+    REQUIRE(memory.contains(96, 4));
+    REQUIRE(!memory.contains(97, 4));
+    REQUIRE(!memory.contains(UINT32_MAX, 2));
+    REQUIRE(memory.bytes(99, 2).empty());
+
+    // Unaligned round trip
+    tss::GuestPtr<uint64_t> ptr(memory, 3);
+    REQUIRE(ptr);
+    ptr.store(0x1122334455667788ULL);
+    REQUIRE(ptr.load() == 0x1122334455667788ULL);
+    REQUIRE(storage[3] == 0x88);
+    REQUIRE(!tss::GuestPtr<uint64_t>(memory, 93));
+
+    // Spans are checked as a whole, including against overflow of count * sizeof(T)
+    REQUIRE(tss::GuestSpan<uint32_t>(memory, 0, 25));
+    REQUIRE(!tss::GuestSpan<uint32_t>(memory, 4, 25));
+    REQUIRE(!tss::GuestSpan<uint64_t>(memory, 0, UINT32_MAX));
+
+    tss::GuestSpan<char> chars(memory, 10, 3);
+    std::memcpy(chars.span().data(), "abc", 3);
+    REQUIRE(chars.string_view() == "abc");
+}
+#endif
@@ -0,0 +1,390 @@
+#pragma once
+
+#include "inc.hh"
+
+// Typed host functions. A host function is a plain C++ function taking the instance context followed by its
+// arguments, for example `auto fd_close(WasiEnv &ctx, __wasi_fd_t fd) -> Errno`. `HostFunc` derives the wasm
+// signature from the C++ one and generates the callback that unpacks the `wasm_val_vec_t`, so argument decoding is
+// straight-line loads from fixed offsets, without kind checks or fixups at runtime.
+//
+// To make a new type usable as an argument or result, specialize `HostValue` for it: `codes` lists the wasm value
+// kinds it occupies (one character per value, see `WasiSignature`), `from_wasm` builds it from that many values and
+// `to_wasm` (results only) converts it back. Functions with guest pointer arguments refresh the cached view of the
+// guest memory before they are called, the rest never touch it
+
+namespace tss {
+
+// Signature of a host function as one character per value: 'i' i32, 'I' i64, 'f' f32, 'F' f64
+struct WasiSignature {
+    std::string_view params;
+    std::string_view results;
+};
+
+inline constexpr auto wasm_valkind_from_char(char c) -> wasm_valkind_t {
+    switch (c) {
+    case 'i': {
+        return WASM_I32;
+    }
+    case 'I': {
+        return WASM_I64;
+    }
+    case 'f': {
+        return WASM_F32;
+    }
+    case 'F': {
+        return WASM_F64;
+    }
+    default: {
+        return WASM_EXTERNREF; // Never part of a signature, so it can never match
+    }
+    }
+}
+
+template <typename T>
+struct HostValue;
+
+// Integers and enums up to 32 bits travel as an i32, which is also how the WASI ABI passes u8 and u16
+template <typename T>
+    requires(std::is_integral_v<T> || std::is_enum_v<T>) && (sizeof(T) <= sizeof(int32_t))
+struct HostValue<T> {
+    static constexpr std::string_view codes = "i";
+    static constexpr bool uses_memory       = false;
+
+    static auto from_wasm(WasiEnv &, const wasm_val_t *vals) -> T {
+        return static_cast<T>(static_cast<uint32_t>(vals[0].of.i32));
+    }
+
+    static auto to_wasm(T value) -> wasm_val_t {
+        wasm_val_t val;
+        val.kind   = WASM_I32;
+        val.of.i32 = static_cast<int32_t>(value);
+        return val;
+    }
+};
+
+template <typename T>
+    requires(std::is_integral_v<T> || std::is_enum_v<T>) && (sizeof(T) == sizeof(int64_t))
+struct HostValue<T> {
+    static constexpr std::string_view codes = "I";
+    static constexpr bool uses_memory       = false;
+
+    static auto from_wasm(WasiEnv &, const wasm_val_t *vals) -> T {
+        return static_cast<T>(vals[0].of.i64);
+    }
+
+    static auto to_wasm(T value) -> wasm_val_t {
+        wasm_val_t val;
+        val.kind   = WASM_I64;
+        val.of.i64 = static_cast<int64_t>(value);
+        return val;
+    }
+};
+
+template <>
+struct HostValue<float> {
+    static constexpr std::string_view codes = "f";
+    static constexpr bool uses_memory       = false;
+
+    static auto from_wasm(WasiEnv &, const wasm_val_t *vals) -> float {
+        return vals[0].of.f32;
+    }
+
+    static auto to_wasm(float value) -> wasm_val_t {
+        wasm_val_t val;
+        val.kind   = WASM_F32;
+        val.of.f32 = value;
+        return val;
+    }
+};
+
+template <>
+struct HostValue<double> {
+    static constexpr std::string_view codes = "F";
+    static constexpr bool uses_memory       = false;
+
+    static auto from_wasm(WasiEnv &, const wasm_val_t *vals) -> double {
+        return vals[0].of.f64;
+    }
+
+    static auto to_wasm(double value) -> wasm_val_t {
+        wasm_val_t val;
+        val.kind   = WASM_F64;
+        val.of.f64 = value;
+        return val;
+    }
+};
+
+// Guest pointers are bounds checked when the call is unpacked, the host function tests them with `operator bool`
+template <typename T>
+struct HostValue<GuestPtr<T>> {
+    static constexpr std::string_view codes = "i";
+    static constexpr bool uses_memory       = true;
+
+    static auto from_wasm(WasiEnv &ctx, const wasm_val_t *vals) -> GuestPtr<T> {
+        return {ctx.guest, static_cast<uint32_t>(vals[0].of.i32)};
+    }
+};
+
+// A (pointer, element count) pair, the way WASI passes buffers, strings and iovec arrays
+template <typename T>
+struct HostValue<GuestSpan<T>> {
+    static constexpr std::string_view codes = "ii";
+    static constexpr bool uses_memory       = true;
+
+    static auto from_wasm(WasiEnv &ctx, const wasm_val_t *vals) -> GuestSpan<T> {
+        return {ctx.guest, static_cast<uint32_t>(vals[0].of.i32), static_cast<uint32_t>(vals[1].of.i32)};
+    }
+};
+
+inline auto wasm_valtype_vec_from_codes(wasm_valtype_vec_t *out, std::string_view codes) {
+    ::wasm_valtype_vec_new_uninitialized(out, codes.size());
+    for (size_t index = 0; index < codes.size(); index++) {
+        out->data[index] = ::wasm_valtype_new(wasm_valkind_from_char(codes[index]));
+    }
+}
+
+// Raised by any host call made after the watchdog interrupted the guest, so guests stuck in host calls unwind too
+inline auto wasm_interrupted_trap(WasiEnv *ctx) -> wasm_trap_t * {
+    wasm_message_t message;
+    ::wasm_name_new_from_string_nt(&message, "interrupted: the call ran past its deadline");
+    wasm_trap_t *trap = ::wasm_trap_new(ctx->store, &message);
+    ctx->stats.traps++;
+    ::wasm_name_delete(&message);
+    return trap;
+}
+
+template <auto Func>
+struct HostFunc;
+
+template <typename R, typename... Args, R (*Func)(WasiEnv &, Args...)>
+struct HostFunc<Func> {
+private:
+    static constexpr size_t param_count = (size_t{0} + ... + HostValue<Args>::codes.size());
+
+    // Index of the first wasm value of every C++ argument
+    static constexpr std::array<size_t, sizeof...(Args)> offsets = [] {
+        std::array<size_t, sizeof...(Args)> out{};
+        [[maybe_unused]] size_t index  = 0;
+        [[maybe_unused]] size_t offset = 0;
+        ((out[index++] = offset, offset += HostValue<Args>::codes.size()), ...);
+        return out;
+    }();
+
+    static constexpr std::array<char, param_count + 1> param_codes = [] {
+        std::array<char, param_count + 1> out{};
+        [[maybe_unused]] size_t index = 0;
+        ((std::ranges::copy(HostValue<Args>::codes, out.begin() + static_cast<ptrdiff_t>(index)),
+          index += HostValue<Args>::codes.size()),
+         ...);
+        return out;
+    }();
+
+    static constexpr bool uses_memory = (false || ... || HostValue<Args>::uses_memory);
+
+    static constexpr auto result_codes = [] {
+        if constexpr (std::is_void_v<R>) {
+            return std::string_view{};
+        } else {
+            return HostValue<R>::codes;
+        }
+    }();
+
+    template <size_t... I>
+    static auto invoke(WasiEnv &ctx, const wasm_val_t *args, wasm_val_t *results, std::index_sequence<I...>)
+        -> wasm_trap_t * {
+        if (ctx.interrupted.load(std::memory_order_relaxed)) [[unlikely]] {
+            return wasm_interrupted_trap(&ctx);
+        }
+        if constexpr (uses_memory) {
+            ctx.guest.refresh(ctx.memory);
+        }
+        if constexpr (std::is_void_v<R>) {
+            UNUSED(results);
+            Func(ctx, HostValue<Args>::from_wasm(ctx, &args[offsets[I]])...);
+        } else {
+            results[0] = HostValue<R>::to_wasm(Func(ctx, HostValue<Args>::from_wasm(ctx, &args[offsets[I]])...));
+        }
+        // Host functions ask for a trap through the context, and still return a regular value
+        if (ctx.interrupted.load(std::memory_order_relaxed) && !ctx.trap) [[unlikely]] {
+            return wasm_interrupted_trap(&ctx);
+        }
+        return std::exchange(ctx.trap, nullptr);
+    }
+
+public:
+    static constexpr WasiSignature signature{{param_codes.data(), param_count}, result_codes};
+
+    static auto invoke(WasiEnv &ctx, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
+        // The runtime has already checked the arguments against the import signature, which matches `signature`
+        assert(args->size == param_count);
+        assert(results->size == result_codes.size());
+        return invoke(ctx, args->data, results->data, std::index_sequence_for<Args...>{});
+    }
+
+    // The caller owns the returned functype
+    static auto functype() -> wasm_functype_t * {
+        wasm_valtype_vec_t params;
+        wasm_valtype_vec_t results;
+        wasm_valtype_vec_from_codes(&params, signature.params);
+        wasm_valtype_vec_from_codes(&results, signature.results);
+        return ::wasm_functype_new(&params, &results);
+    }
+};
+
+template <auto Func>
+inline auto host_callback(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
+    auto ctx = static_cast<WasiEnv *>(env);
+    ctx->stats.host_calls++;
+    return HostFunc<Func>::invoke(*ctx, args, results);
+}
+
+// Creates a host function in `store` for imports outside of WASI, such as the game API
+template <auto Func>
+inline auto host_func_new(wasm_store_t *store, WasiEnv *env) -> wasm_func_t * {
+    wasm_functype_t *functype = HostFunc<Func>::functype();
+    wasm_func_t *func         = ::wasm_func_new_with_env(store, functype, host_callback<Func>, env, nullptr);
+    ::wasm_functype_delete(functype);
+    return func;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+namespace tss::test {
+inline auto host_func_test_add(WasiEnv &ctx, uint32_t lhs, int64_t rhs, Errno errno_in) -> int64_t {
+    UNUSED(ctx);
+    return static_cast<int64_t>(lhs) + rhs + std::to_underlying(errno_in);
+}
+
+inline void host_func_test_void(WasiEnv &ctx) {
+    UNUSED(ctx);
+}
+
+inline auto host_func_test_guest(WasiEnv &ctx, GuestSpan<uint8_t> buf, GuestPtr<uint32_t> out) -> Errno {
+    UNUSED(ctx);
+    return buf && out ? Errno::e_success : Errno::e_fault;
+}
+} // namespace tss::test
+
+TEST_CASE("HostFunc") {
+    using Add = tss::HostFunc<tss::test::host_func_test_add>;
+    REQUIRE(Add::signature.params == "iIi");
+    REQUIRE(Add::signature.results == "I");
+    REQUIRE(tss::HostFunc<tss::test::host_func_test_void>::signature.params.empty());
+    REQUIRE(tss::HostFunc<tss::test::host_func_test_void>::signature.results.empty());
+
+    tss::WasiEnv env{};
+    wasm_val_t args_val[3]    = {WASM_I32_VAL(-1), WASM_I64_VAL(-2), WASM_I32_VAL(3)};
+    wasm_val_t results_val[1] = {WASM_INIT_VAL};
+    wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+    wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+
+    REQUIRE(Add::invoke(env, &args, &results) == nullptr);
+    REQUIRE(results_val[0].kind == WASM_I64);
+    REQUIRE(results_val[0].of.i64 == int64_t{UINT32_MAX} - 2 + 3);
+
+    // Spans take two values, and without a memory nothing but an empty span is in bounds
+    using Guest = tss::HostFunc<tss::test::host_func_test_guest>;
+    REQUIRE(Guest::signature.params == "iii");
+    wasm_val_t guest_args_val[3] = {WASM_I32_VAL(0), WASM_I32_VAL(0), WASM_I32_VAL(0)};
+    wasm_val_vec_t guest_args    = WASM_ARRAY_VEC(guest_args_val);
+    results_val[0]               = WASM_INIT_VAL;
+    REQUIRE(Guest::invoke(env, &guest_args, &results) == nullptr);
+    REQUIRE(results_val[0].of.i32 == std::to_underlying(Errno::e_fault));
+}
+#endif
+
+#ifdef BENCHMARK
+namespace tss::bench {
+inline auto host_add(WasiEnv &ctx, uint32_t lhs, int64_t rhs) -> uint32_t {
+    UNUSED(ctx);
+    return lhs + static_cast<uint32_t>(rhs);
+}
+
+// The same function in the style the WASI stubs used before `HostFunc`: checked decoding, result kind fixup and the
+// call formatted into a string
+inline auto host_add_by_hand(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
+    auto ctx = static_cast<WasiEnv *>(env);
+    ctx->stats.host_calls++;
+    if (args->size != 2 || results->size != 1 || args->data[0].kind != WASM_I32 || args->data[1].kind != WASM_I64) {
+        wasm_message_t message;
+        ::wasm_name_new_from_string_nt(&message, fmt::format("{}: not implemented", __func__).c_str());
+        wasm_trap_t *trap = ::wasm_trap_new(ctx->store, &message);
+        ::wasm_name_delete(&message);
+        return trap;
+    }
+    auto lhs = static_cast<uint32_t>(args->data[0].of.i32);
+    auto rhs = args->data[1].of.i64;
+    if (results->data[0].kind != WASM_I32) {
+        results->data[0].kind = WASM_I32;
+    }
+    results->data[0].of.i32 = static_cast<int32_t>(lhs + static_cast<uint32_t>(rhs));
+    auto str = fmt::format("func called {}({}, {}) -> ({})", __func__, lhs, rhs, results->data[0].of.i32);
+    do_not_optimize(str);
+    return nullptr;
+}
+} // namespace tss::bench
+
+BENCHMARK_CASE("host_func: host call overhead") {
+    // Only the C API here, the rest of the host is not declared yet
+    constexpr std::string_view wat = R"((module
+        (import "env" "add" (func $add (param i32 i64) (result i32)))
+        (func (export "run") (param $count i32) (result i32)
+            (local $acc i32)
+            (loop $loop
+                (local.set $acc (call $add (local.get $acc) (i64.extend_i32_u (local.get $count))))
+                (local.set $count (i32.sub (local.get $count) (i32.const 1)))
+                (br_if $loop (local.get $count)))
+            (local.get $acc))))";
+    wasm_byte_vec_t wat_bytes;
+    wasm_byte_vec_t wasm_bytes;
+    ::wasm_byte_vec_new(&wat_bytes, wat.size(), wat.data());
+    ::wat2wasm(&wat_bytes, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wat_bytes);
+
+    wasm_engine_t *engine = ::wasm_engine_new();
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    constexpr int32_t calls = 1 << 20;
+
+    auto measure = [&](std::string_view name, wasm_func_t *host_func) {
+        wasm_extern_t *imports_data[1] = {::wasm_func_as_extern(host_func)};
+        wasm_extern_vec_t imports      = WASM_ARRAY_VEC(imports_data);
+        wasm_instance_t *instance      = ::wasm_instance_new(store, module, &imports, nullptr);
+        wasm_extern_vec_t exports;
+        ::wasm_instance_exports(instance, &exports);
+        wasm_func_t *run = ::wasm_extern_as_func(exports.data[0]);
+
+        auto ns = tss::bench::ns_per_op(1, [&]() {
+            wasm_val_t args_val[1]    = {WASM_I32_VAL(calls)};
+            wasm_val_t results_val[1] = {WASM_INIT_VAL};
+            wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+            wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+            if (auto trap = ::wasm_func_call(run, &args, &results)) {
+                ::wasm_trap_delete(trap);
+            }
+            tss::bench::do_not_optimize(results_val[0].of.i32);
+        });
+        tss::bench::report(name, ns / calls, "ns/call");
+
+        ::wasm_extern_vec_delete(&exports);
+        ::wasm_instance_delete(instance);
+        ::wasm_func_delete(host_func);
+    };
+
+    tss::WasiEnv env{};
+    env.store = store;
+
+    wasm_functype_t *functype = tss::HostFunc<tss::bench::host_add>::functype();
+    measure("hand decoded (previous stub pattern)",
+            ::wasm_func_new_with_env(store, functype, tss::bench::host_add_by_hand, &env, nullptr));
+    ::wasm_functype_delete(functype);
+
+    measure("HostFunc binding", tss::host_func_new<tss::bench::host_add>(store, &env));
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
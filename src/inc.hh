@@ -1,14 +1,40 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <inttypes.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <set>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -29,6 +55,10 @@ extern "C" {
 #include "doctest/doctest.h"
 #endif
 
+#ifdef BENCHMARK
+#include "bench.hh"
+#endif
+
 #define UNUSED(x) ((void)x)
 #define ARRLEN(x) (sizeof(x) / sizeof(*(x)))
 
@@ -37,4 +67,38 @@ extern "C" {
 
 #include "wasi_types.hh"
 
+#include "mapped_file.hh"
+#include "startup.hh"
+
+#include "wasi_trace.hh"
+#include "wasi_profile.hh"
+
+#include "guest_memory.hh"
+
+#include "stat_cache.hh"
+#include "vfs_pack.hh"
+
+#include "clock.hh"
+#include "random.hh"
+#include "fd_table.hh"
+#include "file_io.hh"
+#include "poller.hh"
+#include "fuel.hh"
+#include "wasi_env.hh"
+
+#include "host_func.hh"
+
 #include "wasi_stubs.hh"
+
+#include "module_cache.hh"
+
+#include "engine.hh"
+
+#include "wasm_utils.hh"
+
+#include "wasi_instance.hh"
+#include "watchdog.hh"
+#include "snapshot.hh"
+#include "instance_pool.hh"
+#include "save_state.hh"
+#include "scheduler.hh"
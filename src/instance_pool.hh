@@ -0,0 +1,403 @@
+#pragma once
+
+#include "inc.hh"
+
+// Pool of ready instances for short guest jobs, where creating an instance would cost more than the job itself.
+//
+// The linear memory of the first instance, right after instantiation and restoring the snapshot if there is one, is
+// copied into a memfd once. Every pooled instance then has that image mapped copy-on-write over its own linear memory,
+// at the address the engine put it, so it reads the image until it writes. Resetting a returned instance is a single
+// MADV_DONTNEED over its memory: pages it wrote go back to the image, pages it grew into go back to zero, and pages it
+// only read were never copied. Mutable exported globals and the host state are put back alongside. Memory can not
+// shrink, so an instance that grew keeps its size, and tables and unexported globals can not be reached through the C
+// API, so an instance whose call trapped, and may have left its stack pointer anywhere, is destroyed instead
+
+namespace tss {
+
+struct InstancePoolStats {
+    size_t instances  = 0; // Alive, idle or in use
+    size_t in_use     = 0;
+    size_t peak       = 0; // Most instances in use at once
+    size_t acquires   = 0;
+    size_t misses     = 0; // Acquires that had to create an instance
+    size_t recycled   = 0;
+    size_t discarded  = 0; // Returned instances that could not be reset
+    uint64_t reset_ns = 0; // Spent resetting the recycled ones
+};
+
+inline auto instance_pool_stats_to_str(const InstancePoolStats &stats) -> std::string {
+    const double reset_us =
+        stats.recycled ? static_cast<double>(stats.reset_ns) / 1e3 / static_cast<double>(stats.recycled) : 0.0;
+    return fmt::format("{} instance(s), {} in use (peak {}), {} acquire(s), {} miss(es), {} recycled, {} discarded, "
+                       "{:.1f} us per reset",
+                       stats.instances,
+                       stats.in_use,
+                       stats.peak,
+                       stats.acquires,
+                       stats.misses,
+                       stats.recycled,
+                       stats.discarded,
+                       reset_us);
+}
+
+// Acquire and release may be called from any thread, each instance is only used by whoever acquired it
+class InstancePool {
+public:
+    // Creates `count` instances up front. `snapshot`, if given, must outlive the pool
+    static auto create(wasm_engine_t *engine,
+                       const wasm_module_t *module,
+                       WasiInstanceConfig config,
+                       const Snapshot *snapshot,
+                       size_t count) -> std::unique_ptr<InstancePool> {
+        std::unique_ptr<InstancePool> self(new InstancePool());
+        self->m_Engine   = engine;
+        self->m_Module   = module;
+        self->m_Snapshot = snapshot;
+        config.timeline  = nullptr;
+        self->m_Config   = std::move(config);
+
+        auto first = self->instantiate();
+        if (!first) {
+            return nullptr;
+        }
+        auto &env = first->env();
+        if (!env.memory) {
+            fmt::print(stderr, "Instance pool: the module exports no memory\n");
+            return nullptr;
+        }
+
+        self->m_ImageSize = ::wasm_memory_data_size(env.memory);
+        self->m_Image     = ::memfd_create("qost-instance-image", MFD_CLOEXEC);
+        if (self->m_Image < 0 || !write_all(self->m_Image, ::wasm_memory_data(env.memory), self->m_ImageSize)) {
+            fmt::print(stderr, "Instance pool: could not create the memory image: {}\n", std::strerror(errno));
+            return nullptr;
+        }
+        self->m_Globals = snapshot_exported_globals(*first);
+        for (auto preopen : env.fds.preopens()) {
+            self->m_Preopens.emplace_back(preopen);
+        }
+        self->m_ClockNs = env.clock.virtual_ns();
+
+        if (!self->adopt(*first)) {
+            return nullptr;
+        }
+        self->m_Idle.push_back(std::move(first));
+        while (self->m_Idle.size() < count) {
+            auto instance = self->instantiate();
+            if (!instance || !self->adopt(*instance)) {
+                return nullptr;
+            }
+            self->m_Idle.push_back(std::move(instance));
+        }
+        self->m_Stats.instances = self->m_Idle.size();
+
+        return self;
+    }
+
+    ~InstancePool() {
+        m_Idle.clear();
+        if (m_Image >= 0) {
+            ::close(m_Image);
+        }
+    }
+
+    InstancePool(const InstancePool &)            = delete;
+    InstancePool &operator=(const InstancePool &) = delete;
+
+    // An idle instance, or a new one if none is idle. Nullptr if a new one could not be created
+    auto acquire() -> std::unique_ptr<WasiInstance> {
+        {
+            std::lock_guard lock(m_Mutex);
+            m_Stats.acquires++;
+            if (!m_Idle.empty()) {
+                auto instance = std::move(m_Idle.back());
+                m_Idle.pop_back();
+                m_Stats.in_use++;
+                m_Stats.peak = std::max(m_Stats.peak, m_Stats.in_use);
+                return instance;
+            }
+            m_Stats.misses++;
+        }
+
+        auto instance = instantiate();
+        if (!instance || !adopt(*instance)) {
+            return nullptr;
+        }
+        std::lock_guard lock(m_Mutex);
+        m_Stats.instances++;
+        m_Stats.in_use++;
+        m_Stats.peak = std::max(m_Stats.peak, m_Stats.in_use);
+        return instance;
+    }
+
+    // Resets `instance` and makes it idle again, or destroys it if it can not be reset. Pass `trapped` if a call into
+    // it trapped
+    void release(std::unique_ptr<WasiInstance> instance, bool trapped = false) {
+        const auto begin    = std::chrono::steady_clock::now();
+        const bool recycled = !trapped && reset(*instance);
+        const auto elapsed  = std::chrono::steady_clock::now() - begin;
+
+        std::unique_ptr<WasiInstance> discarded;
+        std::lock_guard lock(m_Mutex);
+        m_Stats.in_use--;
+        if (recycled) {
+            m_Stats.recycled++;
+            m_Stats.reset_ns += static_cast<uint64_t>(std::chrono::nanoseconds(elapsed).count());
+            m_Idle.push_back(std::move(instance));
+        } else {
+            m_Stats.discarded++;
+            m_Stats.instances--;
+            m_Bases.erase(instance.get());
+            discarded = std::move(instance); // Destroyed once the lock is released
+        }
+    }
+
+    auto stats() -> InstancePoolStats {
+        std::lock_guard lock(m_Mutex);
+        return m_Stats;
+    }
+
+private:
+    InstancePool() = default;
+
+    static auto write_all(int fd, const byte_t *data, size_t size) -> bool {
+        size_t written = 0;
+        while (written < size) {
+            const auto result = ::pwrite(fd, data + written, size - written, static_cast<off_t>(written));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return true;
+    }
+
+    auto instantiate() -> std::unique_ptr<WasiInstance> {
+        auto instance = WasiInstance::create(m_Engine, m_Module, m_Config);
+        if (instance && m_Snapshot && !m_Snapshot->restore(*instance)) {
+            return nullptr;
+        }
+        return instance;
+    }
+
+    // Maps the image over the memory of a fresh instance, whose contents are the same as the image's
+    auto adopt(WasiInstance &instance) -> bool {
+        auto memory = instance.env().memory;
+        if (!memory || ::wasm_memory_data_size(memory) != m_ImageSize) {
+            fmt::print(stderr, "Instance pool: instances do not all start out the same\n");
+            return false;
+        }
+        auto base = ::wasm_memory_data(memory);
+        if (m_ImageSize != 0 &&
+            ::mmap(base, m_ImageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m_Image, 0) == MAP_FAILED) {
+            fmt::print(stderr, "Instance pool: could not map the memory image: {}\n", std::strerror(errno));
+            return false;
+        }
+        std::lock_guard lock(m_Mutex);
+        m_Bases[&instance] = base;
+        return true;
+    }
+
+    auto reset(WasiInstance &instance) -> bool {
+        auto &env = instance.env();
+        byte_t *base;
+        {
+            std::lock_guard lock(m_Mutex);
+            base = m_Bases[&instance];
+        }
+        // Engines that move memory on growth would have left the mapping behind
+        if (!env.memory || ::wasm_memory_data(env.memory) != base) {
+            return false;
+        }
+        if (::madvise(base, ::wasm_memory_data_size(env.memory), MADV_DONTNEED) < 0) {
+            return false;
+        }
+
+        for (const auto &[name, value] : m_Globals) {
+            auto exported = instance.export_by_name(name);
+            if (!exported) {
+                return false;
+            }
+            ::wasm_global_set(::wasm_extern_as_global(exported), &value);
+        }
+
+        env.io.complete();
+        env.fds.reset_to_preopens();
+        env.io.clear_errors();
+        const auto preopens = env.fds.preopens();
+        if (env.fds.size() != 3 + m_Preopens.size() || !std::ranges::equal(preopens, m_Preopens)) {
+            return false;
+        }
+        env.clock.set_virtual_ns(m_ClockNs);
+        if (m_Config.random_seed) {
+            env.random.seed(*m_Config.random_seed);
+        } else if (!env.random.seed_from_host()) {
+            return false;
+        }
+        env.trap  = nullptr;
+        env.stats = {};
+        env.fuel.reset_usage();
+        return true;
+    }
+
+    wasm_engine_t *m_Engine       = nullptr;
+    const wasm_module_t *m_Module = nullptr;
+    const Snapshot *m_Snapshot    = nullptr;
+    WasiInstanceConfig m_Config{};
+    int m_Image        = -1; // memfd holding the memory every instance starts out with
+    size_t m_ImageSize = 0;
+    std::vector<std::pair<std::string, wasm_val_t>> m_Globals;
+    std::vector<std::string> m_Preopens;
+    uint64_t m_ClockNs = 0;
+
+    std::mutex m_Mutex;
+    std::vector<std::unique_ptr<WasiInstance>> m_Idle;
+    std::unordered_map<const WasiInstance *, byte_t *> m_Bases; // Where the image is mapped, per instance
+    InstancePoolStats m_Stats{};
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("InstancePool") {
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 1)
+        (global $counter (export "counter") (mut i32) (i32.const 7))
+        (data (i32.const 16) "image")
+        (func (export "scribble")
+            (i32.store (i32.const 16) (i32.const 0x78787878))
+            (i32.store (i32.const 40000) (i32.const 1))
+            (global.set $counter (i32.const 99)))
+        (func (export "crash") unreachable)))");
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+    REQUIRE(module);
+
+    tss::WasiInstanceConfig config{};
+    config.preopens.push_back({"/tmp", std::filesystem::temp_directory_path(), nullptr});
+    config.clock = tss::ClockMode::deterministic;
+    auto pool    = tss::InstancePool::create(engine, module, config, nullptr, 1);
+    REQUIRE(pool);
+
+    wasm_val_vec_t args    = WASM_EMPTY_VEC;
+    wasm_val_vec_t results = WASM_EMPTY_VEC;
+    auto memory_at         = [](tss::WasiInstance &instance, size_t offset) {
+        return std::string_view(reinterpret_cast<char *>(::wasm_memory_data(instance.env().memory)) + offset, 5);
+    };
+    auto counter = [](tss::WasiInstance &instance) {
+        wasm_val_t value;
+        ::wasm_global_get(::wasm_extern_as_global(instance.export_by_name("counter")), &value);
+        return value.of.i32;
+    };
+
+    // Everything a job changes is put back by the time the instance is handed out again
+    auto instance = pool->acquire();
+    REQUIRE(instance);
+    auto *first = instance.get();
+    REQUIRE(::wasm_func_call(instance->func("scribble"), &args, &results) == nullptr);
+    REQUIRE(memory_at(*instance, 16) == "xxxxx");
+    REQUIRE(counter(*instance) == 99);
+    const int null_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    REQUIRE(null_fd >= 0);
+    instance->env().fds.insert({null_fd, Filetype::character_device, 0, 0, 0, true, {}, nullptr, 0, 0, nullptr});
+    REQUIRE(instance->env().fds.size() == 5);
+    instance->env().clock.advance(1000);
+    pool->release(std::move(instance));
+
+    instance = pool->acquire();
+    REQUIRE(instance.get() == first);
+    REQUIRE(memory_at(*instance, 16) == "image");
+    REQUIRE(memory_at(*instance, 40000)[0] == 0);
+    REQUIRE(counter(*instance) == 7);
+    REQUIRE(instance->env().fds.size() == 4);
+    REQUIRE(instance->env().fds.preopens() == std::vector<std::string_view>{"/tmp"});
+    REQUIRE(instance->env().clock.virtual_ns() == 0);
+    REQUIRE(pool->stats().recycled == 1);
+
+    // An instance whose call trapped is destroyed, and the next acquire makes a new one
+    auto trap = ::wasm_func_call(instance->func("crash"), &args, &results);
+    REQUIRE(trap);
+    ::wasm_trap_delete(trap);
+    pool->release(std::move(instance), true);
+    REQUIRE(pool->stats().discarded == 1);
+    REQUIRE(pool->stats().instances == 0);
+    instance = pool->acquire();
+    REQUIRE(instance);
+    REQUIRE(memory_at(*instance, 16) == "image");
+    REQUIRE(pool->stats().misses == 1);
+    pool->release(std::move(instance));
+
+    pool.reset();
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("instance_pool: job latency") {
+    // One short job per instance: a few KiB of scattered writes over a module with 4 MiB of initial memory
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 64)
+        (global $jobs (export "jobs") (mut i32) (i32.const 0))
+        (data (i32.const 1024) "initial data")
+        (func (export "job") (param $seed i32) (result i32)
+            (local $index i32)
+            (loop $touch
+                (i32.store (i32.and (i32.mul (i32.add (local.get $seed) (local.get $index)) (i32.const 40503))
+                                    (i32.const 0x3ffffc))
+                           (local.get $index))
+                (local.set $index (i32.add (local.get $index) (i32.const 1)))
+                (br_if $touch (i32.lt_u (local.get $index) (i32.const 1024))))
+            (global.set $jobs (i32.add (global.get $jobs) (i32.const 1)))
+            (global.get $jobs))))");
+
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    int32_t seed = 0;
+    auto run_job = [&](tss::WasiInstance &instance) {
+        wasm_val_t args_val[1]    = {WASM_I32_VAL(seed++)};
+        wasm_val_t results_val[1] = {WASM_INIT_VAL};
+        wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+        wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+        auto trap                 = ::wasm_func_call(instance.func("job"), &args, &results);
+        if (trap) {
+            ::wasm_trap_delete(trap);
+        }
+        return trap != nullptr;
+    };
+
+    tss::bench::report("instantiate per job",
+                       tss::bench::ns_per_op(2000,
+                                             [&]() {
+                                                 auto instance = tss::WasiInstance::create(engine, module, {});
+                                                 tss::bench::do_not_optimize(run_job(*instance));
+                                             }) /
+                           1e3,
+                       "us");
+
+    auto pool = tss::InstancePool::create(engine, module, {}, nullptr, 4);
+    tss::bench::report("pooled instance per job",
+                       tss::bench::ns_per_op(20000,
+                                             [&]() {
+                                                 auto instance      = pool->acquire();
+                                                 const bool trapped = run_job(*instance);
+                                                 pool->release(std::move(instance), trapped);
+                                             }) /
+                           1e3,
+                       "us");
+    fmt::print("  {}\n", tss::instance_pool_stats_to_str(pool->stats()));
+    pool.reset();
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
@@ -1,6 +1,9 @@
 #ifdef UNIT_TEST
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #endif
+#ifdef BENCHMARK
+#define QOST_BENCH_IMPLEMENT_WITH_MAIN
+#endif
 #include "inc.hh"
 
 namespace tss {
@@ -143,225 +146,12 @@ namespace tss {
 //     return stream << output(error);
 // }
 
-auto wasm_limits_to_str(const wasm_limits_t *limits) -> std::string {
-    return fmt::format("{:#08x}, {:#08x}", limits->min, limits->max);
-}
-
-auto wasm_mutability_to_str(wasm_mutability_t mutability) -> std::string {
-    switch (mutability) {
-    case WASM_CONST: {
-        return "const";
-    }
-    case WASM_VAR: {
-        return "var";
-    }
-    default: {
-        return fmt::format("unknown ({})", mutability);
-    }
-    }
-}
-
-auto wasm_externkind_to_str(wasm_externkind_t externkind) -> std::string {
-    switch (externkind) {
-    case WASM_EXTERN_FUNC: {
-        return "func";
-    }
-    case WASM_EXTERN_GLOBAL: {
-        return "global";
-    }
-    case WASM_EXTERN_TABLE: {
-        return "table";
-    }
-    case WASM_EXTERN_MEMORY: {
-        return "memory";
-    }
-    default: {
-        return fmt::format("unknown ({})", externkind);
-    }
-    }
-}
-
-auto wasm_externtype_to_str(const wasm_externtype_t *externtype) -> std::string {
-    std::string str;
-    const auto externkind = ::wasm_externtype_kind(externtype);
-
-    switch (externkind) {
-    case WASM_EXTERN_FUNC: {
-        const auto functype = ::wasm_externtype_as_functype_const(externtype);
-        const auto params   = ::wasm_functype_params(functype);
-        const auto results  = ::wasm_functype_results(functype);
-
-        str += "(";
-        for (size_t index = 0; index < params->size; index++) {
-            const auto param   = params->data[index];
-            const auto valkind = ::wasm_valtype_kind(param);
-            str += wasm_valkind_to_str(valkind);
-            if (index != params->size - 1)
-                str += ", ";
-        }
-        str += ") -> (";
-        for (size_t index = 0; index < results->size; index++) {
-            const auto result  = results->data[index];
-            const auto valkind = ::wasm_valtype_kind(result);
-            str += wasm_valkind_to_str(valkind);
-            if (index != results->size - 1)
-                str += ", ";
-        }
-        str += ")";
-        break;
-    }
-    case WASM_EXTERN_GLOBAL: {
-        const auto globaltype = wasm_externtype_as_globaltype_const(externtype);
-        const auto mutability = wasm_globaltype_mutability(globaltype);
-        const auto valtype    = wasm_globaltype_content(globaltype);
-        const auto valkind    = wasm_valtype_kind(valtype);
-
-        str += fmt::format(": {} {}", wasm_mutability_to_str(mutability), wasm_valkind_to_str(valkind));
-        break;
-    }
-    case WASM_EXTERN_TABLE: {
-        const auto tabletype = wasm_externtype_as_tabletype_const(externtype);
-        const auto limits    = wasm_tabletype_limits(tabletype);
-        const auto valtype   = wasm_tabletype_element(tabletype);
-        const auto valkind   = wasm_valtype_kind(valtype);
-
-        str += fmt::format("({}): {}", wasm_limits_to_str(limits), wasm_valkind_to_str(valkind));
-        break;
-    }
-    case WASM_EXTERN_MEMORY: {
-        const auto memorytype = wasm_externtype_as_memorytype_const(externtype);
-        const auto limits     = wasm_memorytype_limits(memorytype);
-
-        str += fmt::format("({})", wasm_limits_to_str(limits));
-        break;
-    }
-    default: {
-        str += fmt::format("(unknown {})", externkind);
-        break;
-    }
-    }
-
-    return str;
-}
-
-auto wasm_memory_to_str() -> std::string {
-    return "";
-}
-
-auto wasm_importtype_to_str(const wasm_importtype_t *importtype) -> std::string {
-    std::string str;
-    auto module     = ::wasm_importtype_module(importtype);
-    auto name       = ::wasm_importtype_name(importtype);
-    auto externtype = ::wasm_importtype_type(importtype);
-    auto externkind = ::wasm_externtype_kind(externtype);
-
-    str += wasm_externkind_to_str(externkind) + " ";
-    str += std::string(module->data, module->size) + "::";
-    str += std::string(name->data, name->size);
-    str += wasm_externtype_to_str(externtype);
-
-    return str;
-}
-
-auto wasm_exporttype_to_str(const wasm_exporttype_t *exporttype, const std::string modulename = "") -> std::string {
-    std::string str;
-    auto name       = ::wasm_exporttype_name(exporttype);
-    auto externtype = ::wasm_exporttype_type(exporttype);
-    auto externkind = ::wasm_externtype_kind(externtype);
-
-    str += wasm_externkind_to_str(externkind) + " ";
-    str += modulename + "::";
-    str += std::string(name->data, name->size);
-    str += wasm_externtype_to_str(externtype);
-
-    return str;
-}
-
-auto wasm_module_imports_to_str(const wasm_module_t *module) -> std::string {
-    std::string str;
-    wasm_importtype_vec_t imports;
-    ::wasm_module_imports(module, &imports);
-
-    for (size_t index = 0; index < imports.size; index++) {
-        str += fmt::format("{}\n", tss::wasm_importtype_to_str(imports.data[index]));
-    }
-
-    ::wasm_importtype_vec_delete(&imports);
-
-    return str;
-}
-
-auto wasm_module_exports_to_str(const wasm_module_t *module) -> std::string {
-    std::string str;
-    wasm_exporttype_vec_t exports;
-    ::wasm_module_exports(module, &exports);
-
-    for (size_t index = 0; index < exports.size; index++) {
-        str += fmt::format("{}\n", tss::wasm_exporttype_to_str(exports.data[index]));
-    }
-
-    ::wasm_exporttype_vec_delete(&exports);
-
-    return str;
-}
-
-auto wasm_frame_to_str(const wasm_frame_t *frame) -> std::string {
-    std::string str;
-
-    if (frame) {
-        str += fmt::format("{} @ {:#08x} = {}.{:#08x}",
-                           static_cast<void *>(::wasm_frame_instance(frame)),
-                           ::wasm_frame_module_offset(frame),
-                           ::wasm_frame_func_index(frame),
-                           ::wasm_frame_func_offset(frame));
-    } else {
-        str += fmt::format("{}", static_cast<const void *>(frame));
-    }
-
-    return str;
-}
-
-auto wasm_new_populated_imports_vec(
-    wasm_extern_vec_t *out, const wasm_module_t *module, wasm_store_t *store, void *env, void (*finalizer)(void *)) {
-    wasm_importtype_vec_t imports;
-    ::wasm_module_imports(module, &imports);
-    wasm_extern_vec_new_uninitialized(out, imports.size);
-
-    for (size_t index = 0; index < imports.size; index++) {
-        auto importtype = imports.data[index];
-        auto externtype = ::wasm_importtype_type(importtype);
-        auto externkind = ::wasm_externtype_kind(externtype);
-        switch (externkind) {
-        case WASM_EXTERN_FUNC: {
-            auto functype = ::wasm_externtype_as_functype_const(externtype);
-            auto str      = wasm_importtype_to_str(importtype);
-            auto stub     = tss::wasi_get_stub_from_str(str);
-            // fmt::print("{} {}\n", stub != nullptr, str);
-            wasm_func_t *func = wasm_func_new_with_env(store, functype, stub, env, finalizer);
-            out->data[index]  = wasm_func_as_extern(func);
-
-            break;
-        }
-        case WASM_EXTERN_GLOBAL:
-        case WASM_EXTERN_TABLE:
-        case WASM_EXTERN_MEMORY: {
-            fmt::print(stderr, "Warning: Unsupported import: {}\n", externkind);
-            continue;
-        }
-        default: {
-            break;
-        }
-        }
-    }
-
-    ::wasm_importtype_vec_delete(&imports);
-}
 } // namespace tss
 
 int my_main(int argc, char *argv[]);
 
-#ifndef UNIT_TEST
-// With unit tests we generate a main(), so we need to remove this define
+#if !defined(UNIT_TEST) && !defined(BENCHMARK)
+// With unit tests and benchmarks we generate a main(), so we need to remove this define
 int main(int argc, char *argv[]) {
     return my_main(argc, argv);
 }
@@ -372,6 +162,13 @@ int my_main(int argc, char *argv[]) {
 
     std::vector<std::string> cmd_args(argv, argv + argc);
 
+    // Everything after `--` is passed on to the guest as its own arguments
+    std::vector<std::string> guest_args{"python.wasm"};
+    if (auto separator = std::find(cmd_args.begin(), cmd_args.end(), "--"); separator != cmd_args.end()) {
+        guest_args.insert(guest_args.end(), std::next(separator), cmd_args.end());
+        cmd_args.erase(separator, cmd_args.end());
+    }
+
     for (auto arg : cmd_args)
         fmt::print("#{}#\n", arg);
 
@@ -396,133 +193,320 @@ int my_main(int argc, char *argv[]) {
     // wat2wasm(&wat, &wasm_bytes);
     // wasm_byte_vec_delete(&wat);
 
-    std::ifstream ifs("python.wasm", std::ios::binary | std::ios::ate);
-    if (!ifs) {
-        fmt::print(stderr, "python.wasm: {}\n", std::strerror(errno));
-        return 1;
+    for (auto &arg : cmd_args) {
+        if (arg.starts_with("--trace-decode=")) {
+            // Offline decoding of a trace written with `--trace-out`, no guest is run
+            std::vector<tss::WasiTraceRecord> records;
+            if (!tss::wasi_trace_read(arg.substr(std::string_view("--trace-decode=").size()), &records))
+                return 1;
+            tss::wasi_trace_print(records, stdout);
+            return 0;
+        }
+        if (arg.starts_with("--vfs-pack=")) {
+            // --vfs-pack=<dir>:<pack>, builds a pack for `--vfs` and exits
+            auto spec  = arg.substr(std::string_view("--vfs-pack=").size());
+            auto colon = spec.find(':');
+            if (colon == std::string::npos) {
+                fmt::print(stderr, "--vfs-pack expects <dir>:<pack>\n");
+                return 1;
+            }
+            return tss::vfs_pack_write(spec.substr(0, colon), spec.substr(colon + 1)) ? 0 : 1;
+        }
     }
 
-    auto end = ifs.tellg();
-    ifs.seekg(0, std::ios::beg);
-
-    auto size = std::size_t(end - ifs.tellg());
-
-    if (size == 0) // avoid undefined behavior
-        return {};
-
-    std::vector<char> buffer(size);
-
-    if (!ifs.read(&buffer[0], static_cast<std::streamsize>(buffer.size()))) {
-        fmt::print(stderr, "python.wasm: {}\n", std::strerror(errno));
+    tss::StartupTimeline startup;
+    tss::MappedFile wasm_file("python.wasm");
+    if (!wasm_file) {
+        fmt::print(stderr, "python.wasm: {}\n", std::strerror(wasm_file.error()));
         return 1;
     }
 
-    wasm_byte_vec_new(&wasm_bytes, buffer.size(), &buffer[0]);
+    if (wasm_file.size() == 0) // avoid undefined behavior
+        return {};
+
+    // View into the mapping, must not be deleted with `wasm_byte_vec_delete`
+    wasm_bytes = wasm_file.view();
 
     fmt::print("Read wasm file of size {}\n", wasm_bytes.size);
+    startup.mark("read");
+
+    tss::ModuleCache module_cache{tss::module_cache_default_dir()};
+    tss::TierConfig tier_config{};
+    bool trace = false;
+    std::string trace_out{};
+    std::vector<tss::WasiPreopen> preopens;
+    bool io_uring   = false;
+    bool stat_cache = true;
+    auto clock      = tss::ClockMode::vdso;
+    std::optional<uint64_t> random_seed;
+    std::vector<std::string> guest_environment;
+    bool profile = false;
+    std::string profile_json{};
+    std::string startup_json{};
+    std::string snapshot_out{};
+    std::string snapshot_init = "wizer.initialize";
+    std::string snapshot_in{};
+    std::string snapshot_resume{};
+    size_t repeat = 0;
+    uint64_t fuel = 0;
+    std::chrono::milliseconds timeout{0};
+    for (auto &arg : cmd_args) {
+        if (arg == "--no-module-cache")
+            module_cache.enabled = false;
+        if (arg == "--tiered")
+            tier_config.tiered = true;
+        if (arg == "--trace")
+            trace = true;
+        if (arg.starts_with("--trace-out=")) {
+            trace     = true;
+            trace_out = arg.substr(std::string_view("--trace-out=").size());
+        }
+        if (arg == "--profile")
+            profile = true;
+        if (arg.starts_with("--profile-json=")) {
+            profile      = true;
+            profile_json = arg.substr(std::string_view("--profile-json=").size());
+        }
+        if (arg.starts_with("--startup-json="))
+            startup_json = arg.substr(std::string_view("--startup-json=").size());
+        if (arg.starts_with("--snapshot-create="))
+            snapshot_out = arg.substr(std::string_view("--snapshot-create=").size());
+        if (arg.starts_with("--snapshot-init="))
+            snapshot_init = arg.substr(std::string_view("--snapshot-init=").size());
+        if (arg.starts_with("--snapshot="))
+            snapshot_in = arg.substr(std::string_view("--snapshot=").size());
+        if (arg.starts_with("--snapshot-resume="))
+            snapshot_resume = arg.substr(std::string_view("--snapshot-resume=").size());
+        if (arg.starts_with("--repeat=")) {
+            // --repeat=<n>, runs `_start` n more times on pooled instances
+            auto count = arg.substr(std::string_view("--repeat=").size());
+            char *end  = nullptr;
+            repeat     = std::strtoull(count.c_str(), &end, 10);
+            if (count.empty() || *end != '\0') {
+                fmt::print(stderr, "--repeat expects a number\n");
+                return 1;
+            }
+        }
+        if (arg.starts_with("--fuel=")) {
+            // --fuel=<n>, stops `_start` once it has run n operators
+            auto count = arg.substr(std::string_view("--fuel=").size());
+            char *end  = nullptr;
+            fuel       = std::strtoull(count.c_str(), &end, 10);
+            if (count.empty() || *end != '\0' || fuel == 0) {
+                fmt::print(stderr, "--fuel expects a positive number\n");
+                return 1;
+            }
+        }
+        if (arg.starts_with("--timeout-ms=")) {
+            // --timeout-ms=<n>, interrupts `_start` once it has run for n milliseconds
+            auto count = arg.substr(std::string_view("--timeout-ms=").size());
+            char *end  = nullptr;
+            timeout    = std::chrono::milliseconds(std::strtoull(count.c_str(), &end, 10));
+            if (count.empty() || *end != '\0' || timeout.count() == 0) {
+                fmt::print(stderr, "--timeout-ms expects a positive number\n");
+                return 1;
+            }
+        }
+        if (arg == "--io-uring")
+            io_uring = true;
+        if (arg == "--no-stat-cache")
+            stat_cache = false;
+        if (arg.starts_with("--clock=")) {
+            // --clock=vdso|tsc|deterministic
+            auto mode = magic_enum::enum_cast<tss::ClockMode>(arg.substr(std::string_view("--clock=").size()));
+            if (!mode) {
+                fmt::print(stderr, "--clock expects vdso, tsc or deterministic\n");
+                return 1;
+            }
+            clock = *mode;
+        }
+        if (arg.starts_with("--random-seed=")) {
+            // --random-seed=<n>, decimal or 0x hex
+            auto seed   = arg.substr(std::string_view("--random-seed=").size());
+            char *end   = nullptr;
+            random_seed = std::strtoull(seed.c_str(), &end, 0);
+            if (seed.empty() || *end != '\0') {
+                fmt::print(stderr, "--random-seed expects a number\n");
+                return 1;
+            }
+        }
+        if (arg.starts_with("--env="))
+            guest_environment.push_back(arg.substr(std::string_view("--env=").size()));
+        if (arg.starts_with("--dir=")) {
+            // --dir=<host>[:<guest>], the guest path defaults to the host one
+            auto dir   = arg.substr(std::string_view("--dir=").size());
+            auto colon = dir.find(':');
+            preopens.push_back({colon == std::string::npos ? dir : dir.substr(colon + 1), dir.substr(0, colon), {}});
+        }
+        if (arg.starts_with("--vfs=")) {
+            // --vfs=<pack>[:<guest>], the guest path defaults to the root
+            auto spec  = arg.substr(std::string_view("--vfs=").size());
+            auto colon = spec.find(':');
+            std::shared_ptr<const tss::VfsPack> pack = tss::VfsPack::open(spec.substr(0, colon));
+            if (!pack)
+                return 1;
+            preopens.push_back({colon == std::string::npos ? "/" : spec.substr(colon + 1), {}, std::move(pack)});
+        }
+    }
 
-    fmt::print("Creating the store...\n");
-    wasm_engine_t *engine = wasm_engine_new();
-    wasm_store_t *store   = wasm_store_new(engine);
-    tss::g_store          = store;
+    // Metering is also what lets the watchdog stop guest code that never calls the host. Metered code is cached under a
+    // tag of its own, next to the unmetered one
+    const bool metered             = fuel != 0 || timeout.count() > 0;
+    tier_config.baseline.metering  = metered;
+    tier_config.optimized.metering = metered;
+
+    // Snapshots are tied to the exact wasm bytes, hashed before the mapping moves into the compiler
+    const auto module_hash = snapshot_out.empty() && snapshot_in.empty()
+                                 ? 0
+                                 : tss::content_hash(wasm_bytes.data, wasm_bytes.size);
+    std::unique_ptr<tss::Snapshot> snapshot;
+    if (!snapshot_in.empty()) {
+        // `_start` of a wasi-libc command runs the constructors and `main`, initialization and all, so a restored
+        // instance has to be started from an export that picks up where the init export left off
+        if (snapshot_resume.empty()) {
+            fmt::print(stderr,
+                       "--snapshot needs --snapshot-resume=<export>, the function a restored instance starts from. "
+                       "Pass --snapshot-resume=_start only if the guest's `_start` skips initialization itself\n");
+            return 1;
+        }
+        snapshot = tss::Snapshot::open(snapshot_in, module_hash);
+        if (!snapshot)
+            return 1;
+    }
 
     fmt::print("Compiling module...\n");
-    wasm_module_t *module = wasm_module_new(store, &wasm_bytes);
+    tss::TieredModule compiled(std::move(wasm_file), std::move(module_cache), tier_config);
 
-    if (!module) {
+    if (!compiled.start(&startup)) {
         fmt::print(stderr, "> Error compiling module!\n");
-        wasm_module_delete(module);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
         return 1;
     }
 
-    wasm_byte_vec_delete(&wasm_bytes);
-    buffer.clear();
+    wasm_engine_t *engine = compiled.current().engine;
+    wasm_module_t *module = compiled.current().module;
 
-    fmt::print("{}", tss::wasm_module_imports_to_str(module));
+    fmt::print("Compile tiers: {}\n", tss::tier_metrics_to_str(compiled.metrics()));
 
-    fmt::print("Creating imports...\n");
-    // // wasm_functype_t *host_func_type = wasm_functype_new_0_1(wasm_valtype_new_i32());
-    // wasm_functype_t *host_func_type = wasm_functype_new_0_0();
-    // wasm_func_t *host_func = wasm_func_new(store, host_func_type, tss::wasi_args_get_stub);
-    // // wasm_func_get_host_info(host_func);
-    // wasm_functype_delete(host_func_type);
-
-    // wasm_extern_t *externs[] = {wasm_func_as_extern(host_func)};
+    if (compiled.cache().enabled) {
+        fmt::print("Module cache {}: {} hit(s), {} miss(es), {} rebuild(s)\n",
+                   compiled.cache().dir.string(),
+                   compiled.cache().stats.hits,
+                   compiled.cache().stats.misses,
+                   compiled.cache().stats.rebuilds);
+    }
 
-    wasm_extern_vec_t imports;
-    int a;
-    tss::wasm_new_populated_imports_vec(&imports, module, store, &a, nullptr);
-    // wasm_extern_vec_new(&imports, ARRLEN(externs), externs);
-    // wasm_extern_vec_t imports = WASM_ARRAY_VEC(externs);
-    // wasm_extern_vec_t imports = WASM_EMPTY_VEC;
+    fmt::print("{}", tss::wasm_module_imports_to_str(module));
 
     fmt::print("Instantiating module...\n");
-    wasm_trap_t *trap         = NULL;
-    wasm_instance_t *instance = wasm_instance_new(store, module, &imports, &trap);
+    tss::WasiInstanceConfig instance_config{};
+    instance_config.args        = std::move(guest_args);
+    instance_config.environment = std::move(guest_environment);
+    instance_config.preopens    = std::move(preopens);
+    instance_config.io_uring    = io_uring;
+    instance_config.stat_cache  = stat_cache;
+    instance_config.clock       = clock;
+    instance_config.random_seed = random_seed;
+    instance_config.profile     = profile;
+    instance_config.metered     = metered;
+    instance_config.timeline    = &startup;
+
+    // Safe point: nothing runs in the guest yet, so a tiered host instantiates from whichever tier is done by now
+    compiled.poll();
+    engine = compiled.current().engine;
+    module = compiled.current().module;
+
+    if (!snapshot_out.empty()) {
+        // --snapshot-create=<image> runs the init export instead of `_start` and exits once the image is written
+        const bool written = tss::snapshot_create(
+            engine, module, std::move(instance_config), snapshot_init, module_hash, snapshot_out);
+        return written ? 0 : 1;
+    }
 
-    wasm_extern_vec_delete(&imports);
+    auto pool_config = instance_config;
+    auto instance    = tss::WasiInstance::create(engine, module, std::move(instance_config));
 
-    if (!instance || trap) {
+    if (!instance) {
         fmt::print(stderr, "> Error instantiating module!\n");
-        if (trap) {
-            fmt::print(stderr, "> Trap detected\n");
-        }
-        wasm_module_delete(module);
-        wasm_instance_delete(instance);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
         return 1;
     }
 
-    fmt::print("{}", tss::wasm_module_exports_to_str(module));
+    if (snapshot) {
+        if (!snapshot->restore(*instance)) {
+            fmt::print(stderr, "> Error restoring snapshot {}!\n", snapshot_in);
+            return 1;
+        }
+        startup.mark("restore");
+    }
 
-    fmt::print("Retrieving exports...\n");
-    wasm_extern_vec_t exports;
-    wasm_instance_exports(instance, &exports);
-    fmt::print("Num exports found: {}\n", exports.size);
-
-    if (exports.size == 0) {
-        fmt::print(stderr, "> Error accessing exports!\n");
-        wasm_module_delete(module);
-        wasm_extern_vec_delete(&exports);
-        wasm_instance_delete(instance);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
-        return 1;
+#ifdef WASI_TRACE
+    if (trace)
+        instance->env().trace.enable();
+#else
+    if (trace)
+        fmt::print(stderr, "WASI tracing is compiled out, build with WASI_TRACE defined to use it\n");
+#endif
+
+    auto dump_trace = [&]() {
+#ifdef WASI_TRACE
+        if (!trace)
+            return;
+        auto records = instance->env().trace.snapshot();
+        fmt::print(stderr, "WASI trace: {} call(s), {} kept\n", instance->env().trace.total(), records.size());
+        if (trace_out.empty())
+            tss::wasi_trace_print(records);
+        else
+            tss::wasi_trace_write(records, trace_out);
+#endif
+    };
+
+    // SIGUSR1 dumps the profile so far while the guest keeps running, and it is dumped once more when the guest exits
+    std::unique_ptr<tss::SignalDumper> profile_dumper;
+    if (profile) {
+        profile_dumper = tss::SignalDumper::create(
+            SIGUSR1, [&instance, &profile_json] { tss::wasi_profile_dump(instance->env().profile, profile_json); });
     }
+    // The last phase is the guest's whole run, from `_start` or the resume export until it returns or traps
+    auto dump_startup = [&]() {
+        startup.mark("start");
+        fmt::print("Startup phases:\n{}", tss::startup_timeline_to_str(startup));
+        if (startup_json.empty())
+            return;
+        std::ofstream out(startup_json, std::ios::binary | std::ios::trunc);
+        out << tss::startup_timeline_to_json(startup);
+        if (!out)
+            fmt::print(stderr, "Could not write {}\n", startup_json);
+    };
+
+    auto dump_profile = [&]() {
+        if (!profile)
+            return;
+        profile_dumper.reset();
+        tss::wasi_profile_dump(instance->env().profile, profile_json);
+    };
 
-    fmt::print("Retrieving the memory...\n");
-    wasm_memory_t *memory = wasm_extern_as_memory(exports.data[0]);
+    fmt::print("{}", tss::wasm_module_exports_to_str(module));
+    fmt::print("Num exports found: {}\n", instance->exports().size);
 
-    if (!memory) {
+    if (!instance->env().memory) {
         fmt::print("> Failed to get the memory!\n");
-        wasm_module_delete(module);
-        wasm_extern_vec_delete(&exports);
-        wasm_instance_delete(instance);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
         return 1;
     }
 
-    tss::g_memory = memory;
-    // ::wasm_memory
-
-    fmt::print("Retrieving the `_start` function...\n");
-    wasm_func_t *start_func = wasm_extern_as_func(exports.data[1]);
+    // A restored instance starts from the resume export, `_start` would initialize it all over again
+    const std::string entry = snapshot ? snapshot_resume : "_start";
+    fmt::print("Retrieving the `{}` function...\n", entry);
+    wasm_func_t *start_func = instance->func(entry);
 
     if (start_func == NULL) {
-        fmt::print("> Failed to get the `_start` function!\n");
-        wasm_module_delete(module);
-        wasm_extern_vec_delete(&exports);
-        wasm_instance_delete(instance);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
+        fmt::print("> Failed to get the `{}` function!\n", entry);
+        return 1;
+    }
+    if (wasm_func_param_arity(start_func) != 0 || wasm_func_result_arity(start_func) != 0) {
+        fmt::print("> The `{}` function has to take and return nothing!\n", entry);
         return 1;
     }
 
-    fmt::print("Calling `_start` function...\n");
+    fmt::print("Calling `{}` function...\n", entry);
     // wasm_val_t args_val[2] = {WASM_I32_VAL(3), WASM_I32_VAL(4)};
     // wasm_val_t results_val[1] = {WASM_INIT_VAL};
     // wasm_val_vec_t args = WASM_ARRAY_VEC(args_val);
@@ -531,11 +515,34 @@ int my_main(int argc, char *argv[]) {
     wasm_val_vec_t results = WASM_EMPTY_VEC;
 
     // if (wasm_func_call(start_func, nullptr, nullptr)) {
-    trap = wasm_func_call(start_func, &args, &results);
+    instance->env().fuel.set_budget({.per_call = fuel});
+    std::unique_ptr<tss::Watchdog> watchdog;
+    if (timeout.count() > 0) {
+        watchdog = tss::Watchdog::create();
+        if (!watchdog)
+            return 1;
+    }
+    wasm_trap_t *trap = nullptr;
+    const auto start_result =
+        watchdog ? tss::watchdog_call(*watchdog, *instance, start_func, &args, &results, &trap, timeout)
+                 : instance->env().fuel.call(start_func, &args, &results, &trap);
+    if (start_result == tss::FuelCallResult::exhausted || start_result == tss::FuelCallResult::interrupted) {
+        if (start_result == tss::FuelCallResult::exhausted)
+            fmt::print(stderr,
+                       "> `{}` ran out of fuel after {} operators\n",
+                       entry,
+                       instance->env().fuel.usage().last_call);
+        else
+            fmt::print(stderr, "> `{}` ran past its deadline of {} ms\n", entry, timeout.count());
+        dump_startup();
+        dump_trace();
+        dump_profile();
+        return 1;
+    }
     if (trap) {
         wasm_message_t message;
         wasm_trap_message(trap, &message);
-        fmt::print(stderr, "> Error calling the `_start` function: {}\n", &message.data[0]);
+        fmt::print(stderr, "> Error calling the `{}` function: {}\n", entry, &message.data[0]);
         wasm_name_delete(&message);
 
         auto frame = wasm_trap_origin(trap);
@@ -552,22 +559,69 @@ int my_main(int argc, char *argv[]) {
         }
 
         wasm_trap_delete(trap);
-        wasm_module_delete(module);
-        wasm_extern_vec_delete(&exports);
-        wasm_instance_delete(instance);
-        wasm_store_delete(store);
-        wasm_engine_delete(engine);
+        dump_startup();
+        dump_trace();
+        dump_profile();
         return 1;
     }
 
     fmt::print("Done!\n");
+    dump_startup();
+    dump_trace();
+    dump_profile();
     // fmt::print("Results of `sum`: %d\n", results_val[0].of.i32);
 
-    wasm_module_delete(module);
-    wasm_extern_vec_delete(&exports);
-    wasm_instance_delete(instance);
-    wasm_store_delete(store);
-    wasm_engine_delete(engine);
+    fmt::print("Host calls: {}, traps: {}\n", instance->env().stats.host_calls, instance->env().stats.traps);
+    const auto stat_cache_stats = instance->env().fds.stat_cache_stats();
+    fmt::print("Stat cache: {} hit(s), {} miss(es), {} invalidation(s)\n",
+               stat_cache_stats.hits,
+               stat_cache_stats.misses,
+               stat_cache_stats.invalidations);
+    instance.reset();
+
+    if (repeat > 0) {
+        // Every run gets an instance reset to the state the first one started from, as short guest jobs would. Between
+        // runs nothing is in the guest, so once the optimized tier is done the pool is made over from it
+        compiled.poll();
+        auto pool = tss::InstancePool::create(
+            compiled.current().engine, compiled.current().module, pool_config, snapshot.get(), 1);
+        if (!pool)
+            return 1;
+        for (size_t run = 0; run < repeat; run++) {
+            if (compiled.poll()) {
+                fmt::print("Instance pool: {}\n", tss::instance_pool_stats_to_str(pool->stats()));
+                pool = tss::InstancePool::create(
+                    compiled.current().engine, compiled.current().module, pool_config, snapshot.get(), 1);
+                if (!pool)
+                    return 1;
+            }
+            auto pooled = pool->acquire();
+            if (!pooled)
+                return 1;
+            wasm_func_t *pooled_start = pooled->func(entry);
+            if (pooled_start == NULL) {
+                fmt::print("> Failed to get the `{}` function!\n", entry);
+                return 1;
+            }
+            // Under the same fuel budget and deadline as the first run
+            pooled->env().fuel.set_budget({.per_call = fuel});
+            wasm_trap_t *pooled_trap = nullptr;
+            const auto pooled_result =
+                watchdog ? tss::watchdog_call(*watchdog, *pooled, pooled_start, &args, &results, &pooled_trap, timeout)
+                         : pooled->env().fuel.call(pooled_start, &args, &results, &pooled_trap);
+            if (pooled_result == tss::FuelCallResult::exhausted)
+                fmt::print(stderr, "> Run {}: `{}` ran out of fuel\n", run + 1, entry);
+            else if (pooled_result == tss::FuelCallResult::interrupted)
+                fmt::print(stderr, "> Run {}: `{}` ran past its deadline of {} ms\n", run + 1, entry, timeout.count());
+            if (pooled_trap)
+                wasm_trap_delete(pooled_trap);
+            // Stopped calls leave the guest wherever they were, as traps do
+            pool->release(std::move(pooled), pooled_result != tss::FuelCallResult::returned);
+        }
+        fmt::print("Instance pool: {}\n", tss::instance_pool_stats_to_str(pool->stats()));
+    }
+
+    fmt::print("Compile tiers: {}\n", tss::tier_metrics_to_str(compiled.metrics()));
 
     return 0;
 }
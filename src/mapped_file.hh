@@ -0,0 +1,205 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+
+// Read-only, private memory mapping of a whole file. The kernel pages the file in on demand straight from the page
+// cache, so handing the mapping to the compiler avoids both the stream buffer and the `wasm_byte_vec_t` heap copy
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::filesystem::path &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            m_Error = errno;
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            m_Error = errno;
+            ::close(fd);
+            return;
+        }
+
+        m_Size = static_cast<size_t>(st.st_size);
+        if (m_Size != 0) {
+            void *data = ::mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                m_Error = errno;
+                m_Size  = 0;
+            } else {
+                m_Data = static_cast<byte_t *>(data);
+                // Both compilation and deserialization walk the file front to back. The advice values are not flags,
+                // so each takes a call of its own
+                ::madvise(data, m_Size, MADV_SEQUENTIAL);
+                ::madvise(data, m_Size, MADV_WILLNEED);
+            }
+        }
+
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        reset();
+    }
+
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept
+        : m_Data{std::exchange(other.m_Data, nullptr)}, m_Size{std::exchange(other.m_Size, 0)},
+          m_Error{std::exchange(other.m_Error, 0)} {}
+
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            reset();
+            m_Data  = std::exchange(other.m_Data, nullptr);
+            m_Size  = std::exchange(other.m_Size, 0);
+            m_Error = std::exchange(other.m_Error, 0);
+        }
+        return *this;
+    }
+
+    void reset() {
+        if (m_Data) {
+            ::munmap(m_Data, m_Size);
+        }
+        m_Data = nullptr;
+        m_Size = 0;
+    }
+
+    // Drop the pages from our address space once the consumer is done with them, without unmapping
+    void release_pages() const {
+        if (m_Data) {
+            ::madvise(m_Data, m_Size, MADV_DONTNEED);
+        }
+    }
+
+    void advise(int advice) const {
+        if (m_Data) {
+            ::madvise(m_Data, m_Size, advice);
+        }
+    }
+
+    explicit operator bool() const {
+        return m_Error == 0;
+    }
+
+    auto error() const -> int {
+        return m_Error;
+    }
+
+    auto data() const -> const byte_t * {
+        return m_Data;
+    }
+
+    auto size() const -> size_t {
+        return m_Size;
+    }
+
+    // Non-owning view for the wasm C API, which only reads through `const wasm_byte_vec_t *`. Must never be passed to
+    // `wasm_byte_vec_delete`
+    auto view(size_t offset = 0) const -> wasm_byte_vec_t {
+        if (offset > m_Size) {
+            offset = m_Size;
+        }
+        return wasm_byte_vec_t{m_Size - offset, m_Data + offset};
+    }
+
+private:
+    byte_t *m_Data = nullptr;
+    size_t m_Size  = 0;
+    int m_Error    = 0;
+};
+
+// Peak resident set size of this process, in bytes
+inline auto peak_rss_bytes() -> size_t {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+} // namespace tss
+
+#ifdef BENCHMARK
+namespace tss::bench {
+// High-water mark of the resident set since the last `peak_rss_reset`, in bytes
+inline auto peak_rss_since_reset() -> size_t {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmHWM:")) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+// Starts the high-water mark over at the current resident set
+inline auto peak_rss_reset() -> bool {
+    int fd = ::open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool reset = ::write(fd, "5", 1) == 1;
+    ::close(fd);
+    return reset;
+}
+} // namespace tss::bench
+
+BENCHMARK_CASE("mapped_file: load") {
+    // A module sized file loaded the way main.cc used to, read into a vector and copied into a `wasm_byte_vec_t` with
+    // the vector kept around, against mapping it and handing out `view()`. Either way every page is read once, as the
+    // compiler would. The file is in the page cache for both, so this is the copying, not the disk
+    const size_t size = size_t{256} << 20;
+    const auto path   = std::filesystem::temp_directory_path() / fmt::format("qost-mapped-file-bench-{}", ::getpid());
+    {
+        std::ofstream out(path, std::ios::binary);
+        std::vector<char> chunk(size_t{1} << 20, 'x');
+        for (size_t written = 0; written < size; written += chunk.size()) {
+            out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        }
+    }
+
+    const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    auto consume         = [&](const byte_t *data, size_t length) {
+        uint64_t sum = 0;
+        for (size_t offset = 0; offset < length; offset += page_size) {
+            sum += static_cast<uint8_t>(data[offset]);
+        }
+        tss::bench::do_not_optimize(sum);
+    };
+
+    for (bool mapped : {false, true}) {
+        const bool reset    = tss::bench::peak_rss_reset();
+        const auto baseline = tss::bench::peak_rss_since_reset();
+        const auto begin    = tss::bench::now_ns();
+        if (mapped) {
+            tss::MappedFile file(path);
+            auto view = file.view();
+            consume(view.data, view.size);
+        } else {
+            std::ifstream in(path, std::ios::binary);
+            std::vector<char> buffer(size);
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            wasm_byte_vec_t bytes;
+            ::wasm_byte_vec_new(&bytes, buffer.size(), buffer.data());
+            consume(bytes.data, bytes.size);
+            ::wasm_byte_vec_delete(&bytes);
+        }
+        const auto ns = tss::bench::now_ns() - begin;
+
+        const auto name = mapped ? "MappedFile view" : "ifstream, vector and wasm_byte_vec_new";
+        tss::bench::report(fmt::format("{}, load time", name), static_cast<double>(ns) / 1e6, "ms");
+        if (reset) {
+            const auto added = tss::bench::peak_rss_since_reset() - baseline;
+            tss::bench::report(fmt::format("{}, peak RSS added", name), static_cast<double>(added) / (1 << 20), "MiB");
+        } else {
+            fmt::print("  the peak RSS can not be reset here\n");
+        }
+    }
+    std::filesystem::remove(path);
+}
+#endif
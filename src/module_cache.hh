@@ -0,0 +1,241 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+
+// Bump whenever the on-disk layout of a cache entry changes, so old entries are rebuilt instead of misread
+#define MODULE_CACHE_VERSION 1U
+
+inline constexpr char module_cache_magic[8] = {'Q', 'O', 'S', 'T', 'M', 'O', 'D', '\0'};
+
+struct ModuleCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t content_hash; // Hash of the wasm bytes the artifact was compiled from
+    uint64_t config_hash;  // Hash of the engine/compiler configuration the artifact was compiled with
+    uint64_t payload_size; // Size of the serialized artifact following the header
+    uint64_t payload_hash; // Hash of the serialized artifact, catches truncated or corrupted entries
+};
+
+static_assert(sizeof(ModuleCacheHeader) == 48, "module cache header layout changed, bump MODULE_CACHE_VERSION");
+
+// Word-at-a-time FNV-1a style hash with a final avalanche, fast enough to run over a multi-megabyte module on every
+// startup while still catching any changed byte
+inline auto content_hash(const void *data, size_t size, uint64_t seed = 0xcbf29ce484222325ULL) -> uint64_t {
+    constexpr uint64_t prime = 0x100000001b3ULL;
+    auto bytes               = static_cast<const uint8_t *>(data);
+    uint64_t hash            = seed ^ (size * prime);
+    size_t index             = 0;
+
+    for (; index + sizeof(uint64_t) <= size; index += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, &bytes[index], sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+
+    for (; index < size; index++) {
+        hash = (hash ^ bytes[index]) * prime;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+inline auto content_hash(std::string_view str) -> uint64_t {
+    return content_hash(str.data(), str.size());
+}
+
+struct ModuleCacheStats {
+    size_t hits     = 0;
+    size_t misses   = 0;
+    size_t rebuilds = 0; // Entries that existed but were stale or corrupt
+};
+
+struct ModuleCache {
+    std::filesystem::path dir;
+    bool enabled = true;
+    ModuleCacheStats stats{};
+};
+
+inline auto module_cache_default_dir() -> std::filesystem::path {
+    if (auto dir = std::getenv("QOST_CACHE_DIR"); dir && *dir) {
+        return std::filesystem::path(dir) / "modules";
+    }
+    if (auto dir = std::getenv("XDG_CACHE_HOME"); dir && *dir) {
+        return std::filesystem::path(dir) / "quest-on-saer-tor" / "modules";
+    }
+    if (auto dir = std::getenv("HOME"); dir && *dir) {
+        return std::filesystem::path(dir) / ".cache" / "quest-on-saer-tor" / "modules";
+    }
+    return std::filesystem::path(".qost-cache") / "modules";
+}
+
+// Everything that changes the generated machine code has to be part of this tag, or we would happily load an
+// artifact compiled for a different configuration
+inline auto module_cache_config_tag(std::string_view engine_config) -> std::string {
+    return fmt::format("wasmer {}; {}", ::wasmer_version(), engine_config);
+}
+
+inline auto module_cache_entry_path(const ModuleCache &cache, uint64_t content_hash, uint64_t config_hash)
+    -> std::filesystem::path {
+    return cache.dir / fmt::format("{:016x}-{:016x}.wasmu", content_hash, config_hash);
+}
+
+inline auto module_cache_load(ModuleCache &cache,
+                              wasm_store_t *store,
+                              const std::filesystem::path &path,
+                              uint64_t content_hash,
+                              uint64_t config_hash) -> wasm_module_t * {
+    MappedFile file(path);
+    if (!file) {
+        return nullptr;
+    }
+
+    ModuleCacheHeader header{};
+    if (file.size() >= sizeof(header)) {
+        std::memcpy(&header, file.data(), sizeof(header));
+    }
+
+    if (std::memcmp(header.magic, module_cache_magic, sizeof(header.magic)) != 0 ||
+        header.version != MODULE_CACHE_VERSION || header.content_hash != content_hash ||
+        header.config_hash != config_hash) {
+        fmt::print(stderr, "Module cache: stale entry {}, rebuilding\n", path.string());
+        cache.stats.rebuilds++;
+        return nullptr;
+    }
+
+    // The artifact is deserialized straight out of the mapping, no intermediate buffer
+    const wasm_byte_vec_t artifact = file.view(sizeof(header));
+    if (artifact.size != header.payload_size ||
+        tss::content_hash(artifact.data, artifact.size) != header.payload_hash) {
+        fmt::print(stderr, "Module cache: corrupt entry {}, rebuilding\n", path.string());
+        cache.stats.rebuilds++;
+        return nullptr;
+    }
+
+    wasm_module_t *module = ::wasm_module_deserialize(store, &artifact);
+
+    if (!module) {
+        fmt::print(stderr, "Module cache: could not deserialize {}, rebuilding\n", path.string());
+        cache.stats.rebuilds++;
+    }
+
+    return module;
+}
+
+inline auto module_cache_store(const ModuleCache &cache,
+                               const wasm_module_t *module,
+                               const std::filesystem::path &path,
+                               uint64_t content_hash,
+                               uint64_t config_hash) -> bool {
+    std::error_code error;
+    std::filesystem::create_directories(cache.dir, error);
+    if (error) {
+        fmt::print(stderr, "Module cache: {}: {}\n", cache.dir.string(), error.message());
+        return false;
+    }
+
+    wasm_byte_vec_t artifact;
+    ::wasm_module_serialize(module, &artifact);
+    if (artifact.size == 0) {
+        ::wasm_byte_vec_delete(&artifact);
+        return false;
+    }
+
+    ModuleCacheHeader header{};
+    std::memcpy(header.magic, module_cache_magic, sizeof(header.magic));
+    header.version      = MODULE_CACHE_VERSION;
+    header.content_hash = content_hash;
+    header.config_hash  = config_hash;
+    header.payload_size = artifact.size;
+    header.payload_hash = tss::content_hash(artifact.data, artifact.size);
+
+    // Write to a temporary file and rename it into place, so a concurrent or interrupted writer can never leave a
+    // half-written entry behind under the real name
+    auto tmp_path = path;
+    tmp_path += fmt::format(".{}.tmp", ::getpid());
+
+    bool ok = false;
+    {
+        std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+        ok = ofs && ofs.write(reinterpret_cast<const char *>(&header), sizeof(header)) &&
+             ofs.write(artifact.data, static_cast<std::streamsize>(artifact.size)) && ofs.flush();
+    }
+    ::wasm_byte_vec_delete(&artifact);
+
+    if (ok) {
+        std::filesystem::rename(tmp_path, path, error);
+        ok = !error;
+    }
+    if (!ok) {
+        fmt::print(stderr, "Module cache: could not write {}\n", path.string());
+        std::filesystem::remove(tmp_path, error);
+    }
+
+    return ok;
+}
+
+// Only consults the cache, never compiles. Returns nullptr on a miss, and the hash of `binary` in `*wasm_hash` if
+// given, for `module_cache_put` to store the compiled module under without hashing the bytes again
+inline auto wasm_module_load_cached(ModuleCache &cache,
+                                    wasm_store_t *store,
+                                    const wasm_byte_vec_t *binary,
+                                    std::string_view engine_config,
+                                    uint64_t *wasm_hash = nullptr) -> wasm_module_t * {
+    if (!cache.enabled) {
+        return nullptr;
+    }
+
+    const auto hash        = content_hash(binary->data, binary->size);
+    const auto config_hash = content_hash(module_cache_config_tag(engine_config));
+    const auto path        = module_cache_entry_path(cache, hash, config_hash);
+    if (wasm_hash) {
+        *wasm_hash = hash;
+    }
+
+    if (auto module = module_cache_load(cache, store, path, hash, config_hash)) {
+        cache.stats.hits++;
+        return module;
+    }
+
+    cache.stats.misses++;
+    return nullptr;
+}
+
+// Serializes a freshly compiled module into the cache, `wasm_hash` is the hash of the wasm bytes it was compiled from
+// as returned by `wasm_module_load_cached`
+inline auto module_cache_put(const ModuleCache &cache,
+                             const wasm_module_t *module,
+                             uint64_t wasm_hash,
+                             std::string_view engine_config) -> bool {
+    if (!cache.enabled) {
+        return false;
+    }
+
+    const auto config_hash = content_hash(module_cache_config_tag(engine_config));
+    const auto path        = module_cache_entry_path(cache, wasm_hash, config_hash);
+
+    return module_cache_store(cache, module, path, wasm_hash, config_hash);
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("content_hash") {
+    const char data[] = "the quick brown fox jumps over the lazy dog";
+    REQUIRE(tss::content_hash(data, sizeof(data)) == tss::content_hash(data, sizeof(data)));
+    REQUIRE(tss::content_hash(data, sizeof(data)) != tss::content_hash(data, sizeof(data) - 1));
+
+    char modified[sizeof(data)];
+    std::memcpy(modified, data, sizeof(data));
+    modified[20] ^= 1;
+    REQUIRE(tss::content_hash(data, sizeof(data)) != tss::content_hash(modified, sizeof(modified)));
+}
+#endif
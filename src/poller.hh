@@ -0,0 +1,440 @@
+#pragma once
+
+#include "inc.hh"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+// Blocking for poll_oneoff: epoll for fd readiness, and a hierarchical timer wheel for clock subscriptions.
+//
+// The wheel has `TIMER_WHEEL_LEVELS` levels of 64 slots, level N slots being 64^N ticks wide. A timer goes into the
+// lowest level whose range covers its distance from now, and moves down a level whenever the wheel reaches its slot,
+// so adding and cancelling are O(1) no matter how many timers there are. Every level keeps a bitmap of its occupied
+// slots, which gives the next tick at which anything happens without looking at the timers, so time is skipped over in
+// jumps rather than tick by tick and the thread sleeps in epoll until exactly then
+
+namespace tss {
+
+#define TIMER_WHEEL_TICK_SHIFT 10 // A tick is 1024 ns
+#define TIMER_WHEEL_LEVELS 6      // 64^6 ticks, about 19 hours
+
+class TimerWheel {
+public:
+    // Intrusive, owned by the caller and linked into the wheel while pending
+    struct Timer {
+        Timer *prev    = nullptr;
+        Timer *next    = nullptr;
+        uint64_t tick  = 0;
+        uint64_t user  = 0; // Free for the owner, to find its way back from an expired timer
+        uint32_t level = 0;
+        uint32_t slot  = 0;
+
+        auto pending() const -> bool {
+            return prev != nullptr;
+        }
+    };
+
+    static constexpr uint64_t no_tick = UINT64_MAX;
+
+    TimerWheel() {
+        for (auto &level : m_Slots) {
+            for (auto &slot : level) {
+                slot.prev = &slot;
+                slot.next = &slot;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &)            = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    static constexpr auto ticks_floor(uint64_t ns) -> uint64_t {
+        return ns >> TIMER_WHEEL_TICK_SHIFT;
+    }
+
+    static constexpr auto ticks_ceil(uint64_t ns) -> uint64_t {
+        return (ns >> TIMER_WHEEL_TICK_SHIFT) + ((ns & ((uint64_t{1} << TIMER_WHEEL_TICK_SHIFT) - 1)) != 0);
+    }
+
+    auto now() const -> uint64_t {
+        return m_Now;
+    }
+
+    // False if `tick` is not in the future, the timer has then not been added. Ticks beyond the range of the wheel
+    // are clamped, the owner has to add such timers again when they expire early
+    auto add(Timer *timer, uint64_t tick) -> bool {
+        assert(!timer->pending());
+        if (tick <= m_Now) {
+            return false;
+        }
+        timer->tick = std::min(tick, m_Now + range - 1);
+        insert(timer);
+        return true;
+    }
+
+    void cancel(Timer *timer) {
+        if (!timer->pending()) {
+            return;
+        }
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev       = nullptr;
+        timer->next       = nullptr;
+        if (m_Slots[timer->level][timer->slot].next == &m_Slots[timer->level][timer->slot]) {
+            m_Occupied[timer->level] &= ~(uint64_t{1} << timer->slot);
+        }
+    }
+
+    // The earliest tick at which `advance` has something to do, `no_tick` if the wheel is empty. Timers are due at
+    // that tick only if it comes from level 0, higher levels merely move down then
+    auto next_tick() const -> uint64_t {
+        uint64_t next = no_tick;
+        for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            if (!m_Occupied[level]) {
+                continue;
+            }
+            const uint32_t shift = 6 * level;
+            const auto position  = m_Now >> shift;
+            const auto rotated   = std::rotr(m_Occupied[level], static_cast<int>(position & 63));
+            // A level 0 timer in the current slot is due now. Above that, the current slot was either handled when
+            // the wheel got here or holds timers a whole revolution ahead
+            const auto candidates   = level == 0 ? rotated : rotated & ~uint64_t{1};
+            const uint64_t distance = candidates ? static_cast<uint64_t>(std::countr_zero(candidates)) : 64;
+            next                    = std::min(next, (position + distance) << shift);
+        }
+        return next;
+    }
+
+    // Moves the wheel to `tick`, calling `expired` with every timer that came due on the way, in order of their tick
+    template <typename Func>
+    void advance(uint64_t tick, Func &&expired) {
+        while (true) {
+            const auto next = next_tick();
+            if (next > tick) {
+                m_Now = std::max(m_Now, tick);
+                return;
+            }
+            m_Now = next;
+
+            // From the top, so a timer due right now drops all the way to level 0 in one go
+            for (uint32_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+                const uint32_t shift = 6 * level;
+                if ((m_Now & ((uint64_t{1} << shift) - 1)) == 0) {
+                    for_each_taken(level, static_cast<uint32_t>((m_Now >> shift) & 63), [&](Timer *timer) {
+                        insert(timer);
+                    });
+                }
+            }
+            for_each_taken(0, static_cast<uint32_t>(m_Now & 63), [&](Timer *timer) {
+                expired(timer);
+            });
+        }
+    }
+
+private:
+    static constexpr uint64_t range = uint64_t{1} << (6 * TIMER_WHEEL_LEVELS);
+
+    void insert(Timer *timer) {
+        const auto distance = timer->tick - m_Now;
+        uint32_t level      = 0;
+        while (level + 1 < TIMER_WHEEL_LEVELS && distance >= (uint64_t{1} << (6 * (level + 1)))) {
+            level++;
+        }
+        timer->level = level;
+        timer->slot  = static_cast<uint32_t>((timer->tick >> (6 * level)) & 63);
+
+        auto &head      = m_Slots[level][timer->slot];
+        timer->prev     = head.prev;
+        timer->next     = &head;
+        head.prev->next = timer;
+        head.prev       = timer;
+        m_Occupied[level] |= uint64_t{1} << timer->slot;
+    }
+
+    // Unlinks every timer of a slot before handing them out, `func` may add them again
+    template <typename Func>
+    void for_each_taken(uint32_t level, uint32_t slot, Func &&func) {
+        auto &head = m_Slots[level][slot];
+        if (head.next == &head) {
+            return;
+        }
+        Timer *timer    = head.next;
+        head.prev->next = nullptr;
+        head.prev       = &head;
+        head.next       = &head;
+        m_Occupied[level] &= ~(uint64_t{1} << slot);
+
+        while (timer) {
+            Timer *next = timer->next;
+            timer->prev = nullptr;
+            timer->next = nullptr;
+            func(timer);
+            timer = next;
+        }
+    }
+
+    uint64_t m_Now = 0;
+    std::array<uint64_t, TIMER_WHEEL_LEVELS> m_Occupied{};
+    std::array<std::array<Timer, 64>, TIMER_WHEEL_LEVELS> m_Slots; // List heads
+};
+
+// Per call state of one poll_oneoff subscription
+struct PollWait {
+    TimerWheel::Timer timer;
+    uint64_t deadline = 0; // Monotonic ns, clock subscriptions only
+    int host_fd       = -1;
+    uint32_t events   = 0; // EPOLLIN or EPOLLOUT, fd subscriptions only
+};
+
+// Per instance epoll set. Registrations are kept from one call to the next, so a guest polling the same fds over and
+// over only pays for the epoll_wait. Fds a call does not arm are removed, since epoll reports hangups and errors even
+// for registrations without events
+class Poller {
+public:
+    Poller() = default;
+
+    ~Poller() {
+        if (m_Epoll >= 0) {
+            ::close(m_Epoll);
+        }
+    }
+
+    Poller(const Poller &)            = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    auto timers() -> TimerWheel & {
+        return m_Timers;
+    }
+
+    // Scratch for poll_oneoff, so a call does not allocate
+    std::vector<PollWait> waits;
+
+    // Starts collecting the fds of one wait
+    void begin() {
+        m_Generation++;
+    }
+
+    // Adds `events` on `host_fd` to the current wait. 0 or -errno, -EPERM meaning the fd is always ready, as regular
+    // files are
+    auto arm(int host_fd, uint32_t events) -> int {
+        if (m_Epoll < 0) {
+            m_Epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            if (m_Epoll < 0) {
+                return -errno;
+            }
+        }
+
+        auto &registration = m_Registered[host_fd];
+        if (registration.generation == m_Generation) {
+            events |= registration.events;
+        }
+        registration.generation = m_Generation;
+        if (registration.events == events && registration.added) {
+            return 0;
+        }
+
+        epoll_event event{};
+        event.events  = events;
+        event.data.fd = host_fd;
+        // The guest may have closed and reused the fd since, which silently drops the old registration
+        int result = ::epoll_ctl(m_Epoll, registration.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, host_fd, &event);
+        if (result < 0 && errno == ENOENT) {
+            result = ::epoll_ctl(m_Epoll, EPOLL_CTL_ADD, host_fd, &event);
+        } else if (result < 0 && errno == EEXIST) {
+            result = ::epoll_ctl(m_Epoll, EPOLL_CTL_MOD, host_fd, &event);
+        }
+        if (result < 0) {
+            const int error = errno;
+            m_Registered.erase(host_fd);
+            return -error;
+        }
+        registration.events = events;
+        registration.added  = true;
+        return 0;
+    }
+
+    // Waits for the fds armed since `begin`, for at most `timeout_ns` or forever if negative. The number of ready fds,
+    // which are then in `ready`, or -errno
+    auto wait(int64_t timeout_ns) -> int {
+        if (m_Epoll < 0) {
+            // Nothing to wait for but time
+            if (timeout_ns > 0) {
+                const timespec ts{timeout_ns / 1000000000, timeout_ns % 1000000000};
+                ::nanosleep(&ts, nullptr);
+            }
+            m_ReadyCount = 0;
+            return 0;
+        }
+
+        // Whatever was armed for an earlier wait must not wake this one. Failing with EBADF or ENOENT just means the
+        // guest closed the fd, which took it out of the set already
+        std::erase_if(m_Registered, [&](const auto &entry) {
+            const auto &[host_fd, registration] = entry;
+            if (registration.generation == m_Generation) {
+                return false;
+            }
+            ::epoll_ctl(m_Epoll, EPOLL_CTL_DEL, host_fd, nullptr);
+            return true;
+        });
+
+        int count;
+        if (timeout_ns < 0) {
+            count = ::epoll_pwait2(m_Epoll, m_Ready.data(), static_cast<int>(m_Ready.size()), nullptr, nullptr);
+        } else {
+            const timespec ts{timeout_ns / 1000000000, timeout_ns % 1000000000};
+            count = ::epoll_pwait2(m_Epoll, m_Ready.data(), static_cast<int>(m_Ready.size()), &ts, nullptr);
+        }
+        if (count < 0 && errno == ENOSYS) {
+            // Before Linux 5.11 the timeout is in whole milliseconds, rounded up so the wait is never cut short
+            const int timeout_ms = timeout_ns < 0 ? -1 : static_cast<int>((timeout_ns + 999999) / 1000000);
+            count = ::epoll_wait(m_Epoll, m_Ready.data(), static_cast<int>(m_Ready.size()), timeout_ms);
+        }
+        m_ReadyCount = std::max(count, 0);
+        return count < 0 ? -errno : count;
+    }
+
+    auto ready() const -> std::span<const epoll_event> {
+        return {m_Ready.data(), static_cast<size_t>(m_ReadyCount)};
+    }
+
+private:
+    struct Registration {
+        uint32_t events     = 0;
+        uint64_t generation = 0;
+        bool added          = false;
+    };
+
+    int m_Epoll           = -1;
+    uint64_t m_Generation = 0;
+    std::unordered_map<int, Registration> m_Registered;
+    std::array<epoll_event, 64> m_Ready{};
+    int m_ReadyCount = 0;
+    TimerWheel m_Timers;
+};
+
+inline auto monotonic_ns() -> uint64_t {
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("TimerWheel") {
+    // Timers spread over every level, advanced in uneven steps: each must expire at the first step that reaches its
+    // tick, and not before
+    tss::TimerWheel wheel;
+    std::vector<tss::TimerWheel::Timer> timers(5000);
+    std::vector<uint64_t> expired_at(timers.size(), 0);
+    uint64_t seed = 42;
+    auto random   = [&]() {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return seed >> 33;
+    };
+
+    for (size_t index = 0; index < timers.size(); index++) {
+        timers[index].user = index;
+        REQUIRE(wheel.add(&timers[index], 1 + (random() % (uint64_t{1} << (6 * (1 + index % 5))))));
+    }
+    tss::TimerWheel::Timer past;
+    REQUIRE(!wheel.add(&past, 0));
+
+    // Cancelling is O(1) and leaves the rest alone
+    for (size_t index = 0; index < timers.size(); index += 7) {
+        wheel.cancel(&timers[index]);
+    }
+
+    uint64_t now = 0;
+    while (wheel.next_tick() != tss::TimerWheel::no_tick) {
+        const auto previous = now;
+        now += 1 + random() % 5000;
+        wheel.advance(now, [&](tss::TimerWheel::Timer *timer) {
+            REQUIRE(timer->tick > previous);
+            REQUIRE(timer->tick <= now);
+            expired_at[timer->user] = now;
+        });
+    }
+    for (size_t index = 0; index < timers.size(); index++) {
+        REQUIRE((expired_at[index] == 0) == (index % 7 == 0));
+    }
+
+    // Far future deadlines are clamped to the range of the wheel
+    tss::TimerWheel::Timer far;
+    REQUIRE(wheel.add(&far, UINT64_MAX));
+    REQUIRE(far.tick < UINT64_MAX);
+    wheel.cancel(&far);
+    REQUIRE(wheel.next_tick() == tss::TimerWheel::no_tick);
+}
+
+TEST_CASE("Poller") {
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    ::close(fds[1]);
+
+    // A pipe whose writer is gone reports a hangup
+    tss::Poller poller;
+    poller.begin();
+    REQUIRE(poller.arm(fds[0], EPOLLIN) == 0);
+    REQUIRE(poller.wait(-1) == 1);
+    REQUIRE(poller.ready()[0].events & EPOLLHUP);
+
+    // A later wait for time alone sleeps through it instead of waking up again right away. Signals from other tests
+    // may cut a wait short, as in poll_oneoff that just means waiting for the rest
+    poller.begin();
+    const auto begin = tss::monotonic_ns();
+    const auto end   = begin + 20000000;
+    int waited;
+    do {
+        const auto now = tss::monotonic_ns();
+        waited         = poller.wait(now < end ? static_cast<int64_t>(end - now) : 0);
+    } while (waited == -EINTR);
+    REQUIRE(waited == 0);
+    REQUIRE(tss::monotonic_ns() - begin >= 20000000);
+
+    // And the fd can be armed again
+    poller.begin();
+    REQUIRE(poller.arm(fds[0], EPOLLIN) == 0);
+    REQUIRE(poller.wait(0) == 1);
+    ::close(fds[0]);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("poller: timer wheel") {
+    tss::TimerWheel wheel;
+    std::vector<tss::TimerWheel::Timer> timers(100000);
+    uint64_t seed = 1;
+    auto random   = [&]() {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return seed >> 33;
+    };
+
+    // Sleeps between 1 ms and 10 s, like a guest with many tasks
+    std::vector<uint64_t> ticks(timers.size());
+    for (auto &tick : ticks) {
+        tick = tss::TimerWheel::ticks_ceil(1000000 + random() % 10000000000ULL);
+    }
+
+    size_t index = 0;
+    tss::bench::report("add, 100k pending",
+                       tss::bench::ns_per_op(timers.size(),
+                                             [&]() {
+                                                 wheel.add(&timers[index], ticks[index]);
+                                                 index++;
+                                             }),
+                       "ns");
+    index = 0;
+    tss::bench::report("cancel, 100k pending",
+                       tss::bench::ns_per_op(timers.size(), [&]() { wheel.cancel(&timers[index++]); }),
+                       "ns");
+
+    for (index = 0; index < timers.size(); index++) {
+        wheel.add(&timers[index], ticks[index]);
+    }
+    size_t expired   = 0;
+    const auto start = tss::bench::now_ns();
+    wheel.advance(tss::TimerWheel::ticks_ceil(10001000000ULL), [&](tss::TimerWheel::Timer *) { expired++; });
+    const auto elapsed = static_cast<double>(tss::bench::now_ns() - start);
+    tss::bench::report("advance over 10 s, per expired timer", elapsed / static_cast<double>(expired), "ns");
+}
+#endif
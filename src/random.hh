@@ -0,0 +1,215 @@
+#pragma once
+
+#include "inc.hh"
+
+#include <sys/random.h>
+
+// random_get. Every instance has its own ChaCha20 generator, keyed once from the kernel or from a fixed seed, so the
+// guest never waits on a syscall for randomness and a seeded instance produces the same bytes on every run. Keystream
+// is generated `RANDOM_BUFFER_BLOCKS` blocks at a time, and the last 32 bytes of every such chunk replace the key, so
+// earlier output cannot be reconstructed from the generator's state. Small requests are served from a buffered chunk,
+// while large ones have whole chunks generated straight into guest memory, each next chunk overwriting the key bytes of
+// the one before. Either way the output is the same stream, however the guest splits it into calls
+
+namespace tss {
+
+#define RANDOM_BUFFER_BLOCKS 64 // 4 KiB of keystream per refill
+
+typedef uint32_t chacha_lanes_t __attribute__((vector_size(16)));
+
+inline auto chacha_rotl(chacha_lanes_t value, int bits) -> chacha_lanes_t {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+inline void chacha_quarter_round(chacha_lanes_t &a, chacha_lanes_t &b, chacha_lanes_t &c, chacha_lanes_t &d) {
+    a += b, d = chacha_rotl(d ^ a, 16);
+    c += d, b = chacha_rotl(b ^ c, 12);
+    a += b, d = chacha_rotl(d ^ a, 8);
+    c += d, b = chacha_rotl(b ^ c, 7);
+}
+
+// Four consecutive ChaCha20 blocks, starting at block `counter`, one block per vector lane. The state layout is the
+// original one with a 64 bit counter in words 12 and 13 and a 64 bit nonce in words 14 and 15
+inline void chacha20_blocks4(const uint32_t key[8], uint64_t counter, uint64_t nonce, uint8_t out[256]) {
+    static constexpr uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+    chacha_lanes_t state[16];
+    for (int word = 0; word < 4; word++) {
+        state[word] = chacha_lanes_t{} + sigma[word];
+    }
+    for (int word = 0; word < 8; word++) {
+        state[4 + word] = chacha_lanes_t{} + key[word];
+    }
+    for (uint32_t lane = 0; lane < 4; lane++) {
+        state[12][lane] = static_cast<uint32_t>(counter + lane);
+        state[13][lane] = static_cast<uint32_t>((counter + lane) >> 32);
+    }
+    state[14] = chacha_lanes_t{} + static_cast<uint32_t>(nonce);
+    state[15] = chacha_lanes_t{} + static_cast<uint32_t>(nonce >> 32);
+
+    chacha_lanes_t x[16];
+    std::memcpy(x, state, sizeof(x));
+    for (int round = 0; round < 10; round++) {
+        chacha_quarter_round(x[0], x[4], x[8], x[12]);
+        chacha_quarter_round(x[1], x[5], x[9], x[13]);
+        chacha_quarter_round(x[2], x[6], x[10], x[14]);
+        chacha_quarter_round(x[3], x[7], x[11], x[15]);
+        chacha_quarter_round(x[0], x[5], x[10], x[15]);
+        chacha_quarter_round(x[1], x[6], x[11], x[12]);
+        chacha_quarter_round(x[2], x[7], x[8], x[13]);
+        chacha_quarter_round(x[3], x[4], x[9], x[14]);
+    }
+
+    // Words are little endian on every host this runs on, so a block is its words in order
+    uint32_t words[4][16];
+    for (int word = 0; word < 16; word++) {
+        const auto sum = x[word] + state[word];
+        for (int lane = 0; lane < 4; lane++) {
+            words[lane][word] = sum[lane];
+        }
+    }
+    std::memcpy(out, words, sizeof(words));
+}
+
+class WasiRandom {
+public:
+    static constexpr size_t buffer_size = RANDOM_BUFFER_BLOCKS * 64;
+
+    // Keys the generator from `seed` instead of the kernel, the output is then the same on every run
+    void seed(uint64_t seed) {
+        std::memset(m_Key, 0, sizeof(m_Key));
+        m_Key[0] = static_cast<uint32_t>(seed);
+        m_Key[1] = static_cast<uint32_t>(seed >> 32);
+        reset();
+    }
+
+    // False if the kernel had no entropy to give
+    auto seed_from_host() -> bool {
+        if (::getrandom(m_Key, sizeof(m_Key), 0) != static_cast<ssize_t>(sizeof(m_Key))) {
+            return false;
+        }
+        reset();
+        return true;
+    }
+
+    auto fill(std::span<uint8_t> out) -> bool {
+        if (!m_Keyed && !seed_from_host()) {
+            return false;
+        }
+
+        while (!out.empty()) {
+            if (m_Used == output_size) {
+                if (out.size() >= buffer_size) {
+                    generate(out.first(buffer_size));
+                    rekey(&out[output_size]);
+                    out = out.subspan(output_size);
+                    continue;
+                }
+                refill();
+            }
+            const auto count = std::min(out.size(), output_size - m_Used);
+            std::memcpy(out.data(), &m_Buffer[m_Used], count);
+            std::memset(&m_Buffer[m_Used], 0, count); // Handed out bytes do not stay behind in the host's memory
+            m_Used += count;
+            out = out.subspan(count);
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t output_size = buffer_size - 32;
+
+    void reset() {
+        m_Counter = 0;
+        m_Used    = output_size;
+        m_Keyed   = true;
+    }
+
+    // `out` must be a multiple of four blocks
+    void generate(std::span<uint8_t> out) {
+        for (size_t offset = 0; offset < out.size(); offset += 256) {
+            chacha20_blocks4(m_Key, m_Counter, 0, &out[offset]);
+            m_Counter += 4;
+        }
+    }
+
+    void rekey(const uint8_t *key) {
+        std::memcpy(m_Key, key, sizeof(m_Key));
+        m_Counter = 0;
+    }
+
+    void refill() {
+        generate(m_Buffer);
+        rekey(&m_Buffer[output_size]);
+        std::memset(&m_Buffer[output_size], 0, sizeof(m_Key));
+        m_Used = 0;
+    }
+
+    uint32_t m_Key[8]  = {};
+    uint64_t m_Counter = 0;
+    bool m_Keyed       = false;
+    size_t m_Used      = output_size;
+    std::array<uint8_t, buffer_size> m_Buffer{};
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("WasiRandom") {
+    // RFC 8439, 2.3.2: its 32 bit counter and 96 bit nonce map onto the 64 bit counter and nonce words
+    uint32_t key[8];
+    for (uint32_t word = 0; word < 8; word++) {
+        key[word] = (4 * word) | (4 * word + 1) << 8 | (4 * word + 2) << 16 | (4 * word + 3) << 24;
+    }
+    uint8_t blocks[256];
+    tss::chacha20_blocks4(key, 1 | uint64_t{0x09000000} << 32, 0x4a000000, blocks);
+    const uint8_t expected[16] = {
+        0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4};
+    REQUIRE(std::memcmp(blocks, expected, sizeof(expected)) == 0);
+
+    // Seeded generators agree no matter how the output is split into calls, including calls bigger than the buffer
+    tss::WasiRandom lhs, rhs;
+    lhs.seed(42);
+    rhs.seed(42);
+    std::vector<uint8_t> whole(3 * tss::WasiRandom::buffer_size), split(whole.size());
+    REQUIRE(lhs.fill(whole));
+    size_t offset = 0;
+    for (size_t size : {size_t{1}, size_t{31}, size_t{4096}, size_t{100}}) {
+        REQUIRE(rhs.fill(std::span(split).subspan(offset, size)));
+        offset += size;
+    }
+    REQUIRE(rhs.fill(std::span(split).subspan(offset)));
+    REQUIRE(whole == split);
+
+    tss::WasiRandom other;
+    other.seed(43);
+    std::vector<uint8_t> different(64);
+    REQUIRE(other.fill(different));
+    REQUIRE(std::memcmp(different.data(), whole.data(), different.size()) != 0);
+
+    // Unseeded generators key themselves from the kernel
+    tss::WasiRandom host;
+    std::vector<uint8_t> first(32), second(32);
+    REQUIRE(host.fill(first));
+    REQUIRE(host.fill(second));
+    REQUIRE(first != second);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("random: random_get throughput") {
+    tss::WasiRandom random;
+    std::vector<uint8_t> buffer(65536);
+    for (size_t size : {size_t{16}, size_t{256}, size_t{65536}}) {
+        const size_t iterations = 256 * 1024 * 1024 / (size + 4096);
+        const auto out          = std::span(buffer).first(size);
+        const double host_ns    = tss::bench::ns_per_op(iterations, [&] {
+            tss::bench::do_not_optimize(::getrandom(out.data(), out.size(), 0));
+        });
+        const double chacha_ns  = tss::bench::ns_per_op(iterations, [&] {
+            tss::bench::do_not_optimize(random.fill(out));
+        });
+        tss::bench::report(fmt::format("getrandom, {} B", size), static_cast<double>(size) / host_ns, "GB/s");
+        tss::bench::report(fmt::format("chacha20, {} B", size), static_cast<double>(size) / chacha_ns, "GB/s");
+    }
+}
+#endif
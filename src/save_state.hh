@@ -0,0 +1,775 @@
+#pragma once
+
+#include "inc.hh"
+
+// Incremental save-states of a guest, for autosaves and rollback. A chain is an append-only file of records, each
+// holding the mutable exported globals and only those pages of linear memory that were written since the record before
+// it, so saving costs in proportion to what the guest touched rather than to the size of its heap. Any record can be
+// rebuilt by taking every page from the newest record at or before it that has the page, and rolling a live instance
+// back only rewrites pages that changed since.
+//
+// Written pages are found with the kernel's soft-dirty bits: writing 4 to /proc/self/clear_refs clears them for the
+// whole process, and bit 55 of a page's /proc/self/pagemap entry is set again once the page is written. Clearing is
+// process wide, so every tracker folds the bits of its own range into a pending set whenever another one clears.
+// Clearing also write-protects every resident page of the process, the host's and the other instances' included, so
+// each save costs time in proportion to the resident set of the whole process and makes the next write to any of those
+// pages fault once. That is cheap next to copying the memory for a few guests in a small host, but a host with a large
+// heap of its own should measure it against page hashes, see the "unrelated resident memory" benchmark.
+// Because the other trackers' bits are folded in before the clear, a page written in between is lost to its tracker,
+// and its next save leaves it out. No instance tracked with soft-dirty bits may therefore run while any chain saves,
+// for example a `GuestScheduler` host has to save between ticks rather than from within a guest call of one.
+// Kernels without soft-dirty support fall back to hashing every page and comparing with the hashes of the last save,
+// which reads the whole memory but still only stores what changed
+
+namespace tss {
+
+#define SAVE_STATE_VERSION 1U
+
+inline constexpr char save_state_magic[8] = {'Q', 'O', 'S', 'T', 'S', 'A', 'V', '\0'};
+
+struct SaveStateHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t memory_size;
+    uint32_t page_count; // Stored in this record
+    uint32_t global_count;
+};
+
+struct SaveStateGlobal {
+    uint8_t kind; // wasm_valkind_t, only numbers
+    uint8_t reserved[7];
+    uint64_t bits;
+};
+
+static_assert(sizeof(SaveStateHeader) == 32, "save-state header layout changed, bump SAVE_STATE_VERSION");
+static_assert(sizeof(SaveStateGlobal) == 16, "save-state global layout changed, bump SAVE_STATE_VERSION");
+
+enum class DirtyTracking {
+    soft_dirty, // Soft-dirty bits from /proc/self/pagemap
+    page_hash,  // Compare a hash of every page with the previous one
+};
+
+// Clears the soft-dirty bits of the whole process, walking and write-protecting all of its resident pages
+inline auto soft_dirty_clear() -> bool {
+    int fd = ::open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool cleared = ::write(fd, "4", 1) == 1;
+    ::close(fd);
+    return cleared;
+}
+
+inline auto soft_dirty_bit(int pagemap, const void *address) -> bool {
+    const auto page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    uint64_t entry       = 0;
+    const auto offset    = static_cast<off_t>(reinterpret_cast<uintptr_t>(address) / page_size * sizeof(entry));
+    return ::pread(pagemap, &entry, sizeof(entry), offset) == sizeof(entry) && (entry >> 55 & 1);
+}
+
+// Whether the kernel keeps soft-dirty bits, found out once by clearing and writing a page of our own
+inline auto soft_dirty_available() -> bool {
+    static const bool available = [] {
+        const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        void *page = ::mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        int pagemap = ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        bool works  = false;
+        if (page != MAP_FAILED && pagemap >= 0) {
+            static_cast<volatile uint8_t *>(page)[0] = 1;
+            if (soft_dirty_clear() && !soft_dirty_bit(pagemap, page)) {
+                static_cast<volatile uint8_t *>(page)[0] = 2;
+                works = soft_dirty_bit(pagemap, page);
+            }
+        }
+        if (pagemap >= 0) {
+            ::close(pagemap);
+        }
+        if (page != MAP_FAILED) {
+            ::munmap(page, page_size);
+        }
+        return works;
+    }();
+    return available;
+}
+
+class DirtyTracker {
+public:
+    // Falls back to page hashes if soft-dirty bits are asked for but not available
+    static auto create(DirtyTracking mode) -> std::unique_ptr<DirtyTracker> {
+        std::unique_ptr<DirtyTracker> self(new DirtyTracker());
+        self->m_PageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        if (mode == DirtyTracking::soft_dirty && soft_dirty_available()) {
+            self->m_Pagemap = ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        }
+        self->m_Mode = self->m_Pagemap >= 0 ? DirtyTracking::soft_dirty : DirtyTracking::page_hash;
+        if (self->m_Mode == DirtyTracking::soft_dirty) {
+            std::lock_guard lock(registry().mutex);
+            registry().trackers.push_back(self.get());
+        }
+        return self;
+    }
+
+    ~DirtyTracker() {
+        if (m_Pagemap >= 0) {
+            std::lock_guard lock(registry().mutex);
+            std::erase(registry().trackers, this);
+            ::close(m_Pagemap);
+        }
+    }
+
+    DirtyTracker(const DirtyTracker &)            = delete;
+    DirtyTracker &operator=(const DirtyTracker &) = delete;
+
+    auto mode() const -> DirtyTracking {
+        return m_Mode;
+    }
+
+    auto page_size() const -> size_t {
+        return m_PageSize;
+    }
+
+    // Indices of the pages of `memory` written since the previous call, in order, and starts tracking anew. Every page
+    // counts as written on the first call, and whenever the memory has moved. With soft-dirty bits, no other tracked
+    // memory may be written during the call, see the top of this file
+    auto collect(std::span<const uint8_t> memory) -> std::vector<uint32_t> {
+        const auto pages = static_cast<uint32_t>((memory.size() + m_PageSize - 1) / m_PageSize);
+        std::vector<uint32_t> dirty;
+        const bool moved = memory.data() != m_Base;
+
+        if (m_Mode == DirtyTracking::page_hash) {
+            m_Hashes.resize(pages, 0);
+            for (uint32_t page = 0; page < pages; page++) {
+                const auto offset = page * m_PageSize;
+                const auto hash   = content_hash(&memory[offset], std::min(m_PageSize, memory.size() - offset));
+                if (moved || hash != m_Hashes[page]) {
+                    dirty.push_back(page);
+                    m_Hashes[page] = hash;
+                }
+            }
+            m_Base = memory.data();
+            return dirty;
+        }
+
+        std::lock_guard lock(registry().mutex);
+        if (!moved) {
+            m_Base  = memory.data();
+            m_Pages = pages;
+            fold();
+        }
+        for (uint32_t page = 0; page < pages; page++) {
+            if (moved || (page < m_Pending.size() && m_Pending[page])) {
+                dirty.push_back(page);
+            }
+        }
+        m_Base  = memory.data();
+        m_Pages = pages;
+        m_Pending.assign(pages, false);
+
+        for (auto tracker : registry().trackers) {
+            if (tracker != this) {
+                tracker->fold();
+            }
+        }
+        soft_dirty_clear();
+        return dirty;
+    }
+
+private:
+    struct Registry {
+        std::mutex mutex;
+        std::vector<DirtyTracker *> trackers;
+    };
+
+    static auto registry() -> Registry & {
+        static Registry registry;
+        return registry;
+    }
+
+    DirtyTracker() = default;
+
+    // Adds the soft-dirty bits of the tracked range to the pending set, called with the registry locked
+    void fold() {
+        if (!m_Base) {
+            return;
+        }
+        m_Pending.resize(m_Pages, false);
+        const auto first = reinterpret_cast<uintptr_t>(m_Base) / m_PageSize;
+        m_Entries.resize(std::min<size_t>(m_Pages, 65536));
+        for (size_t page = 0; page < m_Pages; page += m_Entries.size()) {
+            const auto count  = std::min(m_Entries.size(), m_Pages - page);
+            const auto bytes  = count * sizeof(uint64_t);
+            const auto offset = static_cast<off_t>((first + page) * sizeof(uint64_t));
+            if (::pread(m_Pagemap, m_Entries.data(), bytes, offset) != static_cast<ssize_t>(bytes)) {
+                // Without the bits nothing can be ruled out
+                std::fill(m_Pending.begin() + static_cast<ptrdiff_t>(page), m_Pending.end(), true);
+                return;
+            }
+            for (size_t index = 0; index < count; index++) {
+                if (m_Entries[index] >> 55 & 1) {
+                    m_Pending[page + index] = true;
+                }
+            }
+        }
+    }
+
+    DirtyTracking m_Mode  = DirtyTracking::page_hash;
+    size_t m_PageSize     = 4096;
+    const uint8_t *m_Base = nullptr; // Of the memory at the last collect
+    size_t m_Pages        = 0;
+    int m_Pagemap         = -1;
+    std::vector<bool> m_Pending;    // Soft-dirty bits saved from before another tracker cleared them
+    std::vector<uint64_t> m_Entries; // Scratch for pagemap reads
+    std::vector<uint64_t> m_Hashes;
+};
+
+class SaveStateChain {
+public:
+    // Starts a new chain in `path`, replacing whatever was there
+    static auto create(const std::filesystem::path &path, DirtyTracking tracking) -> std::unique_ptr<SaveStateChain> {
+        std::unique_ptr<SaveStateChain> self(new SaveStateChain());
+        self->m_Fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (self->m_Fd < 0) {
+            fmt::print(stderr, "Save-state: {}: {}\n", path.string(), std::strerror(errno));
+            return nullptr;
+        }
+        self->m_Tracker = DirtyTracker::create(tracking);
+        return self;
+    }
+
+    // Opens an existing chain, further saves are appended to it. A record cut short, by a crash while saving, is
+    // dropped along with anything after it
+    static auto open(const std::filesystem::path &path, DirtyTracking tracking) -> std::unique_ptr<SaveStateChain> {
+        std::unique_ptr<SaveStateChain> self(new SaveStateChain());
+        self->m_Fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (self->m_Fd < 0) {
+            fmt::print(stderr, "Save-state: {}: {}\n", path.string(), std::strerror(errno));
+            return nullptr;
+        }
+        self->m_Tracker = DirtyTracker::create(tracking);
+        self->load();
+        return self;
+    }
+
+    ~SaveStateChain() {
+        if (m_Fd >= 0) {
+            ::close(m_Fd);
+        }
+    }
+
+    SaveStateChain(const SaveStateChain &)            = delete;
+    SaveStateChain &operator=(const SaveStateChain &) = delete;
+
+    // Number of save-states in the chain
+    auto size() const -> size_t {
+        return m_Records.size();
+    }
+
+    auto tracking() const -> DirtyTracking {
+        return m_Tracker->mode();
+    }
+
+    // Pages stored by save-state `index`
+    auto stored_pages(size_t index) const -> size_t {
+        return m_Records[index].pages.size();
+    }
+
+    // Appends a save-state of `memory` and `globals`. Nullopt if it could not be written
+    auto save(std::span<const uint8_t> memory, std::span<const wasm_val_t> globals) -> std::optional<size_t> {
+        auto dirty = m_Tracker->collect(memory);
+        if (!m_Forced.empty()) {
+            for (auto page : dirty) {
+                m_Forced.insert(page);
+            }
+            dirty.assign(m_Forced.begin(), m_Forced.end());
+            std::erase_if(dirty, [&](uint32_t page) { return page * page_size() >= memory.size(); });
+            m_Forced.clear();
+        }
+
+        SaveStateHeader header{};
+        std::memcpy(header.magic, save_state_magic, sizeof(header.magic));
+        header.version      = SAVE_STATE_VERSION;
+        header.page_size    = static_cast<uint32_t>(page_size());
+        header.memory_size  = memory.size();
+        header.page_count   = static_cast<uint32_t>(dirty.size());
+        header.global_count = static_cast<uint32_t>(globals.size());
+
+        std::vector<uint8_t> index(sizeof(header) + globals.size() * sizeof(SaveStateGlobal) +
+                                   dirty.size() * sizeof(uint32_t));
+        std::memcpy(index.data(), &header, sizeof(header));
+        auto cursor = index.data() + sizeof(header);
+        for (const auto &global : globals) {
+            const SaveStateGlobal stored{global.kind, {}, snapshot_value_bits(global)};
+            std::memcpy(cursor, &stored, sizeof(stored));
+            cursor += sizeof(stored);
+        }
+        std::memcpy(cursor, dirty.data(), dirty.size() * sizeof(uint32_t));
+
+        Record record{};
+        record.memory_size = memory.size();
+        record.data_offset = align(m_End + index.size());
+        record.pages       = std::move(dirty);
+        for (const auto &global : globals) {
+            record.globals.push_back(global);
+        }
+
+        std::vector<iovec> iovs{{index.data(), index.size()}};
+        static const uint8_t padding[4096] = {};
+        iovs.push_back({const_cast<uint8_t *>(padding), record.data_offset - m_End - index.size()});
+        std::vector<uint8_t> tail(page_size(), 0);
+        for (auto page : record.pages) {
+            const auto offset = page * page_size();
+            const auto size   = std::min(page_size(), memory.size() - offset);
+            if (size < page_size()) {
+                // Only the last page of an odd sized memory, stored padded out to a whole page
+                std::memcpy(tail.data(), &memory[offset], size);
+                iovs.push_back({tail.data(), page_size()});
+            } else {
+                iovs.push_back({const_cast<uint8_t *>(&memory[offset]), size});
+            }
+        }
+        if (!write_all(iovs, m_End)) {
+            fmt::print(stderr, "Save-state: could not write: {}\n", std::strerror(errno));
+            // The tracker has started over, so the pages are only remembered here for the next save
+            m_Forced.insert(record.pages.begin(), record.pages.end());
+            return std::nullopt;
+        }
+
+        const auto number = static_cast<uint32_t>(m_Records.size());
+        for (uint32_t slot = 0; slot < record.pages.size(); slot++) {
+            add_version(record.pages[slot], {number, slot});
+        }
+        m_End = record.data_offset + record.pages.size() * page_size();
+        m_Records.push_back(std::move(record));
+        return m_Records.size() - 1;
+    }
+
+    // The memory and globals of save-state `index`, rebuilt from the whole chain
+    auto rebuild(size_t index, std::vector<uint8_t> *memory, std::vector<wasm_val_t> *globals) const -> bool {
+        const auto &record = m_Records[index];
+        memory->assign(record.memory_size, 0);
+        for (uint32_t page = 0; page * page_size() < record.memory_size; page++) {
+            if (!read_page(page, index, *memory)) {
+                return false;
+            }
+        }
+        *globals = record.globals;
+        return true;
+    }
+
+    // Rolls `memory`, which tracking has followed since the last save, back to save-state `index`. Only pages written
+    // since that save-state are rewritten. `memory` must be at least as large as it was then, anything beyond that is
+    // zeroed if it was written
+    auto rollback(size_t index, std::span<uint8_t> memory, std::vector<wasm_val_t> *globals) -> bool {
+        const auto &record = m_Records[index];
+        if (memory.size() < record.memory_size) {
+            return false;
+        }
+
+        auto changed = m_Tracker->collect(memory);
+        for (auto page : changed) {
+            m_Forced.insert(page);
+        }
+        for (size_t later = index + 1; later < m_Records.size(); later++) {
+            for (auto page : m_Records[later].pages) {
+                m_Forced.insert(page);
+            }
+        }
+        for (auto page : m_Forced) {
+            if (page * page_size() < memory.size() && !read_page(page, index, memory)) {
+                return false;
+            }
+        }
+        // The rewritten pages differ from the newest save-state, so the next save has to store them whatever tracking
+        // finds, and the writes made here must not be mistaken for the guest's
+        m_Tracker->collect(memory);
+        *globals = record.globals;
+        return true;
+    }
+
+private:
+    struct PageVersion {
+        uint32_t record;
+        uint32_t slot; // Position of the page within the record
+    };
+
+    struct Record {
+        uint64_t memory_size = 0;
+        uint64_t data_offset = 0; // Of the first page in the file
+        std::vector<uint32_t> pages;
+        std::vector<wasm_val_t> globals;
+    };
+
+    SaveStateChain() = default;
+
+    auto page_size() const -> size_t {
+        return m_Tracker->page_size();
+    }
+
+    auto align(uint64_t offset) const -> uint64_t {
+        return (offset + page_size() - 1) / page_size() * page_size();
+    }
+
+    void add_version(uint32_t page, PageVersion version) {
+        if (m_Versions.size() <= page) {
+            m_Versions.resize(page + 1);
+        }
+        m_Versions[page].push_back(version);
+    }
+
+    // Copies `page` as it was at save-state `index` into `memory`, zeroes if no record up to it has the page
+    auto read_page(uint32_t page, size_t index, std::span<uint8_t> memory) const -> bool {
+        const auto offset = page * page_size();
+        const auto size   = std::min(page_size(), memory.size() - offset);
+        if (page < m_Versions.size() && m_Records[index].memory_size > offset) {
+            const auto &versions = m_Versions[page];
+            auto newer           = std::upper_bound(
+                versions.begin(), versions.end(), index, [](size_t value, const PageVersion &version) {
+                    return value < version.record;
+                });
+            if (newer != versions.begin()) {
+                const auto &version = *std::prev(newer);
+                const auto at = m_Records[version.record].data_offset + uint64_t{version.slot} * page_size();
+                return ::pread(m_Fd, &memory[offset], size, static_cast<off_t>(at)) == static_cast<ssize_t>(size);
+            }
+        }
+        std::memset(&memory[offset], 0, size);
+        return true;
+    }
+
+    auto write_all(std::vector<iovec> &iovs, uint64_t offset) const -> bool {
+        size_t first = 0;
+        while (first < iovs.size()) {
+            const auto count   = static_cast<int>(std::min<size_t>(iovs.size() - first, IOV_MAX));
+            const auto written = ::pwritev(m_Fd, &iovs[first], count, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            offset += static_cast<uint64_t>(written);
+            // Skip what was written, which may end within an iovec
+            auto remaining = static_cast<size_t>(written);
+            while (first < iovs.size() && remaining >= iovs[first].iov_len) {
+                remaining -= iovs[first].iov_len;
+                first++;
+            }
+            if (first < iovs.size()) {
+                iovs[first].iov_base = static_cast<uint8_t *>(iovs[first].iov_base) + remaining;
+                iovs[first].iov_len -= remaining;
+            }
+        }
+        return true;
+    }
+
+    // Reads the records of an existing file
+    void load() {
+        struct stat st;
+        if (::fstat(m_Fd, &st) < 0) {
+            return;
+        }
+        const auto file_size = static_cast<uint64_t>(st.st_size);
+
+        while (m_End + sizeof(SaveStateHeader) <= file_size) {
+            SaveStateHeader header{};
+            if (::pread(m_Fd, &header, sizeof(header), static_cast<off_t>(m_End)) != sizeof(header) ||
+                std::memcmp(header.magic, save_state_magic, sizeof(header.magic)) != 0 ||
+                header.version != SAVE_STATE_VERSION || header.page_size != page_size()) {
+                break;
+            }
+
+            const auto index_size =
+                header.global_count * sizeof(SaveStateGlobal) + header.page_count * sizeof(uint32_t);
+            Record record{};
+            record.memory_size = header.memory_size;
+            record.data_offset = align(m_End + sizeof(header) + index_size);
+            const auto end     = record.data_offset + uint64_t{header.page_count} * page_size();
+            if (end > file_size) {
+                break;
+            }
+
+            std::vector<uint8_t> index(index_size);
+            if (::pread(m_Fd, index.data(), index_size, static_cast<off_t>(m_End + sizeof(header))) !=
+                static_cast<ssize_t>(index_size)) {
+                break;
+            }
+            auto cursor = index.data();
+            for (uint32_t global = 0; global < header.global_count; global++) {
+                SaveStateGlobal stored;
+                std::memcpy(&stored, cursor, sizeof(stored));
+                record.globals.push_back(snapshot_value_from_bits(stored.kind, stored.bits));
+                cursor += sizeof(stored);
+            }
+            record.pages.resize(header.page_count);
+            std::memcpy(record.pages.data(), cursor, header.page_count * sizeof(uint32_t));
+            if (std::ranges::any_of(record.pages, [&](uint32_t page) {
+                    return page * page_size() >= record.memory_size;
+                })) {
+                break;
+            }
+
+            const auto number = static_cast<uint32_t>(m_Records.size());
+            for (uint32_t slot = 0; slot < record.pages.size(); slot++) {
+                add_version(record.pages[slot], {number, slot});
+            }
+            m_Records.push_back(std::move(record));
+            m_End = end;
+        }
+
+        if (m_End < file_size) {
+            fmt::print(stderr,
+                       "Save-state: dropping {} bytes after save-state {}\n",
+                       file_size - m_End,
+                       m_Records.size());
+            if (::ftruncate(m_Fd, static_cast<off_t>(m_End)) < 0) {
+                fmt::print(stderr, "Save-state: could not truncate: {}\n", std::strerror(errno));
+            }
+        }
+    }
+
+    int m_Fd       = -1;
+    uint64_t m_End = 0; // Where the next record goes
+    std::unique_ptr<DirtyTracker> m_Tracker;
+    std::vector<Record> m_Records;
+    std::vector<std::vector<PageVersion>> m_Versions; // Records holding each page, oldest first
+    std::set<uint32_t> m_Forced;                      // Pages the next save stores no matter what
+};
+
+// Values of the globals `snapshot_exported_globals` finds, in the same order
+inline auto save_state_globals(WasiInstance &instance) -> std::vector<wasm_val_t> {
+    std::vector<wasm_val_t> values;
+    for (auto &[name, value] : snapshot_exported_globals(instance)) {
+        values.push_back(value);
+    }
+    return values;
+}
+
+inline auto save_state_memory(WasiInstance &instance) -> std::span<uint8_t> {
+    auto memory = instance.env().memory;
+    if (!memory) {
+        return {};
+    }
+    return {reinterpret_cast<uint8_t *>(::wasm_memory_data(memory)), ::wasm_memory_data_size(memory)};
+}
+
+// Appends a save-state of `instance` to `chain`, whose tracking must have followed the instance since its last save
+inline auto save_state_save(SaveStateChain &chain, WasiInstance &instance) -> std::optional<size_t> {
+    return chain.save(save_state_memory(instance), save_state_globals(instance));
+}
+
+// Puts `instance` back to save-state `index` of `chain`
+inline auto save_state_rollback(SaveStateChain &chain, WasiInstance &instance, size_t index) -> bool {
+    std::vector<wasm_val_t> values;
+    if (!chain.rollback(index, save_state_memory(instance), &values)) {
+        fmt::print(stderr, "Save-state: could not roll back to {}\n", index);
+        return false;
+    }
+    const auto globals = snapshot_exported_globals(instance);
+    for (size_t global = 0; global < globals.size() && global < values.size(); global++) {
+        ::wasm_global_set(::wasm_extern_as_global(instance.export_by_name(globals[global].first)), &values[global]);
+    }
+    return true;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("SaveStateChain") {
+    namespace fs = std::filesystem;
+
+    for (auto tracking : {tss::DirtyTracking::soft_dirty, tss::DirtyTracking::page_hash}) {
+        const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        const auto path      = fs::temp_directory_path() / fmt::format("qost-save-state-{}", ::getpid());
+
+        // Page aligned, so soft-dirty bits of neighbouring heap allocations do not matter
+        const size_t pages = 64;
+        auto mapping = static_cast<uint8_t *>(
+            ::mmap(nullptr, pages * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        REQUIRE(mapping != MAP_FAILED);
+        std::span<uint8_t> memory(mapping, pages * page_size);
+        for (size_t page = 0; page < pages; page++) {
+            memory[page * page_size] = static_cast<uint8_t>(page);
+        }
+
+        auto chain = tss::SaveStateChain::create(path, tracking);
+        REQUIRE(chain);
+        const wasm_val_t first_globals[1] = {WASM_I32_VAL(1)};
+        REQUIRE(chain->save(memory, first_globals) == 0);
+        REQUIRE(chain->stored_pages(0) == pages);
+
+        // Only what was written since goes into the next save-state
+        memory[3 * page_size + 1]  = 0xaa;
+        memory[40 * page_size + 7] = 0xbb;
+        const wasm_val_t second_globals[1] = {WASM_I32_VAL(2)};
+        REQUIRE(chain->save(memory, second_globals) == 1);
+        REQUIRE(chain->stored_pages(1) == 2);
+
+        memory[3 * page_size + 1] = 0xcc;
+        memory[9 * page_size]     = 0xdd;
+        const std::vector<uint8_t> third(memory.begin(), memory.end());
+
+        // Rolling back rewrites the pages written since, and the next save stores them
+        std::vector<wasm_val_t> globals;
+        REQUIRE(chain->rollback(0, memory, &globals));
+        REQUIRE(globals[0].of.i32 == 1);
+        REQUIRE(memory[3 * page_size + 1] == 0);
+        REQUIRE(memory[40 * page_size + 7] == 0);
+        REQUIRE(memory[9 * page_size] == 9);
+        REQUIRE(chain->save(memory, first_globals) == 2);
+        REQUIRE(chain->stored_pages(2) == 3);
+
+        // Every save-state can be rebuilt, also from the file alone
+        std::copy(third.begin(), third.end(), memory.begin());
+        REQUIRE(chain->save(memory, second_globals) == 3);
+        chain.reset();
+        auto reopened = tss::SaveStateChain::open(path, tracking);
+        REQUIRE(reopened->size() == 4);
+        std::vector<uint8_t> rebuilt;
+        REQUIRE(reopened->rebuild(1, &rebuilt, &globals));
+        REQUIRE(globals[0].of.i32 == 2);
+        REQUIRE(rebuilt[3 * page_size + 1] == 0xaa);
+        REQUIRE(rebuilt[40 * page_size + 7] == 0xbb);
+        REQUIRE(rebuilt[9 * page_size] == 9);
+        REQUIRE(reopened->rebuild(3, &rebuilt, &globals));
+        REQUIRE(rebuilt == third);
+
+        // A torn last record is dropped
+        reopened.reset();
+        fs::resize_file(path, fs::file_size(path) - 1);
+        reopened = tss::SaveStateChain::open(path, tracking);
+        REQUIRE(reopened->size() == 3);
+
+        // The pages of a save that could not be written go into the next one, here the file may not grow any further
+        REQUIRE(reopened->save(memory, first_globals) == 3);
+        memory[5 * page_size] = 0x55;
+        struct sigaction ignore{};
+        struct sigaction previous{};
+        ignore.sa_handler = SIG_IGN;
+        ::sigaction(SIGXFSZ, &ignore, &previous);
+        rlimit limit{};
+        ::getrlimit(RLIMIT_FSIZE, &limit);
+        const rlimit full{static_cast<rlim_t>(fs::file_size(path)), limit.rlim_max};
+        ::setrlimit(RLIMIT_FSIZE, &full);
+        const auto failed = reopened->save(memory, second_globals);
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        ::sigaction(SIGXFSZ, &previous, nullptr);
+        REQUIRE(!failed);
+        memory[6 * page_size] = 0x66;
+        REQUIRE(reopened->save(memory, second_globals) == 4);
+        REQUIRE(reopened->stored_pages(4) == 2);
+        REQUIRE(reopened->rebuild(4, &rebuilt, &globals));
+        REQUIRE(rebuilt == std::vector<uint8_t>(memory.begin(), memory.end()));
+
+        reopened.reset();
+        fs::remove(path);
+        ::munmap(mapping, pages * page_size);
+    }
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("save_state: incremental save") {
+    // Saving should cost in proportion to the pages written, not to the size of the heap
+    const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const auto path      = std::filesystem::temp_directory_path() / fmt::format("qost-save-state-bench-{}", ::getpid());
+
+    for (auto tracking : {tss::DirtyTracking::soft_dirty, tss::DirtyTracking::page_hash}) {
+        if (tracking == tss::DirtyTracking::soft_dirty && !tss::soft_dirty_available()) {
+            fmt::print("  soft-dirty bits are not available\n");
+            continue;
+        }
+        for (size_t heap_mib : {size_t{16}, size_t{256}}) {
+            const size_t size = heap_mib << 20;
+            auto mapping      = static_cast<uint8_t *>(
+                ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            std::span<uint8_t> memory(mapping, size);
+            std::memset(mapping, 1, size);
+
+            auto chain = tss::SaveStateChain::create(path, tracking);
+            chain->save(memory, {});
+            const auto full_ns = tss::bench::ns_per_op(1, [&] {
+                std::vector<uint8_t> copy(memory.begin(), memory.end());
+                tss::bench::do_not_optimize(copy.data());
+            });
+
+            size_t page        = 0;
+            const auto save_ns = tss::bench::ns_per_op(20, [&] {
+                for (size_t touched = 0; touched < 64; touched++) {
+                    page = (page * 7919 + 13) % (size / page_size);
+                    memory[page * page_size]++;
+                }
+                tss::bench::do_not_optimize(chain->save(memory, {}));
+            });
+
+            const auto name = fmt::format("{} MiB heap, {}",
+                                          heap_mib,
+                                          chain->tracking() == tss::DirtyTracking::soft_dirty ? "soft-dirty"
+                                                                                              : "page hashes");
+            tss::bench::report(fmt::format("{}, save 64 dirty pages", name), save_ns / 1e3, "us");
+            tss::bench::report(fmt::format("{}, copy whole memory", name), full_ns / 1e3, "us");
+
+            chain.reset();
+            std::filesystem::remove(path);
+            ::munmap(mapping, size);
+        }
+    }
+}
+
+BENCHMARK_CASE("save_state: save with unrelated resident memory") {
+    // Clearing soft-dirty bits walks the page tables of the whole process, so a host that keeps a large heap resident
+    // makes every save slower even though the guest writes the same pages. Page hashes only read the guest's memory
+    const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const size_t size    = size_t{16} << 20;
+    const auto path      = std::filesystem::temp_directory_path() / fmt::format("qost-save-rss-bench-{}", ::getpid());
+
+    for (auto tracking : {tss::DirtyTracking::soft_dirty, tss::DirtyTracking::page_hash}) {
+        if (tracking == tss::DirtyTracking::soft_dirty && !tss::soft_dirty_available()) {
+            fmt::print("  soft-dirty bits are not available\n");
+            continue;
+        }
+        for (size_t resident_mib : {size_t{0}, size_t{256}, size_t{1024}}) {
+            // Stands in for the host's own heap and the memory of other instances, resident but never saved
+            const size_t resident_size = resident_mib << 20;
+            void *resident             = MAP_FAILED;
+            if (resident_size) {
+                resident = ::mmap(nullptr, resident_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (resident == MAP_FAILED) {
+                    fmt::print("  could not map {} MiB\n", resident_mib);
+                    continue;
+                }
+                std::memset(resident, 1, resident_size);
+            }
+
+            auto mapping = static_cast<uint8_t *>(
+                ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            std::span<uint8_t> memory(mapping, size);
+            std::memset(mapping, 1, size);
+
+            auto chain = tss::SaveStateChain::create(path, tracking);
+            chain->save(memory, {});
+
+            size_t page        = 0;
+            const auto save_ns = tss::bench::ns_per_op(20, [&] {
+                for (size_t touched = 0; touched < 64; touched++) {
+                    page = (page * 7919 + 13) % (size / page_size);
+                    memory[page * page_size]++;
+                }
+                tss::bench::do_not_optimize(chain->save(memory, {}));
+            });
+
+            const auto name = fmt::format("{} MiB elsewhere, {}",
+                                          resident_mib,
+                                          chain->tracking() == tss::DirtyTracking::soft_dirty ? "soft-dirty"
+                                                                                              : "page hashes");
+            tss::bench::report(fmt::format("{}, save 64 dirty pages", name), save_ns / 1e3, "us");
+
+            chain.reset();
+            std::filesystem::remove(path);
+            ::munmap(mapping, size);
+            if (resident_size) {
+                ::munmap(resident, resident_size);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,497 @@
+#pragma once
+
+#include "inc.hh"
+
+// Steps many guest instances every tick, for hosts where dozens of mods and AIs each get a call per simulation tick.
+//
+// Every instance has a home worker thread, and workers are pinned to a core each, so an instance keeps running where
+// its linear memory is already in the caches. A tick puts one task per instance on the queue of its home worker and
+// waits until all of them have run. A worker that runs out of its own tasks takes from the other end of another
+// worker's queue, so one slow instance does not hold up the ones queued behind it. Each instance only ever runs on one
+// worker at a time, and the tick barrier orders everything an instance did in one tick before the next. Save-states
+// with soft-dirty tracking have to be taken between ticks, see save_state.hh
+
+namespace tss {
+
+// CPUs this process may run on, in order
+inline auto allowed_cpus() -> std::vector<int> {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+    }
+    return cpus;
+}
+
+// Runs batches of tasks on a fixed set of worker threads, with work-stealing between them
+class WorkStealingPool {
+public:
+    // `workers` threads, or one per allowed CPU if 0. With `pin` each one is bound to a CPU of its own, where there are
+    // enough
+    static auto create(size_t workers, bool pin) -> std::unique_ptr<WorkStealingPool> {
+        std::unique_ptr<WorkStealingPool> self(new WorkStealingPool());
+        const auto cpus = allowed_cpus();
+        if (workers == 0) {
+            workers = std::max<size_t>(1, cpus.size());
+        }
+        for (size_t index = 0; index < workers; index++) {
+            self->m_Workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t index = 0; index < workers; index++) {
+            auto &worker  = *self->m_Workers[index];
+            worker.thread = std::thread([self = self.get(), index] { self->work(index); });
+            if (pin && !cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(static_cast<size_t>(cpus[index % cpus.size()]), &set);
+                if (::pthread_setaffinity_np(worker.thread.native_handle(), sizeof(set), &set) == 0) {
+                    worker.cpu = cpus[index % cpus.size()];
+                }
+            }
+        }
+        return self;
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard lock(m_Mutex);
+            m_Stop = true;
+        }
+        m_Wake.notify_all();
+        for (auto &worker : m_Workers) {
+            worker->thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &)            = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    auto workers() const -> size_t {
+        return m_Workers.size();
+    }
+
+    // CPU worker `index` is pinned to, -1 if it is not
+    auto cpu(size_t index) const -> int {
+        return m_Workers[index]->cpu;
+    }
+
+    // Calls `job(task, worker)` once for every task below `tasks` and returns when all calls have returned. Task `n` is
+    // queued on worker `n % workers()`, which runs it unless it is still busy when another worker runs out of tasks
+    void run(size_t tasks, const std::function<void(size_t task, size_t worker)> &job) {
+        if (tasks == 0) {
+            return;
+        }
+        m_Job = &job;
+        m_Remaining.store(tasks, std::memory_order_relaxed);
+        for (size_t index = 0; index < m_Workers.size(); index++) {
+            auto &worker = *m_Workers[index];
+            std::lock_guard lock(worker.mutex);
+            for (size_t task = index; task < tasks; task += m_Workers.size()) {
+                worker.queue.push_back(task);
+            }
+        }
+        {
+            std::lock_guard lock(m_Mutex);
+            m_Generation++;
+        }
+        m_Wake.notify_all();
+
+        std::unique_lock lock(m_Mutex);
+        m_Done.wait(lock, [this] { return m_Remaining.load(std::memory_order_acquire) == 0; });
+        m_Job = nullptr;
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<size_t> queue; // Runs from the front, stolen from the back
+        std::thread thread;
+        int cpu = -1;
+    };
+
+    WorkStealingPool() = default;
+
+    auto take(size_t index) -> std::optional<size_t> {
+        {
+            auto &own = *m_Workers[index];
+            std::lock_guard lock(own.mutex);
+            if (!own.queue.empty()) {
+                const auto task = own.queue.front();
+                own.queue.pop_front();
+                return task;
+            }
+        }
+        for (size_t offset = 1; offset < m_Workers.size(); offset++) {
+            auto &victim = *m_Workers[(index + offset) % m_Workers.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.queue.empty()) {
+                const auto task = victim.queue.back();
+                victim.queue.pop_back();
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void work(size_t index) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock lock(m_Mutex);
+                m_Wake.wait(lock, [&] { return m_Stop || m_Generation != seen; });
+                if (m_Stop) {
+                    return;
+                }
+                seen = m_Generation;
+            }
+            // The queue lock that handed out a task also orders the write of `m_Job` before reading it
+            while (auto task = take(index)) {
+                (*m_Job)(*task, index);
+                if (m_Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard lock(m_Mutex);
+                    m_Done.notify_all();
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_Workers;
+    const std::function<void(size_t, size_t)> *m_Job = nullptr;
+    std::atomic<size_t> m_Remaining                  = 0;
+
+    std::mutex m_Mutex; // Guards the two below and pairs with both condition variables
+    uint64_t m_Generation = 0;
+    bool m_Stop           = false;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Done;
+};
+
+struct GuestInstanceStats {
+    size_t calls      = 0;
+    size_t failures   = 0; // Calls that trapped
+    size_t stolen     = 0; // Calls run by a worker other than the instance's home worker
+    size_t exhausted  = 0; // Calls stopped for running out of fuel, also counted as failures
+    size_t overran    = 0; // Calls interrupted by the watchdog, also counted as failures
+    uint64_t fuel     = 0; // Used in the last tick, with metering
+    uint64_t last_ns  = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns   = 0;
+};
+
+struct GuestSchedulerStats {
+    size_t ticks           = 0;
+    uint64_t last_tick_ns  = 0;
+    uint64_t total_tick_ns = 0;
+    uint64_t max_tick_ns   = 0;
+};
+
+// Returns false if the call failed
+using GuestTickJob = std::function<bool(size_t index, WasiInstance &instance)>;
+
+class GuestScheduler {
+public:
+    // Creates `instances` instances of `module`, each with a store of its own, and `workers` threads to run them, one
+    // per allowed CPU if 0
+    static auto create(wasm_engine_t *engine,
+                       const wasm_module_t *module,
+                       WasiInstanceConfig config,
+                       size_t instances,
+                       size_t workers,
+                       bool pin) -> std::unique_ptr<GuestScheduler> {
+        std::unique_ptr<GuestScheduler> self(new GuestScheduler());
+        config.timeline = nullptr;
+        for (size_t index = 0; index < instances; index++) {
+            auto instance = WasiInstance::create(engine, module, config);
+            if (!instance) {
+                fmt::print(stderr, "Scheduler: could not create instance {}\n", index);
+                return nullptr;
+            }
+            self->m_Instances.push_back(std::move(instance));
+        }
+        self->m_InstanceStats.resize(instances);
+        self->m_Exhausted.resize(instances);
+        self->m_Pool = WorkStealingPool::create(workers, pin);
+        return self;
+    }
+
+    GuestScheduler(const GuestScheduler &)            = delete;
+    GuestScheduler &operator=(const GuestScheduler &) = delete;
+
+    auto size() const -> size_t {
+        return m_Instances.size();
+    }
+
+    auto workers() const -> const WorkStealingPool & {
+        return *m_Pool;
+    }
+
+    // Only to be used between ticks
+    auto instance(size_t index) -> WasiInstance & {
+        return *m_Instances[index];
+    }
+
+    auto instance_stats(size_t index) const -> const GuestInstanceStats & {
+        return m_InstanceStats[index];
+    }
+
+    auto stats() const -> const GuestSchedulerStats & {
+        return m_Stats;
+    }
+
+    // Interrupts calls made by `tick_export` that take longer than `timeout`, 0 to let them run. Only to be called
+    // between ticks
+    auto set_call_timeout(std::chrono::nanoseconds timeout) -> bool {
+        if (timeout.count() > 0 && !m_Watchdog) {
+            m_Watchdog = Watchdog::create();
+            if (!m_Watchdog) {
+                return false;
+            }
+        }
+        // Calibrated now rather than in the first tick, the instances all share one engine
+        if (timeout.count() > 0 && !m_Instances.empty() && m_Instances[0]->env().fuel.enabled()) {
+            m_Watchdog->fuel_rate(m_Instances[0]->engine());
+        }
+        m_CallTimeout = timeout;
+        return true;
+    }
+
+    // Runs `job` once for every instance, spread over the workers, and returns once all are done. Returns the number of
+    // calls that failed. Every instance's per-tick fuel budget starts over
+    auto tick(const GuestTickJob &job) -> size_t {
+        const auto begin = std::chrono::steady_clock::now();
+        std::atomic<size_t> failed = 0;
+        for (auto &instance : m_Instances) {
+            instance->env().fuel.begin_tick();
+        }
+
+        m_Pool->run(m_Instances.size(), [&](size_t index, size_t worker) {
+            const auto call_begin = std::chrono::steady_clock::now();
+            const bool succeeded  = job(index, *m_Instances[index]);
+            // Tick boundary: whatever the guest deferred lands before the next one
+            m_Instances[index]->env().io.complete();
+            const auto ns         = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - call_begin)
+                    .count());
+
+            auto &stats     = m_InstanceStats[index];
+            const auto fuel = m_Instances[index]->env().fuel.usage();
+            stats.exhausted += fuel.exhausted - m_Exhausted[index];
+            m_Exhausted[index] = fuel.exhausted;
+            stats.fuel         = fuel.tick;
+            stats.calls++;
+            stats.last_ns = ns;
+            stats.total_ns += ns;
+            stats.max_ns = std::max(stats.max_ns, ns);
+            if (worker != index % m_Pool->workers()) {
+                stats.stolen++;
+            }
+            if (!succeeded) {
+                stats.failures++;
+                failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+
+        const auto ns = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+        m_Stats.ticks++;
+        m_Stats.last_tick_ns = ns;
+        m_Stats.total_tick_ns += ns;
+        m_Stats.max_tick_ns = std::max(m_Stats.max_tick_ns, ns);
+        return failed.load(std::memory_order_relaxed);
+    }
+
+    // Calls export `name` of every instance with `args`, ignoring its results, within the instance's fuel budget.
+    // Instances without the export fail
+    auto tick_export(std::string_view name, std::span<const wasm_val_t> args = {}) -> size_t {
+        return tick([&](size_t index, WasiInstance &instance) {
+            auto func = instance.func(name);
+            if (!func) {
+                fmt::print(stderr, "Scheduler: instance {} exports no function {}\n", index, name);
+                return false;
+            }
+            std::vector<wasm_val_t> args_val(args.begin(), args.end());
+            std::vector<wasm_val_t> results_val(::wasm_func_result_arity(func), wasm_val_t WASM_INIT_VAL);
+            wasm_val_vec_t args_vec    = {args_val.size(), args_val.data()};
+            wasm_val_vec_t results_vec = {results_val.size(), results_val.data()};
+            wasm_trap_t *trap = nullptr;
+            const auto result =
+                m_CallTimeout.count() > 0
+                    ? watchdog_call(*m_Watchdog, instance, func, &args_vec, &results_vec, &trap, m_CallTimeout)
+                    : instance.env().fuel.call(func, &args_vec, &results_vec, &trap);
+            if (result == FuelCallResult::exhausted) {
+                fmt::print(stderr, "Scheduler: instance {} ran out of fuel in {}\n", index, name);
+                return false;
+            }
+            if (result == FuelCallResult::interrupted) {
+                fmt::print(stderr, "Scheduler: instance {} ran past its deadline in {}\n", index, name);
+                m_InstanceStats[index].overran++;
+                return false;
+            }
+            if (trap) {
+                wasm_message_t message;
+                ::wasm_trap_message(trap, &message);
+                fmt::print(stderr,
+                           "Scheduler: trap in {} of instance {}: {}\n",
+                           name,
+                           index,
+                           std::string_view(message.data, message.size));
+                ::wasm_name_delete(&message);
+                ::wasm_trap_delete(trap);
+                return false;
+            }
+            return true;
+        });
+    }
+
+private:
+    GuestScheduler() = default;
+
+    std::vector<std::unique_ptr<WasiInstance>> m_Instances;
+    std::vector<GuestInstanceStats> m_InstanceStats; // Each written only by the worker running its instance
+    std::vector<size_t> m_Exhausted;                 // `FuelUsage::exhausted` of every instance after its last call
+    std::chrono::nanoseconds m_CallTimeout{0};
+    std::unique_ptr<Watchdog> m_Watchdog;
+    GuestSchedulerStats m_Stats{};
+    std::unique_ptr<WorkStealingPool> m_Pool; // Last, so workers are gone before the instances
+};
+
+inline auto guest_scheduler_stats_to_str(const GuestScheduler &scheduler) -> std::string {
+    auto mean = [](uint64_t total_ns, size_t count, double unit) {
+        return count ? static_cast<double>(total_ns) / unit / static_cast<double>(count) : 0.0;
+    };
+
+    const auto &stats = scheduler.stats();
+    std::string str   = fmt::format("{} instance(s) on {} worker(s), {} tick(s), {:.3f} ms mean, {:.3f} ms max\n",
+                                  scheduler.size(),
+                                  scheduler.workers().workers(),
+                                  stats.ticks,
+                                  mean(stats.total_tick_ns, stats.ticks, 1e6),
+                                  static_cast<double>(stats.max_tick_ns) / 1e6);
+    str += fmt::format("{:>8} {:>8} {:>8} {:>9} {:>8} {:>8} {:>12} {:>12} {:>14}\n",
+                       "instance",
+                       "calls",
+                       "failed",
+                       "exhausted",
+                       "overran",
+                       "stolen",
+                       "mean us",
+                       "max us",
+                       "fuel last tick");
+    for (size_t index = 0; index < scheduler.size(); index++) {
+        const auto &instance = scheduler.instance_stats(index);
+        str += fmt::format("{:>8} {:>8} {:>8} {:>9} {:>8} {:>8} {:>12.1f} {:>12.1f} {:>14}\n",
+                           index,
+                           instance.calls,
+                           instance.failures,
+                           instance.exhausted,
+                           instance.overran,
+                           instance.stolen,
+                           mean(instance.total_ns, instance.calls, 1e3),
+                           static_cast<double>(instance.max_ns) / 1e3,
+                           instance.fuel);
+    }
+    return str;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("WorkStealingPool") {
+    auto pool = tss::WorkStealingPool::create(4, true);
+    REQUIRE(pool->workers() == 4);
+
+    // Every task runs exactly once per batch, and the batch is over when run returns
+    std::vector<std::atomic<int>> runs(1000);
+    for (int batch = 1; batch <= 3; batch++) {
+        pool->run(runs.size(), [&](size_t task, size_t) { runs[task].fetch_add(1); });
+        REQUIRE(std::ranges::all_of(runs, [&](const std::atomic<int> &count) { return count.load() == batch; }));
+    }
+
+    // Tasks queued behind a slow one are taken by the idle workers
+    std::vector<size_t> ran_on(32);
+    pool->run(ran_on.size(), [&](size_t task, size_t worker) {
+        if (task % 4 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        ran_on[task] = worker;
+    });
+    size_t stolen = 0;
+    for (size_t task = 0; task < ran_on.size(); task += 4) {
+        stolen += ran_on[task] != 0;
+    }
+    REQUIRE(stolen > 0);
+
+    bool called = false;
+    pool->run(0, [&](size_t, size_t) { called = true; });
+    REQUIRE(!called);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("scheduler: tick latency") {
+    // 64 instances where every eighth one does ten times the work, as a heavy AI among light mods would. The tick can
+    // only end when the slowest worker is done, which stealing evens out
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 1)
+        (func (export "step") (param $iterations i32) (result i32)
+            (local $acc i32)
+            (loop $loop
+                (local.set $acc (i32.add (i32.mul (local.get $acc) (i32.const 31)) (local.get $iterations)))
+                (i32.store (i32.and (i32.shl (local.get $iterations) (i32.const 2)) (i32.const 0xfffc))
+                           (local.get $acc))
+                (local.set $iterations (i32.sub (local.get $iterations) (i32.const 1)))
+                (br_if $loop (local.get $iterations)))
+            (local.get $acc))))");
+
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    constexpr size_t instances = 64;
+    constexpr size_t ticks     = 200;
+    auto job                   = [](size_t index, tss::WasiInstance &instance) {
+        wasm_val_t args_val[1]    = {WASM_I32_VAL(index % 8 == 0 ? 100000 : 10000)};
+        wasm_val_t results_val[1] = {WASM_INIT_VAL};
+        wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+        wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+        auto trap                 = ::wasm_func_call(instance.func("step"), &args, &results);
+        if (trap) {
+            ::wasm_trap_delete(trap);
+        }
+        return trap == nullptr;
+    };
+
+    auto measure = [&](std::string_view name, size_t workers) {
+        auto scheduler = tss::GuestScheduler::create(engine, module, {}, instances, workers, true);
+        std::vector<double> samples;
+        for (size_t tick = 0; tick < ticks; tick++) {
+            scheduler->tick(job);
+            samples.push_back(static_cast<double>(scheduler->stats().last_tick_ns) / 1e3);
+        }
+        size_t stolen = 0;
+        for (size_t index = 0; index < instances; index++) {
+            stolen += scheduler->instance_stats(index).stolen;
+        }
+        tss::bench::report(fmt::format("{}, tick p50", name), tss::bench::percentile(samples, 50), "us");
+        tss::bench::report(fmt::format("{}, tick p99", name), tss::bench::percentile(samples, 99), "us");
+        tss::bench::report(fmt::format("{}, calls stolen", name),
+                           100.0 * static_cast<double>(stolen) / static_cast<double>(instances * ticks),
+                           "%");
+    };
+
+    measure("1 worker", 1);
+    const auto cores = tss::allowed_cpus().size();
+    if (cores > 1) {
+        measure(fmt::format("{} workers", cores), 0);
+    }
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
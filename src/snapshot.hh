@@ -0,0 +1,603 @@
+#pragma once
+
+#include "inc.hh"
+
+// Pre-initialized instance snapshots. Taking one instantiates the module, calls an export that runs the guest's own
+// initialization and returns, and writes out everything that changed: linear memory, the mutable exported globals and
+// the host state the guest may have observed, which is its preopens and virtual time. Later launches instantiate as
+// usual, restore the image over the fresh instance and start it from a resume export instead of initializing all over
+// again. That export is part of the guest's side of the deal: `_start` of a wasi-libc command runs the constructors and
+// `main`, initialization included, so calling it on restored memory would initialize twice. A guest built for
+// snapshots exports the init function and a resume function that carries on from the state init left behind.
+//
+// An image is a header, the globals, the preopens, the chunk index and a names blob, followed by the chunk contents on
+// page boundaries. Only pages that differ from a freshly instantiated memory are stored, found by instantiating a
+// second, pristine instance next to the initialized one and comparing the two, so restoring is a grow and a memcpy per
+// chunk. The C API only reaches globals that the module exports. That is enough for wasi-libc guests, whose only
+// unexported mutable global is `__stack_pointer`, back at its initial value once the init export has returned.
+// Randomness is deliberately not part of the image, every restored instance keys its own generator
+
+namespace tss {
+
+#define SNAPSHOT_VERSION 1U
+#define SNAPSHOT_PAGE_SIZE 4096U       // Memory is compared and stored in pages of this size
+#define SNAPSHOT_WASM_PAGE_SIZE 65536U // Unit of `wasm_memory_size` and `wasm_memory_grow`
+
+inline constexpr char snapshot_magic[8] = {'Q', 'O', 'S', 'T', 'S', 'N', 'P', '\0'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t global_count;
+    uint32_t preopen_count;
+    uint32_t chunk_count;
+    uint64_t module_hash;  // Hash of the wasm bytes, an image only fits the module it was taken from
+    uint64_t memory_pages; // Size of linear memory in wasm pages
+    uint64_t clock_ns;     // Virtual time of a deterministic clock
+    uint64_t names_offset;
+    uint64_t names_size;
+};
+
+// Into the names blob, names are not null terminated
+struct SnapshotName {
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct SnapshotGlobal {
+    SnapshotName name;
+    uint8_t kind; // wasm_valkind_t, only numbers
+    uint8_t reserved[7];
+    uint64_t bits; // The value, zero extended
+};
+
+struct SnapshotChunk {
+    uint64_t memory_offset;
+    uint64_t size;
+    uint64_t file_offset; // Page aligned
+};
+
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header layout changed, bump SNAPSHOT_VERSION");
+static_assert(sizeof(SnapshotGlobal) == 24, "snapshot global layout changed, bump SNAPSHOT_VERSION");
+static_assert(sizeof(SnapshotChunk) == 24, "snapshot chunk layout changed, bump SNAPSHOT_VERSION");
+
+// What goes into an image
+struct SnapshotContents {
+    uint64_t module_hash  = 0;
+    uint64_t memory_pages = 0;
+    std::span<const uint8_t> memory;   // The initialized memory
+    std::vector<SnapshotChunk> chunks; // Ranges of `memory` to store, `file_offset` is filled in when writing
+    std::vector<std::pair<std::string, wasm_val_t>> globals;
+    std::vector<std::string> preopens; // Guest paths, in fd order
+    uint64_t clock_ns = 0;
+};
+
+// The pages of `memory` that differ from `pristine`, merged into runs. Memory beyond the end of `pristine` is compared
+// against zeroes, which is what growing a memory fills it with
+inline auto snapshot_diff(std::span<const uint8_t> memory, std::span<const uint8_t> pristine)
+    -> std::vector<SnapshotChunk> {
+    static const uint8_t zeroes[SNAPSHOT_PAGE_SIZE] = {};
+
+    std::vector<SnapshotChunk> chunks;
+    for (size_t offset = 0; offset < memory.size(); offset += SNAPSHOT_PAGE_SIZE) {
+        const auto size      = std::min<size_t>(SNAPSHOT_PAGE_SIZE, memory.size() - offset);
+        const auto reference = offset + size <= pristine.size() ? &pristine[offset] : zeroes;
+        if (std::memcmp(&memory[offset], reference, size) == 0) {
+            continue;
+        }
+        if (!chunks.empty() && chunks.back().memory_offset + chunks.back().size == offset) {
+            chunks.back().size += size;
+        } else {
+            chunks.push_back({offset, size, 0});
+        }
+    }
+    return chunks;
+}
+
+// Bits of a numeric value as the image stores them
+inline auto snapshot_value_bits(const wasm_val_t &value) -> uint64_t {
+    switch (value.kind) {
+    case WASM_I32: {
+        return static_cast<uint32_t>(value.of.i32);
+    }
+    case WASM_I64: {
+        return static_cast<uint64_t>(value.of.i64);
+    }
+    case WASM_F32: {
+        return std::bit_cast<uint32_t>(value.of.f32);
+    }
+    case WASM_F64: {
+        return std::bit_cast<uint64_t>(value.of.f64);
+    }
+    default: {
+        return 0;
+    }
+    }
+}
+
+inline auto snapshot_value_from_bits(uint8_t kind, uint64_t bits) -> wasm_val_t {
+    wasm_val_t value{};
+    value.kind = kind;
+    switch (kind) {
+    case WASM_I32: {
+        value.of.i32 = static_cast<int32_t>(static_cast<uint32_t>(bits));
+        break;
+    }
+    case WASM_I64: {
+        value.of.i64 = static_cast<int64_t>(bits);
+        break;
+    }
+    case WASM_F32: {
+        value.of.f32 = std::bit_cast<float32_t>(static_cast<uint32_t>(bits));
+        break;
+    }
+    case WASM_F64: {
+        value.of.f64 = std::bit_cast<float64_t>(bits);
+        break;
+    }
+    default: {
+        break;
+    }
+    }
+    return value;
+}
+
+inline auto snapshot_write(const std::filesystem::path &path, const SnapshotContents &contents) -> bool {
+    std::string names;
+    auto add_name = [&names](std::string_view name) -> SnapshotName {
+        SnapshotName out{static_cast<uint32_t>(names.size()), static_cast<uint32_t>(name.size())};
+        names += name;
+        return out;
+    };
+
+    std::vector<SnapshotGlobal> globals;
+    for (const auto &[name, value] : contents.globals) {
+        globals.push_back({add_name(name), value.kind, {}, snapshot_value_bits(value)});
+    }
+    std::vector<SnapshotName> preopens;
+    for (const auto &preopen : contents.preopens) {
+        preopens.push_back(add_name(preopen));
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version       = SNAPSHOT_VERSION;
+    header.global_count  = static_cast<uint32_t>(globals.size());
+    header.preopen_count = static_cast<uint32_t>(preopens.size());
+    header.chunk_count   = static_cast<uint32_t>(contents.chunks.size());
+    header.module_hash   = contents.module_hash;
+    header.memory_pages  = contents.memory_pages;
+    header.clock_ns      = contents.clock_ns;
+    header.names_offset  = sizeof(header) + globals.size() * sizeof(SnapshotGlobal) +
+                          preopens.size() * sizeof(SnapshotName) + contents.chunks.size() * sizeof(SnapshotChunk);
+    header.names_size    = names.size();
+
+    auto chunks     = contents.chunks;
+    uint64_t offset = header.names_offset + header.names_size;
+    for (auto &chunk : chunks) {
+        offset            = (offset + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+        chunk.file_offset = offset;
+        offset += chunk.size;
+    }
+
+    // Written next to the real name and renamed into place, like module cache entries
+    auto tmp_path = path;
+    tmp_path += fmt::format(".{}.tmp", ::getpid());
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char *>(globals.data()),
+              static_cast<std::streamsize>(globals.size() * sizeof(SnapshotGlobal)));
+    ofs.write(reinterpret_cast<const char *>(preopens.data()),
+              static_cast<std::streamsize>(preopens.size() * sizeof(SnapshotName)));
+    ofs.write(reinterpret_cast<const char *>(chunks.data()),
+              static_cast<std::streamsize>(chunks.size() * sizeof(SnapshotChunk)));
+    ofs.write(names.data(), static_cast<std::streamsize>(names.size()));
+    for (const auto &chunk : chunks) {
+        const auto padding = static_cast<std::streamoff>(chunk.file_offset) - ofs.tellp();
+        for (std::streamoff pad = 0; pad < padding; pad++) {
+            ofs.put('\0');
+        }
+        ofs.write(reinterpret_cast<const char *>(&contents.memory[chunk.memory_offset]),
+                  static_cast<std::streamsize>(chunk.size));
+    }
+
+    std::error_code error;
+    if (!ofs.flush()) {
+        fmt::print(stderr, "Snapshot: could not write {}\n", path.string());
+        std::filesystem::remove(tmp_path, error);
+        return false;
+    }
+    ofs.close();
+    std::filesystem::rename(tmp_path, path, error);
+    if (error) {
+        fmt::print(stderr, "Snapshot: {}: {}\n", path.string(), error.message());
+        std::filesystem::remove(tmp_path, error);
+        return false;
+    }
+    return true;
+}
+
+// Mutable exported globals of `instance` with numeric values, references can not be carried over to another instance
+inline auto snapshot_exported_globals(WasiInstance &instance) -> std::vector<std::pair<std::string, wasm_val_t>> {
+    std::vector<std::pair<std::string, wasm_val_t>> globals;
+
+    wasm_exporttype_vec_t exporttypes;
+    ::wasm_module_exports(instance.module(), &exporttypes);
+    for (size_t index = 0; index < exporttypes.size && index < instance.exports().size; index++) {
+        auto exported = instance.exports().data[index];
+        if (::wasm_extern_kind(exported) != WASM_EXTERN_GLOBAL) {
+            continue;
+        }
+        auto global     = ::wasm_extern_as_global(exported);
+        auto globaltype = ::wasm_global_type(global);
+        const bool var  = ::wasm_globaltype_mutability(globaltype) == WASM_VAR;
+        ::wasm_globaltype_delete(globaltype);
+        if (!var) {
+            continue;
+        }
+
+        wasm_val_t value{};
+        ::wasm_global_get(global, &value);
+        auto name = ::wasm_exporttype_name(exporttypes.data[index]);
+        if (std::string_view(name->data, name->size).starts_with("wasmer_metering_")) {
+            continue; // Added by metering, fuel is the host's to hand out and not part of the guest's state
+        }
+        if (value.kind != WASM_I32 && value.kind != WASM_I64 && value.kind != WASM_F32 && value.kind != WASM_F64) {
+            fmt::print(stderr, "Snapshot: not keeping reference global {}\n", std::string_view(name->data, name->size));
+            continue;
+        }
+        globals.emplace_back(std::string(name->data, name->size), value);
+    }
+    ::wasm_exporttype_vec_delete(&exporttypes);
+
+    return globals;
+}
+
+// Instantiates `module` twice with `config`, runs `init_export` in one of the instances and writes what it changed
+// compared to the other to `path`
+inline auto snapshot_create(wasm_engine_t *engine,
+                            const wasm_module_t *module,
+                            WasiInstanceConfig config,
+                            std::string_view init_export,
+                            uint64_t module_hash,
+                            const std::filesystem::path &path) -> bool {
+    config.timeline = nullptr;
+    auto pristine   = WasiInstance::create(engine, module, config);
+    auto instance   = WasiInstance::create(engine, module, std::move(config));
+    if (!instance || !pristine) {
+        return false;
+    }
+    if (!instance->env().memory || !pristine->env().memory) {
+        fmt::print(stderr, "Snapshot: the module exports no memory\n");
+        return false;
+    }
+
+    auto init = instance->func(init_export);
+    if (!init) {
+        fmt::print(stderr, "Snapshot: the module exports no function {}\n", init_export);
+        return false;
+    }
+    wasm_val_vec_t args    = WASM_EMPTY_VEC;
+    wasm_val_vec_t results = WASM_EMPTY_VEC;
+    if (auto trap = ::wasm_func_call(init, &args, &results)) {
+        wasm_message_t message;
+        ::wasm_trap_message(trap, &message);
+        fmt::print(stderr, "Snapshot: trap in {}: {}\n", init_export, std::string_view(message.data, message.size));
+        ::wasm_name_delete(&message);
+        ::wasm_trap_delete(trap);
+        return false;
+    }
+
+    // Open files would have to be reopened at the same position on restore, which is the guest's job to avoid
+    auto &env         = instance->env();
+    const auto opened = env.fds.preopens();
+    if (env.fds.size() != 3 + opened.size()) {
+        fmt::print(
+            stderr, "Snapshot: {} file(s) still open after {}\n", env.fds.size() - 3 - opened.size(), init_export);
+        return false;
+    }
+
+    const auto memory   = std::span(reinterpret_cast<const uint8_t *>(::wasm_memory_data(env.memory)),
+                                  ::wasm_memory_data_size(env.memory));
+    const auto reference = std::span(reinterpret_cast<const uint8_t *>(::wasm_memory_data(pristine->env().memory)),
+                                     ::wasm_memory_data_size(pristine->env().memory));
+
+    SnapshotContents contents{};
+    contents.module_hash  = module_hash;
+    contents.memory_pages = ::wasm_memory_size(env.memory);
+    contents.memory       = memory;
+    contents.chunks       = snapshot_diff(memory, reference);
+    contents.globals      = snapshot_exported_globals(*instance);
+    contents.preopens.assign(opened.begin(), opened.end());
+    contents.clock_ns = env.clock.mode() == ClockMode::deterministic ? env.clock.virtual_ns() : 0;
+
+    if (!snapshot_write(path, contents)) {
+        return false;
+    }
+
+    size_t stored = 0;
+    for (const auto &chunk : contents.chunks) {
+        stored += chunk.size;
+    }
+    fmt::print("Snapshot: {} of {} KiB memory in {} chunk(s), {} global(s) written to {}\n",
+               stored / 1024,
+               memory.size() / 1024,
+               contents.chunks.size(),
+               contents.globals.size(),
+               path.string());
+    return true;
+}
+
+class Snapshot {
+public:
+    // Nullptr if the file can not be mapped, is not a valid image, or was taken from another module
+    static auto open(const std::filesystem::path &path, uint64_t module_hash) -> std::unique_ptr<Snapshot> {
+        std::unique_ptr<Snapshot> self(new Snapshot());
+        self->m_File = MappedFile(path);
+        if (!self->m_File) {
+            fmt::print(stderr, "Snapshot: {}: {}\n", path.string(), std::strerror(self->m_File.error()));
+            return nullptr;
+        }
+        if (!self->validate()) {
+            fmt::print(stderr, "Snapshot: {} is not a valid snapshot\n", path.string());
+            return nullptr;
+        }
+        if (self->m_Header.module_hash != module_hash) {
+            fmt::print(stderr, "Snapshot: {} was taken from a different module\n", path.string());
+            return nullptr;
+        }
+        return self;
+    }
+
+    auto memory_pages() const -> uint64_t {
+        return m_Header.memory_pages;
+    }
+
+    auto chunks() const -> std::span<const SnapshotChunk> {
+        return m_Chunks;
+    }
+
+    auto chunk_data(const SnapshotChunk &chunk) const -> std::span<const uint8_t> {
+        return {reinterpret_cast<const uint8_t *>(m_File.data()) + chunk.file_offset, chunk.size};
+    }
+
+    auto globals() const -> std::span<const SnapshotGlobal> {
+        return m_Globals;
+    }
+
+    auto preopens() const -> std::span<const SnapshotName> {
+        return m_Preopens;
+    }
+
+    auto name(const SnapshotName &name) const -> std::string_view {
+        return m_Names.substr(name.offset, name.size);
+    }
+
+    auto clock_ns() const -> uint64_t {
+        return m_Header.clock_ns;
+    }
+
+    // Brings a freshly created instance of the same module to where the snapshot was taken. The instance must have the
+    // same preopens, in the same order, since the guest remembers which fd is which directory
+    auto restore(WasiInstance &instance) const -> bool {
+        auto &env = instance.env();
+        if (!env.memory) {
+            fmt::print(stderr, "Snapshot: the instance has no memory\n");
+            return false;
+        }
+
+        const auto opened = env.fds.preopens();
+        bool same         = opened.size() == m_Preopens.size();
+        for (size_t index = 0; same && index < opened.size(); index++) {
+            same = opened[index] == name(m_Preopens[index]);
+        }
+        if (!same) {
+            fmt::print(stderr, "Snapshot: the preopens differ from the ones it was taken with\n");
+            return false;
+        }
+
+        const uint64_t pages = ::wasm_memory_size(env.memory);
+        if (pages > m_Header.memory_pages ||
+            (pages < m_Header.memory_pages &&
+             !::wasm_memory_grow(env.memory, static_cast<uint32_t>(m_Header.memory_pages - pages)))) {
+            fmt::print(stderr, "Snapshot: can not resize memory from {} to {} pages\n", pages, m_Header.memory_pages);
+            return false;
+        }
+
+        auto base = reinterpret_cast<uint8_t *>(::wasm_memory_data(env.memory));
+        for (const auto &chunk : m_Chunks) {
+            std::memcpy(base + chunk.memory_offset, chunk_data(chunk).data(), chunk.size);
+        }
+
+        for (const auto &global : m_Globals) {
+            auto exported = instance.export_by_name(name(global.name));
+            if (!exported || ::wasm_extern_kind(exported) != WASM_EXTERN_GLOBAL) {
+                fmt::print(stderr, "Snapshot: the instance exports no global {}\n", name(global.name));
+                return false;
+            }
+            const auto value = snapshot_value_from_bits(global.kind, global.bits);
+            ::wasm_global_set(::wasm_extern_as_global(exported), &value);
+        }
+
+        if (env.clock.mode() == ClockMode::deterministic) {
+            env.clock.advance(m_Header.clock_ns);
+        }
+        return true;
+    }
+
+private:
+    Snapshot() = default;
+
+    auto validate() -> bool {
+        const auto data = reinterpret_cast<const uint8_t *>(m_File.data());
+        const auto size = m_File.size();
+
+        if (size < sizeof(m_Header)) {
+            return false;
+        }
+        std::memcpy(&m_Header, data, sizeof(m_Header));
+        const uint64_t index_size = m_Header.global_count * sizeof(SnapshotGlobal) +
+                                    m_Header.preopen_count * sizeof(SnapshotName) +
+                                    uint64_t{m_Header.chunk_count} * sizeof(SnapshotChunk);
+        if (std::memcmp(m_Header.magic, snapshot_magic, sizeof(m_Header.magic)) != 0 ||
+            m_Header.version != SNAPSHOT_VERSION || index_size > size - sizeof(m_Header) ||
+            m_Header.names_offset != sizeof(m_Header) + index_size ||
+            m_Header.names_size > size - m_Header.names_offset || m_Header.memory_pages > UINT32_MAX) {
+            return false;
+        }
+
+        // The mapping is page aligned and every index entry is made of 32 and 64 bit fields, so they are used in place
+        auto cursor = data + sizeof(m_Header);
+        m_Globals   = {reinterpret_cast<const SnapshotGlobal *>(cursor), m_Header.global_count};
+        cursor += m_Globals.size_bytes();
+        m_Preopens = {reinterpret_cast<const SnapshotName *>(cursor), m_Header.preopen_count};
+        cursor += m_Preopens.size_bytes();
+        m_Chunks = {reinterpret_cast<const SnapshotChunk *>(cursor), m_Header.chunk_count};
+        m_Names  = {reinterpret_cast<const char *>(data + m_Header.names_offset), m_Header.names_size};
+
+        auto valid_name = [this](const SnapshotName &name) {
+            return name.offset <= m_Names.size() && name.size <= m_Names.size() - name.offset;
+        };
+        for (const auto &global : m_Globals) {
+            if (!valid_name(global.name) || global.kind > WASM_F64) {
+                return false;
+            }
+        }
+        for (const auto &preopen : m_Preopens) {
+            if (!valid_name(preopen)) {
+                return false;
+            }
+        }
+        const uint64_t memory_size = m_Header.memory_pages * SNAPSHOT_WASM_PAGE_SIZE;
+        for (const auto &chunk : m_Chunks) {
+            if (chunk.memory_offset > memory_size || chunk.size > memory_size - chunk.memory_offset ||
+                chunk.file_offset > size || chunk.size > size - chunk.file_offset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    MappedFile m_File;
+    SnapshotHeader m_Header{};
+    std::span<const SnapshotGlobal> m_Globals;
+    std::span<const SnapshotName> m_Preopens;
+    std::span<const SnapshotChunk> m_Chunks;
+    std::string_view m_Names;
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("Snapshot") {
+    namespace fs = std::filesystem;
+
+    // Memory grew from two to three pages, one page changed in the original part and one in the grown part
+    std::vector<uint8_t> pristine(2 * SNAPSHOT_PAGE_SIZE, 7);
+    std::vector<uint8_t> memory(4 * SNAPSHOT_PAGE_SIZE, 0);
+    std::copy(pristine.begin(), pristine.end(), memory.begin());
+    memory[SNAPSHOT_PAGE_SIZE + 5]     = 1;
+    memory[2 * SNAPSHOT_PAGE_SIZE + 9] = 2;
+    memory[3 * SNAPSHOT_PAGE_SIZE]     = 3;
+
+    const auto chunks = tss::snapshot_diff(memory, pristine);
+    REQUIRE(chunks.size() == 1);
+    REQUIRE(chunks[0].memory_offset == SNAPSHOT_PAGE_SIZE);
+    REQUIRE(chunks[0].size == 3 * SNAPSHOT_PAGE_SIZE);
+    REQUIRE(tss::snapshot_diff(pristine, pristine).empty());
+
+    tss::SnapshotContents contents{};
+    contents.module_hash  = 0x1234;
+    contents.memory_pages = 1;
+    contents.memory       = memory;
+    contents.chunks       = chunks;
+    contents.globals.emplace_back("counter", wasm_val_t WASM_I32_VAL(-5));
+    contents.preopens = {"/", "/data"};
+    contents.clock_ns = 99;
+
+    const auto path = fs::temp_directory_path() / fmt::format("qost-snapshot-{}", ::getpid());
+    REQUIRE(tss::snapshot_write(path, contents));
+    REQUIRE(!tss::Snapshot::open(path, 0x4321));
+    auto snapshot = tss::Snapshot::open(path, 0x1234);
+    fs::remove(path);
+    REQUIRE(snapshot);
+
+    REQUIRE(snapshot->memory_pages() == 1);
+    REQUIRE(snapshot->clock_ns() == 99);
+    REQUIRE(snapshot->chunks().size() == 1);
+    const auto data = snapshot->chunk_data(snapshot->chunks()[0]);
+    REQUIRE(reinterpret_cast<uintptr_t>(data.data()) % SNAPSHOT_PAGE_SIZE == 0);
+    REQUIRE(std::equal(data.begin(), data.end(), memory.begin() + SNAPSHOT_PAGE_SIZE));
+    REQUIRE(snapshot->globals().size() == 1);
+    REQUIRE(snapshot->name(snapshot->globals()[0].name) == "counter");
+    const auto value = tss::snapshot_value_from_bits(snapshot->globals()[0].kind, snapshot->globals()[0].bits);
+    REQUIRE(value.kind == WASM_I32);
+    REQUIRE(value.of.i32 == -5);
+    REQUIRE(snapshot->preopens().size() == 2);
+    REQUIRE(snapshot->name(snapshot->preopens()[1]) == "/data");
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("snapshot: restore vs init") {
+    // The init export stands in for an interpreter's startup: a lot of computation that leaves a few MiB of state. The
+    // resume export is the first script, a short job over that state, so the two add up to time-to-first-script
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 64)
+        (global $ready (export "ready") (mut i32) (i32.const 0))
+        (func (export "wizer.initialize")
+            (local $offset i32) (local $acc i32) (local $round i32)
+            (loop $rounds
+                (local.set $offset (i32.const 0))
+                (loop $fill
+                    (local.set $acc (i32.add (i32.mul (local.get $acc) (i32.const 1103515245)) (i32.const 12345)))
+                    (i32.store (local.get $offset) (local.get $acc))
+                    (local.set $offset (i32.add (local.get $offset) (i32.const 4)))
+                    (br_if $fill (i32.lt_u (local.get $offset) (i32.const 0x300000))))
+                (local.set $round (i32.add (local.get $round) (i32.const 1)))
+                (br_if $rounds (i32.lt_u (local.get $round) (i32.const 16))))
+            (global.set $ready (i32.const 1)))
+        (func (export "resume")
+            (local $offset i32) (local $acc i32)
+            (loop $sum
+                (local.set $acc (i32.add (local.get $acc) (i32.load (local.get $offset))))
+                (local.set $offset (i32.add (local.get $offset) (i32.const 4)))
+                (br_if $sum (i32.lt_u (local.get $offset) (i32.const 0x10000))))
+            (global.set $ready (local.get $acc)))))");
+
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    const auto path = std::filesystem::temp_directory_path() / fmt::format("qost-snapshot-bench-{}", ::getpid());
+    if (tss::snapshot_create(engine, module, {}, "wizer.initialize", 1, path)) {
+        auto snapshot = tss::Snapshot::open(path, 1);
+
+        auto call = [](tss::WasiInstance &instance, std::string_view name) {
+            wasm_val_vec_t args    = WASM_EMPTY_VEC;
+            wasm_val_vec_t results = WASM_EMPTY_VEC;
+            if (auto trap = ::wasm_func_call(instance.func(name), &args, &results)) {
+                ::wasm_trap_delete(trap);
+            }
+        };
+        auto init = [&]() {
+            auto instance = tss::WasiInstance::create(engine, module, {});
+            call(*instance, "wizer.initialize");
+            call(*instance, "resume");
+            tss::bench::do_not_optimize(instance);
+        };
+        auto restore = [&]() {
+            auto instance = tss::WasiInstance::create(engine, module, {});
+            tss::bench::do_not_optimize(snapshot->restore(*instance));
+            call(*instance, "resume");
+        };
+        tss::bench::report("first script after init", tss::bench::ns_per_op(20, init) / 1e3, "us");
+        tss::bench::report("first script after restore", tss::bench::ns_per_op(20, restore) / 1e3, "us");
+    }
+    std::filesystem::remove(path);
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
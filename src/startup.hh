@@ -0,0 +1,99 @@
+#pragma once
+
+#include "inc.hh"
+
+// Startup phase timings. The host marks the end of every phase as it goes, from reading the wasm file to the guest's
+// `_start` returning, and each mark records how long the phase took and the resident set size at its end. Phases are
+// contiguous, so they always add up to the time since the timeline was created
+
+namespace tss {
+
+// Resident set size of this process right now, in bytes
+inline auto current_rss_bytes() -> size_t {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages    = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+struct StartupPhase {
+    std::string_view name;
+    uint64_t ns;
+    size_t rss_bytes; // At the end of the phase
+};
+
+class StartupTimeline {
+public:
+    StartupTimeline() : m_Begin{std::chrono::steady_clock::now()}, m_Last{m_Begin} {}
+
+    // Ends the phase that started at the previous mark, `name` must outlive the timeline
+    void mark(std::string_view name) {
+        const auto now = std::chrono::steady_clock::now();
+        const auto ns  = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_Last).count();
+        m_Phases.push_back({name, static_cast<uint64_t>(ns), current_rss_bytes()});
+        m_Last = now;
+    }
+
+    auto phases() const -> const std::vector<StartupPhase> & {
+        return m_Phases;
+    }
+
+    // Up to the last mark
+    auto total_ns() const -> uint64_t {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(m_Last - m_Begin).count());
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_Begin;
+    std::chrono::steady_clock::time_point m_Last;
+    std::vector<StartupPhase> m_Phases;
+};
+
+inline auto startup_timeline_to_str(const StartupTimeline &timeline) -> std::string {
+    std::string str = fmt::format("{:<16} {:>12} {:>12}\n", "phase", "ms", "RSS KiB");
+    for (const auto &phase : timeline.phases()) {
+        str += fmt::format(
+            "{:<16} {:>12.3f} {:>12}\n", phase.name, static_cast<double>(phase.ns) / 1e6, phase.rss_bytes / 1024);
+    }
+    str += fmt::format("{:<16} {:>12.3f} {:>12}\n",
+                       "total",
+                       static_cast<double>(timeline.total_ns()) / 1e6,
+                       peak_rss_bytes() / 1024);
+    return str;
+}
+
+// Read by scripts/startup_bench.py
+inline auto startup_timeline_to_json(const StartupTimeline &timeline) -> std::string {
+    std::string str = "{\"phases\": [";
+    for (size_t index = 0; index < timeline.phases().size(); index++) {
+        const auto &phase = timeline.phases()[index];
+        str += fmt::format("{}\n  {{\"name\": \"{}\", \"ns\": {}, \"rss_bytes\": {}}}",
+                           index == 0 ? "" : ",",
+                           phase.name,
+                           phase.ns,
+                           phase.rss_bytes);
+    }
+    str += fmt::format("\n], \"total_ns\": {}, \"peak_rss_bytes\": {}}}\n", timeline.total_ns(), peak_rss_bytes());
+    return str;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("StartupTimeline") {
+    REQUIRE(tss::current_rss_bytes() > 0);
+
+    tss::StartupTimeline timeline;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    timeline.mark("read");
+    std::vector<uint8_t> touched(8 << 20, 1);
+    timeline.mark("compile");
+    REQUIRE(touched.back() == 1);
+
+    REQUIRE(timeline.phases().size() == 2);
+    REQUIRE(timeline.phases()[0].ns >= 2000000);
+    REQUIRE(timeline.phases()[0].ns + timeline.phases()[1].ns == timeline.total_ns());
+    REQUIRE(timeline.phases()[1].rss_bytes >= timeline.phases()[0].rss_bytes + (4 << 20));
+    REQUIRE(tss::startup_timeline_to_json(timeline).find("\"name\": \"compile\"") != std::string::npos);
+}
+#endif
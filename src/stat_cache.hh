@@ -0,0 +1,523 @@
+#pragma once
+
+#include "inc.hh"
+
+#include <dirent.h>
+#include <linux/openat2.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+// Metadata cache of a preopened host directory.
+//
+// Guests like CPython stat dozens of candidate paths and list whole directories for every import, most of which never
+// change while the game runs. `StatCache` keeps the results of those lookups, including the failed ones, so repeated
+// path_filestat_get and fd_readdir calls are served from memory. Every directory on the way to a cached path is
+// watched with inotify. A watcher thread drops entries as soon as the kernel reports a change, and writes made by the
+// instance itself make the next lookup drain the pending events first, so the guest always sees its own writes.
+//
+// All host access below a preopen goes through openat2 with RESOLVE_BENEATH, so neither `..` nor symlinks can take
+// the guest outside of it, cached or not. Kernels before 5.6 have no openat2, there every symlink below a preopen is
+// refused instead
+
+namespace tss {
+
+struct StatCacheStats {
+    size_t hits          = 0;
+    size_t misses        = 0;
+    size_t invalidations = 0; // Entries dropped because the filesystem changed
+};
+
+struct HostDirent {
+    uint64_t ino;
+    uint8_t type; // DT_*
+    std::string name;
+};
+
+// Turns a guest path into one relative to the preopen, without `.`, `..` or empty components. The preopen itself is
+// "". False if the path is absolute or climbs out of the preopen
+inline auto host_path_normalize(std::string_view path, std::string *out) -> bool {
+    out->clear();
+    if (path.starts_with('/')) {
+        return false;
+    }
+    while (!path.empty()) {
+        const auto slash     = path.find('/');
+        const auto component = path.substr(0, slash);
+        path                 = slash == std::string_view::npos ? std::string_view{} : path.substr(slash + 1);
+
+        if (component.empty() || component == ".") {
+            continue;
+        }
+        if (component == "..") {
+            if (out->empty()) {
+                return false;
+            }
+            const auto parent = out->rfind('/');
+            out->resize(parent == std::string::npos ? 0 : parent);
+            continue;
+        }
+        if (!out->empty()) {
+            out->push_back('/');
+        }
+        out->append(component);
+    }
+    return true;
+}
+
+// Opens a normalized `path` below `dir_fd` one component at a time, none of them followed if it is a symlink. A host fd
+// or -errno, -EXDEV for a symlink that would have had to be followed, as openat2 reports an escape. Only a symlink
+// that is the last component and not to be followed, with O_NOFOLLOW, opens as itself
+inline auto host_open_nofollow(int dir_fd, const std::string &path, int flags) -> int {
+    std::string_view rest = path;
+    int parent            = dir_fd;
+    auto close_parent     = [&] {
+        if (parent != dir_fd) {
+            ::close(parent);
+        }
+    };
+
+    for (auto slash = rest.find('/'); slash != std::string_view::npos; slash = rest.find('/')) {
+        const std::string component(rest.substr(0, slash));
+        rest           = rest.substr(slash + 1);
+        const int next = ::openat(parent, component.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0) {
+            const int error = errno;
+            struct stat st;
+            const bool link =
+                ::fstatat(parent, component.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+            close_parent();
+            return link ? -EXDEV : -error;
+        }
+        close_parent();
+        parent = next;
+    }
+
+    const std::string name(rest.empty() ? "." : rest);
+    const bool follow = (flags & O_NOFOLLOW) == 0;
+    int fd            = ::openat(parent, name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+    int error         = errno;
+    struct stat st;
+    if (fd < 0 && error == ELOOP && follow) {
+        error = EXDEV;
+    } else if (fd >= 0 && follow && (flags & O_PATH) != 0 && ::fstat(fd, &st) == 0 && S_ISLNK(st.st_mode)) {
+        ::close(fd);
+        fd    = -1;
+        error = EXDEV;
+    }
+    close_parent();
+    return fd < 0 ? -error : fd;
+}
+
+// A host fd for `path` below `dir_fd`, or -errno
+inline auto host_open_beneath(int dir_fd, const std::string &path, int flags) -> int {
+    open_how how{};
+    how.flags   = static_cast<unsigned>(flags | O_CLOEXEC);
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    const char *name = path.empty() ? "." : path.c_str();
+    const auto fd    = static_cast<int>(::syscall(SYS_openat2, dir_fd, name, &how, sizeof(how)));
+    if (fd < 0 && errno == ENOSYS) {
+        // Plain openat would follow symlinks right out of the preopen, normalizing the path does not stop that
+        return host_open_nofollow(dir_fd, path, flags);
+    }
+    return fd < 0 ? -errno : fd;
+}
+
+// 0 or an errno. Without `follow` a symlink is reported as itself
+inline auto host_stat_beneath(int dir_fd, const std::string &path, bool follow, struct stat *out) -> int {
+    const int fd = host_open_beneath(dir_fd, path, O_PATH | (follow ? 0 : O_NOFOLLOW));
+    if (fd < 0) {
+        return -fd;
+    }
+    const int error = ::fstat(fd, out) < 0 ? errno : 0;
+    ::close(fd);
+    return error;
+}
+
+// 0 or an errno. Entries come in the order the kernel returns them, including `.` and `..`
+inline auto host_list_directory(int dir_fd, const std::string &path, std::vector<HostDirent> *out) -> int {
+    const int fd = host_open_beneath(dir_fd, path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return -fd;
+    }
+    DIR *dir = ::fdopendir(fd);
+    if (!dir) {
+        const int error = errno;
+        ::close(fd);
+        return error;
+    }
+
+    out->clear();
+    errno = 0;
+    while (const dirent *entry = ::readdir(dir)) {
+        out->push_back({entry->d_ino, entry->d_type, entry->d_name});
+    }
+    const int error = errno;
+    ::closedir(dir);
+    return error;
+}
+
+class StatCache {
+public:
+    using Listing = std::shared_ptr<const std::vector<HostDirent>>;
+
+    // Nullptr if inotify is not available, lookups then have to go to the filesystem every time. `dir_fd` is not
+    // owned and must outlive the cache
+    static auto create(int dir_fd, const std::filesystem::path &host_path) -> std::unique_ptr<StatCache> {
+        std::unique_ptr<StatCache> self(new StatCache());
+        self->m_DirFd    = dir_fd;
+        self->m_HostPath = std::filesystem::absolute(host_path);
+        self->m_Inotify  = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        self->m_Stop     = ::eventfd(0, EFD_CLOEXEC);
+        if (self->m_Inotify < 0 || self->m_Stop < 0) {
+            return nullptr;
+        }
+        self->m_Watcher = std::thread([cache = self.get()]() {
+            cache->watch_loop();
+        });
+        return self;
+    }
+
+    ~StatCache() {
+        if (m_Watcher.joinable()) {
+            const uint64_t stop                 = 1;
+            [[maybe_unused]] const auto written = ::write(m_Stop, &stop, sizeof(stop));
+            m_Watcher.join();
+        }
+        if (m_Inotify >= 0) {
+            ::close(m_Inotify);
+        }
+        if (m_Stop >= 0) {
+            ::close(m_Stop);
+        }
+    }
+
+    StatCache(const StatCache &)            = delete;
+    StatCache &operator=(const StatCache &) = delete;
+
+    // Like `host_stat_beneath`, `path` must be normalized
+    auto stat(const std::string &path, bool follow, struct stat *out) -> int {
+        std::lock_guard lock(m_Mutex);
+        sync();
+
+        // Only lstat results are kept. Following only makes a difference for symlinks, whose targets are not watched
+        auto found = m_Entries.find(path);
+        if (found != m_Entries.end()) {
+            if (!follow || found->second.error != 0 || !S_ISLNK(found->second.st.st_mode)) {
+                m_Stats.hits++;
+                *out = found->second.st;
+                return found->second.error;
+            }
+            m_Stats.misses++;
+            return host_stat_beneath(m_DirFd, path, true, out);
+        }
+
+        m_Stats.misses++;
+        // Watch first, so a change that races with the lookup still invalidates the entry
+        const bool watched = watch(parent_of(path));
+        CachedStat entry{};
+        entry.error = host_stat_beneath(m_DirFd, path, false, &entry.st);
+        if (watched && (entry.error == 0 || entry.error == ENOENT || entry.error == ENOTDIR)) {
+            m_Entries.insert_or_assign(path, entry);
+        }
+        if (follow && entry.error == 0 && S_ISLNK(entry.st.st_mode)) {
+            return host_stat_beneath(m_DirFd, path, true, out);
+        }
+        *out = entry.st;
+        return entry.error;
+    }
+
+    // The listing stays valid for as long as the caller holds on to it, even if the directory changes meanwhile
+    auto list(const std::string &path, Listing *out) -> int {
+        std::lock_guard lock(m_Mutex);
+        sync();
+
+        auto found = m_Listings.find(path);
+        if (found != m_Listings.end()) {
+            m_Stats.hits++;
+            *out = found->second;
+            return 0;
+        }
+
+        m_Stats.misses++;
+        const bool watched = watch(path);
+        auto listing       = std::make_shared<std::vector<HostDirent>>();
+        if (const int error = host_list_directory(m_DirFd, path, listing.get()); error != 0) {
+            return error;
+        }
+        if (watched) {
+            m_Listings.insert_or_assign(path, listing);
+        }
+        *out = std::move(listing);
+        return 0;
+    }
+
+    // Called after the instance wrote to any file. The kernel queues the inotify events before the write returns, so
+    // draining them on the next lookup is enough to never serve metadata from before the write
+    void note_write() {
+        m_WritePending.store(true, std::memory_order_relaxed);
+    }
+
+    auto stats() -> StatCacheStats {
+        std::lock_guard lock(m_Mutex);
+        return m_Stats;
+    }
+
+private:
+    struct CachedStat {
+        int error;
+        struct stat st;
+    };
+
+    StatCache() = default;
+
+    static auto parent_of(const std::string &path) -> std::string {
+        const auto slash = path.rfind('/');
+        return slash == std::string::npos ? std::string{} : path.substr(0, slash);
+    }
+
+    // Watches `dir` and every directory above it up to the preopen. A missing directory ends the walk, its creation
+    // shows up as an event on its parent. False if a watch could not be added for any other reason, the result of the
+    // lookup must then not be cached
+    auto watch(const std::string &dir) -> bool {
+        size_t end = 0;
+        while (true) {
+            const auto prefix = dir.substr(0, end);
+            if (!m_Watched.contains(prefix)) {
+                const auto host = prefix.empty() ? m_HostPath : m_HostPath / prefix;
+                const int wd    = ::inotify_add_watch(m_Inotify,
+                                                   host.c_str(),
+                                                   IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                                       IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+                if (wd < 0) {
+                    return errno == ENOENT || errno == ENOTDIR;
+                }
+                m_Watched.emplace(prefix, wd);
+                m_WatchPaths[wd].push_back(prefix);
+            }
+            if (end == dir.size()) {
+                return true;
+            }
+            const auto slash = dir.find('/', end + 1);
+            end              = slash == std::string::npos ? dir.size() : slash;
+        }
+    }
+
+    // Drops `path`, and everything below it if `recursive`
+    void invalidate(const std::string &path, bool recursive) {
+        auto matches = [&](const std::string &key) {
+            if (key == path) {
+                return true;
+            }
+            return recursive && (path.empty() || (key.starts_with(path) && key[path.size()] == '/'));
+        };
+
+        if (!recursive) {
+            m_Stats.invalidations += m_Entries.erase(path) + m_Listings.erase(path);
+            return;
+        }
+        m_Stats.invalidations += std::erase_if(m_Entries, [&](const auto &item) { return matches(item.first); });
+        m_Stats.invalidations += std::erase_if(m_Listings, [&](const auto &item) { return matches(item.first); });
+    }
+
+    void sync() {
+        if (m_WritePending.exchange(false, std::memory_order_relaxed)) {
+            drain();
+        }
+    }
+
+    // Applies every queued inotify event, with the mutex held
+    void drain() {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t size;
+        while ((size = ::read(m_Inotify, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < size;) {
+                const auto event = reinterpret_cast<const inotify_event *>(buffer + offset);
+                offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+                handle(*event);
+            }
+        }
+    }
+
+    void handle(const inotify_event &event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            invalidate({}, true);
+            return;
+        }
+
+        auto found = m_WatchPaths.find(event.wd);
+        if (found == m_WatchPaths.end()) {
+            return;
+        }
+        for (const auto &dir : found->second) {
+            if (event.len > 0) {
+                // Something inside the directory changed, which also changes the directory's listing
+                const std::string name = event.name;
+                m_Stats.invalidations += m_Listings.erase(dir);
+                invalidate(dir.empty() ? name : dir + '/' + name, (event.mask & IN_ISDIR) != 0);
+            } else {
+                invalidate(dir, true);
+            }
+        }
+
+        if (event.mask & IN_MOVE_SELF) {
+            // The paths no longer lead to this directory, the IN_IGNORED that follows forgets the watch
+            ::inotify_rm_watch(m_Inotify, event.wd);
+        }
+        if (event.mask & IN_IGNORED) {
+            for (const auto &dir : found->second) {
+                m_Watched.erase(dir);
+            }
+            m_WatchPaths.erase(found);
+        }
+    }
+
+    void watch_loop() {
+        pollfd fds[2] = {{m_Inotify, POLLIN, 0}, {m_Stop, POLLIN, 0}};
+        while (::poll(fds, ARRLEN(fds), -1) >= 0 || errno == EINTR) {
+            if (fds[1].revents) {
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                std::lock_guard lock(m_Mutex);
+                drain();
+            }
+        }
+    }
+
+    int m_DirFd = -1;
+    std::filesystem::path m_HostPath;
+    int m_Inotify = -1;
+    int m_Stop    = -1;
+    std::thread m_Watcher;
+    std::atomic<bool> m_WritePending = false;
+
+    std::mutex m_Mutex; // Everything below, shared with the watcher thread
+    std::unordered_map<std::string, CachedStat> m_Entries;
+    std::unordered_map<std::string, Listing> m_Listings;
+    std::unordered_map<std::string, int> m_Watched;
+    std::unordered_map<int, std::vector<std::string>> m_WatchPaths;
+    StatCacheStats m_Stats{};
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("StatCache") {
+    std::string normalized;
+    REQUIRE(tss::host_path_normalize("./a//b/../c/", &normalized));
+    REQUIRE(normalized == "a/c");
+    REQUIRE(tss::host_path_normalize(".", &normalized));
+    REQUIRE(normalized.empty());
+    REQUIRE(!tss::host_path_normalize("a/../..", &normalized));
+    REQUIRE(!tss::host_path_normalize("/etc", &normalized));
+
+    namespace fs   = std::filesystem;
+    const auto dir = fs::temp_directory_path() / fmt::format("qost-stat-cache-{}", ::getpid());
+    fs::create_directories(dir / "lib");
+    std::ofstream(dir / "lib" / "os.py") << "import sys";
+
+    const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    REQUIRE(dir_fd >= 0);
+    auto cache = tss::StatCache::create(dir_fd, dir);
+    REQUIRE(cache);
+
+    struct stat st;
+    REQUIRE(cache->stat("lib/os.py", false, &st) == 0);
+    REQUIRE(st.st_size == 10);
+    REQUIRE(cache->stat("lib/os.py", false, &st) == 0);
+    REQUIRE(cache->stat("lib/missing.py", false, &st) == ENOENT);
+    REQUIRE(cache->stat("lib/missing.py", false, &st) == ENOENT);
+    REQUIRE(cache->stats().hits == 2);
+    REQUIRE(cache->stats().misses == 2);
+
+    tss::StatCache::Listing listing;
+    REQUIRE(cache->list("lib", &listing) == 0);
+    REQUIRE(listing->size() == 3); // ., .. and os.py
+
+    // A write tells the cache to catch up with the kernel before the next lookup
+    std::ofstream(dir / "lib" / "os.py", std::ios::app) << "\n";
+    std::ofstream(dir / "lib" / "missing.py") << "";
+    cache->note_write();
+    REQUIRE(cache->stat("lib/os.py", false, &st) == 0);
+    REQUIRE(st.st_size == 11);
+    REQUIRE(cache->stat("lib/missing.py", false, &st) == 0);
+    REQUIRE(cache->list("lib", &listing) == 0);
+    REQUIRE(listing->size() == 4);
+    REQUIRE(cache->stats().invalidations >= 3);
+
+    // Paths are resolved beneath the preopen, symlinks included
+    fs::create_symlink("/etc", dir / "escape");
+    REQUIRE(cache->stat("escape", true, &st) == EXDEV);
+    REQUIRE(cache->stat("escape", false, &st) == 0);
+    REQUIRE(S_ISLNK(st.st_mode));
+
+    // Without openat2 no symlink is followed at all, wherever it leads
+    fs::create_symlink("os.py", dir / "lib" / "inner");
+    int fd = tss::host_open_nofollow(dir_fd, "lib/os.py", O_RDONLY);
+    REQUIRE(fd >= 0);
+    ::close(fd);
+    REQUIRE(tss::host_open_nofollow(dir_fd, "escape/passwd", O_RDONLY) == -EXDEV);
+    REQUIRE(tss::host_open_nofollow(dir_fd, "escape", O_RDONLY) == -EXDEV);
+    REQUIRE(tss::host_open_nofollow(dir_fd, "lib/inner", O_PATH) == -EXDEV);
+    REQUIRE(tss::host_open_nofollow(dir_fd, "lib/os.py/x", O_RDONLY) == -ENOTDIR);
+    REQUIRE(tss::host_open_nofollow(dir_fd, "lib/none", O_RDONLY) == -ENOENT);
+    fd = tss::host_open_nofollow(dir_fd, "lib/inner", O_PATH | O_NOFOLLOW);
+    REQUIRE(fd >= 0);
+    ::close(fd);
+    fd = tss::host_open_nofollow(dir_fd, "", O_RDONLY | O_DIRECTORY);
+    REQUIRE(fd >= 0);
+    ::close(fd);
+
+    cache.reset();
+    ::close(dir_fd);
+    fs::remove_all(dir);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("stat_cache: path_filestat_get") {
+    namespace fs   = std::filesystem;
+    const auto dir = fs::temp_directory_path() / fmt::format("qost-stat-cache-bench-{}", ::getpid());
+    fs::create_directories(dir / "lib" / "python3.12" / "encodings");
+    std::ofstream(dir / "lib" / "python3.12" / "encodings" / "__init__.py") << "";
+
+    const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    auto cache       = tss::StatCache::create(dir_fd, dir);
+    if (dir_fd < 0 || !cache) {
+        return;
+    }
+
+    // The typical import probe: one file that exists and one that does not
+    const std::string found   = "lib/python3.12/encodings/__init__.py";
+    const std::string missing = "lib/python3.12/encodings/__init__.pyc";
+    struct stat st;
+    tss::bench::report("uncached, existing file",
+                       tss::bench::ns_per_op(100000,
+                                             [&]() {
+                                                 tss::bench::do_not_optimize(
+                                                     tss::host_stat_beneath(dir_fd, found, false, &st));
+                                             }),
+                       "ns");
+    tss::bench::report("uncached, missing file",
+                       tss::bench::ns_per_op(100000,
+                                             [&]() {
+                                                 tss::bench::do_not_optimize(
+                                                     tss::host_stat_beneath(dir_fd, missing, false, &st));
+                                             }),
+                       "ns");
+    tss::bench::report("cached, existing file",
+                       tss::bench::ns_per_op(1000000,
+                                             [&]() { tss::bench::do_not_optimize(cache->stat(found, false, &st)); }),
+                       "ns");
+    tss::bench::report("cached, missing file",
+                       tss::bench::ns_per_op(1000000,
+                                             [&]() { tss::bench::do_not_optimize(cache->stat(missing, false, &st)); }),
+                       "ns");
+
+    cache.reset();
+    ::close(dir_fd);
+    fs::remove_all(dir);
+}
+#endif
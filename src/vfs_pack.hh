@@ -0,0 +1,395 @@
+#pragma once
+
+#include "inc.hh"
+
+// Read-only filesystem pack, exposed to the guest as a preopened directory.
+//
+// A pack is a header, an index of fixed size entries, a blob of names and then the file contents, back to back. Entry 0
+// is the root directory. The children of every directory are stored contiguously and sorted by name, so a directory is
+// just a range of entries and looking up a path component is a binary search. The pack is mapped once and validated as
+// a whole when it is opened, after which path lookups, stat and readdir only touch the index, and reading a file is a
+// memcpy out of the mapping, none of them enter the kernel
+
+namespace tss {
+
+#define VFS_PACK_VERSION 1U
+#define VFS_PACK_ALIGN 16U // File contents start on this alignment
+
+inline constexpr char vfs_pack_magic[8] = {'Q', 'O', 'S', 'T', 'P', 'A', 'K', '\0'};
+
+struct VfsPackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t names_offset;
+    uint64_t names_size;
+};
+
+struct VfsPackEntry {
+    uint64_t offset;      // Files: start of the contents in the pack. Directories: index of the first child
+    uint64_t size;        // Files: size in bytes. Directories: number of children
+    uint64_t mtime_ns;
+    uint32_t name_offset; // Into the names blob, names are not null terminated
+    uint32_t name_size;
+    uint32_t parent;      // The root is its own parent
+    uint8_t filetype;     // Filetype, only directory and regular_file
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(VfsPackHeader) == 32, "pack header layout changed, bump VFS_PACK_VERSION");
+static_assert(sizeof(VfsPackEntry) == 40, "pack entry layout changed, bump VFS_PACK_VERSION");
+
+class VfsPack {
+public:
+    // Nullptr if the file can not be mapped or is not a valid pack
+    static auto open(const std::filesystem::path &path) -> std::unique_ptr<VfsPack> {
+        std::unique_ptr<VfsPack> self(new VfsPack());
+        self->m_File = MappedFile(path);
+        if (!self->m_File) {
+            fmt::print(stderr, "Pack: {}: {}\n", path.string(), std::strerror(self->m_File.error()));
+            return nullptr;
+        }
+        if (!self->validate()) {
+            fmt::print(stderr, "Pack: {} is not a valid pack\n", path.string());
+            return nullptr;
+        }
+        // Guests read whatever they import, in no particular order
+        self->m_File.advise(MADV_RANDOM);
+        return self;
+    }
+
+    auto size() const -> uint32_t {
+        return static_cast<uint32_t>(m_Entries.size());
+    }
+
+    auto entry(uint32_t index) const -> const VfsPackEntry & {
+        return m_Entries[index];
+    }
+
+    auto name(uint32_t index) const -> std::string_view {
+        const auto &entry = m_Entries[index];
+        return m_Names.substr(entry.name_offset, entry.name_size);
+    }
+
+    auto is_directory(uint32_t index) const -> bool {
+        return m_Entries[index].filetype == std::to_underlying(Filetype::directory);
+    }
+
+    auto contents(uint32_t index) const -> std::span<const uint8_t> {
+        const auto &entry = m_Entries[index];
+        return {reinterpret_cast<const uint8_t *>(m_File.data()) + entry.offset, entry.size};
+    }
+
+    // Resolves `path` relative to the directory `dir`. `..` may not climb above `dir`, which is the whole world for
+    // whoever holds it, like the preopen is for the guest
+    auto lookup(uint32_t dir, std::string_view path, uint32_t *out) const -> Errno {
+        uint32_t current = dir;
+        while (!path.empty()) {
+            const auto slash     = path.find('/');
+            const auto component = path.substr(0, slash);
+            path                 = slash == std::string_view::npos ? std::string_view{} : path.substr(slash + 1);
+
+            if (component.empty() || component == ".") {
+                if (!is_directory(current)) {
+                    return Errno::e_notdir;
+                }
+                continue;
+            }
+            if (!is_directory(current)) {
+                return Errno::e_notdir;
+            }
+            if (component == "..") {
+                if (current == dir) {
+                    return Errno::e_notcapable;
+                }
+                current = m_Entries[current].parent;
+                continue;
+            }
+
+            const auto &parent = m_Entries[current];
+            auto first         = static_cast<uint32_t>(parent.offset);
+            auto last          = first + static_cast<uint32_t>(parent.size);
+            while (first < last) {
+                const auto middle = first + (last - first) / 2;
+                if (name(middle) < component) {
+                    first = middle + 1;
+                } else {
+                    last = middle;
+                }
+            }
+            if (first == parent.offset + parent.size || name(first) != component) {
+                return Errno::e_noent;
+            }
+            current = first;
+        }
+
+        *out = current;
+        return Errno::e_success;
+    }
+
+    auto filestat(uint32_t index) const -> __wasi_filestat_t {
+        const auto &entry = m_Entries[index];
+        __wasi_filestat_t stat{};
+        stat.dev      = reinterpret_cast<uintptr_t>(this); // Unique per pack, which is all the guest can rely on
+        stat.ino      = index + 1;
+        stat.filetype = entry.filetype;
+        stat.nlink    = 1;
+        stat.size     = is_directory(index) ? 0 : entry.size;
+        stat.atim     = entry.mtime_ns;
+        stat.mtim     = entry.mtime_ns;
+        stat.ctim     = entry.mtime_ns;
+        return stat;
+    }
+
+private:
+    VfsPack() = default;
+
+    auto validate() -> bool {
+        const auto data = reinterpret_cast<const uint8_t *>(m_File.data());
+        const auto size = m_File.size();
+
+        VfsPackHeader header{};
+        if (size < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, vfs_pack_magic, sizeof(header.magic)) != 0 ||
+            header.version != VFS_PACK_VERSION || header.entry_count == 0 ||
+            header.entry_count > (size - sizeof(header)) / sizeof(VfsPackEntry) || header.names_offset > size ||
+            header.names_size > size - header.names_offset) {
+            return false;
+        }
+
+        // The mapping is page aligned and the index directly follows the header, so it can be used in place
+        m_Entries = {reinterpret_cast<const VfsPackEntry *>(data + sizeof(header)), header.entry_count};
+        m_Names   = {reinterpret_cast<const char *>(data + header.names_offset), header.names_size};
+
+        for (uint32_t index = 0; index < header.entry_count; index++) {
+            const auto &entry = m_Entries[index];
+            if (entry.name_offset > m_Names.size() || entry.name_size > m_Names.size() - entry.name_offset ||
+                entry.parent >= header.entry_count || (index == 0) != (entry.parent == 0 && entry.name_size == 0)) {
+                return false;
+            }
+            if (is_directory(index)) {
+                // Children come after their parent, which also rules out cycles
+                if (entry.offset <= index || entry.offset > header.entry_count ||
+                    entry.size > header.entry_count - entry.offset) {
+                    return false;
+                }
+                for (auto child = entry.offset; child < entry.offset + entry.size; child++) {
+                    if (m_Entries[child].parent != index ||
+                        (child > entry.offset && !(name(static_cast<uint32_t>(child - 1)) <
+                                                   name(static_cast<uint32_t>(child))))) {
+                        return false;
+                    }
+                }
+            } else if (entry.filetype != std::to_underlying(Filetype::regular_file) || entry.offset > size ||
+                       entry.size > size - entry.offset) {
+                return false;
+            }
+        }
+        return is_directory(0);
+    }
+
+    MappedFile m_File;
+    std::span<const VfsPackEntry> m_Entries;
+    std::string_view m_Names;
+};
+
+// Packs the directory tree under `dir` into `out`. Only directories and regular files are packed, symlinks are
+// followed and anything else is skipped, broken symlinks included. A directory reached a second time, through a
+// symlink cycle or not, is skipped too
+inline auto vfs_pack_write(const std::filesystem::path &dir, const std::filesystem::path &out) -> bool {
+    namespace fs = std::filesystem;
+
+    struct Node {
+        fs::path path;
+        VfsPackEntry entry;
+    };
+
+    auto mtime_ns = [](const fs::path &path) -> uint64_t {
+        struct stat st;
+        if (::stat(path.c_str(), &st) < 0) {
+            return 0;
+        }
+        return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    };
+
+    // Breadth first, so the children of every directory end up next to each other
+    std::vector<Node> nodes;
+    std::string names;
+    nodes.push_back({dir, {}});
+    nodes[0].entry.filetype = std::to_underlying(Filetype::directory);
+    nodes[0].entry.mtime_ns = mtime_ns(dir);
+
+    // (dev, ino) of every directory packed so far
+    std::set<std::pair<dev_t, ino_t>> visited;
+    auto first_visit = [&](const fs::path &path) {
+        struct stat st;
+        return ::stat(path.c_str(), &st) == 0 && visited.emplace(st.st_dev, st.st_ino).second;
+    };
+    first_visit(dir);
+
+    std::error_code error;
+    for (size_t index = 0; index < nodes.size(); index++) {
+        if (nodes[index].entry.filetype != std::to_underlying(Filetype::directory)) {
+            continue;
+        }
+
+        std::vector<fs::directory_entry> children;
+        for (const auto &child : fs::directory_iterator(nodes[index].path, error)) {
+            // Errors of a single child, such as a broken symlink, only skip that child
+            std::error_code child_error;
+            if (child.is_directory(child_error)) {
+                if (first_visit(child.path())) {
+                    children.push_back(child);
+                }
+            } else if (child.is_regular_file(child_error)) {
+                children.push_back(child);
+            }
+        }
+        if (error) {
+            fmt::print(stderr, "Pack: {}: {}\n", nodes[index].path.string(), error.message());
+            return false;
+        }
+        std::sort(children.begin(), children.end(), [](const auto &lhs, const auto &rhs) {
+            return lhs.path().filename().string() < rhs.path().filename().string();
+        });
+
+        nodes[index].entry.offset = nodes.size();
+        nodes[index].entry.size   = children.size();
+        for (const auto &child : children) {
+            const auto name = child.path().filename().string();
+            VfsPackEntry entry{};
+            entry.name_offset = static_cast<uint32_t>(names.size());
+            entry.name_size   = static_cast<uint32_t>(name.size());
+            entry.parent      = static_cast<uint32_t>(index);
+            entry.mtime_ns    = mtime_ns(child.path());
+            std::error_code child_error;
+            entry.filetype = std::to_underlying(child.is_directory(child_error) ? Filetype::directory
+                                                                                : Filetype::regular_file);
+            if (entry.filetype == std::to_underlying(Filetype::regular_file)) {
+                const auto size = child.file_size(child_error);
+                entry.size      = child_error ? 0 : size;
+            }
+            names += name;
+            nodes.push_back({child.path(), entry});
+        }
+    }
+
+    auto align = [](uint64_t value) {
+        return (value + VFS_PACK_ALIGN - 1) / VFS_PACK_ALIGN * VFS_PACK_ALIGN;
+    };
+
+    VfsPackHeader header{};
+    std::memcpy(header.magic, vfs_pack_magic, sizeof(header.magic));
+    header.version      = VFS_PACK_VERSION;
+    header.entry_count  = static_cast<uint32_t>(nodes.size());
+    header.names_offset = sizeof(header) + nodes.size() * sizeof(VfsPackEntry);
+    header.names_size   = names.size();
+
+    uint64_t offset = align(header.names_offset + header.names_size);
+    for (auto &node : nodes) {
+        if (node.entry.filetype == std::to_underlying(Filetype::regular_file)) {
+            node.entry.offset = offset;
+            offset            = align(offset + node.entry.size);
+        }
+    }
+
+    std::ofstream ofs(out, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &node : nodes) {
+        ofs.write(reinterpret_cast<const char *>(&node.entry), sizeof(node.entry));
+    }
+    ofs.write(names.data(), static_cast<std::streamsize>(names.size()));
+
+    for (const auto &node : nodes) {
+        if (node.entry.filetype != std::to_underlying(Filetype::regular_file)) {
+            continue;
+        }
+        // Pad up to where the index says the contents start
+        const auto padding = static_cast<std::streamoff>(node.entry.offset) - ofs.tellp();
+        for (std::streamoff pad = 0; pad < padding; pad++) {
+            ofs.put('\0');
+        }
+        if (node.entry.size == 0) {
+            continue; // Streaming an empty buffer would set failbit
+        }
+        std::ifstream ifs(node.path, std::ios::binary);
+        ofs << ifs.rdbuf();
+        if (!ifs || static_cast<uint64_t>(ofs.tellp()) != node.entry.offset + node.entry.size) {
+            fmt::print(stderr, "Pack: could not pack {}\n", node.path.string());
+            return false;
+        }
+    }
+
+    if (!ofs.flush()) {
+        fmt::print(stderr, "Pack: could not write {}\n", out.string());
+        return false;
+    }
+
+    fmt::print("Packed {} entries, {} bytes into {}\n", nodes.size(), static_cast<uint64_t>(ofs.tellp()), out.string());
+    return true;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("VfsPack") {
+    namespace fs = std::filesystem;
+    const auto dir = fs::temp_directory_path() / fmt::format("qost-vfs-pack-{}", ::getpid());
+    fs::create_directories(dir / "data" / "maps");
+    std::ofstream(dir / "data" / "maps" / "town.map") << "town";
+    std::ofstream(dir / "data" / "b.txt") << "bee";
+    std::ofstream(dir / "data" / "a.txt") << "a";
+    std::ofstream(dir / "empty");
+
+    const auto path = dir.string() + ".pak";
+    REQUIRE(tss::vfs_pack_write(dir, path));
+    auto pack = tss::VfsPack::open(path);
+    fs::remove_all(dir);
+    fs::remove(path);
+    REQUIRE(pack);
+
+    // BFS order: root, data, empty, a.txt, b.txt, maps, town.map
+    REQUIRE(pack->size() == 7);
+    uint32_t index = 0;
+    REQUIRE(pack->lookup(0, "data/maps/town.map", &index) == Errno::e_success);
+    REQUIRE(pack->name(index) == "town.map");
+    REQUIRE(pack->filestat(index).size == 4);
+    REQUIRE(std::memcmp(pack->contents(index).data(), "town", 4) == 0);
+    REQUIRE(reinterpret_cast<uintptr_t>(pack->contents(index).data()) % VFS_PACK_ALIGN == 0);
+
+    uint32_t data = 0;
+    REQUIRE(pack->lookup(0, "data/", &data) == Errno::e_success);
+    REQUIRE(pack->is_directory(data));
+    REQUIRE(pack->entry(data).size == 3);
+    REQUIRE(pack->lookup(data, "./maps/../b.txt", &index) == Errno::e_success);
+    REQUIRE(pack->contents(index).size() == 3);
+    REQUIRE(pack->lookup(0, "empty", &index) == Errno::e_success);
+    REQUIRE(pack->contents(index).empty());
+
+    REQUIRE(pack->lookup(0, "data/c.txt", &index) == Errno::e_noent);
+    REQUIRE(pack->lookup(0, "empty/x", &index) == Errno::e_notdir);
+    REQUIRE(pack->lookup(0, "..", &index) == Errno::e_notcapable);
+
+    // A directory is the root for whoever holds it, `..` climbs back to it but not above
+    REQUIRE(pack->lookup(data, "maps/..", &index) == Errno::e_success);
+    REQUIRE(index == data);
+    REQUIRE(pack->lookup(data, "..", &index) == Errno::e_notcapable);
+    REQUIRE(pack->lookup(data, "maps/../../empty", &index) == Errno::e_notcapable);
+
+    // Broken symlinks and symlink cycles are skipped rather than failing the pack
+    fs::create_directories(dir / "looped");
+    fs::create_symlink("../looped", dir / "looped" / "again");
+    fs::create_symlink("missing", dir / "broken");
+    REQUIRE(tss::vfs_pack_write(dir, path));
+    auto looped = tss::VfsPack::open(path);
+    fs::remove_all(dir);
+    fs::remove(path);
+    REQUIRE(looped);
+    REQUIRE(looped->size() == 2); // root and looped
+    REQUIRE(looped->lookup(0, "looped", &index) == Errno::e_success);
+    REQUIRE(looped->lookup(0, "looped/again", &index) == Errno::e_noent);
+    REQUIRE(looped->lookup(0, "broken", &index) == Errno::e_noent);
+}
+#endif
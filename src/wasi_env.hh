@@ -0,0 +1,61 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+
+// Strings the guest copies out with a `*_sizes_get` and `*_get` pair, serialized once when the instance is created:
+// all of them back to back with their terminators, and where each one starts within that blob
+struct GuestStrings {
+    std::vector<char> blob;
+    std::vector<uint32_t> offsets;
+
+    static auto from(const std::vector<std::string> &strings) -> GuestStrings {
+        GuestStrings out;
+        out.offsets.reserve(strings.size());
+        for (const auto &string : strings) {
+            out.offsets.push_back(static_cast<uint32_t>(out.blob.size()));
+            out.blob.insert(out.blob.end(), string.c_str(), string.c_str() + string.size() + 1);
+        }
+        return out;
+    }
+
+    auto count() const -> uint32_t {
+        return static_cast<uint32_t>(offsets.size());
+    }
+
+    auto size() const -> uint32_t {
+        return static_cast<uint32_t>(blob.size());
+    }
+};
+
+struct WasiStats {
+    uint64_t host_calls = 0;
+    uint64_t traps      = 0;
+    uint64_t bytes      = 0; // Moved between guest memory and the host
+};
+
+// Host side state of one guest instance. Every host function receives it through its `env` pointer, so any number of
+// instances can live side by side in one process, each with its own store
+struct WasiEnv {
+    wasm_store_t *store   = nullptr;
+    wasm_memory_t *memory = nullptr;
+    GuestMemory guest{}; // Cached view of `memory`, only valid during host calls which take guest pointers
+    FdTable fds;
+    FileIo io;         // Positioned file I/O, completed by the host at tick boundaries
+    Poller poller;     // poll_oneoff
+    WasiClock clock;   // clock_time_get and clock_res_get
+    WasiRandom random; // random_get
+    GuestStrings args;
+    GuestStrings environment;
+    std::vector<iovec> iovecs; // Scratch for fd_read and fd_write, so translating guest iovecs does not allocate
+    WasiStats stats{};
+    wasm_trap_t *trap = nullptr; // Set by a host function to make the current call trap once it returns
+    WasiProfile profile;
+    FuelMeter fuel; // For calls into the guest, only metered if the module was compiled with metering
+    std::atomic<bool> interrupted{false}; // Set by the Watchdog once the current call is past its deadline
+#ifdef WASI_TRACE
+    WasiTrace trace;
+#endif
+};
+} // namespace tss
@@ -0,0 +1,305 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+
+struct WasiPreopen {
+    std::string guest_path;
+    std::filesystem::path host_path;
+    std::shared_ptr<const VfsPack> pack; // Preopened instead of `host_path` if set, and shared between instances
+};
+
+struct WasiInstanceConfig {
+    std::vector<std::string> args;
+    std::vector<std::string> environment;
+    std::vector<WasiPreopen> preopens;         // Become guest fds 3 and up, in order
+    bool io_uring           = false;           // Batch positioned file I/O through io_uring, where the kernel allows it
+    bool stat_cache         = true;            // Cache stat results and directory listings of host preopens
+    ClockMode clock         = ClockMode::vdso; // Where clock_time_get gets its time from
+    uint64_t clock_epoch_ns = 0;               // Realtime of a deterministic clock before its first tick
+    uint64_t clock_tick_ns  = 16666667;        // Simulation tick of a deterministic clock, 60 Hz
+    bool profile            = false;           // Time every WASI call into `WasiEnv::profile`
+    bool metered            = false;           // The module was compiled with metering, see `WasiEnv::fuel`
+    std::optional<uint64_t> random_seed;       // Makes random_get reproducible, it is keyed by the kernel otherwise
+    StartupTimeline *timeline = nullptr;       // Gets the "host setup", "bind imports" and "instantiate" phases
+};
+
+// Looks up an export by name, `exports` must have been retrieved from an instance of `module`
+inline auto wasm_instance_export_by_name(const wasm_module_t *module,
+                                         const wasm_extern_vec_t *exports,
+                                         std::string_view name) -> wasm_extern_t * {
+    wasm_exporttype_vec_t exporttypes;
+    ::wasm_module_exports(module, &exporttypes);
+
+    wasm_extern_t *found = nullptr;
+    for (size_t index = 0; index < exporttypes.size && index < exports->size; index++) {
+        auto export_name = ::wasm_exporttype_name(exporttypes.data[index]);
+        if (std::string_view(export_name->data, export_name->size) == name) {
+            found = exports->data[index];
+            break;
+        }
+    }
+
+    ::wasm_exporttype_vec_delete(&exporttypes);
+
+    return found;
+}
+
+// One guest instance with its own store and host context. Any number of these can share a single engine and compiled
+// module, but each one must only be used from one thread at a time
+class WasiInstance {
+public:
+    static auto create(wasm_engine_t *engine, const wasm_module_t *module, WasiInstanceConfig config)
+        -> std::unique_ptr<WasiInstance> {
+        std::unique_ptr<WasiInstance> self(new WasiInstance());
+        self->m_Engine          = engine;
+        self->m_Module          = module;
+        self->m_Env.store       = ::wasm_store_new(engine);
+        self->m_Env.args        = GuestStrings::from(config.args);
+        self->m_Env.environment = GuestStrings::from(config.environment);
+
+        if (config.io_uring && !self->m_Env.io.enable_io_uring()) {
+            fmt::print(stderr, "io_uring is not available, using preadv/pwritev\n");
+        }
+
+        self->m_Env.clock.set_virtual(config.clock_epoch_ns, config.clock_tick_ns);
+        if (!self->m_Env.clock.set_mode(config.clock)) {
+            fmt::print(stderr, "No invariant TSC, reading the clock through the vDSO\n");
+        }
+
+        if (config.random_seed) {
+            self->m_Env.random.seed(*config.random_seed);
+        }
+
+        self->m_Env.fds.install_stdio();
+        for (auto &preopen : config.preopens) {
+            if (preopen.pack) {
+                self->m_Env.fds.preopen(preopen.guest_path, std::move(preopen.pack));
+            } else if (!self->m_Env.fds.preopen(preopen.guest_path, preopen.host_path, config.stat_cache)) {
+                return nullptr;
+            }
+        }
+
+        if (config.profile) {
+            self->m_Env.profile.enable();
+        }
+        if (config.timeline) {
+            config.timeline->mark("host setup");
+        }
+
+        // The env pointer stays valid for the lifetime of the instance since `self` is heap allocated and never moves
+        wasm_extern_vec_t imports;
+        wasm_new_populated_imports_vec(&imports, module, self->m_Env.store, &self->m_Env, nullptr, config.profile);
+        if (config.timeline) {
+            config.timeline->mark("bind imports");
+        }
+
+        wasm_trap_t *trap = nullptr;
+        self->m_Instance  = ::wasm_instance_new(self->m_Env.store, module, &imports, &trap);
+        ::wasm_extern_vec_delete(&imports);
+
+        if (!self->m_Instance || trap) {
+            if (trap) {
+                wasm_message_t message;
+                ::wasm_trap_message(trap, &message);
+                fmt::print(stderr, "> Trap while instantiating: {}\n", std::string_view(message.data, message.size));
+                ::wasm_name_delete(&message);
+                ::wasm_trap_delete(trap);
+            }
+            return nullptr;
+        }
+
+        ::wasm_instance_exports(self->m_Instance, &self->m_Exports);
+        if (config.metered) {
+            self->m_Env.fuel.enable(self->m_Instance);
+        }
+        if (config.timeline) {
+            config.timeline->mark("instantiate");
+        }
+
+        if (auto memory = self->export_by_name("memory")) {
+            self->m_Env.memory = ::wasm_extern_as_memory(memory);
+        }
+
+        return self;
+    }
+
+    ~WasiInstance() {
+        // A transfer given up on for the watchdog may still be reading into the linear memory
+        m_Env.io.complete();
+        ::wasm_extern_vec_delete(&m_Exports);
+        if (m_Instance)
+            ::wasm_instance_delete(m_Instance);
+        if (m_Env.store)
+            ::wasm_store_delete(m_Env.store);
+    }
+
+    WasiInstance(const WasiInstance &)            = delete;
+    WasiInstance &operator=(const WasiInstance &) = delete;
+
+    auto export_by_name(std::string_view name) -> wasm_extern_t * {
+        return wasm_instance_export_by_name(m_Module, &m_Exports, name);
+    }
+
+    auto engine() -> wasm_engine_t * {
+        return m_Engine;
+    }
+
+    auto module() -> const wasm_module_t * {
+        return m_Module;
+    }
+
+    auto func(std::string_view name) -> wasm_func_t * {
+        auto found = export_by_name(name);
+        return found ? ::wasm_extern_as_func(found) : nullptr;
+    }
+
+    auto env() -> WasiEnv & {
+        return m_Env;
+    }
+
+    auto instance() -> wasm_instance_t * {
+        return m_Instance;
+    }
+
+    auto exports() -> const wasm_extern_vec_t & {
+        return m_Exports;
+    }
+
+private:
+    WasiInstance() = default;
+
+    WasiEnv m_Env{};
+    wasm_engine_t *m_Engine       = nullptr;
+    const wasm_module_t *m_Module = nullptr;
+    wasm_instance_t *m_Instance   = nullptr;
+    wasm_extern_vec_t m_Exports   = WASM_EMPTY_VEC;
+};
+
+inline auto wat_to_wasm(std::string_view wat_string) -> wasm_byte_vec_t {
+    wasm_byte_vec_t wat;
+    wasm_byte_vec_t wasm_bytes;
+    ::wasm_byte_vec_new(&wat, wat_string.size(), wat_string.data());
+    ::wat2wasm(&wat, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wat);
+    return wasm_bytes;
+}
+} // namespace tss
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("wasi_instance: instantiate") {
+    // Import binding is on this path, instantiating per request or per mod reload is only viable if it stays cheap
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (import "wasi_snapshot_preview1" "args_get" (func (param i32 i32) (result i32)))
+        (import "wasi_snapshot_preview1" "clock_time_get" (func (param i32 i64 i32) (result i32)))
+        (import "wasi_snapshot_preview1" "fd_write" (func (param i32 i32 i32 i32) (result i32)))
+        (import "wasi_snapshot_preview1" "path_open" (func (param i32 i32 i32 i32 i32 i64 i64 i32 i32) (result i32)))
+        (import "wasi_snapshot_preview1" "proc_exit" (func (param i32)))
+        (import "wasi_snapshot_preview1" "sock_shutdown" (func (param i32 i32) (result i32)))
+        (memory (export "memory") 1))))");
+
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    tss::bench::report("instantiate",
+                       tss::bench::ns_per_op(10000,
+                                             [&]() {
+                                                 auto instance = tss::WasiInstance::create(engine, module, {});
+                                                 tss::bench::do_not_optimize(instance);
+                                             }),
+                       "ns");
+
+    auto str = std::string_view("fd_write");
+    tss::bench::report("wasi_find_import",
+                       tss::bench::ns_per_op(1000000,
+                                             [&]() {
+                                                 tss::bench::do_not_optimize(
+                                                     tss::wasi_find_import("wasi_snapshot_preview1", str));
+                                             }),
+                       "ns");
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+
+BENCHMARK_CASE("wasi_instance: instance count scaling") {
+    // Every instance runs the same fixed amount of integer and memory work; with a shared engine and module and no
+    // shared mutable state, throughput should grow linearly with the instance count up to the number of cores
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 1)
+        (func (export "work") (param $iterations i32) (result i32)
+            (local $acc i32)
+            (loop $loop
+                (local.set $acc (i32.add (i32.mul (local.get $acc) (i32.const 31)) (local.get $iterations)))
+                (i32.store (i32.and (i32.shl (local.get $iterations) (i32.const 2)) (i32.const 0xfffc))
+                           (local.get $acc))
+                (local.set $iterations (i32.sub (local.get $iterations) (i32.const 1)))
+                (br_if $loop (local.get $iterations)))
+            (local.get $acc))))");
+
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config(tss::EngineConfig{});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+
+    constexpr int32_t iterations_per_call = 1 << 20;
+    constexpr size_t calls_per_instance   = 64;
+
+    const auto cores = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts;
+    for (unsigned count = 1; count < cores; count *= 2) {
+        counts.push_back(count);
+    }
+    counts.push_back(cores);
+
+    double single = 0.0;
+    for (auto count : counts) {
+        // Created up front, so only the calls are timed
+        std::vector<std::unique_ptr<tss::WasiInstance>> instances;
+        for (unsigned index = 0; index < count; index++) {
+            instances.push_back(tss::WasiInstance::create(engine, module, {}));
+        }
+
+        std::vector<std::thread> threads;
+        auto begin = tss::bench::now_ns();
+
+        for (auto &instance : instances) {
+            threads.emplace_back([&]() {
+                auto work = instance->func("work");
+                for (size_t call = 0; call < calls_per_instance; call++) {
+                    wasm_val_t args_val[1]    = {WASM_I32_VAL(iterations_per_call)};
+                    wasm_val_t results_val[1] = {WASM_INIT_VAL};
+                    wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+                    wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+                    if (auto trap = ::wasm_func_call(work, &args, &results)) {
+                        ::wasm_trap_delete(trap);
+                    }
+                    tss::bench::do_not_optimize(results_val[0].of.i32);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        auto seconds    = static_cast<double>(tss::bench::now_ns() - begin) / 1e9;
+        auto throughput = static_cast<double>(count * calls_per_instance) / seconds;
+        if (count == 1) {
+            single = throughput;
+        }
+
+        tss::bench::report(fmt::format("{} instance(s) throughput", count), throughput, "calls/s");
+        tss::bench::report(fmt::format("{} instance(s) scaling efficiency", count),
+                           100.0 * throughput / (single * count),
+                           "%");
+    }
+
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
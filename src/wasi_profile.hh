@@ -0,0 +1,349 @@
+#pragma once
+
+#include "inc.hh"
+
+#include <cmath>
+#include <csignal>
+#include <functional>
+
+// Per-function profile of WASI host calls: call count, bytes moved between guest memory and the host, and a latency
+// histogram for every function, kept per instance. Instances that profile have their imports bound to a timing wrapper
+// of each stub instead of the stub itself, so instances that do not profile run exactly the same code as without a
+// profiler. Like the trace ring buffer the profile has a single writer, the thread running the instance, and can be
+// read from any other thread at any time
+
+namespace tss {
+
+#define LATENCY_SUB_BUCKET_BITS 4 // 16 buckets per power of two, so a bucket is at most 1/16th wider than its start
+#define LATENCY_MAX_BITS 40       // About 18 minutes, longer calls are counted in the last bucket
+
+// Log-linear buckets in the style of HdrHistogram: exact below 32 ns, then 16 buckets for every power of two
+class LatencyHistogram {
+public:
+    static constexpr uint32_t sub_buckets  = 1U << LATENCY_SUB_BUCKET_BITS;
+    static constexpr uint32_t bucket_count = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * sub_buckets;
+
+    static auto bucket_of(uint64_t ns) -> uint32_t {
+        const auto width = static_cast<uint32_t>(std::bit_width(ns));
+        const auto shift = width > LATENCY_SUB_BUCKET_BITS + 1 ? width - LATENCY_SUB_BUCKET_BITS - 1 : 0;
+        return std::min(shift * sub_buckets + static_cast<uint32_t>(ns >> shift), bucket_count - 1);
+    }
+
+    // Smallest value that lands in `bucket`
+    static auto bucket_floor(uint32_t bucket) -> uint64_t {
+        if (bucket < 2 * sub_buckets) {
+            return bucket;
+        }
+        const auto shift = bucket / sub_buckets - 1;
+        return static_cast<uint64_t>(bucket - shift * sub_buckets) << shift;
+    }
+
+    void record(uint64_t ns) {
+        auto &count = m_Counts[bucket_of(ns)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    auto count(uint32_t bucket) const -> uint64_t {
+        return m_Counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    // Upper edge of the bucket holding the `p`th percentile, `p` in [0, 100], so reported latencies are never too low
+    auto percentile(double p) const -> uint64_t {
+        uint64_t total = 0;
+        for (uint32_t bucket = 0; bucket < bucket_count; bucket++) {
+            total += count(bucket);
+        }
+        if (total == 0) {
+            return 0;
+        }
+        const auto rank = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(total)));
+        uint64_t seen   = 0;
+        for (uint32_t bucket = 0; bucket < bucket_count; bucket++) {
+            seen += count(bucket);
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return bucket + 1 < bucket_count ? bucket_floor(bucket + 1) - 1 : bucket_floor(bucket);
+            }
+        }
+        return bucket_floor(bucket_count - 1);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count> m_Counts{};
+};
+
+struct WasiFuncProfile {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    LatencyHistogram latency;
+};
+
+// Plain copy of one function's counters, for reporting
+struct WasiFuncProfileSummary {
+    WasiFunc func;
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+class WasiProfile {
+public:
+    static constexpr size_t func_count = magic_enum::enum_count<WasiFunc>();
+
+    // Must be called before the instance binds its imports, which is what decides whether calls are timed at all
+    void enable() {
+        if (!m_Funcs) {
+            m_Funcs = std::make_unique<WasiFuncProfile[]>(func_count);
+        }
+    }
+
+    auto enabled() const -> bool {
+        return m_Funcs != nullptr;
+    }
+
+    void record(WasiFunc func, uint64_t ns, uint64_t bytes) {
+        auto &profile = m_Funcs[std::to_underlying(func)];
+        auto bump     = [](std::atomic<uint64_t> &counter, uint64_t value) {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        };
+        bump(profile.calls, 1);
+        bump(profile.bytes, bytes);
+        bump(profile.total_ns, ns);
+        if (ns > profile.max_ns.load(std::memory_order_relaxed)) {
+            profile.max_ns.store(ns, std::memory_order_relaxed);
+        }
+        profile.latency.record(ns);
+    }
+
+    auto func(WasiFunc func) const -> const WasiFuncProfile & {
+        return m_Funcs[std::to_underlying(func)];
+    }
+
+    // Functions that were called at least once, the most time spent first
+    auto summary() const -> std::vector<WasiFuncProfileSummary> {
+        std::vector<WasiFuncProfileSummary> out;
+        if (!m_Funcs) {
+            return out;
+        }
+        for (size_t index = 0; index < func_count; index++) {
+            const auto &profile = m_Funcs[index];
+            const auto calls    = profile.calls.load(std::memory_order_relaxed);
+            if (calls == 0) {
+                continue;
+            }
+            out.push_back({static_cast<WasiFunc>(index),
+                           calls,
+                           profile.bytes.load(std::memory_order_relaxed),
+                           profile.total_ns.load(std::memory_order_relaxed),
+                           profile.max_ns.load(std::memory_order_relaxed),
+                           profile.latency.percentile(50),
+                           profile.latency.percentile(90),
+                           profile.latency.percentile(99),
+                           profile.latency.percentile(99.9)});
+        }
+        std::sort(out.begin(), out.end(), [](const auto &lhs, const auto &rhs) { return lhs.total_ns > rhs.total_ns; });
+        return out;
+    }
+
+private:
+    std::unique_ptr<WasiFuncProfile[]> m_Funcs;
+};
+
+inline auto wasi_profile_to_table(const WasiProfile &profile) -> std::string {
+    std::string str = fmt::format("{:<24} {:>10} {:>12} {:>10} {:>9} {:>9} {:>9} {:>9} {:>9}\n",
+                                  "function",
+                                  "calls",
+                                  "bytes",
+                                  "total ms",
+                                  "mean us",
+                                  "p50 us",
+                                  "p99 us",
+                                  "p99.9 us",
+                                  "max us");
+    for (const auto &entry : profile.summary()) {
+        str += fmt::format("{:<24} {:>10} {:>12} {:>10.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f}\n",
+                           magic_enum::enum_name(entry.func),
+                           entry.calls,
+                           entry.bytes,
+                           static_cast<double>(entry.total_ns) / 1e6,
+                           static_cast<double>(entry.total_ns) / static_cast<double>(entry.calls) / 1e3,
+                           static_cast<double>(entry.p50_ns) / 1e3,
+                           static_cast<double>(entry.p99_ns) / 1e3,
+                           static_cast<double>(entry.p999_ns) / 1e3,
+                           static_cast<double>(entry.max_ns) / 1e3);
+    }
+    return str;
+}
+
+// Every function with its non-empty histogram buckets as [floor_ns, count] pairs, for plotting or diffing runs
+inline auto wasi_profile_to_json(const WasiProfile &profile) -> std::string {
+    std::string str = "{\"functions\": [";
+    bool first      = true;
+    for (const auto &entry : profile.summary()) {
+        str += fmt::format("{}\n  {{\"name\": \"{}\", \"calls\": {}, \"bytes\": {}, \"total_ns\": {}, \"max_ns\": {}, "
+                           "\"p50_ns\": {}, \"p90_ns\": {}, \"p99_ns\": {}, \"p999_ns\": {}, \"histogram\": [",
+                           first ? "" : ",",
+                           magic_enum::enum_name(entry.func),
+                           entry.calls,
+                           entry.bytes,
+                           entry.total_ns,
+                           entry.max_ns,
+                           entry.p50_ns,
+                           entry.p90_ns,
+                           entry.p99_ns,
+                           entry.p999_ns);
+        first = false;
+
+        const auto &latency = profile.func(entry.func).latency;
+        bool first_bucket   = true;
+        for (uint32_t bucket = 0; bucket < LatencyHistogram::bucket_count; bucket++) {
+            if (const auto count = latency.count(bucket)) {
+                const auto floor = LatencyHistogram::bucket_floor(bucket);
+                str += fmt::format("{}[{}, {}]", first_bucket ? "" : ", ", floor, count);
+                first_bucket = false;
+            }
+        }
+        str += "]}";
+    }
+    str += "\n]}\n";
+    return str;
+}
+
+// The table goes to stderr if `json_path` is empty, the JSON replaces the file otherwise
+inline auto wasi_profile_dump(const WasiProfile &profile, const std::string &json_path) -> bool {
+    if (json_path.empty()) {
+        fmt::print(stderr, "WASI profile:\n{}", wasi_profile_to_table(profile));
+        return true;
+    }
+    std::ofstream out(json_path, std::ios::binary | std::ios::trunc);
+    out << wasi_profile_to_json(profile);
+    if (!out) {
+        fmt::print(stderr, "WASI profile: could not write {}\n", json_path);
+        return false;
+    }
+    return true;
+}
+
+// Runs `func` on a thread of its own whenever the process receives `signal`, so a profile can be dumped while the guest
+// keeps running. The handler only writes to a pipe, which is all that is safe to do there. One per process
+class SignalDumper {
+public:
+    static auto create(int signal, std::function<void()> func) -> std::unique_ptr<SignalDumper> {
+        std::unique_ptr<SignalDumper> self(new SignalDumper());
+        if (::pipe2(self->m_Pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            fmt::print(stderr, "SignalDumper: pipe2: {}\n", std::strerror(errno));
+            return nullptr;
+        }
+        // Only the write end must not block, the thread waits in a blocking read
+        ::fcntl(self->m_Pipe[0], F_SETFL, 0);
+
+        s_WriteFd.store(self->m_Pipe[1], std::memory_order_relaxed);
+        struct sigaction action{};
+        action.sa_handler = [](int) {
+            const int saved_errno = errno;
+            const char byte       = 1;
+            [[maybe_unused]] const auto written = ::write(s_WriteFd.load(std::memory_order_relaxed), &byte, 1);
+            errno = saved_errno;
+        };
+        action.sa_flags = SA_RESTART;
+        ::sigemptyset(&action.sa_mask);
+        if (::sigaction(signal, &action, &self->m_Previous) < 0) {
+            fmt::print(stderr, "SignalDumper: sigaction: {}\n", std::strerror(errno));
+            return nullptr;
+        }
+        self->m_Signal = signal;
+
+        self->m_Thread = std::thread([self = self.get(), func = std::move(func)] {
+            char byte = 0;
+            while (::read(self->m_Pipe[0], &byte, 1) == 1 && byte == 1) {
+                func();
+            }
+        });
+        return self;
+    }
+
+    ~SignalDumper() {
+        if (m_Signal >= 0) {
+            ::sigaction(m_Signal, &m_Previous, nullptr);
+        }
+        if (m_Thread.joinable()) {
+            const char stop = 0;
+            [[maybe_unused]] const auto written = ::write(m_Pipe[1], &stop, 1);
+            m_Thread.join();
+        }
+        for (int fd : m_Pipe) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    SignalDumper(const SignalDumper &)            = delete;
+    SignalDumper &operator=(const SignalDumper &) = delete;
+
+private:
+    SignalDumper() = default;
+
+    static inline std::atomic<int> s_WriteFd{-1};
+
+    int m_Pipe[2] = {-1, -1};
+    int m_Signal  = -1;
+    struct sigaction m_Previous{};
+    std::thread m_Thread;
+};
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("LatencyHistogram") {
+    // Buckets are contiguous and every value lands in a bucket no more than 1/16th wider than where it starts
+    for (uint32_t bucket = 1; bucket < tss::LatencyHistogram::bucket_count; bucket++) {
+        const auto floor = tss::LatencyHistogram::bucket_floor(bucket);
+        REQUIRE(floor > tss::LatencyHistogram::bucket_floor(bucket - 1));
+        REQUIRE(tss::LatencyHistogram::bucket_of(floor) == bucket);
+        REQUIRE(tss::LatencyHistogram::bucket_of(floor - 1) == bucket - 1);
+    }
+    REQUIRE(tss::LatencyHistogram::bucket_of(UINT64_MAX) == tss::LatencyHistogram::bucket_count - 1);
+
+    tss::LatencyHistogram histogram;
+    for (uint64_t ns = 1; ns <= 1000; ns++) {
+        histogram.record(ns * 1000);
+    }
+    const auto p50 = histogram.percentile(50);
+    REQUIRE(p50 >= 500000);
+    REQUIRE(p50 < 500000 + 500000 / 16);
+    REQUIRE(histogram.percentile(100) >= 1000000);
+
+    tss::WasiProfile profile;
+    REQUIRE(profile.summary().empty());
+    profile.enable();
+    profile.record(tss::WasiFunc::fd_write, 2000, 100);
+    profile.record(tss::WasiFunc::fd_write, 4000, 50);
+    profile.record(tss::WasiFunc::clock_time_get, 30, 0);
+    const auto summary = profile.summary();
+    REQUIRE(summary.size() == 2);
+    REQUIRE(summary[0].func == tss::WasiFunc::fd_write);
+    REQUIRE(summary[0].calls == 2);
+    REQUIRE(summary[0].bytes == 150);
+    REQUIRE(summary[0].max_ns == 4000);
+    REQUIRE(tss::wasi_profile_to_table(profile).find("clock_time_get") != std::string::npos);
+    REQUIRE(tss::wasi_profile_to_json(profile).find("\"name\": \"fd_write\", \"calls\": 2") != std::string::npos);
+}
+
+TEST_CASE("SignalDumper") {
+    std::atomic<int> dumps{0};
+    auto dumper = tss::SignalDumper::create(SIGUSR2, [&] { dumps++; });
+    REQUIRE(dumper);
+    ::raise(SIGUSR2);
+    for (int attempt = 0; attempt < 1000 && dumps == 0; attempt++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(dumps == 1);
+    dumper.reset();
+}
+#endif
@@ -6,10 +6,6 @@
 
 namespace tss {
 
-inline wasm_store_t *g_store = nullptr;
-
-inline wasm_memory_t *g_memory = nullptr;
-
 inline auto str_replace(std::string str, const std::string &from, const std::string &to) -> std::string {
     size_t start_pos = 0;
     while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
@@ -129,98 +125,66 @@ inline auto wasm_val_vec_to_str(const wasm_val_vec_t *vals) -> std::string {
     return str;
 }
 
-inline auto wasm_check_pointer(uint32_t pointer_value, size_t object_size, size_t mem_size) -> bool {
-    if (object_size > mem_size) {
-        return false;
-    }
-    if (pointer_value > static_cast<uint32_t>(mem_size - object_size)) {
-        return false;
-    }
-    return true;
-}
-
-inline auto wasm_wasi_fix_return_type(wasm_valkind_t *kind, bool *printed) -> std::string {
-    std::string str{};
-
-    if (*kind != WASM_I32) {
-        if (!*printed) {
-            *printed = true;
-            str      = fmt::format("Correcting return type from {}\n", wasm_valkind_to_str(*kind));
-        }
-        *kind = WASM_I32;
-    }
-
-    return str;
-}
-
 inline auto
 wasm_func_called_to_str(std::string func, const wasm_val_vec_t *args, const wasm_val_vec_t *results) -> std::string {
     return fmt::format("func called {}({}) -> ({})", func, wasm_val_vec_to_str(args), wasm_val_vec_to_str(results));
 }
 
-template <wasm_valkind_t T, typename R = void>
-inline constexpr auto wasm_get_from_val(wasm_val_t val) {
-    assert(val.kind == T);
-    if constexpr (T == WASM_I32) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.i32;
-        } else {
-            return static_cast<R>(val.of.i32);
-        }
-    }
-    if constexpr (T == WASM_I64) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.i64;
-        } else {
-            return static_cast<R>(val.of.i64);
-        }
-    }
-    if constexpr (T == WASM_F32) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.f32;
-        } else {
-            return static_cast<R>(val.of.f32);
-        }
-    }
-    if constexpr (T == WASM_F64) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.f64;
-        } else {
-            return static_cast<R>(val.of.f64);
-        }
-    }
-    if constexpr (T == WASM_EXTERNREF) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.ref;
-        } else {
-            return static_cast<R>(val.of.ref);
-        }
-    }
-    if constexpr (T == WASM_FUNCREF) {
-        if constexpr (std::is_same<R, void>()) {
-            return val.of.ref;
-        } else {
-            return static_cast<R>(val.of.ref);
-        }
-    }
-}
-
-inline auto wasm_not_implemented_trap() -> wasm_trap_t * {
+inline auto wasm_not_implemented_trap(WasiEnv *ctx, std::string_view func) -> wasm_trap_t * {
     wasm_message_t message;
-    ::wasm_name_new_from_string_nt(&message, "not implemented");
-    wasm_trap_t *trap = ::wasm_trap_new(g_store, &message);
+    ::wasm_name_new_from_string_nt(&message, fmt::format("{}: not implemented", func).c_str());
+    wasm_trap_t *trap = ::wasm_trap_new(ctx->store, &message);
+    ctx->stats.traps++;
     ::wasm_name_delete(&message);
     return trap;
 }
 
-inline auto wasm_out_of_bounds_trap() -> wasm_trap_t * {
+inline auto wasm_out_of_bounds_trap(WasiEnv *ctx) -> wasm_trap_t * {
     wasm_message_t message;
     ::wasm_name_new_from_string_nt(&message, "out of bounds memory access");
-    wasm_trap_t *trap = ::wasm_trap_new(g_store, &message);
+    wasm_trap_t *trap = ::wasm_trap_new(ctx->store, &message);
+    ctx->stats.traps++;
     ::wasm_name_delete(&message);
     return trap;
 }
 
+// Every WASI call returns through here, so the only cost tracing adds to a host call is this, and nothing at all when
+// `WASI_TRACE` is not defined
+inline auto wasi_return(WasiEnv *ctx,
+                        WasiFunc func,
+                        const wasm_val_vec_t *args,
+                        const wasm_val_vec_t *results,
+                        wasm_trap_t *trap) -> wasm_trap_t * {
+#ifdef WASI_TRACE
+    if (ctx->trace.enabled()) [[unlikely]] {
+        ctx->trace.record(func, args, results, trap != nullptr);
+    }
+#else
+    UNUSED(ctx);
+    UNUSED(func);
+    UNUSED(args);
+    UNUSED(results);
+#endif
+    return trap;
+}
+
+// Makes the current host call trap once it returns
+inline auto wasi_trap_not_implemented(WasiEnv &ctx, std::string_view func) -> Errno {
+    ctx.trap = wasm_not_implemented_trap(&ctx, func);
+    return Errno::e_nosys;
+}
+
+inline auto wasi_trap_out_of_bounds(WasiEnv &ctx) -> Errno {
+    ctx.trap = wasm_out_of_bounds_trap(&ctx);
+    return Errno::e_fault;
+}
+
+// Counts `bytes` as moved across the host boundary, for the profiler
+inline auto wasi_moved(WasiEnv &ctx, __wasi_size_t bytes) -> __wasi_size_t {
+    ctx.stats.bytes += bytes;
+    return bytes;
+}
+
 #define NANOSECONDS_PER_SECOND 1000000000ULL
 
 inline auto timespec_to_nanoseconds(const timespec *ts) -> __wasi_timestamp_t {
@@ -557,724 +521,1200 @@ inline auto convert_errno(int error) -> __wasi_errno_t {
 
 // #define mem_as(mem, as) *reinterpret_cast<as *>(&mem)
 
-inline auto wasi_args_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+// Shared by args and environ: the blob goes over in one copy, followed by its offset table relocated to where the blob
+// landed in the guest. Both arrays are sized by the matching `*_sizes_get`, only their start offsets are passed in
+inline auto
+wasi_strings_get(WasiEnv &ctx, const GuestStrings &strings, GuestPtr<uint32_t> pointers, GuestPtr<uint8_t> buf)
+    -> Errno {
+    GuestSpan<uint32_t> pointer_span(ctx.guest, pointers.offset(), strings.count());
+    GuestSpan<uint8_t> buf_span(ctx.guest, buf.offset(), strings.size());
+    if (!pointer_span || !buf_span) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    std::memcpy(buf_span.bytes().data(), strings.blob.data(), wasi_moved(ctx, strings.size()));
+    for (uint32_t index = 0; index < strings.count(); index++) {
+        pointer_span.store(index, buf.offset() + strings.offsets[index]);
+    }
+    return Errno::e_success;
 }
 
-inline auto wasi_args_sizes_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_strings_sizes_get(WasiEnv &ctx,
+                                   const GuestStrings &strings,
+                                   GuestPtr<__wasi_size_t> count,
+                                   GuestPtr<__wasi_size_t> buf_size) -> Errno {
+    if (!count || !buf_size) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    count.store(strings.count());
+    buf_size.store(strings.size());
+    return Errno::e_success;
+}
+
+inline auto wasi_args_get(WasiEnv &ctx, GuestPtr<uint32_t> argv, GuestPtr<uint8_t> argv_buf) -> Errno {
+    return wasi_strings_get(ctx, ctx.args, argv, argv_buf);
+}
+
+inline auto
+wasi_args_sizes_get(WasiEnv &ctx, GuestPtr<__wasi_size_t> argc, GuestPtr<__wasi_size_t> argv_buf_size) -> Errno {
+    return wasi_strings_sizes_get(ctx, ctx.args, argc, argv_buf_size);
 }
 
-inline std::vector<const char *> environment({"MYVAR=ASD", ""});
+inline auto wasi_environ_get(WasiEnv &ctx, GuestPtr<uint32_t> environ_ptrs, GuestPtr<uint8_t> environ_buf) -> Errno {
+    return wasi_strings_get(ctx, ctx.environment, environ_ptrs, environ_buf);
+}
 
-inline auto constexpr get_str_vector_byte_size(std::vector<const char *> vec) -> size_t {
-    size_t size = 0;
+inline auto wasi_environ_sizes_get(WasiEnv &ctx,
+                                   GuestPtr<__wasi_size_t> environ_count,
+                                   GuestPtr<__wasi_size_t> environ_buf_size) -> Errno {
+    return wasi_strings_sizes_get(ctx, ctx.environment, environ_count, environ_buf_size);
+}
 
-    for (auto &elem : vec) {
-        size += std::strlen(elem) + 1;
+inline auto
+wasi_clock_res_get(WasiEnv &ctx, __wasi_clockid_t clock_id, GuestPtr<__wasi_timestamp_t> resolution) -> Errno {
+    if (!resolution) {
+        return wasi_trap_out_of_bounds(ctx);
     }
+    if (!magic_enum::enum_contains<ClockID>(clock_id)) {
+        return Errno::e_inval;
+    }
+    resolution.store(ctx.clock.resolution(static_cast<ClockID>(clock_id)));
+    return Errno::e_success;
+}
 
-    return size;
+// Served by the instance's clock provider, see `WasiClock`
+inline auto wasi_clock_time_get(WasiEnv &ctx,
+                                __wasi_clockid_t clock_id,
+                                __wasi_timestamp_t precision,
+                                GuestPtr<__wasi_timestamp_t> time) -> Errno {
+    UNUSED(precision);
+    if (!time) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    if (!magic_enum::enum_contains<ClockID>(clock_id)) {
+        return Errno::e_inval;
+    }
+    time.store(ctx.clock.now(static_cast<ClockID>(clock_id)));
+    return Errno::e_success;
 }
 
-inline auto wasi_environ_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    assert(args->size == 2);
-    assert(results->size == 1);
-    wasm_trap_t *out = nullptr;
+// Points host iovecs straight into linear memory, so the data is never copied on the host side. False if any buffer is
+// out of bounds
+inline auto wasi_iovecs_from_guest(WasiEnv &ctx, GuestSpan<__wasi_guest_iovec_t> iovs) -> bool {
+    ctx.iovecs.resize(iovs.size());
+    for (uint32_t index = 0; index < iovs.size(); index++) {
+        const auto iov   = iovs.load(index);
+        const auto bytes = ctx.guest.bytes(iov.buf, iov.buf_len);
+        if (bytes.size() != iov.buf_len) {
+            return false;
+        }
+        ctx.iovecs[index] = {bytes.data(), bytes.size()};
+    }
+    return true;
+}
 
-    uint32_t environ_ptr     = wasm_get_from_val<WASM_I32, uint32_t>(args->data[0]);
-    uint32_t environ_buf_ptr = wasm_get_from_val<WASM_I32, uint32_t>(args->data[1]);
-    byte_t *mem              = wasm_memory_data(g_memory);
-    size_t mem_size          = wasm_memory_data_size(g_memory);
+// Checks and translates the arguments shared by all reads and writes, on success `out` is the fd's entry
+inline auto wasi_fd_transfer_prepare(WasiEnv &ctx,
+                                     __wasi_fd_t fd,
+                                     GuestSpan<__wasi_guest_iovec_t> iovs,
+                                     GuestPtr<__wasi_size_t> ntransferred,
+                                     __wasi_rights_t rights,
+                                     FdEntry **out) -> Errno {
+    if (!iovs || !ntransferred) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    // Before translating, so the guest can not make the host allocate iovecs for its whole memory
+    if (iovs.size() > IOV_MAX) {
+        return Errno::e_inval;
+    }
+    if (!wasi_iovecs_from_guest(ctx, iovs)) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    if (auto error = ctx.fds.lookup(fd, rights, out); error != Errno::e_success) {
+        return error;
+    }
+    // A deferred fd_pwrite to the fd that failed since
+    if (const int error = ctx.io.take_error((*out)->host_fd); error != 0) {
+        return static_cast<Errno>(convert_errno(error));
+    }
+    return Errno::e_success;
+}
 
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
+// Reads from a pack file are copies out of the mapping, short at the end of the file like a regular read
+inline auto wasi_pack_read(const FdEntry &entry, const std::vector<iovec> &iovecs, uint64_t offset) -> __wasi_size_t {
+    const auto contents = entry.pack->contents(entry.pack_index);
+    __wasi_size_t total = 0;
+    for (const auto &iov : iovecs) {
+        if (offset >= contents.size()) {
+            break;
+        }
+        const auto count =
+            std::min({static_cast<uint64_t>(iov.iov_len), contents.size() - offset, uint64_t{UINT32_MAX - total}});
+        std::memcpy(iov.iov_base, contents.data() + offset, count);
+        offset += count;
+        total += static_cast<__wasi_size_t>(count);
+    }
+    return total;
+}
 
-    auto target_environ_ptr     = reinterpret_cast<__wasi_size_t *>(&mem[environ_ptr]);
-    auto target_environ_buf_ptr = reinterpret_cast<__wasi_size_t *>(&mem[environ_buf_ptr]);
-    std::string memdump{};
+// One readv or writev per call. A short transfer is reported to the guest as is, like the syscall does, and it is up
+// to the guest to retry with the rest
+template <auto Transfer, Rights Required>
+inline auto wasi_fd_transfer(WasiEnv &ctx,
+                             __wasi_fd_t fd,
+                             GuestSpan<__wasi_guest_iovec_t> iovs,
+                             GuestPtr<__wasi_size_t> ntransferred) -> Errno {
+    FdEntry *entry = nullptr;
+    if (auto error = wasi_fd_transfer_prepare(ctx, fd, iovs, ntransferred, std::to_underlying(Required), &entry);
+        error != Errno::e_success) {
+        return error;
+    }
 
-    if (!wasm_check_pointer(environ_ptr, sizeof(__wasi_size_t), mem_size)) {
-        // TODO : Which one of these two should we resort to? Its safer to throw for now
-        // results->data[0].of.i32 = std::to_underlying(Errno::e_2big);
-        out = wasm_out_of_bounds_trap();
-        goto out;
+    if constexpr (Required == Rights::fd_read) {
+        if (entry->pack) {
+            if (entry->filetype == Filetype::directory) {
+                return Errno::e_isdir;
+            }
+            const auto result = wasi_pack_read(*entry, ctx.iovecs, entry->position);
+            entry->position += result;
+            ntransferred.store(wasi_moved(ctx, result));
+            return Errno::e_success;
+        }
     }
 
-    if (!wasm_check_pointer(environ_buf_ptr, sizeof(__wasi_size_t), mem_size)) {
-        // TODO : Which one of these two should we resort to? Its safer to throw for now
-        // results->data[0].of.i32 = std::to_underlying(Errno::e_2big);
-        out = wasm_out_of_bounds_trap();
-        goto out;
+    ssize_t result;
+    do {
+        result = Transfer(entry->host_fd, ctx.iovecs.data(), static_cast<int>(ctx.iovecs.size()));
+    } while (result < 0 && errno == EINTR && !ctx.interrupted.load(std::memory_order_relaxed));
+
+    if (result < 0) {
+        return static_cast<Errno>(convert_errno(errno));
+    }
+    if constexpr (Required == Rights::fd_write) {
+        ctx.fds.note_write();
     }
 
-    // TODO THIS IS NOT DONE
-    *target_environ_ptr     = static_cast<__wasi_size_t>(environment.size());
-    *target_environ_buf_ptr = static_cast<__wasi_size_t>(get_str_vector_byte_size(environment));
-    str += fmt::format("setting mem {:#Lx} to {:#Lx}\n", environ_ptr, *target_environ_ptr);
-    memdump =
-        str_replace(memdump_to_str(target_environ_buf_ptr, get_str_vector_byte_size(environment) * 4, environ_buf_ptr),
-                    "\n",
-                    "\n  ");
-    str += fmt::format("setting mem {:#Lx} to \n  {}\n", environ_buf_ptr, memdump);
+    ntransferred.store(wasi_moved(ctx, static_cast<__wasi_size_t>(result)));
+    return Errno::e_success;
+}
 
-out:
-    str = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    fmt::print("==> {}", str);
-    return out;
+// Positioned reads and writes go through the instance's `FileIo`. With io_uring enabled, writes to regular files are
+// deferred until the next WASI call that is not a fd_pwrite, and submitted together. Appends are not, their order is
+// the file's. Like pread and pwrite they need the seek right on top of read or write
+template <bool Write>
+inline auto wasi_fd_transfer_at(WasiEnv &ctx,
+                                __wasi_fd_t fd,
+                                GuestSpan<__wasi_guest_iovec_t> iovs,
+                                __wasi_filesize_t offset,
+                                GuestPtr<__wasi_size_t> ntransferred) -> Errno {
+    const auto rights = wasi_rights({Write ? Rights::fd_write : Rights::fd_read, Rights::fd_seek});
+    FdEntry *entry    = nullptr;
+    if (auto error = wasi_fd_transfer_prepare(ctx, fd, iovs, ntransferred, rights, &entry); error != Errno::e_success) {
+        return error;
+    }
+    if (offset > static_cast<__wasi_filesize_t>(INT64_MAX)) {
+        return Errno::e_inval;
+    }
+    if constexpr (!Write) {
+        if (entry->pack) {
+            if (entry->filetype == Filetype::directory) {
+                return Errno::e_isdir;
+            }
+            ntransferred.store(wasi_moved(ctx, wasi_pack_read(*entry, ctx.iovecs, offset)));
+            return Errno::e_success;
+        }
+    }
+
+    const auto count = static_cast<int>(ctx.iovecs.size());
+    if constexpr (Write) {
+        const bool append = (entry->flags & std::to_underlying(FDFlags::append)) != 0;
+        if (entry->filetype == Filetype::regular_file && !append) {
+            if (auto queued = ctx.io.write_deferred(entry->host_fd, ctx.iovecs.data(), count, offset)) {
+                ctx.fds.note_write();
+                ntransferred.store(wasi_moved(ctx, *queued));
+                return Errno::e_success;
+            }
+        }
+    }
+
+    const auto result = ctx.io.transfer(Write, entry->host_fd, ctx.iovecs.data(), count, offset, &ctx.interrupted);
+    if (result < 0) {
+        return static_cast<Errno>(convert_errno(static_cast<int>(-result)));
+    }
+    if constexpr (Write) {
+        ctx.fds.note_write();
+    }
+
+    ntransferred.store(wasi_moved(ctx, static_cast<__wasi_size_t>(result)));
+    return Errno::e_success;
 }
 
-inline auto
-wasi_environ_sizes_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    assert(args->size == 2);
-    assert(results->size == 1);
-    wasm_trap_t *out = nullptr;
+inline auto wasi_filestat_from_stat(const struct stat &st) -> __wasi_filestat_t {
+    __wasi_filestat_t stat{};
+    stat.dev      = st.st_dev;
+    stat.ino      = st.st_ino;
+    stat.filetype = std::to_underlying(wasi_filetype_from_mode(st.st_mode));
+    stat.nlink    = st.st_nlink;
+    stat.size     = static_cast<__wasi_filesize_t>(st.st_size);
+    stat.atim     = timespec_to_nanoseconds(&st.st_atim);
+    stat.mtim     = timespec_to_nanoseconds(&st.st_mtim);
+    stat.ctim     = timespec_to_nanoseconds(&st.st_ctim);
+    return stat;
+}
 
-    uint32_t environ_count_ptr    = wasm_get_from_val<WASM_I32, uint32_t>(args->data[0]);
-    uint32_t environ_buf_size_ptr = wasm_get_from_val<WASM_I32, uint32_t>(args->data[1]);
-    byte_t *mem                   = wasm_memory_data(g_memory);
-    size_t mem_size               = wasm_memory_data_size(g_memory);
+// openat2 reports paths that would leave the preopen as EXDEV, which to the guest is a missing capability
+inline auto wasi_host_errno(int error) -> Errno {
+    return error == EXDEV ? Errno::e_notcapable : static_cast<Errno>(convert_errno(error));
+}
 
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
+// Appends one entry to a fd_readdir buffer, cut off if the buffer runs out
+inline void
+wasi_dirent_append(std::span<uint8_t> out, size_t *used, const __wasi_dirent_t &dirent, std::string_view name) {
+    const auto header = std::min(sizeof(dirent), out.size() - *used);
+    std::memcpy(out.data() + *used, &dirent, header);
+    *used += header;
+    const auto name_size = std::min(name.size(), out.size() - *used);
+    std::memcpy(out.data() + *used, name.data(), name_size);
+    *used += name_size;
+}
 
-    auto target_environ_count_ptr    = reinterpret_cast<__wasi_size_t *>(&mem[environ_count_ptr]);
-    auto target_environ_buf_size_ptr = reinterpret_cast<__wasi_size_t *>(&mem[environ_buf_size_ptr]);
+// Resolves `path` inside the pack directory `dir`. Like everywhere in WASI, paths are relative to the directory fd and
+// may not escape it
+inline auto wasi_pack_resolve(const FdEntry &dir, std::string_view path, uint32_t *out) -> Errno {
+    if (path.empty()) {
+        return Errno::e_noent;
+    }
+    if (path.front() == '/') {
+        return Errno::e_notcapable;
+    }
+    if (auto error = dir.pack->lookup(dir.pack_index, path, out); error != Errno::e_success) {
+        return error;
+    }
+    if (path.back() == '/' && !dir.pack->is_directory(*out)) {
+        return Errno::e_notdir;
+    }
+    return Errno::e_success;
+}
 
-    if (!wasm_check_pointer(environ_count_ptr, sizeof(__wasi_size_t), mem_size)) {
-        // TODO : Which one of these two should we resort to? Its safer to throw for now
-        // results->data[0].of.i32 = std::to_underlying(Errno::e_2big);
-        out = wasm_out_of_bounds_trap();
-        goto out;
+inline auto wasi_fd_advise(WasiEnv &ctx,
+                           __wasi_fd_t fd,
+                           __wasi_filesize_t offset,
+                           __wasi_filesize_t len,
+                           __wasi_advice_t advice) -> Errno {
+    UNUSED(fd);
+    UNUSED(offset);
+    UNUSED(len);
+    UNUSED(advice);
+    return wasi_trap_not_implemented(ctx, __func__);
+}
+
+inline auto wasi_fd_close(WasiEnv &ctx, __wasi_fd_t fd) -> Errno {
+    auto entry = ctx.fds.remove(fd);
+    if (!entry) {
+        return Errno::e_badf;
+    }
+    // Deferred writes were completed before this call, a failed one is reported here at the latest
+    const int deferred_error = ctx.io.take_error(entry->host_fd);
+    // The slot is free even if the host close fails, Linux releases the descriptor either way
+    if (entry->owned && ::close(entry->host_fd) < 0) {
+        return static_cast<Errno>(convert_errno(errno));
     }
+    return deferred_error != 0 ? static_cast<Errno>(convert_errno(deferred_error)) : Errno::e_success;
+}
+
+inline auto wasi_fd_datasync(WasiEnv &ctx, __wasi_fd_t fd) -> Errno {
+    UNUSED(fd);
+    return wasi_trap_not_implemented(ctx, __func__);
+}
 
-    if (!wasm_check_pointer(environ_buf_size_ptr, sizeof(__wasi_size_t), mem_size)) {
-        // TODO : Which one of these two should we resort to? Its safer to throw for now
-        // results->data[0].of.i32 = std::to_underlying(Errno::e_2big);
-        out = wasm_out_of_bounds_trap();
-        goto out;
+inline auto wasi_fd_fdstat_get(WasiEnv &ctx, __wasi_fd_t fd, GuestPtr<__wasi_fdstat_t> stat) -> Errno {
+    if (!stat) {
+        return wasi_trap_out_of_bounds(ctx);
     }
 
-    *target_environ_count_ptr    = static_cast<__wasi_size_t>(environment.size());
-    *target_environ_buf_size_ptr = static_cast<__wasi_size_t>(get_str_vector_byte_size(environment));
-    str += fmt::format("setting mem {:#Lx} to {:#Lx}\n", environ_count_ptr, *target_environ_count_ptr);
-    str += fmt::format("setting mem {:#Lx} to {:#Lx}\n", environ_buf_size_ptr, *target_environ_buf_size_ptr);
+    auto entry = ctx.fds.get(fd);
+    if (!entry) {
+        return Errno::e_badf;
+    }
 
-out:
-    str = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    fmt::print("==> {}", str);
-    return out;
-}
+    __wasi_fdstat_t out{};
+    out.fs_filetype          = std::to_underlying(entry->filetype);
+    out.fs_flags             = entry->flags;
+    out.fs_rights_base       = entry->rights_base;
+    out.fs_rights_inheriting = entry->rights_inheriting;
+    stat.store(out);
 
-inline auto wasi_clock_res_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+    return Errno::e_success;
 }
 
-inline auto wasi_clock_time_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    assert(args->size == 3);
-    assert(results->size == 1);
-    wasm_trap_t *out = nullptr;
-
-    __wasi_clockid_t clock_id = wasm_get_from_val<WASM_I32, __wasi_clockid_t>(args->data[0]);
-    int64_t precision         = wasm_get_from_val<WASM_I64>(args->data[1]);
-    uint32_t time_ptr         = wasm_get_from_val<WASM_I32, uint32_t>(args->data[2]);
-    byte_t *mem               = wasm_memory_data(g_memory);
-    size_t mem_size           = wasm_memory_data_size(g_memory);
-    UNUSED(precision);
+inline auto wasi_fd_fdstat_set_flags(WasiEnv &ctx, __wasi_fd_t fd, __wasi_fdflags_t flags) -> Errno {
+    FdEntry *entry = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::fd_fdstat_set_flags), &entry);
+        error != Errno::e_success) {
+        return error;
+    }
 
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
+    // Linux ignores the synchronized I/O flags in F_SETFL, so only pretend to support what actually changes
+    const auto settable = std::to_underlying(FDFlags::append) | std::to_underlying(FDFlags::nonblock);
+    if ((flags & ~settable) != 0) {
+        return Errno::e_notsup;
+    }
 
-    auto target = reinterpret_cast<__wasi_timestamp_t *>(&mem[time_ptr]);
+    int host_flags = ::fcntl(entry->host_fd, F_GETFL);
+    if (host_flags < 0) {
+        return static_cast<Errno>(convert_errno(errno));
+    }
+    host_flags &= ~(O_APPEND | O_NONBLOCK);
+    host_flags |= (flags & std::to_underlying(FDFlags::append)) ? O_APPEND : 0;
+    host_flags |= (flags & std::to_underlying(FDFlags::nonblock)) ? O_NONBLOCK : 0;
+    if (::fcntl(entry->host_fd, F_SETFL, host_flags) < 0) {
+        return static_cast<Errno>(convert_errno(errno));
+    }
+
+    entry->flags = flags;
+    return Errno::e_success;
+}
 
-    if (!wasm_check_pointer(time_ptr, sizeof(__wasi_timestamp_t), mem_size)) {
-        // TODO : Which one of these two should we resort to? Its safer to throw for now
-        // results->data[0].of.i32 = std::to_underlying(Errno::e_2big);
-        out = wasm_out_of_bounds_trap();
-        goto out;
+inline auto wasi_fd_filestat_get(WasiEnv &ctx, __wasi_fd_t fd, GuestPtr<__wasi_filestat_t> buf) -> Errno {
+    if (!buf) {
+        return wasi_trap_out_of_bounds(ctx);
     }
 
-    if (!magic_enum::enum_contains<ClockID>(clock_id)) {
-        // TODO : Check if all clocks are supported by the host, and return e_notsup if not
-        results->data[0].of.i32 = std::to_underlying(Errno::e_inval);
-        goto out;
+    FdEntry *entry = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::fd_filestat_get), &entry);
+        error != Errno::e_success) {
+        return error;
     }
 
-    timespec ts;
-    if (clock_gettime(static_cast<clockid_t>(clock_id), &ts) < 0) {
-        results->data[0].of.i32 = convert_errno(errno);
-        goto out;
+    if (entry->pack) {
+        buf.store(entry->pack->filestat(entry->pack_index));
+        return Errno::e_success;
     }
 
-    *target = timespec_to_nanoseconds(&ts);
-    str += fmt::format("setting mem {:#Lx} to {:#Lx}\n", time_ptr, *target);
+    struct stat st;
+    if (::fstat(entry->host_fd, &st) < 0) {
+        return static_cast<Errno>(convert_errno(errno));
+    }
+    buf.store(wasi_filestat_from_stat(st));
+    return Errno::e_success;
+}
 
-out:
-    str = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    fmt::print("==> {}", str);
-    return out;
+inline auto wasi_fd_filestat_set_size(WasiEnv &ctx, __wasi_fd_t fd, __wasi_filesize_t size) -> Errno {
+    UNUSED(fd);
+    UNUSED(size);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_advise_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_filestat_set_times(WasiEnv &ctx,
+                                       __wasi_fd_t fd,
+                                       __wasi_timestamp_t atim,
+                                       __wasi_timestamp_t mtim,
+                                       __wasi_fstflags_t fst_flags) -> Errno {
+    UNUSED(fd);
+    UNUSED(atim);
+    UNUSED(mtim);
+    UNUSED(fst_flags);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_close_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_pread(WasiEnv &ctx,
+                          __wasi_fd_t fd,
+                          GuestSpan<__wasi_guest_iovec_t> iovs,
+                          __wasi_filesize_t offset,
+                          GuestPtr<__wasi_size_t> nread) -> Errno {
+    return wasi_fd_transfer_at<false>(ctx, fd, iovs, offset, nread);
 }
 
-inline auto wasi_fd_datasync_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_prestat_get(WasiEnv &ctx, __wasi_fd_t fd, GuestPtr<__wasi_prestat_t> buf) -> Errno {
+    if (!buf) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    auto entry = ctx.fds.get(fd);
+    if (!entry || entry->preopen.empty()) {
+        return Errno::e_badf;
+    }
+
+    __wasi_prestat_t out{};
+    out.tag               = std::to_underlying(PreopenType::dir);
+    out.u.dir.pr_name_len = static_cast<__wasi_size_t>(entry->preopen.size());
+    buf.store(out);
+
+    return Errno::e_success;
 }
 
-inline auto wasi_fd_fdstat_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_prestat_dir_name(WasiEnv &ctx, __wasi_fd_t fd, GuestSpan<char> path) -> Errno {
+    if (!path) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    auto entry = ctx.fds.get(fd);
+    if (!entry || entry->preopen.empty()) {
+        return Errno::e_badf;
+    }
+    if (path.size() < entry->preopen.size()) {
+        return Errno::e_nametoolong;
+    }
+
+    std::ranges::copy(entry->preopen, path.span().begin());
+    return Errno::e_success;
 }
 
-inline auto
-wasi_fd_fdstat_set_flags_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_pwrite(WasiEnv &ctx,
+                           __wasi_fd_t fd,
+                           GuestSpan<__wasi_guest_iovec_t> iovs,
+                           __wasi_filesize_t offset,
+                           GuestPtr<__wasi_size_t> nwritten) -> Errno {
+    return wasi_fd_transfer_at<true>(ctx, fd, iovs, offset, nwritten);
 }
 
-inline auto wasi_fd_filestat_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_read(WasiEnv &ctx,
+                         __wasi_fd_t fd,
+                         GuestSpan<__wasi_guest_iovec_t> iovs,
+                         GuestPtr<__wasi_size_t> nread) -> Errno {
+    return wasi_fd_transfer<readv, Rights::fd_read>(ctx, fd, iovs, nread);
 }
 
-inline auto
-wasi_fd_filestat_set_size_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_readdir(WasiEnv &ctx,
+                            __wasi_fd_t fd,
+                            GuestSpan<uint8_t> buf,
+                            __wasi_dircookie_t cookie,
+                            GuestPtr<__wasi_size_t> bufused) -> Errno {
+    if (!buf || !bufused) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    FdEntry *entry = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::fd_readdir), &entry); error != Errno::e_success) {
+        return error;
+    }
+    if (entry->filetype != Filetype::directory) {
+        return Errno::e_notdir;
+    }
+
+    // The cookie is the position in the listing. The last entry is cut off when the buffer runs out, which is how the
+    // guest learns that it has to call again
+    const auto out = buf.span();
+    size_t used    = 0;
+    if (entry->pack) {
+        const auto &pack = *entry->pack;
+        const auto &dir  = pack.entry(entry->pack_index);
+        for (auto child = cookie; child < dir.size && used < out.size(); child++) {
+            const auto index = static_cast<uint32_t>(dir.offset + child);
+            const auto name  = pack.name(index);
+
+            __wasi_dirent_t dirent{};
+            dirent.d_next   = child + 1;
+            dirent.d_ino    = index + 1;
+            dirent.d_namlen = static_cast<__wasi_dirnamlen_t>(name.size());
+            dirent.d_type   = pack.entry(index).filetype;
+            wasi_dirent_append(out, &used, dirent, name);
+        }
+    } else {
+        // Without a cache the directory is listed again for every call, since the cookie has to stay meaningful
+        StatCache::Listing listing;
+        int error;
+        if (entry->stat_cache) {
+            error = entry->stat_cache->list({}, &listing);
+        } else {
+            auto uncached = std::make_shared<std::vector<HostDirent>>();
+            error         = host_list_directory(entry->host_fd, {}, uncached.get());
+            listing       = std::move(uncached);
+        }
+        if (error != 0) {
+            return wasi_host_errno(error);
+        }
+
+        for (auto index = cookie; index < listing->size() && used < out.size(); index++) {
+            const auto &host = (*listing)[index];
+
+            __wasi_dirent_t dirent{};
+            dirent.d_next   = index + 1;
+            dirent.d_ino    = host.ino;
+            dirent.d_namlen = static_cast<__wasi_dirnamlen_t>(host.name.size());
+            dirent.d_type   = std::to_underlying(wasi_filetype_from_mode(DTTOIF(host.type)));
+            wasi_dirent_append(out, &used, dirent, host.name);
+        }
+    }
+
+    bufused.store(wasi_moved(ctx, static_cast<__wasi_size_t>(used)));
+    return Errno::e_success;
 }
 
-inline auto
-wasi_fd_filestat_set_times_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_seek(WasiEnv &ctx,
+                         __wasi_fd_t fd,
+                         __wasi_filedelta_t offset,
+                         __wasi_whence_t whence,
+                         GuestPtr<__wasi_filesize_t> newoffset) -> Errno {
+    if (!newoffset) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    FdEntry *entry = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::fd_seek), &entry); error != Errno::e_success) {
+        return error;
+    }
+
+    if (!entry->pack) {
+        int host_whence;
+        switch (static_cast<Whence>(whence)) {
+        case Whence::set: {
+            host_whence = SEEK_SET;
+            break;
+        }
+        case Whence::cur: {
+            host_whence = SEEK_CUR;
+            break;
+        }
+        case Whence::end: {
+            host_whence = SEEK_END;
+            break;
+        }
+        default: {
+            return Errno::e_inval;
+        }
+        }
+        const auto result = ::lseek(entry->host_fd, offset, host_whence);
+        if (result < 0) {
+            return static_cast<Errno>(convert_errno(errno));
+        }
+        newoffset.store(static_cast<__wasi_filesize_t>(result));
+        return Errno::e_success;
+    }
+
+    if (entry->filetype == Filetype::directory) {
+        return Errno::e_isdir;
+    }
+    int64_t base;
+    switch (static_cast<Whence>(whence)) {
+    case Whence::set: {
+        base = 0;
+        break;
+    }
+    case Whence::cur: {
+        base = static_cast<int64_t>(entry->position);
+        break;
+    }
+    case Whence::end: {
+        base = static_cast<int64_t>(entry->pack->entry(entry->pack_index).size);
+        break;
+    }
+    default: {
+        return Errno::e_inval;
+    }
+    }
+    // Seeking past the end is fine, reads there just return nothing
+    int64_t position;
+    if (__builtin_add_overflow(base, offset, &position) || position < 0) {
+        return Errno::e_inval;
+    }
+    entry->position = static_cast<uint64_t>(position);
+    newoffset.store(entry->position);
+    return Errno::e_success;
 }
 
-inline auto wasi_fd_pread_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_sync(WasiEnv &ctx, __wasi_fd_t fd) -> Errno {
+    UNUSED(fd);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_prestat_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_tell(WasiEnv &ctx, __wasi_fd_t fd, GuestPtr<__wasi_filesize_t> offset) -> Errno {
+    if (!offset) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    FdEntry *entry = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::fd_tell), &entry); error != Errno::e_success) {
+        return error;
+    }
+
+    if (entry->pack) {
+        offset.store(entry->position);
+        return Errno::e_success;
+    }
+
+    const auto result = ::lseek(entry->host_fd, 0, SEEK_CUR);
+    if (result < 0) {
+        return static_cast<Errno>(convert_errno(errno));
+    }
+    offset.store(static_cast<__wasi_filesize_t>(result));
+    return Errno::e_success;
 }
 
-inline auto
-wasi_fd_prestat_dir_name_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_fd_write(WasiEnv &ctx,
+                          __wasi_fd_t fd,
+                          GuestSpan<__wasi_guest_iovec_t> iovs,
+                          GuestPtr<__wasi_size_t> nwritten) -> Errno {
+    return wasi_fd_transfer<writev, Rights::fd_write>(ctx, fd, iovs, nwritten);
 }
 
-inline auto wasi_fd_pwrite_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_create_directory(WasiEnv &ctx, __wasi_fd_t fd, GuestSpan<char> path) -> Errno {
+    UNUSED(fd);
+    UNUSED(path);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_read_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_filestat_get(WasiEnv &ctx,
+                                   __wasi_fd_t fd,
+                                   __wasi_lookupflags_t flags,
+                                   GuestSpan<char> path,
+                                   GuestPtr<__wasi_filestat_t> buf) -> Errno {
+    if (!path || !buf) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    FdEntry *dir = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::path_filestat_get), &dir);
+        error != Errno::e_success) {
+        return error;
+    }
+    if (!dir->pack) {
+        std::string host_path;
+        if (path.empty()) {
+            return Errno::e_noent;
+        }
+        if (!host_path_normalize(path.string_view(), &host_path)) {
+            return Errno::e_notcapable;
+        }
+        const bool follow = (flags & std::to_underlying(LookupFlags::symlink_follow)) != 0;
+        struct stat st;
+        const int error = dir->stat_cache ? dir->stat_cache->stat(host_path, follow, &st)
+                                          : host_stat_beneath(dir->host_fd, host_path, follow, &st);
+        if (error != 0) {
+            return wasi_host_errno(error);
+        }
+        if (path.string_view().ends_with('/') && !S_ISDIR(st.st_mode)) {
+            return Errno::e_notdir;
+        }
+        buf.store(wasi_filestat_from_stat(st));
+        return Errno::e_success;
+    }
+
+    UNUSED(flags); // Packs have no symlinks to follow
+    uint32_t index = 0;
+    if (auto error = wasi_pack_resolve(*dir, path.string_view(), &index); error != Errno::e_success) {
+        return error;
+    }
+    buf.store(dir->pack->filestat(index));
+    return Errno::e_success;
 }
 
-inline auto wasi_fd_readdir_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_filestat_set_times(WasiEnv &ctx,
+                                         __wasi_fd_t fd,
+                                         __wasi_lookupflags_t flags,
+                                         GuestSpan<char> path,
+                                         __wasi_timestamp_t atim,
+                                         __wasi_timestamp_t mtim,
+                                         __wasi_fstflags_t fst_flags) -> Errno {
+    UNUSED(fd);
+    UNUSED(flags);
+    UNUSED(path);
+    UNUSED(atim);
+    UNUSED(mtim);
+    UNUSED(fst_flags);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_seek_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_link(WasiEnv &ctx,
+                           __wasi_fd_t old_fd,
+                           __wasi_lookupflags_t old_flags,
+                           GuestSpan<char> old_path,
+                           __wasi_fd_t new_fd,
+                           GuestSpan<char> new_path) -> Errno {
+    UNUSED(old_fd);
+    UNUSED(old_flags);
+    UNUSED(old_path);
+    UNUSED(new_fd);
+    UNUSED(new_path);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_sync_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_open(WasiEnv &ctx,
+                           __wasi_fd_t fd,
+                           __wasi_lookupflags_t dirflags,
+                           GuestSpan<char> path,
+                           __wasi_oflags_t oflags,
+                           __wasi_rights_t fs_rights_base,
+                           __wasi_rights_t fs_rights_inheriting,
+                           __wasi_fdflags_t fdflags,
+                           GuestPtr<__wasi_fd_t> opened_fd) -> Errno {
+    if (!path || !opened_fd) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+
+    FdEntry *dir = nullptr;
+    if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::path_open), &dir); error != Errno::e_success) {
+        return error;
+    }
+    if (!dir->pack) {
+        return wasi_trap_not_implemented(ctx, __func__);
+    }
+
+    UNUSED(dirflags); // Packs have no symlinks to follow
+    uint32_t index    = 0;
+    const auto result = wasi_pack_resolve(*dir, path.string_view(), &index);
+    if (result == Errno::e_noent && (oflags & std::to_underlying(OFlags::creat))) {
+        return Errno::e_rofs;
+    }
+    if (result != Errno::e_success) {
+        return result;
+    }
+    if (oflags & std::to_underlying(OFlags::excl)) {
+        return Errno::e_exist;
+    }
+    const auto pack_filetype = static_cast<Filetype>(dir->pack->entry(index).filetype);
+    if ((oflags & std::to_underlying(OFlags::directory)) && pack_filetype != Filetype::directory) {
+        return Errno::e_notdir;
+    }
+
+    // Anything that would modify the file fails up front rather than on first use
+    const auto writes      = wasi_rights({Rights::fd_write, Rights::fd_allocate, Rights::fd_filestat_set_size});
+    const auto write_flags = std::to_underlying(FDFlags::append) | std::to_underlying(FDFlags::dsync) |
+                             std::to_underlying(FDFlags::sync);
+    if ((oflags & std::to_underlying(OFlags::trunc)) || (fs_rights_base & writes) || (fdflags & write_flags)) {
+        return Errno::e_rofs;
+    }
+
+    // Pack files are never closed on the host, so they need no ownership
+    opened_fd.store(ctx.fds.insert({-1,
+                                    pack_filetype,
+                                    fdflags,
+                                    fs_rights_base & dir->rights_inheriting,
+                                    fs_rights_inheriting & dir->rights_inheriting,
+                                    false,
+                                    {},
+                                    dir->pack,
+                                    index,
+                                    0,
+                                    nullptr}));
+    return Errno::e_success;
 }
 
-inline auto wasi_fd_tell_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_readlink(WasiEnv &ctx,
+                               __wasi_fd_t fd,
+                               GuestSpan<char> path,
+                               GuestSpan<uint8_t> buf,
+                               GuestPtr<__wasi_size_t> bufused) -> Errno {
+    UNUSED(fd);
+    UNUSED(path);
+    UNUSED(buf);
+    UNUSED(bufused);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_fd_write_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_remove_directory(WasiEnv &ctx, __wasi_fd_t fd, GuestSpan<char> path) -> Errno {
+    UNUSED(fd);
+    UNUSED(path);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto
-wasi_path_create_directory_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_path_rename(WasiEnv &ctx,
+                             __wasi_fd_t fd,
+                             GuestSpan<char> old_path,
+                             __wasi_fd_t new_fd,
+                             GuestSpan<char> new_path) -> Errno {
+    UNUSED(fd);
+    UNUSED(old_path);
+    UNUSED(new_fd);
+    UNUSED(new_path);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
 inline auto
-wasi_path_filestat_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+wasi_path_symlink(WasiEnv &ctx, GuestSpan<char> old_path, __wasi_fd_t fd, GuestSpan<char> new_path) -> Errno {
+    UNUSED(old_path);
+    UNUSED(fd);
+    UNUSED(new_path);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
+inline auto wasi_path_unlink_file(WasiEnv &ctx, __wasi_fd_t fd, GuestSpan<char> path) -> Errno {
+    UNUSED(fd);
+    UNUSED(path);
+    return wasi_trap_not_implemented(ctx, __func__);
+}
+
+// Host monotonic deadline of a clock subscription. Absolute timeouts are on the guest's clock, which is not the host's
+// when the instance runs on virtual time, so they are turned into a delay on the guest's clock once and that delay is
+// put on the host's monotonic timeline. A change of either clock while waiting is not followed
 inline auto
-wasi_path_filestat_set_times_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+wasi_poll_deadline(const WasiClock &guest_clock, const __wasi_subscription_clock_t &clock, uint64_t now, uint64_t *out)
+    -> Errno {
+    if (clock.id != std::to_underlying(ClockID::monotonic) && clock.id != std::to_underlying(ClockID::realtime)) {
+        return Errno::e_inval;
+    }
+    auto delay = clock.timeout;
+    if (clock.flags & std::to_underlying(SubClockFlags::subscription_clock_abstime)) {
+        const auto guest_now = guest_clock.now(static_cast<ClockID>(clock.id));
+        delay                = clock.timeout > guest_now ? clock.timeout - guest_now : 0;
+    }
+    *out = now + std::min(delay, UINT64_MAX - now);
+    return Errno::e_success;
 }
 
-inline auto wasi_path_link_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+// Clock subscriptions wait in the instance's timer wheel and fd subscriptions in its epoll set, so the thread sleeps
+// until whichever comes first. Subscriptions that are ready or fail right away make the call return without blocking
+inline auto wasi_poll_oneoff(WasiEnv &ctx,
+                             uint32_t in_ptr,
+                             uint32_t out_ptr,
+                             __wasi_size_t nsubscriptions,
+                             GuestPtr<__wasi_size_t> nevents) -> Errno {
+    GuestSpan<__wasi_subscription_t> in(ctx.guest, in_ptr, nsubscriptions);
+    GuestSpan<__wasi_event_t> out(ctx.guest, out_ptr, nsubscriptions);
+    if (!in || !out || !nevents) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    if (nsubscriptions == 0) {
+        return Errno::e_inval;
+    }
+    for (uint32_t index = 0; index < nsubscriptions; index++) {
+        if (!magic_enum::enum_contains<EventType>(in.load(index).u.tag)) {
+            return Errno::e_inval;
+        }
+    }
+
+    auto &poller = ctx.poller;
+    auto &timers = poller.timers();
+    auto &waits  = poller.waits;
+    auto now     = monotonic_ns();
+    timers.advance(TimerWheel::ticks_floor(now), [](TimerWheel::Timer *) {});
+    waits.assign(nsubscriptions, {});
+    poller.begin();
+
+    __wasi_size_t count = 0;
+    auto emit = [&](uint32_t index, Errno error, __wasi_filesize_t nbytes, __wasi_eventrwflags_t flags) {
+        const auto sub = in.load(index);
+        __wasi_event_t event{};
+        event.userdata            = sub.userdata;
+        event.error               = std::to_underlying(error);
+        event.type                = sub.u.tag;
+        event.fd_readwrite.nbytes = nbytes;
+        event.fd_readwrite.flags  = flags;
+        out.store(count++, event);
+    };
+    auto readable = [](int host_fd) -> __wasi_filesize_t {
+        int available = 0;
+        return ::ioctl(host_fd, FIONREAD, &available) == 0 ? static_cast<__wasi_filesize_t>(available) : 0;
+    };
+
+    bool armed = false;
+    for (uint32_t index = 0; index < nsubscriptions; index++) {
+        const auto sub = in.load(index);
+        auto &wait     = waits[index];
+        if (sub.u.tag == std::to_underlying(EventType::clock)) {
+            if (auto error = wasi_poll_deadline(ctx.clock, sub.u.u.clock, now, &wait.deadline);
+                error != Errno::e_success) {
+                emit(index, error, 0, 0);
+                continue;
+            }
+            wait.timer.user = index;
+            if (!timers.add(&wait.timer, TimerWheel::ticks_ceil(wait.deadline))) {
+                emit(index, Errno::e_success, 0, 0);
+            }
+            continue;
+        }
+
+        const bool read = sub.u.tag == std::to_underlying(EventType::fd_read);
+        const auto fd   = read ? sub.u.u.fd_read.file_descriptor : sub.u.u.fd_write.file_descriptor;
+        FdEntry *entry  = nullptr;
+        if (auto error = ctx.fds.lookup(fd, std::to_underlying(Rights::poll_fd_readwrite), &entry);
+            error != Errno::e_success) {
+            emit(index, error, 0, 0);
+            continue;
+        }
+        if (entry->pack) {
+            // In memory, so always ready
+            const auto size = entry->pack->entry(entry->pack_index).size;
+            emit(index, Errno::e_success, read && entry->position < size ? size - entry->position : 0, 0);
+            continue;
+        }
+
+        wait.host_fd      = entry->host_fd;
+        wait.events       = read ? EPOLLIN : EPOLLOUT;
+        const auto result = poller.arm(wait.host_fd, wait.events);
+        if (result == -EPERM) {
+            // Regular files can not be waited on and never block
+            emit(index, Errno::e_success, read ? readable(wait.host_fd) : 0, 0);
+            wait.events = 0;
+        } else if (result < 0) {
+            emit(index, static_cast<Errno>(convert_errno(-result)), 0, 0);
+            wait.events = 0;
+        } else {
+            armed = true;
+        }
+    }
+
+    // Block only if nothing is ready yet, otherwise just pick up whatever else is ready too
+    Errno result = Errno::e_success;
+    while (armed || count == 0) {
+        int64_t timeout = 0;
+        if (count == 0) {
+            const auto next = timers.next_tick();
+            const auto wake = next << TIMER_WHEEL_TICK_SHIFT;
+            timeout         = next == TimerWheel::no_tick ? -1 : static_cast<int64_t>(wake > now ? wake - now : 0);
+        }
+        const auto ready = poller.wait(timeout);
+        if (ready < 0 && ready != -EINTR) {
+            result = static_cast<Errno>(convert_errno(-ready));
+            break;
+        }
+        if (ctx.interrupted.load(std::memory_order_relaxed)) {
+            // The watchdog gave up on this call, which traps once it returns
+            result = Errno::e_intr;
+            break;
+        }
+
+        for (const auto &event : poller.ready()) {
+            for (uint32_t index = 0; index < nsubscriptions; index++) {
+                auto &wait = waits[index];
+                if (wait.host_fd != event.data.fd || !(event.events & (wait.events | EPOLLHUP | EPOLLERR)) ||
+                    wait.events == 0) {
+                    continue;
+                }
+                const bool hangup = event.events & (EPOLLHUP | EPOLLERR);
+                emit(index,
+                     Errno::e_success,
+                     wait.events == EPOLLIN ? readable(wait.host_fd) : 0,
+                     hangup ? std::to_underlying(EventRWFlags::fd_readwrite_hangup) : 0);
+                wait.events = 0;
+            }
+        }
+
+        now = monotonic_ns();
+        timers.advance(TimerWheel::ticks_floor(now), [&](TimerWheel::Timer *timer) {
+            // Only deadlines beyond the range of the wheel expire early, and go round again
+            auto &wait = waits[timer->user];
+            if (wait.deadline <= now || !timers.add(timer, TimerWheel::ticks_ceil(wait.deadline))) {
+                emit(static_cast<uint32_t>(timer->user), Errno::e_success, 0, 0);
+            }
+        });
+        armed = false;
+    }
+
+    // Subscriptions only live for one call
+    for (auto &wait : waits) {
+        timers.cancel(&wait.timer);
+    }
+    if (result != Errno::e_success) {
+        return result;
+    }
+
+    nevents.store(count);
+    return Errno::e_success;
 }
 
-inline auto wasi_path_open_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_proc_exit(WasiEnv &ctx, __wasi_exitcode_t rval) -> void {
+    UNUSED(rval);
+    wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_path_readlink_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+// A yield is a point where the guest expects to wait anyway, so it is a good time to finish the queued host I/O
+inline auto wasi_sched_yield(WasiEnv &ctx) -> Errno {
+    ctx.io.complete();
+    return Errno::e_success;
+}
+
+inline auto wasi_random_get(WasiEnv &ctx, GuestSpan<uint8_t> buf) -> Errno {
+    if (!buf) {
+        return wasi_trap_out_of_bounds(ctx);
+    }
+    wasi_moved(ctx, buf.size());
+    return ctx.random.fill(buf.bytes()) ? Errno::e_success : Errno::e_io;
 }
 
 inline auto
-wasi_path_remove_directory_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+wasi_sock_accept(WasiEnv &ctx, __wasi_fd_t fd, __wasi_fdflags_t flags, GuestPtr<__wasi_fd_t> accepted_fd) -> Errno {
+    UNUSED(fd);
+    UNUSED(flags);
+    UNUSED(accepted_fd);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_path_rename_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_sock_recv(WasiEnv &ctx,
+                           __wasi_fd_t fd,
+                           GuestSpan<__wasi_guest_iovec_t> ri_data,
+                           __wasi_riflags_t ri_flags,
+                           GuestPtr<__wasi_size_t> ro_datalen,
+                           GuestPtr<__wasi_roflags_t> ro_flags) -> Errno {
+    UNUSED(fd);
+    UNUSED(ri_data);
+    UNUSED(ri_flags);
+    UNUSED(ro_datalen);
+    UNUSED(ro_flags);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_path_symlink_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_sock_send(WasiEnv &ctx,
+                           __wasi_fd_t fd,
+                           GuestSpan<__wasi_guest_iovec_t> si_data,
+                           __wasi_siflags_t si_flags,
+                           GuestPtr<__wasi_size_t> so_datalen) -> Errno {
+    UNUSED(fd);
+    UNUSED(si_data);
+    UNUSED(si_flags);
+    UNUSED(so_datalen);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto
-wasi_path_unlink_file_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_sock_shutdown(WasiEnv &ctx, __wasi_fd_t fd, __wasi_sdflags_t how) -> Errno {
+    UNUSED(fd);
+    UNUSED(how);
+    return wasi_trap_not_implemented(ctx, __func__);
 }
 
-inline auto wasi_poll_oneoff_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+struct WasiImport {
+    std::string_view module;
+    std::string_view name;
+    WasiSignature signature;
+    wasm_func_callback_with_env_t stub;
+    wasm_func_callback_with_env_t profiled_stub; // `stub` timed into the instance's `WasiProfile`
+};
+
+// Callback for a typed WASI function, see `HostFunc`
+template <WasiFunc Id, auto Func>
+inline auto wasi_callback(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
+    auto ctx = static_cast<WasiEnv *>(env);
+    ctx->stats.host_calls++;
+    // Whatever else the guest does may depend on its deferred writes having landed
+    if constexpr (Id != WasiFunc::fd_pwrite) {
+        if (ctx->io.has_deferred()) {
+            ctx->io.complete();
+        }
+    }
+    return wasi_return(ctx, Id, args, results, HostFunc<Func>::invoke(*ctx, args, results));
 }
 
-inline auto wasi_proc_exit_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    str = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+template <WasiFunc Id, auto Func>
+inline auto wasi_profiled_callback(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
+    auto ctx         = static_cast<WasiEnv *>(env);
+    const auto bytes = ctx->stats.bytes;
+    const auto begin = std::chrono::steady_clock::now();
+    auto trap        = wasi_callback<Id, Func>(env, args, results);
+    const auto ns    = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+    ctx->profile.record(Id, static_cast<uint64_t>(ns.count()), ctx->stats.bytes - bytes);
+    return trap;
 }
 
-inline auto wasi_sched_yield_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+template <WasiFunc Id, auto Func>
+inline constexpr auto wasi_import() -> WasiImport {
+    return {"wasi_snapshot_preview1",
+            magic_enum::enum_name(Id),
+            HostFunc<Func>::signature,
+            wasi_callback<Id, Func>,
+            wasi_profiled_callback<Id, Func>};
 }
 
-inline auto wasi_random_get_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline constexpr auto wasi_import_less(const WasiImport &lhs, const WasiImport &rhs) -> bool {
+    return lhs.module != rhs.module ? lhs.module < rhs.module : lhs.name < rhs.name;
 }
 
-inline auto wasi_sock_accept_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+// Sorted on (module, name), which is checked at compile time, so resolving an import is a binary search over string
+// views without formatting or allocating anything
+inline constexpr WasiImport wasi_imports[] = {
+    wasi_import<WasiFunc::args_get, wasi_args_get>(),
+    wasi_import<WasiFunc::args_sizes_get, wasi_args_sizes_get>(),
+    wasi_import<WasiFunc::clock_res_get, wasi_clock_res_get>(),
+    wasi_import<WasiFunc::clock_time_get, wasi_clock_time_get>(),
+    wasi_import<WasiFunc::environ_get, wasi_environ_get>(),
+    wasi_import<WasiFunc::environ_sizes_get, wasi_environ_sizes_get>(),
+    wasi_import<WasiFunc::fd_advise, wasi_fd_advise>(),
+    wasi_import<WasiFunc::fd_close, wasi_fd_close>(),
+    wasi_import<WasiFunc::fd_datasync, wasi_fd_datasync>(),
+    wasi_import<WasiFunc::fd_fdstat_get, wasi_fd_fdstat_get>(),
+    wasi_import<WasiFunc::fd_fdstat_set_flags, wasi_fd_fdstat_set_flags>(),
+    wasi_import<WasiFunc::fd_filestat_get, wasi_fd_filestat_get>(),
+    wasi_import<WasiFunc::fd_filestat_set_size, wasi_fd_filestat_set_size>(),
+    wasi_import<WasiFunc::fd_filestat_set_times, wasi_fd_filestat_set_times>(),
+    wasi_import<WasiFunc::fd_pread, wasi_fd_pread>(),
+    wasi_import<WasiFunc::fd_prestat_dir_name, wasi_fd_prestat_dir_name>(),
+    wasi_import<WasiFunc::fd_prestat_get, wasi_fd_prestat_get>(),
+    wasi_import<WasiFunc::fd_pwrite, wasi_fd_pwrite>(),
+    wasi_import<WasiFunc::fd_read, wasi_fd_read>(),
+    wasi_import<WasiFunc::fd_readdir, wasi_fd_readdir>(),
+    wasi_import<WasiFunc::fd_seek, wasi_fd_seek>(),
+    wasi_import<WasiFunc::fd_sync, wasi_fd_sync>(),
+    wasi_import<WasiFunc::fd_tell, wasi_fd_tell>(),
+    wasi_import<WasiFunc::fd_write, wasi_fd_write>(),
+    wasi_import<WasiFunc::path_create_directory, wasi_path_create_directory>(),
+    wasi_import<WasiFunc::path_filestat_get, wasi_path_filestat_get>(),
+    wasi_import<WasiFunc::path_filestat_set_times, wasi_path_filestat_set_times>(),
+    wasi_import<WasiFunc::path_link, wasi_path_link>(),
+    wasi_import<WasiFunc::path_open, wasi_path_open>(),
+    wasi_import<WasiFunc::path_readlink, wasi_path_readlink>(),
+    wasi_import<WasiFunc::path_remove_directory, wasi_path_remove_directory>(),
+    wasi_import<WasiFunc::path_rename, wasi_path_rename>(),
+    wasi_import<WasiFunc::path_symlink, wasi_path_symlink>(),
+    wasi_import<WasiFunc::path_unlink_file, wasi_path_unlink_file>(),
+    wasi_import<WasiFunc::poll_oneoff, wasi_poll_oneoff>(),
+    wasi_import<WasiFunc::proc_exit, wasi_proc_exit>(),
+    wasi_import<WasiFunc::random_get, wasi_random_get>(),
+    wasi_import<WasiFunc::sched_yield, wasi_sched_yield>(),
+    wasi_import<WasiFunc::sock_accept, wasi_sock_accept>(),
+    wasi_import<WasiFunc::sock_recv, wasi_sock_recv>(),
+    wasi_import<WasiFunc::sock_send, wasi_sock_send>(),
+    wasi_import<WasiFunc::sock_shutdown, wasi_sock_shutdown>(),
+};
+
+static_assert(std::is_sorted(std::begin(wasi_imports), std::end(wasi_imports), wasi_import_less),
+              "wasi_imports must be sorted on (module, name)");
+
+static_assert(
+    [] {
+        for (size_t index = 0; index < std::size(wasi_imports); index++) {
+            if (magic_enum::enum_name(static_cast<WasiFunc>(index)) != wasi_imports[index].name) {
+                return false;
+            }
+        }
+        return std::size(wasi_imports) == magic_enum::enum_count<WasiFunc>();
+    }(),
+    "WasiFunc must list the functions of wasi_imports in the same order");
+
+inline auto wasm_valtypes_match(const wasm_valtype_vec_t *valtypes, std::string_view expected) -> bool {
+    if (valtypes->size != expected.size()) {
+        return false;
+    }
+    for (size_t index = 0; index < expected.size(); index++) {
+        if (::wasm_valtype_kind(valtypes->data[index]) != wasm_valkind_from_char(expected[index])) {
+            return false;
+        }
+    }
+    return true;
 }
 
-inline auto wasi_sock_recv_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasm_functype_matches(const wasm_functype_t *functype, const WasiSignature &signature) -> bool {
+    return wasm_valtypes_match(::wasm_functype_params(functype), signature.params) &&
+           wasm_valtypes_match(::wasm_functype_results(functype), signature.results);
 }
 
-inline auto wasi_sock_send_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
+inline auto wasi_find_import(std::string_view module, std::string_view name) -> const WasiImport * {
+    const WasiImport key{module, name, {}, nullptr, nullptr};
+    auto found = std::lower_bound(std::begin(wasi_imports), std::end(wasi_imports), key, wasi_import_less);
+    if (found == std::end(wasi_imports) || found->module != module || found->name != name) {
+        return nullptr;
+    }
+    return found;
 }
 
-inline auto wasi_sock_shutdown_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results) -> wasm_trap_t * {
-    UNUSED(env);
-    std::string str{};
-    static bool printed = false;
-    str += wasm_wasi_fix_return_type(&results->data[0].kind, &printed);
-    results->data[0].of.i32 = std::to_underlying(Errno::e_success);
-    str                     = wasm_func_called_to_str(__func__, args, results) + "\n" + str;
-    str += "not implemented\n";
-    fmt::print("==> {}", str);
-    return wasm_not_implemented_trap();
-}
-
-inline auto wasi_get_stub_from_str(const std::string str) -> wasm_func_callback_with_env_t {
-    // clang-format off
-    if (str.find("wasi_snapshot_preview1::args_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_args_get_stub;
-    else if (str.find("wasi_snapshot_preview1::args_sizes_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_args_sizes_get_stub;
-    else if (str.find("wasi_snapshot_preview1::environ_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_environ_get_stub;
-    else if (str.find("wasi_snapshot_preview1::environ_sizes_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_environ_sizes_get_stub;
-    else if (str.find("wasi_snapshot_preview1::clock_res_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_clock_res_get_stub;
-    else if (str.find("wasi_snapshot_preview1::clock_time_get(i32, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_clock_time_get_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_advise(i32, i64, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_advise_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_close(i32) -> (i32)") != std::string::npos)
-        return wasi_fd_close_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_datasync(i32) -> (i32)") != std::string::npos)
-        return wasi_fd_datasync_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_fdstat_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_fdstat_get_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_fdstat_set_flags(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_fdstat_set_flags_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_filestat_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_filestat_get_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_filestat_set_size(i32, i64) -> (i32)") != std::string::npos)
-        return wasi_fd_filestat_set_size_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_filestat_set_times(i32, i64, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_filestat_set_times_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_pread(i32, i32, i32, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_pread_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_prestat_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_prestat_get_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_prestat_dir_name(i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_prestat_dir_name_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_pwrite(i32, i32, i32, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_pwrite_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_read(i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_read_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_readdir(i32, i32, i32, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_readdir_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_seek(i32, i64, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_seek_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_sync(i32) -> (i32)") != std::string::npos)
-        return wasi_fd_sync_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_tell(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_tell_stub;
-    else if (str.find("wasi_snapshot_preview1::fd_write(i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_fd_write_stub;
-    else if (str.find("wasi_snapshot_preview1::path_create_directory(i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_create_directory_stub;
-    else if (str.find("wasi_snapshot_preview1::path_filestat_get(i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_filestat_get_stub;
-    else if (str.find("wasi_snapshot_preview1::path_filestat_set_times(i32, i32, i32, i32, i64, i64, i32) -> (i32)") != std::string::npos)
-        return wasi_path_filestat_set_times_stub;
-    else if (str.find("wasi_snapshot_preview1::path_link(i32, i32, i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_link_stub;
-    else if (str.find("wasi_snapshot_preview1::path_open(i32, i32, i32, i32, i32, i64, i64, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_open_stub;
-    else if (str.find("wasi_snapshot_preview1::path_readlink(i32, i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_readlink_stub;
-    else if (str.find("wasi_snapshot_preview1::path_remove_directory(i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_remove_directory_stub;
-    else if (str.find("wasi_snapshot_preview1::path_rename(i32, i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_rename_stub;
-    else if (str.find("wasi_snapshot_preview1::path_symlink(i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_symlink_stub;
-    else if (str.find("wasi_snapshot_preview1::path_unlink_file(i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_path_unlink_file_stub;
-    else if (str.find("wasi_snapshot_preview1::poll_oneoff(i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_poll_oneoff_stub;
-    else if (str.find("wasi_snapshot_preview1::proc_exit(i32) -> ()") != std::string::npos)
-        return wasi_proc_exit_stub;
-    else if (str.find("wasi_snapshot_preview1::sched_yield() -> (i32)") != std::string::npos)
-        return wasi_sched_yield_stub;
-    else if (str.find("wasi_snapshot_preview1::random_get(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_random_get_stub;
-    else if (str.find("wasi_snapshot_preview1::sock_accept(i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_sock_accept_stub;
-    else if (str.find("wasi_snapshot_preview1::sock_recv(i32, i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_sock_recv_stub;
-    else if (str.find("wasi_snapshot_preview1::sock_send(i32, i32, i32, i32, i32) -> (i32)") != std::string::npos)
-        return wasi_sock_send_stub;
-    else if (str.find("wasi_snapshot_preview1::sock_shutdown(i32, i32) -> (i32)") != std::string::npos)
-        return wasi_sock_shutdown_stub;
-    // clang-format on
-
-    return nullptr;
+// Bound in place of imports we do not provide, or whose signature does not match ours, so that the module still
+// instantiates and only traps if the guest actually calls the function
+inline auto wasi_unresolved_import_stub(void *env, const wasm_val_vec_t *args, wasm_val_vec_t *results)
+    -> wasm_trap_t * {
+    auto ctx = static_cast<WasiEnv *>(env);
+    ctx->stats.host_calls++;
+    UNUSED(args);
+    UNUSED(results);
+    return wasm_not_implemented_trap(ctx, "unresolved import");
+}
+
+// Returns the stub for a function import, or nullptr if the import is unknown or its signature does not match
+inline auto
+wasi_get_stub(std::string_view module, std::string_view name, const wasm_functype_t *functype, bool profiled = false)
+    -> wasm_func_callback_with_env_t {
+    auto import = wasi_find_import(module, name);
+    if (!import || !wasm_functype_matches(functype, import->signature)) {
+        return nullptr;
+    }
+    return profiled ? import->profiled_stub : import->stub;
 }
 } // namespace tss
 // clang-format off
@@ -2024,4 +2464,388 @@ TEST_CASE("memdump_to_str") {
     INFO("\n", memdump_str);
     REQUIRE(memdump_str.c_str() == doctest::Contains("asd"));
 }
+
+TEST_CASE("wasi_find_import") {
+    for (const auto &import : tss::wasi_imports) {
+        REQUIRE(tss::wasi_find_import(import.module, import.name) == &import);
+    }
+    REQUIRE(tss::wasi_find_import("wasi_snapshot_preview1", "fd_writ") == nullptr);
+    REQUIRE(tss::wasi_find_import("wasi_unstable", "fd_write") == nullptr);
+    REQUIRE(tss::wasi_find_import("", "") == nullptr);
+}
+
+TEST_CASE("wasi_fd_write and wasi_fd_read") {
+    int pipe_fds[2];
+    REQUIRE(pipe(pipe_fds) == 0);
+
+    // Guest layout: two iovecs at 0, their buffers at 16 and 32, nwritten/nread at 48
+    std::vector<uint8_t> storage(64);
+    tss::WasiEnv env{};
+    env.guest = tss::GuestMemory(storage.data(), storage.size());
+    const auto read  = tss::wasi_rights({Rights::fd_read});
+    const auto write = tss::wasi_rights({Rights::fd_write});
+    env.fds.insert({pipe_fds[0], Filetype::unknown, 0, read, 0, true, {}, nullptr, 0, 0, nullptr});
+    env.fds.insert({pipe_fds[1], Filetype::unknown, 0, write, 0, true, {}, nullptr, 0, 0, nullptr});
+
+    tss::GuestSpan<__wasi_guest_iovec_t> iovs(env.guest, 0, 2);
+    tss::GuestPtr<__wasi_size_t> count(env.guest, 48);
+    iovs.store(0, {16, 6});
+    iovs.store(1, {32, 5});
+    std::memcpy(&storage[16], "hello ", 6);
+    std::memcpy(&storage[32], "world", 5);
+
+    REQUIRE(tss::wasi_fd_write(env, 1, iovs, count) == Errno::e_success);
+    REQUIRE(count.load() == 11);
+
+    // Read it back split differently across the same two buffers
+    std::fill(storage.begin() + 16, storage.begin() + 48, 0);
+    iovs.store(0, {16, 3});
+    iovs.store(1, {32, 16});
+    REQUIRE(tss::wasi_fd_read(env, 0, iovs, count) == Errno::e_success);
+    REQUIRE(count.load() == 11);
+    REQUIRE(std::string_view(reinterpret_cast<char *>(&storage[16]), 3) == "hel");
+    REQUIRE(std::string_view(reinterpret_cast<char *>(&storage[32]), 8) == "lo world");
+
+    REQUIRE(tss::wasi_fd_write(env, 7, iovs, count) == Errno::e_badf);
+    REQUIRE(tss::wasi_fd_write(env, 0, iovs, count) == Errno::e_notcapable);
+
+    // Too many iovecs are refused before any host iovecs are set up for them
+    std::vector<uint8_t> many_storage((IOV_MAX + 1) * sizeof(__wasi_guest_iovec_t) + 8);
+    tss::WasiEnv many_env{};
+    many_env.guest = tss::GuestMemory(many_storage.data(), many_storage.size());
+    many_env.fds.insert({pipe_fds[1], Filetype::unknown, 0, write, 0, false, {}, nullptr, 0, 0, nullptr});
+    tss::GuestSpan<__wasi_guest_iovec_t> many_iovs(many_env.guest, 0, IOV_MAX + 1);
+    tss::GuestPtr<__wasi_size_t> many_count(many_env.guest, (IOV_MAX + 1) * sizeof(__wasi_guest_iovec_t));
+    REQUIRE(tss::wasi_fd_write(many_env, 0, many_iovs, many_count) == Errno::e_inval);
+    REQUIRE(many_env.iovecs.capacity() == 0);
+
+    REQUIRE(tss::wasi_fd_close(env, 0) == Errno::e_success);
+    REQUIRE(tss::wasi_fd_close(env, 0) == Errno::e_badf);
+}
+
+TEST_CASE("wasi_fd_pwrite deferred through io_uring") {
+    char path[] = "/tmp/qost_wasi_pwrite_XXXXXX";
+    const int file_fd = mkstemp(path);
+    REQUIRE(file_fd >= 0);
+    unlink(path);
+
+    std::vector<uint8_t> storage(64);
+    tss::WasiEnv env{};
+    if (!env.io.enable_io_uring(4)) {
+        ::close(file_fd);
+        return; // Nothing is deferred without io_uring
+    }
+    env.guest         = tss::GuestMemory(storage.data(), storage.size());
+    const auto rights = tss::wasi_rights({Rights::fd_write, Rights::fd_seek});
+    env.fds.insert({file_fd, Filetype::regular_file, 0, rights, 0, true, {}, nullptr, 0, 0, nullptr});
+
+    tss::GuestSpan<__wasi_guest_iovec_t> iovs(env.guest, 0, 1);
+    tss::GuestPtr<__wasi_size_t> count(env.guest, 48);
+    iovs.store(0, {16, 5});
+    std::memcpy(&storage[16], "hello", 5);
+
+    // Reported as written, but only in the file once the next call that is not a fd_pwrite completes it
+    REQUIRE(tss::wasi_fd_pwrite(env, 0, iovs, 10, count) == Errno::e_success);
+    REQUIRE(count.load() == 5);
+    std::memcpy(&storage[16], "xxxxx", 5); // The guest may reuse its buffer right away
+    REQUIRE(env.io.has_deferred());
+    env.io.complete();
+    char buf[8] = {};
+    REQUIRE(::pread(file_fd, buf, sizeof(buf), 10) == 5);
+    REQUIRE(std::string_view(buf, 5) == "hello");
+
+    // A write that fails is reported when the fd is closed
+    const int read_only = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    REQUIRE(read_only >= 0);
+    const auto fd = env.fds.insert({read_only, Filetype::regular_file, 0, rights, 0, true, {}, nullptr, 0, 0, nullptr});
+    REQUIRE(tss::wasi_fd_pwrite(env, fd, iovs, 0, count) == Errno::e_success);
+    env.io.complete();
+    REQUIRE(tss::wasi_fd_close(env, fd) == Errno::e_badf);
+    REQUIRE(tss::wasi_fd_close(env, 0) == Errno::e_success);
+}
+
+TEST_CASE("wasi path_open and fd_read on a pack") {
+    namespace fs = std::filesystem;
+    const auto dir = fs::temp_directory_path() / fmt::format("qost-wasi-pack-{}", ::getpid());
+    fs::create_directories(dir / "sub");
+    std::ofstream(dir / "sub" / "file.txt") << "0123456789";
+    const auto path = dir.string() + ".pak";
+    REQUIRE(tss::vfs_pack_write(dir, path));
+    std::shared_ptr<const tss::VfsPack> pack = tss::VfsPack::open(path);
+    fs::remove_all(dir);
+    fs::remove(path);
+    REQUIRE(pack);
+
+    // Guest layout: path at 0, one iovec at 32, its buffer at 48, results at 96, 104 and 128
+    std::vector<uint8_t> storage(192);
+    tss::WasiEnv env{};
+    env.guest = tss::GuestMemory(storage.data(), storage.size());
+    env.fds.preopen("/data", pack);
+    std::memcpy(&storage[0], "sub/file.txt", 12);
+
+    tss::GuestSpan<char> file_path(env.guest, 0, 12);
+    tss::GuestPtr<__wasi_fd_t> opened(env.guest, 96);
+    const auto rights = tss::wasi_rights({Rights::fd_read, Rights::fd_seek, Rights::fd_write});
+    REQUIRE(tss::wasi_path_open(env, 0, 0, file_path, 0, rights, 0, 0, opened) == Errno::e_rofs);
+    const auto read = tss::wasi_rights({Rights::fd_read, Rights::fd_seek});
+    REQUIRE(tss::wasi_path_open(env, 0, 0, file_path, 0, read, 0, 0, opened) == Errno::e_success);
+    const auto fd = opened.load();
+
+    tss::GuestSpan<__wasi_guest_iovec_t> iovs(env.guest, 32, 1);
+    tss::GuestPtr<__wasi_size_t> count(env.guest, 104);
+    iovs.store(0, {48, 4});
+    REQUIRE(tss::wasi_fd_read(env, fd, iovs, count) == Errno::e_success);
+    REQUIRE(count.load() == 4);
+    REQUIRE(tss::wasi_fd_read(env, fd, iovs, count) == Errno::e_success);
+    REQUIRE(std::string_view(reinterpret_cast<char *>(&storage[48]), 4) == "4567");
+    REQUIRE(tss::wasi_fd_pread(env, fd, iovs, 8, count) == Errno::e_success);
+    REQUIRE(count.load() == 2);
+
+    tss::GuestPtr<__wasi_filesize_t> position(env.guest, 104);
+    REQUIRE(tss::wasi_fd_seek(env, fd, -1, std::to_underlying(Whence::end), position) == Errno::e_success);
+    REQUIRE(position.load() == 9);
+    REQUIRE(tss::wasi_fd_seek(env, fd, -1, std::to_underlying(Whence::set), position) == Errno::e_inval);
+
+    tss::GuestPtr<__wasi_filestat_t> stat(env.guest, 128);
+    REQUIRE(tss::wasi_fd_filestat_get(env, fd, stat) == Errno::e_notcapable);
+    std::memcpy(&storage[48], "sub", 3);
+    tss::GuestSpan<char> sub_path(env.guest, 48, 3);
+    REQUIRE(tss::wasi_path_filestat_get(env, 0, 0, tss::GuestSpan<char>(env.guest, 48, 0), stat) == Errno::e_noent);
+    REQUIRE(tss::wasi_path_filestat_get(env, 0, 0, sub_path, stat) == Errno::e_success);
+    REQUIRE(stat.load().filetype == std::to_underlying(Filetype::directory));
+
+    // A buffer that only fits half of the one entry gets it cut off
+    const auto dir_rights = tss::wasi_rights({Rights::fd_readdir});
+    REQUIRE(tss::wasi_path_open(env, 0, 0, sub_path, 0, dir_rights, 0, 0, opened) == Errno::e_success);
+    const auto dir_fd = opened.load();
+    tss::GuestSpan<uint8_t> entries(env.guest, 48, 28);
+    tss::GuestPtr<__wasi_size_t> used(env.guest, 104);
+    std::memset(&storage[76], '#', 4);
+    REQUIRE(tss::wasi_fd_readdir(env, dir_fd, entries, 0, used) == Errno::e_success);
+    REQUIRE(used.load() == 28); // The whole buffer, which is how the guest learns it was cut off
+    REQUIRE(env.guest.load<__wasi_dirent_t>(48).d_namlen == 8);
+    REQUIRE(std::string_view(reinterpret_cast<char *>(&storage[72]), 8) == "file####");
+    REQUIRE(tss::wasi_fd_readdir(env, dir_fd, entries, 1, used) == Errno::e_success);
+    REQUIRE(used.load() == 0);
+
+    REQUIRE(tss::wasi_fd_close(env, fd) == Errno::e_success);
+}
+
+TEST_CASE("wasi args_get and environ_get") {
+    std::vector<uint8_t> storage(64);
+    tss::WasiEnv env{};
+    env.guest       = tss::GuestMemory(storage.data(), storage.size());
+    env.args        = tss::GuestStrings::from({"game.wasm", "", "--fast"});
+    env.environment = tss::GuestStrings::from({"HOME=/"});
+    tss::GuestPtr<__wasi_size_t> count(env.guest, 0);
+    tss::GuestPtr<__wasi_size_t> size(env.guest, 4);
+
+    REQUIRE(tss::wasi_args_sizes_get(env, count, size) == Errno::e_success);
+    REQUIRE(count.load() == 3);
+    REQUIRE(size.load() == 18);
+
+    // Pointers at 8, strings at 20
+    REQUIRE(tss::wasi_args_get(env, tss::GuestPtr<uint32_t>(env.guest, 8), tss::GuestPtr<uint8_t>(env.guest, 20)) ==
+            Errno::e_success);
+    tss::GuestSpan<uint32_t> argv(env.guest, 8, 3);
+    REQUIRE(argv.load(0) == 20);
+    REQUIRE(argv.load(1) == 30);
+    REQUIRE(argv.load(2) == 31);
+    REQUIRE(std::string_view(reinterpret_cast<const char *>(&storage[31])) == "--fast");
+    REQUIRE(storage[30] == 0);
+
+    REQUIRE(tss::wasi_environ_sizes_get(env, count, size) == Errno::e_success);
+    REQUIRE(count.load() == 1);
+    REQUIRE(size.load() == 7);
+    REQUIRE(tss::wasi_environ_get(env, tss::GuestPtr<uint32_t>(env.guest, 8), tss::GuestPtr<uint8_t>(env.guest, 40)) ==
+            Errno::e_success);
+    REQUIRE(argv.load(0) == 40);
+    REQUIRE(std::string_view(reinterpret_cast<const char *>(&storage[40])) == "HOME=/");
+}
+
+TEST_CASE("wasi clock_time_get and clock_res_get") {
+    std::vector<uint8_t> storage(16);
+    tss::WasiEnv env{};
+    env.guest = tss::GuestMemory(storage.data(), storage.size());
+    tss::GuestPtr<__wasi_timestamp_t> time(env.guest, 0);
+    tss::GuestPtr<__wasi_timestamp_t> resolution(env.guest, 8);
+    const auto monotonic = std::to_underlying(ClockID::monotonic);
+
+    REQUIRE(tss::wasi_clock_time_get(env, monotonic, 0, time) == Errno::e_success);
+    REQUIRE(time.load() > 0);
+    REQUIRE(tss::wasi_clock_res_get(env, monotonic, resolution) == Errno::e_success);
+    REQUIRE(resolution.load() > 0);
+    REQUIRE(tss::wasi_clock_time_get(env, 42, 0, time) == Errno::e_inval);
+    REQUIRE(tss::wasi_clock_res_get(env, 42, resolution) == Errno::e_inval);
+
+    // A replay sees the same timestamps no matter how long the host takes between ticks
+    env.clock.set_mode(tss::ClockMode::deterministic);
+    env.clock.set_virtual(5000, 100);
+    env.clock.tick();
+    REQUIRE(tss::wasi_clock_time_get(env, std::to_underlying(ClockID::realtime), 0, time) == Errno::e_success);
+    REQUIRE(time.load() == 5100);
+    REQUIRE(tss::wasi_clock_res_get(env, monotonic, resolution) == Errno::e_success);
+    REQUIRE(resolution.load() == 100);
+
+    // Absolute poll timeouts are read on the virtual clock, so one in the virtual past expires right away
+    __wasi_subscription_clock_t sleep{};
+    sleep.id      = monotonic;
+    sleep.timeout = 50;
+    sleep.flags   = std::to_underlying(SubClockFlags::subscription_clock_abstime);
+    uint64_t deadline = 0;
+    REQUIRE(tss::wasi_poll_deadline(env.clock, sleep, 1000, &deadline) == Errno::e_success);
+    REQUIRE(deadline == 1000);
+    sleep.timeout = 400;
+    REQUIRE(tss::wasi_poll_deadline(env.clock, sleep, 1000, &deadline) == Errno::e_success);
+    REQUIRE(deadline == 1300);
+}
+
+TEST_CASE("wasi_poll_oneoff") {
+    int pipe_fds[2];
+    REQUIRE(pipe(pipe_fds) == 0);
+
+    // Guest layout: three subscriptions at 0, three events at 160, nevents at 256
+    std::vector<uint8_t> storage(264);
+    tss::WasiEnv env{};
+    env.guest         = tss::GuestMemory(storage.data(), storage.size());
+    const auto rights = tss::wasi_rights({Rights::fd_read, Rights::poll_fd_readwrite});
+    const auto read = env.fds.insert({pipe_fds[0], Filetype::unknown, 0, rights, 0, true, {}, nullptr, 0, 0, nullptr});
+
+    tss::GuestSpan<__wasi_subscription_t> in(env.guest, 0, 3);
+    tss::GuestSpan<__wasi_event_t> out(env.guest, 160, 3);
+    tss::GuestPtr<__wasi_size_t> nevents(env.guest, 256);
+
+    __wasi_subscription_t sleep{};
+    sleep.userdata          = 1;
+    sleep.u.tag             = std::to_underlying(EventType::clock);
+    sleep.u.u.clock.id      = std::to_underlying(ClockID::monotonic);
+    sleep.u.u.clock.timeout = 2000000;
+    __wasi_subscription_t readable{};
+    readable.userdata                    = 2;
+    readable.u.tag                       = std::to_underlying(EventType::fd_read);
+    readable.u.u.fd_read.file_descriptor = read;
+    __wasi_subscription_t bad_fd       = readable;
+    bad_fd.userdata                    = 3;
+    bad_fd.u.u.fd_read.file_descriptor = 42;
+
+    // Nothing to read, so the clock wakes the guest after its timeout and not before
+    in.store(0, sleep);
+    in.store(1, readable);
+    auto start = tss::monotonic_ns();
+    REQUIRE(tss::wasi_poll_oneoff(env, in.offset(), out.offset(), 2, nevents) == Errno::e_success);
+    REQUIRE(tss::monotonic_ns() - start >= 2000000);
+    REQUIRE(nevents.load() == 1);
+    REQUIRE(out.load(0).userdata == 1);
+    REQUIRE(out.load(0).type == std::to_underlying(EventType::clock));
+
+    // Data beats a long sleep, and a bad fd is an event rather than a failure of the call
+    REQUIRE(write(pipe_fds[1], "abc", 3) == 3);
+    sleep.u.u.clock.timeout = 10000000000ULL;
+    in.store(0, sleep);
+    in.store(2, bad_fd);
+    start = tss::monotonic_ns();
+    REQUIRE(tss::wasi_poll_oneoff(env, in.offset(), out.offset(), 3, nevents) == Errno::e_success);
+    REQUIRE(tss::monotonic_ns() - start < 1000000000);
+    REQUIRE(nevents.load() == 2);
+    REQUIRE(out.load(0).userdata == 3);
+    REQUIRE(out.load(0).error == std::to_underlying(Errno::e_badf));
+    REQUIRE(out.load(1).userdata == 2);
+    REQUIRE(out.load(1).fd_readwrite.nbytes == 3);
+
+    // An absolute deadline in the past is ready right away
+    sleep.u.u.clock.flags   = std::to_underlying(SubClockFlags::subscription_clock_abstime);
+    sleep.u.u.clock.timeout = 1;
+    in.store(0, sleep);
+    REQUIRE(tss::wasi_poll_oneoff(env, in.offset(), out.offset(), 1, nevents) == Errno::e_success);
+    REQUIRE(nevents.load() == 1);
+
+    REQUIRE(tss::wasi_poll_oneoff(env, in.offset(), out.offset(), 0, nevents) == Errno::e_inval);
+    close(pipe_fds[1]);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("wasi_stubs: fd_write throughput") {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        return;
+    }
+
+    // 16 x 4 KiB buffers per call, like a guest flushing a large buffered write
+    constexpr uint32_t iov_count = 16;
+    constexpr uint32_t buf_size  = 4096;
+    std::vector<uint8_t> storage(iov_count * sizeof(__wasi_guest_iovec_t) + 4 + iov_count * buf_size);
+    tss::WasiEnv env{};
+    env.guest = tss::GuestMemory(storage.data(), storage.size());
+    const auto rights = tss::wasi_rights_all;
+    env.fds.insert({null_fd, Filetype::character_device, 0, rights, 0, true, {}, nullptr, 0, 0, nullptr});
+
+    tss::GuestSpan<__wasi_guest_iovec_t> iovs(env.guest, 0, iov_count);
+    tss::GuestPtr<__wasi_size_t> nwritten(env.guest, iov_count * sizeof(__wasi_guest_iovec_t));
+    std::vector<iovec> native(iov_count);
+    for (uint32_t index = 0; index < iov_count; index++) {
+        const uint32_t offset = nwritten.offset() + 4 + index * buf_size;
+        iovs.store(index, {offset, buf_size});
+        native[index] = {&storage[offset], buf_size};
+    }
+
+    constexpr size_t iterations = 100000;
+    const double bytes          = iov_count * buf_size;
+    const double native_ns      = tss::bench::ns_per_op(iterations, [&] {
+        tss::bench::do_not_optimize(writev(null_fd, native.data(), static_cast<int>(native.size())));
+    });
+    const double wasi_ns        = tss::bench::ns_per_op(iterations, [&] {
+        tss::bench::do_not_optimize(tss::wasi_fd_write(env, 0, iovs, nwritten));
+    });
+    tss::bench::report("native writev", bytes / native_ns, "GB/s");
+    tss::bench::report("wasi_fd_write", bytes / wasi_ns, "GB/s");
+}
+
+BENCHMARK_CASE("wasi_stubs: clock_time_get") {
+    // Calls per second on one core, for each clock provider, through the full host function minus the wasm transition
+    std::vector<uint8_t> storage(8);
+    tss::WasiEnv env{};
+    env.guest = tss::GuestMemory(storage.data(), storage.size());
+    tss::GuestPtr<__wasi_timestamp_t> time(env.guest, 0);
+    const auto monotonic = std::to_underlying(ClockID::monotonic);
+
+    constexpr size_t iterations = 10000000;
+    for (auto mode : {tss::ClockMode::vdso, tss::ClockMode::tsc, tss::ClockMode::deterministic}) {
+        if (!env.clock.set_mode(mode)) {
+            fmt::print("  {} is not available\n", magic_enum::enum_name(mode));
+            continue;
+        }
+        const double ns = tss::bench::ns_per_op(iterations, [&] {
+            tss::bench::do_not_optimize(tss::wasi_clock_time_get(env, monotonic, 0, time));
+        });
+        tss::bench::report(fmt::format("monotonic, {}", magic_enum::enum_name(mode)), 1000.0 / ns, "M calls/s");
+    }
+    env.clock.set_mode(tss::ClockMode::vdso);
+    const double ns = tss::bench::ns_per_op(iterations, [&] {
+        tss::bench::do_not_optimize(tss::wasi_clock_time_get(env, std::to_underlying(ClockID::realtime), 0, time));
+    });
+    tss::bench::report("realtime, vdso", 1000.0 / ns, "M calls/s");
+}
+
+BENCHMARK_CASE("wasi_stubs: profiler overhead") {
+    // The stub bound when profiling is off against its profiled wrapper, around a call that does next to nothing:
+    // closing an fd that is not open
+    tss::WasiEnv env{};
+    env.profile.enable();
+
+    wasm_val_t args_val[1]    = {WASM_I32_VAL(1000)};
+    wasm_val_t results_val[1] = {WASM_INIT_VAL};
+    wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+    wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+
+    const auto *import          = tss::wasi_find_import("wasi_snapshot_preview1", "fd_close");
+    constexpr size_t iterations = 10000000;
+    for (auto [name, stub] :
+         {std::pair{"fd_close, unprofiled", import->stub}, std::pair{"fd_close, profiled", import->profiled_stub}}) {
+        tss::bench::report(name,
+                           tss::bench::ns_per_op(iterations,
+                                                 [&] { tss::bench::do_not_optimize(stub(&env, &args, &results)); }),
+                           "ns/call");
+    }
+}
 #endif
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "inc.hh"
+
+// Tracing of WASI host calls, in three levels:
+//  * `WASI_TRACE` not defined: compiled out, the stubs contain no tracing code at all
+//  * `WASI_TRACE` defined, tracing not enabled on the instance: one relaxed load and a predictable branch per call
+//  * enabled: every call appends a fixed size binary record to a per-instance ring buffer, nothing is formatted or
+//    written on the call path. Records are decoded by `wasi_trace_record_to_str` on demand, or written to a file with
+//    `wasi_trace_write` and decoded later with `wasi_trace_read`
+
+namespace tss {
+
+// One entry per host function, in the same order as `wasi_imports`
+enum class WasiFunc : uint16_t {
+    args_get,
+    args_sizes_get,
+    clock_res_get,
+    clock_time_get,
+    environ_get,
+    environ_sizes_get,
+    fd_advise,
+    fd_close,
+    fd_datasync,
+    fd_fdstat_get,
+    fd_fdstat_set_flags,
+    fd_filestat_get,
+    fd_filestat_set_size,
+    fd_filestat_set_times,
+    fd_pread,
+    fd_prestat_dir_name,
+    fd_prestat_get,
+    fd_pwrite,
+    fd_read,
+    fd_readdir,
+    fd_seek,
+    fd_sync,
+    fd_tell,
+    fd_write,
+    path_create_directory,
+    path_filestat_get,
+    path_filestat_set_times,
+    path_link,
+    path_open,
+    path_readlink,
+    path_remove_directory,
+    path_rename,
+    path_symlink,
+    path_unlink_file,
+    poll_oneoff,
+    proc_exit,
+    random_get,
+    sched_yield,
+    sock_accept,
+    sock_recv,
+    sock_send,
+    sock_shutdown,
+};
+
+#define WASI_TRACE_MAX_ARGS 9U // path_open
+#define WASI_TRACE_VERSION 1U
+
+enum WasiTraceFlags : uint8_t {
+    WASI_TRACE_TRAPPED = 1U << 0,
+};
+
+struct WasiTraceRecord {
+    uint64_t timestamp_ns;              // Steady clock, taken when the call returns
+    uint64_t args[WASI_TRACE_MAX_ARGS]; // i32 arguments are zero extended
+    int32_t result;                     // Errno returned to the guest, 0 for functions without a result
+    uint16_t func;                      // WasiFunc
+    uint16_t wide_args;                 // Bit n is set when args[n] is an i64
+    uint8_t arg_count;
+    uint8_t flags;                      // WasiTraceFlags
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(WasiTraceRecord) == 96, "trace record layout changed, bump WASI_TRACE_VERSION");
+
+inline constexpr char wasi_trace_magic[8] = {'Q', 'O', 'S', 'T', 'T', 'R', 'C', '\0'};
+
+struct WasiTraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t record_count;
+};
+
+// Single producer ring buffer: only the thread running the instance appends, any thread may take a snapshot. The
+// buffer is only allocated once tracing is enabled, so instances that never trace do not pay for it in memory either
+class WasiTrace {
+public:
+    // `capacity` is rounded up to a power of two
+    void enable(size_t capacity = 1U << 14) {
+        if (!m_Records) {
+            m_Capacity = std::bit_ceil(std::max<size_t>(capacity, 1));
+            m_Records  = std::make_unique<WasiTraceRecord[]>(m_Capacity);
+        }
+        m_Enabled.store(true, std::memory_order_relaxed);
+    }
+
+    void disable() {
+        m_Enabled.store(false, std::memory_order_relaxed);
+    }
+
+    auto enabled() const -> bool {
+        return m_Enabled.load(std::memory_order_relaxed);
+    }
+
+    void record(WasiFunc func, const wasm_val_vec_t *args, const wasm_val_vec_t *results, bool trapped) {
+        const auto head      = m_Head.load(std::memory_order_relaxed);
+        WasiTraceRecord &out = m_Records[head & (m_Capacity - 1)];
+
+        out.timestamp_ns = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+                .count());
+        out.func      = std::to_underlying(func);
+        out.arg_count = static_cast<uint8_t>(std::min<size_t>(args->size, WASI_TRACE_MAX_ARGS));
+        out.wide_args = 0;
+        for (size_t index = 0; index < out.arg_count; index++) {
+            const auto &arg = args->data[index];
+            if (arg.kind == WASM_I64) {
+                out.args[index] = static_cast<uint64_t>(arg.of.i64);
+                out.wide_args   = static_cast<uint16_t>(out.wide_args | (1U << index));
+            } else {
+                out.args[index] = static_cast<uint32_t>(arg.of.i32);
+            }
+        }
+        out.result = results->size > 0 ? results->data[0].of.i32 : 0;
+        out.flags  = trapped ? WASI_TRACE_TRAPPED : 0;
+
+        m_Head.store(head + 1, std::memory_order_release);
+    }
+
+    // Number of records ever appended, including the ones that have since been overwritten
+    auto total() const -> uint64_t {
+        return m_Head.load(std::memory_order_acquire);
+    }
+
+    // Copies out the records still in the buffer, oldest first. Of a full buffer that leaves out the oldest record,
+    // which the producer may be overwriting
+    auto snapshot() const -> std::vector<WasiTraceRecord> {
+        std::vector<WasiTraceRecord> out;
+        if (!m_Records) {
+            return out;
+        }
+
+        const auto head  = m_Head.load(std::memory_order_acquire);
+        const auto first = head > m_Capacity ? head - m_Capacity : 0;
+        out.reserve(head - first);
+        for (auto index = first; index < head; index++) {
+            out.push_back(m_Records[index & (m_Capacity - 1)]);
+        }
+
+        // The producer may have lapped us while copying, drop whatever it could have overwritten in the meantime. That
+        // includes record `after`, which it may be writing right now over the slot of record `after - m_Capacity`
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const auto after = m_Head.load(std::memory_order_relaxed);
+        if (after + 1 > m_Capacity && after + 1 - m_Capacity > first) {
+            const auto torn = std::min<size_t>(after + 1 - m_Capacity - first, out.size());
+            out.erase(out.begin(), out.begin() + static_cast<ptrdiff_t>(torn));
+        }
+
+        return out;
+    }
+
+private:
+    std::atomic<bool> m_Enabled{false};
+    std::atomic<uint64_t> m_Head{0};
+    size_t m_Capacity = 0;
+    std::unique_ptr<WasiTraceRecord[]> m_Records;
+};
+
+// `base_ns` is subtracted from the timestamp, pass the timestamp of the first record to get times relative to it
+inline auto wasi_trace_record_to_str(const WasiTraceRecord &record, uint64_t base_ns = 0) -> std::string {
+    std::string str = fmt::format("[{:>12.3f} us] {}(",
+                                  static_cast<double>(record.timestamp_ns - base_ns) / 1e3,
+                                  magic_enum::enum_name(static_cast<WasiFunc>(record.func)));
+
+    for (size_t index = 0; index < record.arg_count && index < WASI_TRACE_MAX_ARGS; index++) {
+        const bool wide = (record.wide_args & (1U << index)) != 0;
+        str += fmt::format("{}{:#x}:{}", index != 0 ? ", " : "", record.args[index], wide ? "i64" : "i32");
+    }
+
+    auto error = magic_enum::enum_name(static_cast<Errno>(record.result));
+    str += error.empty() ? fmt::format(") -> {}", record.result) : fmt::format(") -> {}", error);
+    if (record.flags & WASI_TRACE_TRAPPED) {
+        str += " (trapped)";
+    }
+
+    return str;
+}
+
+inline void wasi_trace_print(const std::vector<WasiTraceRecord> &records, FILE *out = stderr) {
+    const uint64_t base_ns = records.empty() ? 0 : records.front().timestamp_ns;
+    for (const auto &record : records) {
+        fmt::print(out, "{}\n", wasi_trace_record_to_str(record, base_ns));
+    }
+}
+
+inline auto wasi_trace_write(const std::vector<WasiTraceRecord> &records, const std::filesystem::path &path) -> bool {
+    WasiTraceFileHeader header{};
+    std::memcpy(header.magic, wasi_trace_magic, sizeof(header.magic));
+    header.version      = WASI_TRACE_VERSION;
+    header.record_size  = sizeof(WasiTraceRecord);
+    header.record_count = records.size();
+
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    const bool ok = ofs && ofs.write(reinterpret_cast<const char *>(&header), sizeof(header)) &&
+                    ofs.write(reinterpret_cast<const char *>(records.data()),
+                              static_cast<std::streamsize>(records.size() * sizeof(WasiTraceRecord))) &&
+                    ofs.flush();
+    if (!ok) {
+        fmt::print(stderr, "Trace: could not write {}\n", path.string());
+    }
+
+    return ok;
+}
+
+inline auto wasi_trace_read(const std::filesystem::path &path, std::vector<WasiTraceRecord> *out) -> bool {
+    MappedFile file(path);
+    if (!file) {
+        fmt::print(stderr, "Trace: {}: {}\n", path.string(), std::strerror(file.error()));
+        return false;
+    }
+
+    WasiTraceFileHeader header{};
+    if (file.size() >= sizeof(header)) {
+        std::memcpy(&header, file.data(), sizeof(header));
+    }
+
+    if (std::memcmp(header.magic, wasi_trace_magic, sizeof(header.magic)) != 0 ||
+        header.version != WASI_TRACE_VERSION || header.record_size != sizeof(WasiTraceRecord) ||
+        header.record_count > (file.size() - sizeof(header)) / sizeof(WasiTraceRecord)) {
+        fmt::print(stderr, "Trace: {} is not a valid trace file\n", path.string());
+        return false;
+    }
+
+    out->resize(header.record_count);
+    std::memcpy(out->data(), file.data() + sizeof(header), header.record_count * sizeof(WasiTraceRecord));
+
+    return true;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("WasiTrace") {
+    tss::WasiTrace trace;
+    REQUIRE(!trace.enabled());
+    REQUIRE(trace.snapshot().empty());
+
+    trace.enable(4);
+    REQUIRE(trace.enabled());
+
+    wasm_val_t args_val[3]    = {WASM_I32_VAL(1), WASM_I64_VAL(-1), WASM_I32_VAL(0x100)};
+    wasm_val_t results_val[1] = {WASM_I32_VAL(0)};
+    wasm_val_vec_t args       = WASM_ARRAY_VEC(args_val);
+    wasm_val_vec_t results    = WASM_ARRAY_VEC(results_val);
+
+    for (int32_t index = 0; index < 6; index++) {
+        results_val[0].of.i32 = index;
+        trace.record(tss::WasiFunc::clock_time_get, &args, &results, index == 5);
+    }
+
+    // Six records through a ring of four keeps the last four, less the oldest, whose slot the next record may be
+    // written to while the snapshot copies
+    auto records = trace.snapshot();
+    REQUIRE(trace.total() == 6);
+    REQUIRE(records.size() == 3);
+    REQUIRE(records.front().result == 3);
+    REQUIRE(records.back().result == 5);
+    REQUIRE(records.back().arg_count == 3);
+    REQUIRE(records.back().wide_args == 0b010);
+    REQUIRE(records.back().args[1] == UINT64_MAX);
+
+    auto str = tss::wasi_trace_record_to_str(records.back(), records.back().timestamp_ns);
+    INFO(str);
+    REQUIRE(str.find("clock_time_get(0x1:i32, 0xffffffffffffffff:i64, 0x100:i32)") != std::string::npos);
+    REQUIRE(str.find("(trapped)") != std::string::npos);
+}
+#endif
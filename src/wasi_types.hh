@@ -247,6 +247,19 @@ typedef struct __wasi_ciovec_t {
 // static_assert(offsetof(__wasi_ciovec_t, buf) == 0, "witx calculated offset");
 // static_assert(offsetof(__wasi_ciovec_t, buf_len) == 4, "witx calculated offset");
 
+/**
+ * An iovec or ciovec as laid out in guest memory, where `buf` is a 32 bit offset rather than a host pointer.
+ */
+typedef struct __wasi_guest_iovec_t {
+    uint32_t buf;
+    __wasi_size_t buf_len;
+} __wasi_guest_iovec_t;
+
+static_assert(sizeof(__wasi_guest_iovec_t) == 8, "witx calculated size");
+static_assert(alignof(__wasi_guest_iovec_t) == 4, "witx calculated align");
+static_assert(offsetof(__wasi_guest_iovec_t, buf) == 0, "witx calculated offset");
+static_assert(offsetof(__wasi_guest_iovec_t, buf_len) == 4, "witx calculated offset");
+
 /**
  * Relative offset within a file.
  */
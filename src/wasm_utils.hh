@@ -0,0 +1,231 @@
+#pragma once
+
+#include "inc.hh"
+
+namespace tss {
+inline auto wasm_limits_to_str(const wasm_limits_t *limits) -> std::string {
+    return fmt::format("{:#08x}, {:#08x}", limits->min, limits->max);
+}
+
+inline auto wasm_mutability_to_str(wasm_mutability_t mutability) -> std::string {
+    switch (mutability) {
+    case WASM_CONST: {
+        return "const";
+    }
+    case WASM_VAR: {
+        return "var";
+    }
+    default: {
+        return fmt::format("unknown ({})", mutability);
+    }
+    }
+}
+
+inline auto wasm_externkind_to_str(wasm_externkind_t externkind) -> std::string {
+    switch (externkind) {
+    case WASM_EXTERN_FUNC: {
+        return "func";
+    }
+    case WASM_EXTERN_GLOBAL: {
+        return "global";
+    }
+    case WASM_EXTERN_TABLE: {
+        return "table";
+    }
+    case WASM_EXTERN_MEMORY: {
+        return "memory";
+    }
+    default: {
+        return fmt::format("unknown ({})", externkind);
+    }
+    }
+}
+
+inline auto wasm_externtype_to_str(const wasm_externtype_t *externtype) -> std::string {
+    std::string str;
+    const auto externkind = ::wasm_externtype_kind(externtype);
+
+    switch (externkind) {
+    case WASM_EXTERN_FUNC: {
+        const auto functype = ::wasm_externtype_as_functype_const(externtype);
+        const auto params   = ::wasm_functype_params(functype);
+        const auto results  = ::wasm_functype_results(functype);
+
+        str += "(";
+        for (size_t index = 0; index < params->size; index++) {
+            const auto param   = params->data[index];
+            const auto valkind = ::wasm_valtype_kind(param);
+            str += wasm_valkind_to_str(valkind);
+            if (index != params->size - 1)
+                str += ", ";
+        }
+        str += ") -> (";
+        for (size_t index = 0; index < results->size; index++) {
+            const auto result  = results->data[index];
+            const auto valkind = ::wasm_valtype_kind(result);
+            str += wasm_valkind_to_str(valkind);
+            if (index != results->size - 1)
+                str += ", ";
+        }
+        str += ")";
+        break;
+    }
+    case WASM_EXTERN_GLOBAL: {
+        const auto globaltype = wasm_externtype_as_globaltype_const(externtype);
+        const auto mutability = wasm_globaltype_mutability(globaltype);
+        const auto valtype    = wasm_globaltype_content(globaltype);
+        const auto valkind    = wasm_valtype_kind(valtype);
+
+        str += fmt::format(": {} {}", wasm_mutability_to_str(mutability), wasm_valkind_to_str(valkind));
+        break;
+    }
+    case WASM_EXTERN_TABLE: {
+        const auto tabletype = wasm_externtype_as_tabletype_const(externtype);
+        const auto limits    = wasm_tabletype_limits(tabletype);
+        const auto valtype   = wasm_tabletype_element(tabletype);
+        const auto valkind   = wasm_valtype_kind(valtype);
+
+        str += fmt::format("({}): {}", wasm_limits_to_str(limits), wasm_valkind_to_str(valkind));
+        break;
+    }
+    case WASM_EXTERN_MEMORY: {
+        const auto memorytype = wasm_externtype_as_memorytype_const(externtype);
+        const auto limits     = wasm_memorytype_limits(memorytype);
+
+        str += fmt::format("({})", wasm_limits_to_str(limits));
+        break;
+    }
+    default: {
+        str += fmt::format("(unknown {})", externkind);
+        break;
+    }
+    }
+
+    return str;
+}
+
+inline auto wasm_memory_to_str() -> std::string {
+    return "";
+}
+
+inline auto wasm_importtype_to_str(const wasm_importtype_t *importtype) -> std::string {
+    std::string str;
+    auto module     = ::wasm_importtype_module(importtype);
+    auto name       = ::wasm_importtype_name(importtype);
+    auto externtype = ::wasm_importtype_type(importtype);
+    auto externkind = ::wasm_externtype_kind(externtype);
+
+    str += wasm_externkind_to_str(externkind) + " ";
+    str += std::string(module->data, module->size) + "::";
+    str += std::string(name->data, name->size);
+    str += wasm_externtype_to_str(externtype);
+
+    return str;
+}
+
+inline auto
+wasm_exporttype_to_str(const wasm_exporttype_t *exporttype, const std::string modulename = "") -> std::string {
+    std::string str;
+    auto name       = ::wasm_exporttype_name(exporttype);
+    auto externtype = ::wasm_exporttype_type(exporttype);
+    auto externkind = ::wasm_externtype_kind(externtype);
+
+    str += wasm_externkind_to_str(externkind) + " ";
+    str += modulename + "::";
+    str += std::string(name->data, name->size);
+    str += wasm_externtype_to_str(externtype);
+
+    return str;
+}
+
+inline auto wasm_module_imports_to_str(const wasm_module_t *module) -> std::string {
+    std::string str;
+    wasm_importtype_vec_t imports;
+    ::wasm_module_imports(module, &imports);
+
+    for (size_t index = 0; index < imports.size; index++) {
+        str += fmt::format("{}\n", tss::wasm_importtype_to_str(imports.data[index]));
+    }
+
+    ::wasm_importtype_vec_delete(&imports);
+
+    return str;
+}
+
+inline auto wasm_module_exports_to_str(const wasm_module_t *module) -> std::string {
+    std::string str;
+    wasm_exporttype_vec_t exports;
+    ::wasm_module_exports(module, &exports);
+
+    for (size_t index = 0; index < exports.size; index++) {
+        str += fmt::format("{}\n", tss::wasm_exporttype_to_str(exports.data[index]));
+    }
+
+    ::wasm_exporttype_vec_delete(&exports);
+
+    return str;
+}
+
+inline auto wasm_frame_to_str(const wasm_frame_t *frame) -> std::string {
+    std::string str;
+
+    if (frame) {
+        str += fmt::format("{} @ {:#08x} = {}.{:#08x}",
+                           static_cast<void *>(::wasm_frame_instance(frame)),
+                           ::wasm_frame_module_offset(frame),
+                           ::wasm_frame_func_index(frame),
+                           ::wasm_frame_func_offset(frame));
+    } else {
+        str += fmt::format("{}", static_cast<const void *>(frame));
+    }
+
+    return str;
+}
+
+inline auto wasm_new_populated_imports_vec(wasm_extern_vec_t *out,
+                                           const wasm_module_t *module,
+                                           wasm_store_t *store,
+                                           void *env,
+                                           void (*finalizer)(void *),
+                                           bool profiled = false) {
+    wasm_importtype_vec_t imports;
+    ::wasm_module_imports(module, &imports);
+    wasm_extern_vec_new_uninitialized(out, imports.size);
+
+    for (size_t index = 0; index < imports.size; index++) {
+        auto importtype = imports.data[index];
+        auto externtype = ::wasm_importtype_type(importtype);
+        auto externkind = ::wasm_externtype_kind(externtype);
+        switch (externkind) {
+        case WASM_EXTERN_FUNC: {
+            auto functype    = ::wasm_externtype_as_functype_const(externtype);
+            auto module_name = ::wasm_importtype_module(importtype);
+            auto name        = ::wasm_importtype_name(importtype);
+            auto stub        = tss::wasi_get_stub(std::string_view(module_name->data, module_name->size),
+                                               std::string_view(name->data, name->size),
+                                               functype,
+                                               profiled);
+            if (!stub) {
+                fmt::print(stderr, "Warning: Unresolved import: {}\n", wasm_importtype_to_str(importtype));
+                stub = tss::wasi_unresolved_import_stub;
+            }
+            wasm_func_t *func = wasm_func_new_with_env(store, functype, stub, env, finalizer);
+            out->data[index]  = wasm_func_as_extern(func);
+
+            break;
+        }
+        case WASM_EXTERN_GLOBAL:
+        case WASM_EXTERN_TABLE:
+        case WASM_EXTERN_MEMORY: {
+            fmt::print(stderr, "Warning: Unsupported import: {}\n", externkind);
+            continue;
+        }
+        default: {
+            break;
+        }
+        }
+    }
+
+    ::wasm_importtype_vec_delete(&imports);
+}
+} // namespace tss
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "inc.hh"
+
+// Wall-clock deadlines for calls into guests, so a frame never waits on a guest that hangs, whatever it hangs in. A
+// thread of its own sleeps until the earliest deadline of the calls being watched. Once a call is past its deadline the
+// watchdog interrupts it two ways, since no single one reaches everywhere:
+//
+// - Host calls check `WasiEnv::interrupted` on the way in and out, and trap
+// - A host call blocked in the kernel, reading stdin, sleeping in poll_oneoff or waiting on file I/O, is woken with a
+//   signal whose handler is installed without SA_RESTART, so the system call fails with EINTR instead of resuming
+//
+// The watchdog thread never touches the store, wasmer has no interrupt that is safe to raise from another thread. A
+// loop that never calls the host is instead stopped by fuel: `watchdog_call` gives a metered call the fuel its engine
+// burns before the deadline, plus a quarter for noise. The rate is calibrated once per engine, by timing a metered
+// loop of the cheapest operators there are, so a loop of those runs out within 1.25 times its deadline, and a loop of
+// slower operators within that times how much slower they are, a few times for loops full of memory accesses and
+// calls. Untrusted guests therefore have to be compiled with metering.
+//
+// The watchdog keeps at it every millisecond until the call is no longer watched, in case the signal arrived just
+// before the thread went to sleep. Interrupting always happens through a trap, from a host call or a metering check,
+// so the host side of the instance is consistent afterwards. The guest's own state is wherever the trap left it, so an
+// interrupted instance should be treated like one that trapped: destroyed, or restored from a snapshot or save-state
+
+namespace tss {
+
+#define WATCHDOG_SIGNAL SIGURG // Ignored by default, so a stray one does no harm
+
+// Operators per nanosecond `engine` runs a metered loop of local arithmetic and branches at, the fastest of a few runs
+// of a few milliseconds each. The engine has to meter, see `EngineConfig::metering`, 0 if the loop could not be run
+inline auto fuel_rate_measure(wasm_engine_t *engine) -> double {
+    auto wasm_bytes = wat_to_wasm(R"((module
+        (func (export "spin") (local $counter i32)
+            (loop $forever
+                (local.set $counter (i32.add (local.get $counter) (i32.const 1)))
+                (br $forever)))))");
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+    wasm_extern_vec_t imports = WASM_EMPTY_VEC;
+    wasm_instance_t *instance = module ? ::wasm_instance_new(store, module, &imports, nullptr) : nullptr;
+
+    double rate = 0.0;
+    if (instance) {
+        wasm_extern_vec_t exports;
+        ::wasm_instance_exports(instance, &exports);
+        wasm_func_t *spin       = ::wasm_extern_as_func(exports.data[0]);
+        wasm_val_vec_t args     = WASM_EMPTY_VEC;
+        wasm_val_vec_t results  = WASM_EMPTY_VEC;
+        constexpr uint64_t fuel = 10000000;
+        for (int run = 0; run < 3; run++) {
+            ::wasmer_metering_set_remaining_points(instance, fuel);
+            const auto begin = std::chrono::steady_clock::now();
+            if (auto trap = ::wasm_func_call(spin, &args, &results)) {
+                ::wasm_trap_delete(trap);
+            }
+            const auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+            if (!::wasmer_metering_points_are_exhausted(instance)) {
+                break;
+            }
+            rate = std::max(rate, static_cast<double>(fuel) / std::max(ns, 1.0));
+        }
+        ::wasm_extern_vec_delete(&exports);
+        ::wasm_instance_delete(instance);
+    }
+    if (module) {
+        ::wasm_module_delete(module);
+    }
+    ::wasm_store_delete(store);
+    return rate;
+}
+
+struct WatchdogStats {
+    size_t watched = 0; // Calls ever watched
+    size_t fired   = 0; // Of those, calls that ran past their deadline
+};
+
+class Watchdog {
+public:
+    static auto create() -> std::unique_ptr<Watchdog> {
+        static const bool installed = [] {
+            struct sigaction action{};
+            action.sa_handler = [](int) {};
+            ::sigemptyset(&action.sa_mask);
+            action.sa_flags = 0; // Without SA_RESTART, the point of the whole signal
+            return ::sigaction(WATCHDOG_SIGNAL, &action, nullptr) == 0;
+        }();
+        if (!installed) {
+            fmt::print(stderr, "Watchdog: could not install the signal handler: {}\n", std::strerror(errno));
+            return nullptr;
+        }
+
+        std::unique_ptr<Watchdog> self(new Watchdog());
+        self->m_Thread = std::thread([self = self.get()] { self->run(); });
+        return self;
+    }
+
+    ~Watchdog() {
+        {
+            std::lock_guard lock(m_Mutex);
+            m_Stop = true;
+        }
+        m_Wake.notify_all();
+        m_Thread.join();
+    }
+
+    Watchdog(const Watchdog &)            = delete;
+    Watchdog &operator=(const Watchdog &) = delete;
+
+    // Starts watching a call into the instance of `env` that the calling thread is about to make, to be interrupted
+    // once `timeout` has passed. Returns the id to stop watching it with
+    auto watch(WasiEnv &env, std::chrono::nanoseconds timeout) -> uint64_t {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        uint64_t id;
+        {
+            std::lock_guard lock(m_Mutex);
+            id = m_NextId++;
+            m_Watches.emplace(id, Watch{&env, ::pthread_self(), deadline, false});
+            m_Stats.watched++;
+        }
+        m_Wake.notify_one();
+        return id;
+    }
+
+    // Stops watching the call, which must have returned, and takes back the interrupt if there was one. Returns
+    // whether the call ran past its deadline
+    auto unwatch(uint64_t id) -> bool {
+        std::unique_lock lock(m_Mutex);
+        auto found = m_Watches.find(id);
+        if (found == m_Watches.end()) {
+            return false;
+        }
+        const auto watch = found->second;
+        m_Watches.erase(found);
+        lock.unlock();
+
+        if (watch.fired) {
+            watch.env->interrupted.store(false);
+        }
+        return watch.fired;
+    }
+
+    auto stats() -> WatchdogStats {
+        std::lock_guard lock(m_Mutex);
+        return m_Stats;
+    }
+
+    // Operators per nanosecond metered code of `engine` runs at, measured on the first call for each engine, which
+    // takes some tens of milliseconds. Best called at startup, `watchdog_call` calls it otherwise
+    auto fuel_rate(wasm_engine_t *engine) -> double {
+        {
+            std::lock_guard lock(m_Mutex);
+            if (auto found = m_FuelRates.find(engine); found != m_FuelRates.end()) {
+                return found->second;
+            }
+        }
+        // Measured without the lock, the watchdog thread has to keep to its deadlines meanwhile
+        const auto rate = fuel_rate_measure(engine);
+        std::lock_guard lock(m_Mutex);
+        m_FuelRates.emplace(engine, rate);
+        return rate;
+    }
+
+private:
+    struct Watch {
+        WasiEnv *env;
+        pthread_t thread; // Making the call
+        std::chrono::steady_clock::time_point deadline;
+        bool fired;
+    };
+
+    static constexpr auto repeat_interval = std::chrono::milliseconds(1);
+
+    Watchdog() = default;
+
+    void run() {
+        std::unique_lock lock(m_Mutex);
+        while (!m_Stop) {
+            const auto now = std::chrono::steady_clock::now();
+            auto wake      = std::chrono::steady_clock::time_point::max();
+            for (auto &[id, watch] : m_Watches) {
+                if (now < watch.deadline) {
+                    wake = std::min(wake, watch.deadline);
+                    continue;
+                }
+                if (!watch.fired) {
+                    watch.fired = true;
+                    m_Stats.fired++;
+                }
+                watch.env->interrupted.store(true);
+                ::pthread_kill(watch.thread, WATCHDOG_SIGNAL);
+                wake = std::min(wake, now + repeat_interval);
+            }
+            if (wake == std::chrono::steady_clock::time_point::max()) {
+                m_Wake.wait(lock);
+            } else {
+                m_Wake.wait_until(lock, wake);
+            }
+        }
+    }
+
+    std::thread m_Thread;
+    std::mutex m_Mutex; // Everything below, shared with the watchdog thread
+    std::condition_variable m_Wake;
+    std::unordered_map<uint64_t, Watch> m_Watches;
+    uint64_t m_NextId = 1;
+    bool m_Stop       = false;
+    WatchdogStats m_Stats{};
+    std::unordered_map<wasm_engine_t *, double> m_FuelRates; // Operators per nanosecond, by engine
+};
+
+// Fuel a metered call gets on top of what its engine burns before the deadline, so a loop of the calibration's own
+// operators does not run out just before it
+inline constexpr double watchdog_fuel_margin = 1.25;
+
+// Calls `func` of `instance` through its fuel meter, interrupted if it is still running after `timeout`. A trap
+// raised by the interrupt is deleted here, any other is left in `*trap` for the caller
+inline auto watchdog_call(Watchdog &watchdog,
+                          WasiInstance &instance,
+                          wasm_func_t *func,
+                          const wasm_val_vec_t *args,
+                          wasm_val_vec_t *results,
+                          wasm_trap_t **trap,
+                          std::chrono::nanoseconds timeout) -> FuelCallResult {
+    auto &env     = instance.env();
+    auto max_fuel = UINT64_MAX;
+    if (env.fuel.enabled()) {
+        const auto rate = watchdog.fuel_rate(instance.engine());
+        if (rate > 0.0) {
+            max_fuel = static_cast<uint64_t>(static_cast<double>(timeout.count()) * rate * watchdog_fuel_margin) + 1;
+        }
+    }
+    const auto id     = watchdog.watch(env, timeout);
+    auto result       = env.fuel.call(func, args, results, trap, max_fuel);
+    const bool missed = watchdog.unwatch(id);
+    if (missed && result != FuelCallResult::returned) {
+        // Whatever stopped the call, the deadline passing is what it is down to
+        if (*trap) {
+            ::wasm_trap_delete(*trap);
+            *trap = nullptr;
+        }
+        result = FuelCallResult::interrupted;
+    }
+    return result;
+}
+} // namespace tss
+
+#ifdef UNIT_TEST
+TEST_CASE("Watchdog") {
+    auto watchdog = tss::Watchdog::create();
+    REQUIRE(watchdog);
+    tss::WasiEnv env{};
+
+    // A call that returns in time is left alone
+    auto id = watchdog->watch(env, std::chrono::seconds(10));
+    REQUIRE(!watchdog->unwatch(id));
+    REQUIRE(!env.interrupted);
+
+    // A host call blocked in the kernel is woken up, as fd_read on an empty pipe would be
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    const auto begin = std::chrono::steady_clock::now();
+    id               = watchdog->watch(env, std::chrono::milliseconds(5));
+    char byte;
+    ssize_t result;
+    do {
+        result = ::read(fds[0], &byte, 1);
+    } while (result < 0 && errno == EINTR && !env.interrupted.load());
+    REQUIRE(result < 0);
+    REQUIRE(errno == EINTR);
+    REQUIRE(env.interrupted);
+    REQUIRE(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(5));
+
+    // Unwatching takes the interrupt back, so the instance can be called again
+    REQUIRE(watchdog->unwatch(id));
+    REQUIRE(!env.interrupted);
+    REQUIRE(!watchdog->unwatch(id));
+    REQUIRE(watchdog->stats().watched == 2);
+    REQUIRE(watchdog->stats().fired == 1);
+
+    // So does one waiting on io_uring, whose read is then finished by the next `complete`
+    if (env.io.enable_io_uring(4)) {
+        id = watchdog->watch(env, std::chrono::milliseconds(5));
+        iovec iov{&byte, 1};
+        REQUIRE(env.io.transfer(false, fds[0], &iov, 1, 0, &env.interrupted) == -EINTR);
+        REQUIRE(watchdog->unwatch(id));
+        REQUIRE(::write(fds[1], "x", 1) == 1);
+        env.io.complete();
+        REQUIRE(byte == 'x');
+    }
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+TEST_CASE("watchdog_call") {
+    // A metered loop that never calls the host is stopped by the fuel its deadline leaves it
+    auto wasm_bytes = tss::wat_to_wasm(R"((module
+        (memory (export "memory") 1)
+        (func (export "spin") (loop $forever (br $forever)))
+        (func (export "ping") (result i32) (i32.const 1))))");
+    wasm_engine_t *engine = tss::wasm_engine_new_from_config({.compiler = CRANELIFT, .metering = true});
+    wasm_store_t *store   = ::wasm_store_new(engine);
+    wasm_module_t *module = ::wasm_module_new(store, &wasm_bytes);
+    ::wasm_byte_vec_delete(&wasm_bytes);
+    REQUIRE(module);
+    tss::WasiInstanceConfig config{};
+    config.metered = true;
+    auto instance  = tss::WasiInstance::create(engine, module, config);
+    REQUIRE(instance);
+    auto watchdog = tss::Watchdog::create();
+    REQUIRE(watchdog);
+
+    wasm_val_vec_t args    = WASM_EMPTY_VEC;
+    wasm_val_vec_t results = WASM_EMPTY_VEC;
+    wasm_trap_t *trap      = nullptr;
+    const auto begin       = std::chrono::steady_clock::now();
+    const auto result      = tss::watchdog_call(
+        *watchdog, *instance, instance->func("spin"), &args, &results, &trap, std::chrono::milliseconds(20));
+    REQUIRE(result == tss::FuelCallResult::interrupted);
+    REQUIRE(!trap);
+    REQUIRE(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(20));
+    REQUIRE(watchdog->stats().fired == 1);
+
+    // The instance can be called again, with no deadline and no fuel limit
+    wasm_val_t results_val[1] = {WASM_INIT_VAL};
+    wasm_val_vec_t ping       = WASM_ARRAY_VEC(results_val);
+    REQUIRE(instance->env().fuel.call(instance->func("ping"), &args, &ping, &trap) == tss::FuelCallResult::returned);
+    REQUIRE(results_val[0].of.i32 == 1);
+
+    instance.reset();
+    ::wasm_module_delete(module);
+    ::wasm_store_delete(store);
+    ::wasm_engine_delete(engine);
+}
+#endif
+
+#ifdef BENCHMARK
+BENCHMARK_CASE("watchdog: watch and unwatch") {
+    // What guarding a call that returns in time adds to it
+    auto watchdog = tss::Watchdog::create();
+    tss::WasiEnv env{};
+    tss::bench::report("watch and unwatch a call",
+                       tss::bench::ns_per_op(1000000,
+                                             [&]() {
+                                                 const auto id = watchdog->watch(env, std::chrono::milliseconds(16));
+                                                 tss::bench::do_not_optimize(watchdog->unwatch(id));
+                                             }),
+                       "ns");
+}
+#endif